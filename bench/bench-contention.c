@@ -0,0 +1,422 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Login storm: WRITERS processes write login entries and READERS
+   processes read them at the same time from one database with ROWS
+   users, OPS times each. Like pam_lastlog2 and lastlog2, every
+   operation opens its own context, unless -p is given, in which case
+   every process keeps one context open for all its operations.
+   Latency percentiles, the number of operations which failed with
+   -EBUSY or another error and the throughput are written as JSON
+   lines, see bench_report.
+
+   Usage: bench-contention -n ROWS -w WRITERS -r READERS [-k OPS]
+			   [-b BUSY_TIMEOUT] [-C] [-J] [-p] [-d DIR]
+			   [-o FILE]
+
+   -b  busy timeout in milliseconds, default is the one of pam_lastlog2
+   -C  let writers checkpoint, pam_lastlog2 leaves this to a timer
+   -J  use a rollback journal instead of WAL
+   -p  one context per process instead of one per operation
+*/
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define SUITE "contention"
+
+/* Same as DEFAULT_BUSY_TIMEOUT of pam_lastlog2. */
+#define PAM_BUSY_TIMEOUT 50
+
+/* Counters of one process, in memory shared with the parent. */
+struct proc_result {
+  size_t done;
+  size_t busy;
+  size_t errors;
+};
+
+static const char *db_path;
+static const struct bench_dataset *data;
+static size_t ops;
+static int busy_timeout = PAM_BUSY_TIMEOUT;
+static int writer_flags = LL2_OPEN_NO_CHECKPOINT;
+static int persistent;
+
+static void
+remove_database (const char *path)
+{
+  static const char *const suffixes[] = { "", "-wal", "-shm" };
+  char buf[4096];
+
+  for (size_t i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); i++)
+    {
+      snprintf (buf, sizeof (buf), "%s%s", path, suffixes[i]);
+      unlink (buf);
+    }
+}
+
+static struct ll2_context *
+open_context (int flags, char **error)
+{
+  struct ll2_context *context;
+
+  if ((context = ll2_open_context (db_path, flags, error)) != NULL)
+    ll2_ctx_set_busy_timeout (context, busy_timeout);
+
+  return context;
+}
+
+static int
+do_write (struct ll2_context *context, const struct ll2_entry *e,
+	  int64_t ll_time, char **error)
+{
+  return ll2_ctx_write_entry_uid (context, e->user, ll_time, e->tty,
+				  e->rhost, e->pam_service, e->uid, error);
+}
+
+static int
+do_read (struct ll2_context *context, const struct ll2_entry *e,
+	 int64_t ll_time, char **error)
+{
+  char *tty = NULL, *rhost = NULL, *service = NULL;
+  int64_t time;
+  int ret;
+
+  (void)ll_time;
+
+  ret = ll2_ctx_read_entry (context, e->user, &time, &tty, &rhost, &service,
+			    error);
+  free (tty);
+  free (rhost);
+  free (service);
+
+  return ret;
+}
+
+/* Runs in the child: waits until the parent closes the start pipe,
+   then runs the operations and stores the latency of every one in
+   samples. */
+static void
+run_process (int start_fd, int writer, uint64_t seed,
+	     struct proc_result *result, uint64_t *samples)
+{
+  int (*op) (struct ll2_context *, const struct ll2_entry *, int64_t,
+	     char **) = writer ? do_write : do_read;
+  int flags = writer ? writer_flags : LL2_OPEN_READONLY;
+  struct ll2_context *context = NULL;
+  uint64_t state = seed;
+  char c;
+
+  while (read (start_fd, &c, 1) > 0)
+    ;
+  close (start_fd);
+
+  for (size_t i = 0; i < ops; i++)
+    {
+      const struct ll2_entry *e =
+	&data->entries[bench_random (&state) % data->count];
+      uint64_t start = bench_now_ns ();
+      char *error = NULL;
+      int ret;
+
+      if (context == NULL && (context = open_context (flags, &error)) == NULL)
+	ret = -1;
+      else
+	ret = op (context, e, e->ll_time + 86400 + i, &error);
+
+      if (!persistent && context)
+	{
+	  ll2_close_context (context);
+	  context = NULL;
+	}
+
+      samples[i] = bench_now_ns () - start;
+      if (ret == -EBUSY)
+	result->busy++;
+      else if (ret != 0)
+	{
+	  if (result->errors++ == 0)
+	    fprintf (stderr, "%s: %s\n", writer ? "write" : "read",
+		     error ? error : "failed");
+	}
+      free (error);
+      result->done++;
+    }
+
+  if (context)
+    ll2_close_context (context);
+}
+
+static void
+report (FILE *output, const char *name, const char *storage, size_t rows,
+	size_t first, size_t nprocs, const struct proc_result *results,
+	uint64_t *samples, uint64_t elapsed, const char *config)
+{
+  struct bench_latency lat = { 0 };
+  size_t busy = 0, errors = 0;
+  char fields[512];
+
+  if (nprocs == 0)
+    return;
+
+  for (size_t p = first; p < first + nprocs; p++)
+    {
+      busy += results[p].busy;
+      errors += results[p].errors;
+      for (size_t i = 0; i < results[p].done; i++)
+	if (bench_latency_add (&lat, samples[p * ops + i]) != 0)
+	  {
+	    fprintf (stderr, "Out of memory\n");
+	    bench_latency_free (&lat);
+	    return;
+	  }
+    }
+
+  snprintf (fields, sizeof (fields),
+	    "%s, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+	    "\"max_ns\": %llu, \"busy\": %zu, \"errors\": %zu, "
+	    "\"ops_per_sec\": %.0f",
+	    config,
+	    (unsigned long long)bench_latency_percentile (&lat, 50),
+	    (unsigned long long)bench_latency_percentile (&lat, 99),
+	    (unsigned long long)bench_latency_percentile (&lat, 99.9),
+	    (unsigned long long)bench_latency_percentile (&lat, 100),
+	    busy, errors,
+	    elapsed ? lat.count * 1e9 / elapsed : 0.0);
+
+  bench_report (output, SUITE, name, storage, rows, lat.count, elapsed,
+		fields);
+  bench_latency_free (&lat);
+}
+
+static void
+usage (int retval)
+{
+  fprintf (retval ? stderr : stdout,
+	   "Usage: bench-contention -n ROWS -w WRITERS -r READERS [-k OPS]\n"
+	   "                        [-b BUSY_TIMEOUT] [-C] [-J] [-p] [-d DIR]\n"
+	   "                        [-o FILE]\n"
+	   "  -b  busy timeout in milliseconds (default: %d)\n"
+	   "  -C  let writers checkpoint\n"
+	   "  -J  use a rollback journal instead of WAL\n"
+	   "  -k  operations per process (default: 200)\n"
+	   "  -p  one context per process instead of one per operation\n",
+	   PAM_BUSY_TIMEOUT);
+  exit (retval);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct bench_dataset dataset;
+  struct proc_result *results = MAP_FAILED;
+  uint64_t *samples = MAP_FAILED;
+  size_t results_size = 0, samples_size = 0;
+  const char *dir = ".";
+  const char *storage;
+  FILE *output = NULL;
+  char path[4096], config[256];
+  size_t rows = 0, writers = 0, readers = 0, nprocs, started = 0;
+  int create_flags = 0;
+  int start_pipe[2];
+  uint64_t start, elapsed;
+  char *error = NULL;
+  int retval = 1;
+  int c;
+
+  while ((c = getopt (argc, argv, "b:Cd:hJk:n:o:pr:w:")) != -1)
+    switch (c)
+      {
+      case 'b':
+	busy_timeout = atoi (optarg);
+	break;
+      case 'C':
+	writer_flags &= ~LL2_OPEN_NO_CHECKPOINT;
+	break;
+      case 'd':
+	dir = optarg;
+	break;
+      case 'J':
+	create_flags |= LL2_OPEN_NO_WAL;
+	break;
+      case 'k':
+	ops = strtoul (optarg, NULL, 10);
+	break;
+      case 'n':
+	rows = strtoul (optarg, NULL, 10);
+	break;
+      case 'o':
+	if ((output = fopen (optarg, "a")) == NULL)
+	  {
+	    fprintf (stderr, "Cannot open %s: %s\n", optarg,
+		     strerror (errno));
+	    return 1;
+	  }
+	break;
+      case 'p':
+	persistent = 1;
+	break;
+      case 'r':
+	readers = strtoul (optarg, NULL, 10);
+	break;
+      case 'w':
+	writers = strtoul (optarg, NULL, 10);
+	break;
+      case 'h':
+	usage (0);
+	break;
+      default:
+	usage (1);
+      }
+
+  nprocs = writers + readers;
+  if (rows == 0 || nprocs == 0 || optind < argc)
+    usage (1);
+  if (ops == 0)
+    ops = 200;
+
+  storage = bench_storage (dir);
+  snprintf (path, sizeof (path), "%s/bench-contention-%ld.db", dir,
+	    (long)getpid ());
+  db_path = path;
+  remove_database (db_path);
+
+  if (bench_dataset_generate (&dataset, rows, 42) != 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return 1;
+    }
+  data = &dataset;
+
+  /* Create the database in the requested journal mode. */
+  struct ll2_context *context;
+  if ((context = ll2_open_context (db_path, create_flags, &error)) == NULL ||
+      ll2_ctx_write_entries (context, dataset.entries, dataset.count, 10000,
+			     NULL, &error) != 0 ||
+      ll2_ctx_checkpoint (context, &error) != 0)
+    {
+      fprintf (stderr, "Creating %s failed: %s\n", db_path,
+	       error ? error : "unknown error");
+      free (error);
+      if (context)
+	ll2_close_context (context);
+      goto out;
+    }
+  ll2_close_context (context);
+
+  /* Shared with the children, which write their results there. */
+  results_size = nprocs * sizeof (struct proc_result);
+  samples_size = nprocs * ops * sizeof (uint64_t);
+  results = mmap (NULL, results_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  samples = mmap (NULL, samples_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED || samples == MAP_FAILED)
+    {
+      fprintf (stderr, "mmap: %s\n", strerror (errno));
+      goto out;
+    }
+
+  /* The children block reading the pipe until the parent closes it,
+     so that all of them start at the same moment. */
+  if (pipe (start_pipe) != 0)
+    {
+      fprintf (stderr, "pipe: %s\n", strerror (errno));
+      goto out;
+    }
+
+  fflush (NULL);
+  for (; started < nprocs; started++)
+    {
+      pid_t pid = fork ();
+
+      if (pid < 0)
+	{
+	  fprintf (stderr, "fork: %s\n", strerror (errno));
+	  break;
+	}
+      if (pid == 0)
+	{
+	  close (start_pipe[1]);
+	  run_process (start_pipe[0], started < writers, started + 1,
+		       &results[started], &samples[started * ops]);
+	  _exit (0);
+	}
+    }
+
+  close (start_pipe[0]);
+  start = bench_now_ns ();
+  close (start_pipe[1]);
+
+  retval = started == nprocs ? 0 : 1;
+  for (size_t i = 0; i < started; i++)
+    {
+      int status;
+
+      if (wait (&status) < 0 || !WIFEXITED (status) ||
+	  WEXITSTATUS (status) != 0)
+	retval = 1;
+    }
+  elapsed = bench_now_ns () - start;
+
+  if (retval == 0)
+    {
+      snprintf (config, sizeof (config),
+		"\"writers\": %zu, \"readers\": %zu, \"busy_timeout_ms\": %d, "
+		"\"journal\": \"%s\", \"checkpoint\": %s, "
+		"\"connection\": \"%s\"",
+		writers, readers, busy_timeout,
+		(create_flags & LL2_OPEN_NO_WAL) ? "delete" : "wal",
+		(writer_flags & LL2_OPEN_NO_CHECKPOINT) ? "false" : "true",
+		persistent ? "process" : "operation");
+
+      report (output, "login_write", storage, rows, 0, writers, results,
+	      samples, elapsed, config);
+      report (output, "login_read", storage, rows, writers, readers,
+	      results, samples, elapsed, config);
+    }
+
+ out:
+  if (results != MAP_FAILED)
+    munmap (results, results_size);
+  if (samples != MAP_FAILED)
+    munmap (samples, samples_size);
+  remove_database (db_path);
+  bench_dataset_free (&dataset);
+  if (output)
+    fclose (output);
+
+  return retval;
+}
@@ -0,0 +1,339 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Benchmark of the liblastlog2 functions used by logins and by
+   lastlog2: a database with a synthetic dataset of ROWS users gets
+   created in DIR and every function is called OPS times for random
+   users. The results are written as JSON lines, see bench_report.
+
+   Usage: bench-lastlog2 -n ROWS [-k OPS] [-d DIR] [-o FILE]
+*/
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define SUITE "lib"
+
+static FILE *output;
+static const char *storage;
+static size_t rows;
+
+static void
+remove_database (const char *path)
+{
+  static const char *const suffixes[] = { "", "-wal", "-shm", ".spool",
+					  ".cache" };
+  char buf[4096];
+
+  for (size_t i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); i++)
+    {
+      snprintf (buf, sizeof (buf), "%s%s", path, suffixes[i]);
+      unlink (buf);
+    }
+}
+
+static int
+fail (const char *func, char *error)
+{
+  fprintf (stderr, "%s: %s\n", func, error ? error : "failed");
+  free (error);
+  return 1;
+}
+
+static size_t read_all_count;
+
+static int
+count_legacy (const char *user, int64_t ll_time, const char *tty,
+	      const char *rhost, const char *pam_service)
+{
+  (void)user; (void)ll_time; (void)tty; (void)rhost; (void)pam_service;
+
+  read_all_count++;
+  return 0;
+}
+
+static int
+count_entry (const struct ll2_entry *entry, void *userdata)
+{
+  (void)entry;
+
+  (*(size_t *)userdata)++;
+  return 0;
+}
+
+static int
+bench_write_entry (const char *db_path, const struct bench_dataset *data,
+		   size_t ops, uint64_t *state)
+{
+  uint64_t start = bench_now_ns ();
+  char *error = NULL;
+
+  for (size_t i = 0; i < ops; i++)
+    {
+      const struct ll2_entry *e =
+	&data->entries[bench_random (state) % data->count];
+
+      if (ll2_write_entry (db_path, e->user, e->ll_time + 86400 + i, e->tty,
+			   e->rhost, e->pam_service, &error) != 0)
+	return fail ("ll2_write_entry", error);
+    }
+
+  bench_report (output, SUITE, "ll2_write_entry", storage, rows, ops,
+		bench_now_ns () - start, NULL);
+  return 0;
+}
+
+static int
+bench_read_entry (const char *db_path, const struct bench_dataset *data,
+		  size_t ops, uint64_t *state)
+{
+  uint64_t start = bench_now_ns ();
+  char *error = NULL;
+
+  for (size_t i = 0; i < ops; i++)
+    {
+      const struct ll2_entry *e =
+	&data->entries[bench_random (state) % data->count];
+      int64_t ll_time;
+      char *tty = NULL, *rhost = NULL, *service = NULL;
+
+      if (ll2_read_entry (db_path, e->user, &ll_time, &tty, &rhost,
+			  &service, &error) != 0)
+	return fail ("ll2_read_entry", error);
+      free (tty);
+      free (rhost);
+      free (service);
+    }
+
+  bench_report (output, SUITE, "ll2_read_entry", storage, rows, ops,
+		bench_now_ns () - start, NULL);
+  return 0;
+}
+
+static int
+bench_read_all (const char *db_path)
+{
+  uint64_t start = bench_now_ns ();
+  char *error = NULL;
+
+  read_all_count = 0;
+  if (ll2_read_all (db_path, count_legacy, &error) != 0)
+    return fail ("ll2_read_all", error);
+
+  bench_report (output, SUITE, "ll2_read_all", storage, rows, read_all_count,
+		bench_now_ns () - start, NULL);
+  return 0;
+}
+
+static int
+bench_update_login_time (const char *db_path,
+			 const struct bench_dataset *data, size_t ops,
+			 uint64_t *state)
+{
+  uint64_t start = bench_now_ns ();
+  char *error = NULL;
+
+  for (size_t i = 0; i < ops; i++)
+    {
+      const struct ll2_entry *e =
+	&data->entries[bench_random (state) % data->count];
+
+      if (ll2_update_login_time (db_path, e->user, e->ll_time + 2 * 86400 + i,
+				 &error) != 0)
+	return fail ("ll2_update_login_time", error);
+    }
+
+  bench_report (output, SUITE, "ll2_update_login_time", storage, rows, ops,
+		bench_now_ns () - start, NULL);
+  return 0;
+}
+
+/* Renames the first ops users, every user only once. */
+static int
+bench_rename_user (const char *db_path, const struct bench_dataset *data,
+		   size_t ops)
+{
+  uint64_t start = bench_now_ns ();
+  char *error = NULL;
+  char newname[32];
+
+  for (size_t i = 0; i < ops; i++)
+    {
+      snprintf (newname, sizeof (newname), "renamed%07zu", i);
+      if (ll2_rename_user (db_path, data->entries[i].user, newname,
+			   &error) != 0)
+	return fail ("ll2_rename_user", error);
+    }
+
+  bench_report (output, SUITE, "ll2_rename_user", storage, rows, ops,
+		bench_now_ns () - start, NULL);
+  return 0;
+}
+
+/* Imports a lastlog file with a record for every user into an empty
+   database. Only the records of the passwd entries get read, the
+   synthetic UIDs are usually not among them, so mostly the walk
+   through the passwd entries is measured. */
+static int
+bench_import_lastlog (const char *dir, const struct bench_dataset *data)
+{
+  char db_path[4096], ll_path[4096], fields[64];
+  size_t imported = 0;
+  uint64_t start;
+  char *error = NULL;
+  int ret;
+
+  snprintf (db_path, sizeof (db_path), "%s/bench-import-%ld.db", dir,
+	    (long)getpid ());
+  snprintf (ll_path, sizeof (ll_path), "%s/bench-import-%ld.lastlog", dir,
+	    (long)getpid ());
+  remove_database (db_path);
+
+  if (bench_write_lastlog (data, ll_path) != 0)
+    {
+      fprintf (stderr, "Cannot write %s: %s\n", ll_path, strerror (errno));
+      return 1;
+    }
+
+  start = bench_now_ns ();
+  ret = ll2_import_lastlog (db_path, ll_path, &error);
+  uint64_t elapsed = bench_now_ns () - start;
+
+  if (ret == 0 &&
+      ll2_read_all_entries (db_path, count_entry, &imported, &error) != 0)
+    ret = -1;
+
+  remove_database (db_path);
+  unlink (ll_path);
+
+  if (ret != 0)
+    return fail ("ll2_import_lastlog", error);
+
+  snprintf (fields, sizeof (fields), "\"imported\": %zu", imported);
+  bench_report (output, SUITE, "ll2_import_lastlog", storage, rows,
+		data->count, elapsed, fields);
+  return 0;
+}
+
+static void
+usage (int retval)
+{
+  fputs ("Usage: bench-lastlog2 -n ROWS [-k OPS] [-d DIR] [-o FILE]\n",
+	 retval ? stderr : stdout);
+  exit (retval);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct bench_dataset data;
+  const char *dir = ".";
+  char db_path[4096];
+  uint64_t state = 42;
+  size_t ops = 0;
+  uint64_t start;
+  char *error = NULL;
+  int retval = 1;
+  int c;
+
+  while ((c = getopt (argc, argv, "d:hk:n:o:")) != -1)
+    switch (c)
+      {
+      case 'd':
+	dir = optarg;
+	break;
+      case 'k':
+	ops = strtoul (optarg, NULL, 10);
+	break;
+      case 'n':
+	rows = strtoul (optarg, NULL, 10);
+	break;
+      case 'o':
+	if ((output = fopen (optarg, "a")) == NULL)
+	  {
+	    fprintf (stderr, "Cannot open %s: %s\n", optarg,
+		     strerror (errno));
+	    return 1;
+	  }
+	break;
+      case 'h':
+	usage (0);
+	break;
+      default:
+	usage (1);
+      }
+
+  if (rows == 0 || optind < argc)
+    usage (1);
+  if (ops == 0)
+    ops = rows < 1000 ? rows : 1000;
+
+  storage = bench_storage (dir);
+  snprintf (db_path, sizeof (db_path), "%s/bench-lastlog2-%ld.db", dir,
+	    (long)getpid ());
+  remove_database (db_path);
+
+  if (bench_dataset_generate (&data, rows, state) != 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return 1;
+    }
+
+  start = bench_now_ns ();
+  if (ll2_write_entries (db_path, data.entries, data.count, 10000, NULL,
+			 &error) != 0)
+    {
+      fail ("ll2_write_entries", error);
+      goto out;
+    }
+  bench_report (output, SUITE, "ll2_write_entries", storage, rows, rows,
+		bench_now_ns () - start, NULL);
+
+  if (bench_write_entry (db_path, &data, ops, &state) != 0 ||
+      bench_read_entry (db_path, &data, ops, &state) != 0 ||
+      bench_read_all (db_path) != 0 ||
+      bench_update_login_time (db_path, &data, ops, &state) != 0 ||
+      bench_rename_user (db_path, &data, ops) != 0 ||
+      bench_import_lastlog (dir, &data) != 0)
+    goto out;
+
+  retval = 0;
+
+ out:
+  remove_database (db_path);
+  bench_dataset_free (&data);
+  if (output)
+    fclose (output);
+
+  return retval;
+}
@@ -0,0 +1,704 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* End-to-end benchmark of pam_sm_open_session of pam_lastlog2.so
+   with a database of ROWS users, as an interactive login pays for
+   it: the module gets loaded with dlopen like libpam does and
+   called through a stand-in PAM handle, which is defined here
+   together with the PAM functions the module uses.
+
+   CHILDREN processes, which do not have the module, liblastlog2 and
+   libsqlite3 loaded yet, measure the cold dlopen and the first
+   session. Afterwards OPS sessions of random users are run in one
+   process with the module already loaded.
+
+   The liblastlog2 functions called by the module are interposed by
+   wrappers in this program to break every session down into phases.
+   The time not spent in them (parsing arguments, getting the PAM
+   items, formatting the message) is reported as "other".
+
+   Usage: bench-pam -m MODULE -n ROWS [-c CHILDREN] [-k OPS]
+		    [-a ARG]... [-d DIR] [-o FILE]
+*/
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>
+#include <security/pam_modutil.h>
+
+#include "bench.h"
+
+#define SUITE "pam"
+
+/* Maximal number of additional module arguments. */
+#define MAX_ARGS 8
+
+enum phase {
+  PHASE_CHECK_DATABASE,
+  PHASE_OPEN_CONTEXT,
+  PHASE_READ_ENTRY,
+  PHASE_WRITE_ENTRY,
+  PHASE_SPOOL_ENTRY,
+  PHASE_CLOSE_CONTEXT,
+  PHASE_OTHER,
+  PHASE_TOTAL,
+  PHASE_COUNT
+};
+
+static const char *const phase_names[PHASE_COUNT] = {
+  "check_database",
+  "open_context",
+  "read_entry",
+  "write_entry",
+  "spool_entry",
+  "close_context",
+  "other",
+  "total"
+};
+
+/* Nanoseconds spent in every phase of one session. */
+struct session_times {
+  uint64_t phase[PHASE_COUNT];
+};
+
+/* Result of a child measuring the cold start, in memory shared with
+   the parent. */
+struct cold_result {
+  uint64_t dlopen_ns;
+  struct session_times first;
+  int ok;
+};
+
+/* Stand-in for the PAM handle of the application. */
+struct pam_handle {
+  const char *service;
+  const char *user;
+  const char *tty;
+  const char *rhost;
+  uid_t uid;
+};
+
+typedef int (*open_session_fn) (pam_handle_t *, int, int, const char **);
+
+static const struct bench_dataset *data;
+static const char *module_argv[MAX_ARGS + 1];
+static int module_argc;
+static size_t syslog_errors;
+
+/* Phases of the running session, NULL if no session is running. */
+static struct session_times *current;
+/* Nesting of the wrappers, only the outermost call gets timed. */
+static int depth;
+
+/* PAM functions used by the module. */
+
+int
+pam_get_item (const pam_handle_t *pamh, int item_type, const void **item)
+{
+  switch (item_type)
+    {
+    case PAM_SERVICE:
+      *item = pamh->service;
+      break;
+    case PAM_USER:
+      *item = pamh->user;
+      break;
+    case PAM_TTY:
+      *item = pamh->tty;
+      break;
+    case PAM_RHOST:
+      *item = pamh->rhost;
+      break;
+    default:
+      *item = NULL;
+    }
+
+  return PAM_SUCCESS;
+}
+
+const char *
+pam_getenv (pam_handle_t *pamh, const char *name)
+{
+  (void)pamh; (void)name;
+
+  return NULL;
+}
+
+void
+pam_syslog (const pam_handle_t *pamh, int priority, const char *fmt, ...)
+{
+  va_list ap;
+
+  (void)pamh;
+
+  if (priority > LOG_ERR)
+    return;
+
+  syslog_errors++;
+  va_start (ap, fmt);
+  vfprintf (stderr, fmt, ap);
+  va_end (ap);
+  fputc ('\n', stderr);
+}
+
+/* Used by pam_info, the message is formatted but not shown. */
+int
+pam_prompt (pam_handle_t *pamh, int style, char **response,
+	    const char *fmt, ...)
+{
+  char buf[1024];
+  va_list ap;
+
+  (void)pamh; (void)style;
+
+  va_start (ap, fmt);
+  vsnprintf (buf, sizeof (buf), fmt, ap);
+  va_end (ap);
+  if (response)
+    *response = NULL;
+
+  return PAM_SUCCESS;
+}
+
+/* The synthetic users are not known to the name services. */
+struct passwd *
+pam_modutil_getpwnam (pam_handle_t *pamh, const char *user)
+{
+  static char name[32], dir[] = "/", shell[] = "/bin/sh";
+  static struct passwd pwd;
+
+  snprintf (name, sizeof (name), "%s", user);
+  memset (&pwd, 0, sizeof (pwd));
+  pwd.pw_name = name;
+  pwd.pw_uid = pamh->uid;
+  pwd.pw_gid = pamh->uid;
+  pwd.pw_dir = dir;
+  pwd.pw_shell = shell;
+
+  return &pwd;
+}
+
+/* Wrappers around the liblastlog2 functions used by the module. The
+   real functions are looked up in the module's dependencies, which
+   do not contain this program. */
+
+static int (*real_check_database) (const char *);
+static struct ll2_context *(*real_open_context) (const char *, int, char **);
+static void (*real_close_context) (struct ll2_context *);
+static int (*real_read_cached_entry) (const char *, const char *, int64_t *,
+				      char **, char **, char **, char **);
+static int (*real_ctx_read_entry) (struct ll2_context *, const char *,
+				   int64_t *, char **, char **, char **,
+				   char **);
+static int (*real_ctx_write_entry_uid) (struct ll2_context *, const char *,
+					int64_t, const char *, const char *,
+					const char *, int64_t, char **);
+static int (*real_spool_entry) (const char *, const struct ll2_entry *,
+				char **);
+
+static uint64_t
+phase_start (void)
+{
+  depth++;
+  return bench_now_ns ();
+}
+
+static void
+phase_end (enum phase phase, uint64_t start)
+{
+  if (--depth == 0 && current)
+    current->phase[phase] += bench_now_ns () - start;
+}
+
+int
+ll2_check_database (const char *lastlog2_path)
+{
+  uint64_t start = phase_start ();
+  int ret = real_check_database (lastlog2_path);
+
+  phase_end (PHASE_CHECK_DATABASE, start);
+  return ret;
+}
+
+struct ll2_context *
+ll2_open_context (const char *lastlog2_path, int flags, char **error)
+{
+  uint64_t start = phase_start ();
+  struct ll2_context *context = real_open_context (lastlog2_path, flags,
+						   error);
+
+  phase_end (PHASE_OPEN_CONTEXT, start);
+  return context;
+}
+
+void
+ll2_close_context (struct ll2_context *context)
+{
+  uint64_t start = phase_start ();
+
+  real_close_context (context);
+  phase_end (PHASE_CLOSE_CONTEXT, start);
+}
+
+int
+ll2_read_cached_entry (const char *lastlog2_path, const char *user,
+		       int64_t *ll_time, char **tty, char **rhost,
+		       char **pam_service, char **error)
+{
+  uint64_t start = phase_start ();
+  int ret = real_read_cached_entry (lastlog2_path, user, ll_time, tty, rhost,
+				    pam_service, error);
+
+  phase_end (PHASE_READ_ENTRY, start);
+  return ret;
+}
+
+int
+ll2_ctx_read_entry (struct ll2_context *context, const char *user,
+		    int64_t *ll_time, char **tty, char **rhost,
+		    char **pam_service, char **error)
+{
+  uint64_t start = phase_start ();
+  int ret = real_ctx_read_entry (context, user, ll_time, tty, rhost,
+				 pam_service, error);
+
+  phase_end (PHASE_READ_ENTRY, start);
+  return ret;
+}
+
+int
+ll2_ctx_write_entry_uid (struct ll2_context *context, const char *user,
+			 int64_t ll_time, const char *tty, const char *rhost,
+			 const char *pam_service, int64_t uid, char **error)
+{
+  uint64_t start = phase_start ();
+  int ret = real_ctx_write_entry_uid (context, user, ll_time, tty, rhost,
+				      pam_service, uid, error);
+
+  phase_end (PHASE_WRITE_ENTRY, start);
+  return ret;
+}
+
+int
+ll2_spool_entry (const char *lastlog2_path, const struct ll2_entry *entry,
+		 char **error)
+{
+  uint64_t start = phase_start ();
+  int ret = real_spool_entry (lastlog2_path, entry, error);
+
+  phase_end (PHASE_SPOOL_ENTRY, start);
+  return ret;
+}
+
+/* Loads the module and looks up the real liblastlog2 functions.
+   Returns the handle, or NULL on failure. */
+static void *
+load_module (const char *path, open_session_fn *open_session)
+{
+  void *handle;
+
+  /* libpam loads modules with RTLD_NOW. */
+  if ((handle = dlopen (path, RTLD_NOW)) == NULL)
+    {
+      fprintf (stderr, "dlopen: %s\n", dlerror ());
+      return NULL;
+    }
+
+  if ((*open_session = (open_session_fn)dlsym (handle,
+					       "pam_sm_open_session")) == NULL ||
+      (real_check_database = dlsym (handle, "ll2_check_database")) == NULL ||
+      (real_open_context = dlsym (handle, "ll2_open_context")) == NULL ||
+      (real_close_context = dlsym (handle, "ll2_close_context")) == NULL ||
+      (real_read_cached_entry = dlsym (handle,
+				       "ll2_read_cached_entry")) == NULL ||
+      (real_ctx_read_entry = dlsym (handle, "ll2_ctx_read_entry")) == NULL ||
+      (real_ctx_write_entry_uid = dlsym (handle,
+					 "ll2_ctx_write_entry_uid")) == NULL ||
+      (real_spool_entry = dlsym (handle, "ll2_spool_entry")) == NULL)
+    {
+      fprintf (stderr, "dlsym: %s\n", dlerror ());
+      dlclose (handle);
+      return NULL;
+    }
+
+  return handle;
+}
+
+/* Runs pam_sm_open_session for a random user and stores the time of
+   every phase in times. Returns 0 on success, -1 on failure. */
+static int
+run_session (open_session_fn open_session, uint64_t *state,
+	     struct session_times *times)
+{
+  const struct ll2_entry *e =
+    &data->entries[bench_random (state) % data->count];
+  struct pam_handle pamh = {
+    .service = e->pam_service,
+    .user = e->user,
+    .tty = e->tty,
+    .rhost = e->rhost,
+    .uid = e->uid
+  };
+  uint64_t start, other;
+  int ret;
+
+  memset (times, 0, sizeof (*times));
+  current = times;
+  start = bench_now_ns ();
+  ret = open_session (&pamh, 0, module_argc, module_argv);
+  times->phase[PHASE_TOTAL] = bench_now_ns () - start;
+  current = NULL;
+
+  other = times->phase[PHASE_TOTAL];
+  for (int p = 0; p < PHASE_OTHER; p++)
+    other -= times->phase[p];
+  times->phase[PHASE_OTHER] = other;
+
+  if (ret != PAM_SUCCESS)
+    {
+      fprintf (stderr, "pam_sm_open_session returned %d\n", ret);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Writes the database with the dataset in a child, so that this
+   process does not load liblastlog2 before the cold starts. */
+static int
+create_database (const char *module, const char *db_path)
+{
+  pid_t pid;
+  int status;
+
+  fflush (NULL);
+  if ((pid = fork ()) < 0)
+    {
+      fprintf (stderr, "fork: %s\n", strerror (errno));
+      return -1;
+    }
+
+  if (pid == 0)
+    {
+      int (*write_entries) (const char *, const struct ll2_entry *, size_t,
+			    size_t, int *, char **);
+      open_session_fn open_session;
+      char *error = NULL;
+      void *handle;
+
+      if ((handle = load_module (module, &open_session)) == NULL ||
+	  (write_entries = dlsym (handle, "ll2_write_entries")) == NULL)
+	_exit (1);
+
+      if (write_entries (db_path, data->entries, data->count, 10000, NULL,
+			 &error) != 0)
+	{
+	  fprintf (stderr, "ll2_write_entries: %s\n",
+		   error ? error : "failed");
+	  _exit (1);
+	}
+      _exit (0);
+    }
+
+  if (waitpid (pid, &status, 0) < 0 || !WIFEXITED (status) ||
+      WEXITSTATUS (status) != 0)
+    return -1;
+
+  return 0;
+}
+
+/* Forks children, which load the module and run the first session. */
+static int
+run_cold (const char *module, struct cold_result *results, size_t children)
+{
+  int retval = 0;
+
+  for (size_t i = 0; i < children; i++)
+    {
+      pid_t pid;
+      int status;
+
+      fflush (NULL);
+      if ((pid = fork ()) < 0)
+	{
+	  fprintf (stderr, "fork: %s\n", strerror (errno));
+	  return -1;
+	}
+
+      if (pid == 0)
+	{
+	  open_session_fn open_session;
+	  uint64_t state = i + 1;
+	  uint64_t start = bench_now_ns ();
+
+	  if (load_module (module, &open_session) == NULL)
+	    _exit (1);
+	  results[i].dlopen_ns = bench_now_ns () - start;
+
+	  if (run_session (open_session, &state, &results[i].first) != 0)
+	    _exit (1);
+	  results[i].ok = 1;
+	  _exit (0);
+	}
+
+      /* One after the other, the cold starts should not compete. */
+      if (waitpid (pid, &status, 0) < 0 || !WIFEXITED (status) ||
+	  WEXITSTATUS (status) != 0 || !results[i].ok)
+	retval = -1;
+    }
+
+  return retval;
+}
+
+static void
+report_latency (FILE *output, const char *name, const char *storage,
+		size_t rows, const char *fields, struct bench_latency *lat)
+{
+  char buf[512];
+
+  snprintf (buf, sizeof (buf),
+	    "%s\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu",
+	    fields ? fields : "",
+	    (unsigned long long)bench_latency_percentile (lat, 50),
+	    (unsigned long long)bench_latency_percentile (lat, 99),
+	    (unsigned long long)bench_latency_percentile (lat, 99.9));
+
+  bench_report (output, SUITE, name, storage, rows, lat->count, lat->total,
+		buf);
+}
+
+/* Reports every phase of the sessions, session is "first" or
+   "warm". */
+static int
+report_sessions (FILE *output, const char *storage, size_t rows,
+		 const char *session, const struct session_times *times,
+		 size_t stride, size_t count)
+{
+  for (int p = 0; p < PHASE_COUNT; p++)
+    {
+      struct bench_latency lat = { 0 };
+      char fields[128];
+      int used = 0;
+
+      for (size_t i = 0; i < count; i++)
+	{
+	  const struct session_times *t =
+	    (const void *)((const char *)times + i * stride);
+
+	  if (t->phase[p])
+	    used = 1;
+	  if (bench_latency_add (&lat, t->phase[p]) != 0)
+	    {
+	      bench_latency_free (&lat);
+	      fprintf (stderr, "Out of memory\n");
+	      return -1;
+	    }
+	}
+
+      /* Don't report phases the configuration does not have. */
+      if (used)
+	{
+	  snprintf (fields, sizeof (fields),
+		    "\"session\": \"%s\", \"phase\": \"%s\", ", session,
+		    phase_names[p]);
+	  report_latency (output, "pam_sm_open_session", storage, rows,
+			  fields, &lat);
+	}
+      bench_latency_free (&lat);
+    }
+
+  return 0;
+}
+
+static void
+remove_database (const char *path)
+{
+  static const char *const suffixes[] = { "", "-wal", "-shm", ".spool",
+					  ".cache" };
+  char buf[4096];
+
+  for (size_t i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); i++)
+    {
+      snprintf (buf, sizeof (buf), "%s%s", path, suffixes[i]);
+      unlink (buf);
+    }
+}
+
+static void
+usage (int retval)
+{
+  fprintf (retval ? stderr : stdout,
+	   "Usage: bench-pam -m MODULE -n ROWS [-c CHILDREN] [-k OPS]\n"
+	   "                 [-a ARG]... [-d DIR] [-o FILE]\n"
+	   "  -a  additional argument for the module, e.g. cache\n"
+	   "  -c  processes measuring the cold start (default: 10)\n"
+	   "  -k  sessions with the module loaded (default: 1000)\n");
+  exit (retval);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct bench_dataset dataset;
+  struct cold_result *cold = MAP_FAILED;
+  struct session_times *warm = NULL;
+  struct bench_latency dlopen_lat = { 0 };
+  const char *module = NULL;
+  const char *dir = ".";
+  const char *storage;
+  FILE *output = NULL;
+  char db_path[4096], database_arg[4200];
+  size_t rows = 0, children = 10, ops = 1000;
+  open_session_fn open_session;
+  uint64_t state = 4711;
+  int retval = 1;
+  int c;
+
+  /* The first argument is the database. */
+  module_argc = 1;
+
+  while ((c = getopt (argc, argv, "a:c:d:hk:m:n:o:")) != -1)
+    switch (c)
+      {
+      case 'a':
+	if (module_argc > MAX_ARGS)
+	  usage (1);
+	module_argv[module_argc++] = optarg;
+	break;
+      case 'c':
+	children = strtoul (optarg, NULL, 10);
+	break;
+      case 'd':
+	dir = optarg;
+	break;
+      case 'k':
+	ops = strtoul (optarg, NULL, 10);
+	break;
+      case 'm':
+	module = optarg;
+	break;
+      case 'n':
+	rows = strtoul (optarg, NULL, 10);
+	break;
+      case 'o':
+	if ((output = fopen (optarg, "a")) == NULL)
+	  {
+	    fprintf (stderr, "Cannot open %s: %s\n", optarg,
+		     strerror (errno));
+	    return 1;
+	  }
+	break;
+      case 'h':
+	usage (0);
+	break;
+      default:
+	usage (1);
+      }
+
+  if (module == NULL || rows == 0 || ops == 0 || optind < argc)
+    usage (1);
+
+  storage = bench_storage (dir);
+  snprintf (db_path, sizeof (db_path), "%s/bench-pam-%ld.db", dir,
+	    (long)getpid ());
+  snprintf (database_arg, sizeof (database_arg), "database=%s", db_path);
+  module_argv[0] = database_arg;
+  remove_database (db_path);
+
+  if (bench_dataset_generate (&dataset, rows, 42) != 0 ||
+      (warm = calloc (ops, sizeof (struct session_times))) == NULL)
+    {
+      fprintf (stderr, "Out of memory\n");
+      free (warm);
+      return 1;
+    }
+  data = &dataset;
+
+  if (create_database (module, db_path) != 0)
+    goto out;
+
+  if (children > 0)
+    {
+      cold = mmap (NULL, children * sizeof (struct cold_result),
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if (cold == MAP_FAILED)
+	{
+	  fprintf (stderr, "mmap: %s\n", strerror (errno));
+	  goto out;
+	}
+
+      if (run_cold (module, cold, children) != 0)
+	goto out;
+
+      for (size_t i = 0; i < children; i++)
+	if (bench_latency_add (&dlopen_lat, cold[i].dlopen_ns) != 0)
+	  {
+	    fprintf (stderr, "Out of memory\n");
+	    goto out;
+	  }
+      report_latency (output, "dlopen", storage, rows, NULL, &dlopen_lat);
+      if (report_sessions (output, storage, rows, "first", &cold[0].first,
+			   sizeof (struct cold_result), children) != 0)
+	goto out;
+    }
+
+  if (load_module (module, &open_session) == NULL)
+    goto out;
+
+  for (size_t i = 0; i < ops; i++)
+    if (run_session (open_session, &state, &warm[i]) != 0)
+      goto out;
+
+  if (report_sessions (output, storage, rows, "warm", warm,
+		       sizeof (struct session_times), ops) != 0)
+    goto out;
+
+  retval = syslog_errors ? 1 : 0;
+
+ out:
+  if (cold != MAP_FAILED)
+    munmap (cold, children * sizeof (struct cold_result));
+  bench_latency_free (&dlopen_lat);
+  free (warm);
+  remove_database (db_path);
+  bench_dataset_free (&dataset);
+  if (output)
+    fclose (output);
+
+  return retval;
+}
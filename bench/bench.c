@@ -0,0 +1,281 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lastlog.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/vfs.h>
+
+#include "bench.h"
+#include "bench-version.h"
+
+/* Number of distinct remote hosts in a dataset. */
+#define BENCH_HOSTS 3000
+
+/* Last login times are spread over two years before this time. */
+#define BENCH_TIME_BASE 1700000000
+
+uint64_t
+bench_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+uint64_t
+bench_random (uint64_t *state)
+{
+  uint64_t x = *state ? *state : 0x9e3779b97f4a7c15ULL;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+int
+bench_latency_add (struct bench_latency *lat, uint64_t ns)
+{
+  if (lat->count == lat->size)
+    {
+      size_t size = lat->size ? lat->size * 2 : 1024;
+      uint64_t *samples = realloc (lat->samples, size * sizeof (uint64_t));
+
+      if (samples == NULL)
+	return -1;
+      lat->samples = samples;
+      lat->size = size;
+    }
+
+  lat->samples[lat->count++] = ns;
+  lat->total += ns;
+
+  return 0;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+uint64_t
+bench_latency_percentile (struct bench_latency *lat, double p)
+{
+  size_t i;
+
+  if (lat->count == 0)
+    return 0;
+
+  qsort (lat->samples, lat->count, sizeof (uint64_t), compare_u64);
+
+  i = (size_t)(p / 100.0 * lat->count);
+  if (i >= lat->count)
+    i = lat->count - 1;
+
+  return lat->samples[i];
+}
+
+void
+bench_latency_free (struct bench_latency *lat)
+{
+  free (lat->samples);
+  memset (lat, 0, sizeof (*lat));
+}
+
+/* Random number below max, small numbers are more likely. */
+static size_t
+skewed (uint64_t *state, size_t max)
+{
+  uint64_t a = bench_random (state) % max;
+  uint64_t b = bench_random (state) % max;
+
+  return a * b / max;
+}
+
+int
+bench_dataset_generate (struct bench_dataset *data, size_t count,
+			uint64_t seed)
+{
+  uint64_t state = seed;
+
+  memset (data, 0, sizeof (*data));
+
+  data->entries = calloc (count, sizeof (struct ll2_entry));
+  data->names = calloc (count, sizeof (data->names[0]));
+  data->ttys = calloc (count, sizeof (data->ttys[0]));
+  data->hosts = calloc (BENCH_HOSTS, sizeof (data->hosts[0]));
+  if (data->entries == NULL || data->names == NULL || data->ttys == NULL ||
+      data->hosts == NULL)
+    {
+      bench_dataset_free (data);
+      return -1;
+    }
+  data->count = count;
+
+  for (size_t i = 0; i < BENCH_HOSTS; i++)
+    if (i % 2)
+      snprintf (data->hosts[i], sizeof (data->hosts[i]),
+		"host%04zu.example.com", i);
+    else
+      snprintf (data->hosts[i], sizeof (data->hosts[i]), "10.%zu.%zu.%zu",
+		(i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+
+  for (size_t i = 0; i < count; i++)
+    {
+      struct ll2_entry *e = &data->entries[i];
+      unsigned int kind = bench_random (&state) % 100;
+
+      snprintf (data->names[i], sizeof (data->names[i]), "user%07zu", i);
+      e->user = data->names[i];
+      e->ll_time = BENCH_TIME_BASE -
+	(int64_t)(bench_random (&state) % (2 * 365 * 86400));
+      e->uid = 1000 + 3 * i;
+      e->has_uid = 1;
+      e->tty = data->ttys[i];
+
+      if (kind < 80)
+	{
+	  snprintf (data->ttys[i], sizeof (data->ttys[i]), "pts/%zu",
+		    skewed (&state, 256));
+	  e->rhost = data->hosts[skewed (&state, BENCH_HOSTS)];
+	  e->pam_service = "sshd";
+	}
+      else if (kind < 88)
+	{
+	  snprintf (data->ttys[i], sizeof (data->ttys[i]), "tty%u",
+		    (unsigned int)(bench_random (&state) % 6) + 1);
+	  e->pam_service = "login";
+	}
+      else if (kind < 95)
+	{
+	  strcpy (data->ttys[i], "tty2");
+	  e->pam_service = "gdm-password";
+	}
+      else
+	{
+	  snprintf (data->ttys[i], sizeof (data->ttys[i]), "pts/%zu",
+		    skewed (&state, 256));
+	  e->pam_service = "su-l";
+	}
+    }
+
+  return 0;
+}
+
+void
+bench_dataset_free (struct bench_dataset *data)
+{
+  free (data->entries);
+  free (data->names);
+  free (data->ttys);
+  free (data->hosts);
+  memset (data, 0, sizeof (*data));
+}
+
+int
+bench_write_lastlog (const struct bench_dataset *data, const char *path)
+{
+  int fd;
+
+  if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+
+  for (size_t i = 0; i < data->count; i++)
+    {
+      const struct ll2_entry *e = &data->entries[i];
+      struct lastlog ll;
+
+      memset (&ll, 0, sizeof (ll));
+      ll.ll_time = e->ll_time;
+      /* Not NUL terminated if the fields are full. */
+      memcpy (ll.ll_line, e->tty, strnlen (e->tty, sizeof (ll.ll_line)));
+      if (e->rhost)
+	memcpy (ll.ll_host, e->rhost, strnlen (e->rhost, sizeof (ll.ll_host)));
+
+      if (pwrite (fd, &ll, sizeof (ll),
+		  (off_t)e->uid * sizeof (ll)) != sizeof (ll))
+	{
+	  close (fd);
+	  return -1;
+	}
+    }
+
+  return close (fd);
+}
+
+const char *
+bench_storage (const char *path)
+{
+  struct statfs st;
+
+  if (statfs (path, &st) == 0 && st.f_type == TMPFS_MAGIC)
+    return "tmpfs";
+
+  return "disk";
+}
+
+void
+bench_report (FILE *output, const char *suite, const char *name,
+	      const char *storage, size_t rows, size_t ops,
+	      uint64_t total_ns, const char *fields)
+{
+  char *line;
+
+  if (asprintf (&line, "{\"version\": \"%s\", \"commit\": \"%s\", "
+		"\"suite\": \"%s\", "
+		"\"name\": \"%s\", \"storage\": \"%s\", \"rows\": %zu, "
+		"\"ops\": %zu, \"total_ns\": %llu, \"ns_per_op\": %llu%s%s}\n",
+		PROJECT_VERSION, BENCH_COMMIT, suite, name, storage, rows, ops,
+		(unsigned long long)total_ns,
+		(unsigned long long)(ops ? total_ns / ops : 0),
+		fields ? ", " : "", fields ? fields : "") < 0)
+    return;
+
+  fputs (line, stdout);
+  fflush (stdout);
+  if (output)
+    {
+      fputs (line, output);
+      fflush (output);
+    }
+  free (line);
+}
@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Helpers shared by the benchmarks: clock, latency statistics,
+   synthetic datasets and JSON output. */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lastlog2.h"
+
+/* Monotonic time in nanoseconds. */
+extern uint64_t bench_now_ns (void);
+
+/* Deterministic random numbers, so that every run uses the same
+   dataset and the same access pattern. */
+extern uint64_t bench_random (uint64_t *state);
+
+/* Collects latencies for percentiles. */
+struct bench_latency {
+  uint64_t *samples;
+  size_t count;
+  size_t size;
+  uint64_t total;
+};
+
+extern int bench_latency_add (struct bench_latency *lat, uint64_t ns);
+/* Returns the latency below which p percent of the samples are,
+   the samples get sorted. */
+extern uint64_t bench_latency_percentile (struct bench_latency *lat,
+					  double p);
+extern void bench_latency_free (struct bench_latency *lat);
+
+/* Synthetic logins of count users. Services, TTYs and remote hosts
+   follow the distribution of a typical server: mostly sshd from a
+   few thousand hosts, some console logins and display managers.
+   user[i] is "userNNNNNNN", uid[i] is 1000 + 3 * i, so that a
+   lastlog file indexed by UID has holes. */
+struct bench_dataset {
+  size_t count;
+  struct ll2_entry *entries;
+  char (*names)[32];
+  char (*ttys)[16];
+  char (*hosts)[32];
+};
+
+extern int bench_dataset_generate (struct bench_dataset *data, size_t count,
+				   uint64_t seed);
+extern void bench_dataset_free (struct bench_dataset *data);
+
+/* Writes the dataset as old lastlog file indexed by UID.
+   Returns 0 on success, -1 on failure. */
+extern int bench_write_lastlog (const struct bench_dataset *data,
+				const char *path);
+
+/* Returns "tmpfs" if path is on a tmpfs, else "disk". */
+extern const char *bench_storage (const char *path);
+
+/* Writes one result as a line of JSON to stdout and to output, if
+   not NULL. fields are additional members of the object, written
+   as is, e.g. "\"p99_ns\": 1234", or NULL. */
+extern void bench_report (FILE *output, const char *suite, const char *name,
+			  const char *storage, size_t rows, size_t ops,
+			  uint64_t total_ns, const char *fields);
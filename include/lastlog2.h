@@ -28,13 +28,17 @@
 #pragma once
 
 #define _PATH_LASTLOG2 "/var/lib/lastlog/lastlog2.db"
+#define _PATH_LASTLOG2D_SOCKET "/run/lastlog2/lastlog2d.sock"
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 /* Check if database file exists.
    Returns 0 on success, -1 on failure. */
 extern int ll2_check_database (const char *lastlog2_path);
-/* Write a new entry. Returns 0 on success, -1 on failure. */
+/* Write a new entry. Returns 0 on success, -EBUSY if the database
+   stayed locked for the busy timeout, -1 on other failures. */
 extern int ll2_write_entry (const char *lastlog2_path, const char *user,
 			    int64_t ll_time, const char *tty,
 			    const char *rhost, const char *pam_service,
@@ -44,17 +48,374 @@ extern int ll2_read_all (const char *lastlog2_path,
 					 const char *tty, const char *rhost,
 					 const char *pam_service),
 			 char **error);
+/* Read the entry of user, or a newer one from the spool. The strings
+   need to be freed. Returns 0 on success, -ENOENT if there is no
+   entry for user, -EBUSY if the database or the spool stayed locked
+   for the busy timeout, -1 on other failures. */
 extern int ll2_read_entry (const char *lastlog2_path, const char *user,
 			   int64_t *ll_time, char **tty, char **rhost,
 			   char **pam_service, char **error);
+/* Look up an entry in the cache file next to the database, without
+   opening the database. The cache is created by ll2_ctx_rebuild_cache
+   and kept up to date by all writers of this library. Returns 0 on
+   success, -ENOENT if there is no entry for user, -ESTALE if there is
+   no cache or it is not up to date, and -1 on failure. Callers should
+   use ll2_read_entry if it returns -ESTALE. */
+extern int ll2_read_cached_entry (const char *lastlog2_path,
+				  const char *user, int64_t *ll_time,
+				  char **tty, char **rhost,
+				  char **pam_service, char **error);
+/* Update the login time of an existing entry. Returns 0 on success,
+   -ENOENT if there is no entry for user, -EBUSY if the database or
+   the spool stayed locked for the busy timeout, -1 on other
+   failures. */
 extern int ll2_update_login_time (const char *lastlog2_path,
 				  const char *user, int64_t ll_time,
 				  char **error);
+/* Remove the entry of user, including spooled ones. Returns 0 on
+   success, also if there was no entry, -EBUSY if the database or the
+   spool stayed locked for the busy timeout, -1 on other failures. */
 extern int ll2_remove_entry (const char *lastlog2_path, const char *user,
 			     char **error);
 
+/* Rename an entry, replacing an existing entry of newname. Returns
+   0 on success, -ENOENT if there is no entry for user, -EBUSY if the
+   database or the spool stayed locked for the busy timeout, -1 on
+   other failures. */
 extern int ll2_rename_user (const char *lastlog2_path, const char *user,
 			    const char *newname, char **error);
 
 extern int ll2_import_lastlog (const char *lastlog2_path, 
 		               const char *lastlog_file, char **error);
+
+/* One entry for ll2_write_entries and ll2_read_all_entries. The
+   lengths are set by the read functions and ignored when writing,
+   strings which are NULL have length 0. uid is only valid if has_uid
+   is set, entries written without UID keep the UID stored before. */
+struct ll2_entry {
+  const char *user;
+  int64_t ll_time;
+  const char *tty;
+  const char *rhost;
+  const char *pam_service;
+  size_t user_len;
+  size_t tty_len;
+  size_t rhost_len;
+  size_t pam_service_len;
+  uid_t uid;
+  int has_uid;
+};
+
+/* Call callback for every entry, ordered by user name. The strings
+   are only valid during the callback, a return value other than 0
+   stops reading. Returns 0 on success, -1 on failure. */
+extern int ll2_read_all_entries (const char *lastlog2_path,
+				 int (*callback)(const struct ll2_entry *entry,
+						 void *userdata),
+				 void *userdata, char **error);
+
+/* Call callback for every entry with from <= UID <= to, ordered by
+   UID and user name, see ll2_read_all_entries. Entries without UID
+   are skipped. */
+extern int ll2_read_uid_range (const char *lastlog2_path, uid_t from,
+			       uid_t to,
+			       int (*callback)(const struct ll2_entry *entry,
+					       void *userdata),
+			       void *userdata, char **error);
+/* Call callback for every entry of uid, see ll2_read_uid_range. More
+   than one entry is found if the user was renamed without
+   ll2_rename_user, or the UID was reused. */
+extern int ll2_read_uid (const char *lastlog2_path, uid_t uid,
+			 int (*callback)(const struct ll2_entry *entry,
+					 void *userdata),
+			 void *userdata, char **error);
+
+/* Write count entries with one prepared statement in transactions of
+   chunk_size entries, or all in one transaction if chunk_size is 0.
+   Failing entries are skipped and marked in status, if not NULL.
+   Returns the number of failed entries, or -1 if a transaction
+   failed. */
+extern int ll2_write_entries (const char *lastlog2_path,
+			      const struct ll2_entry *entries, size_t count,
+			      size_t chunk_size, int *status, char **error);
+
+/* Send an entry to lastlog2d listening on socket_path, or on
+   _PATH_LASTLOG2D_SOCKET if NULL, which writes many entries in one
+   transaction into its database, by default _PATH_LASTLOG2. Returns 0 on
+   success, -ENOENT or -ECONNREFUSED if the daemon is not running,
+   -EAGAIN if it is overloaded, and other negative errno values on
+   failure. Callers should write the entry themselves if it fails. */
+extern int ll2_send_entry (const char *socket_path,
+			   const struct ll2_entry *entry, char **error);
+
+/* Append an entry to the spool file next to the database, which is
+   much cheaper than writing it into the database. ll2_read_entry
+   already returns spooled entries, ll2_compact_journal moves them into
+   the database. Returns 0 on success, -EINVAL if the entry is too
+   large for the spool, -EBUSY if the spool is being compacted, and
+   other negative errno values on failure. Callers should write the
+   entry themselves if it fails. */
+extern int ll2_spool_entry (const char *lastlog2_path,
+			    const struct ll2_entry *entry, char **error);
+/* Move all spooled entries into the database with one transaction.
+   Returns the number of spooled entries, -EBUSY if the spool stayed
+   locked by readers or writers for the busy timeout, or -1 on
+   failure. */
+extern int ll2_compact_journal (const char *lastlog2_path, char **error);
+
+/* A context keeps the database open and the SQL statements prepared
+   between calls, which is much cheaper if more than one operation is
+   done. A context must not be used by several threads at the same
+   time. */
+struct ll2_context;
+
+/* Flags for ll2_open_context. */
+#define LL2_OPEN_READONLY      0x01 /* open database read-only */
+#define LL2_OPEN_NO_WAL        0x02 /* don't switch new or migrated
+				       databases to WAL mode */
+#define LL2_OPEN_NO_CHECKPOINT 0x04 /* leave WAL checkpoints to
+				       ll2_ctx_checkpoint, for callers
+				       in the login path */
+
+/* Open the database and create a new context.
+   Returns NULL on failure. */
+extern struct ll2_context *ll2_open_context (const char *lastlog2_path,
+					     int flags, char **error);
+/* Same as ll2_open_context, but wait at most timeout_ms milliseconds
+   for a database locked by somebody else, already while creating or
+   migrating it, and keep this as busy timeout of the new context.
+   Stores the context in *context.
+   Returns 0 on success, -EBUSY if the database stayed locked and -1
+   on failure. */
+extern int ll2_open_context_timeout (const char *lastlog2_path, int flags,
+				     int timeout_ms,
+				     struct ll2_context **context,
+				     char **error);
+/* Close the database and free all resources of the context. */
+extern void ll2_close_context (struct ll2_context *context);
+
+/* Default time in milliseconds to wait for a database locked by
+   somebody else. */
+#define LL2_DEFAULT_BUSY_TIMEOUT 1000
+/* Set how long to wait for a locked database, retrying with backoff.
+   Reading, writing, updating or removing an entry fails with -EBUSY
+   if the lock could not be obtained in time. 0 means fail at once. */
+extern void ll2_ctx_set_busy_timeout (struct ll2_context *context,
+				      int timeout_ms);
+
+/* Report statements, lock waits and syncs to disk, which take at least
+   threshold_ms milliseconds, to syslog with the database and the
+   calling process. Affects all databases opened afterwards in this
+   process. 0 disables the reports. If not called, the threshold is
+   taken from the environment variable LASTLOG2_SLOWLOG_MS. */
+extern void ll2_set_slowlog (int threshold_ms);
+
+/* Same as the functions above, but use an already open context and
+   its busy timeout. They return the same values. */
+extern int ll2_ctx_write_entry (struct ll2_context *context, const char *user,
+				int64_t ll_time, const char *tty,
+				const char *rhost, const char *pam_service,
+				char **error);
+/* Same as ll2_ctx_write_entry, but store the UID of the user, or keep
+   the UID of an existing entry if uid is negative. */
+extern int ll2_ctx_write_entry_uid (struct ll2_context *context,
+				    const char *user, int64_t ll_time,
+				    const char *tty, const char *rhost,
+				    const char *pam_service, int64_t uid,
+				    char **error);
+extern int ll2_ctx_write_entries (struct ll2_context *context,
+				  const struct ll2_entry *entries,
+				  size_t count, size_t chunk_size,
+				  int *status, char **error);
+extern int ll2_ctx_read_all (struct ll2_context *context,
+			     int (*callback)(const struct ll2_entry *entry,
+					     void *userdata),
+			     void *userdata, char **error);
+extern int ll2_ctx_read_entry (struct ll2_context *context, const char *user,
+			       int64_t *ll_time, char **tty, char **rhost,
+			       char **pam_service, char **error);
+extern int ll2_ctx_update_login_time (struct ll2_context *context,
+				      const char *user, int64_t ll_time,
+				      char **error);
+extern int ll2_ctx_remove_entry (struct ll2_context *context,
+				 const char *user, char **error);
+extern int ll2_ctx_rename_user (struct ll2_context *context, const char *user,
+				const char *newname, char **error);
+
+/* Flags for ll2_ctx_purge_before and ll2_ctx_purge_orphans. */
+#define LL2_PURGE_DRY_RUN 0x01 /* only count the entries */
+/* Remove all entries with a login before the time before, in
+   transactions of 1000 entries. *count is set to the number of
+   removed entries, or of entries which would be removed with
+   LL2_PURGE_DRY_RUN. Strings like TTYs and hosts, which no entry
+   uses anymore, are removed afterwards.
+   Returns 0 on success, -EBUSY if the database stayed locked, -1 on
+   failure. Entries removed before a failure stay removed. */
+extern int ll2_ctx_purge_before (struct ll2_context *context,
+				 int64_t before, int flags, size_t *count,
+				 char **error);
+/* Same as ll2_ctx_purge_before, but remove the entries of all users,
+   who getpwnam_r does not find anymore. Stops at the first lookup,
+   which fails, e.g. because a name service is not available. */
+extern int ll2_ctx_purge_orphans (struct ll2_context *context, int flags,
+				  size_t *count, char **error);
+/* Call callback for every entry with from <= ll_time < to, ordered by
+   user name, see ll2_read_all_entries. */
+extern int ll2_read_range (const char *lastlog2_path, int64_t from,
+			   int64_t to,
+			   int (*callback)(const struct ll2_entry *entry,
+					   void *userdata),
+			   void *userdata, char **error);
+/* Flags for ll2_read_recent. */
+#define LL2_READ_OLDEST 0x01 /* oldest instead of most recent logins */
+/* Call callback for the count entries with the most recent login,
+   newest first, see ll2_read_all_entries. */
+extern int ll2_read_recent (const char *lastlog2_path, size_t count,
+			    int flags,
+			    int (*callback)(const struct ll2_entry *entry,
+					    void *userdata),
+			    void *userdata, char **error);
+extern int ll2_ctx_read_range (struct ll2_context *context, int64_t from,
+			       int64_t to,
+			       int (*callback)(const struct ll2_entry *entry,
+					       void *userdata),
+			       void *userdata, char **error);
+extern int ll2_ctx_read_uid_range (struct ll2_context *context, uid_t from,
+				   uid_t to,
+				   int (*callback)(const struct ll2_entry *entry,
+						   void *userdata),
+				   void *userdata, char **error);
+extern int ll2_ctx_read_recent (struct ll2_context *context, size_t count,
+				int flags,
+				int (*callback)(const struct ll2_entry *entry,
+						void *userdata),
+				void *userdata, char **error);
+
+/* A cursor reads the entries page by page, ordered by user name.
+   Between pages no read transaction is held, so it can be kept open
+   for a long time. A cursor must not be used after its context got
+   closed. */
+struct ll2_cursor;
+
+/* Open a cursor returning the entries after the user start, or from
+   the beginning if start is NULL. At most limit entries are returned,
+   no limit if 0. Returns NULL on failure. */
+extern struct ll2_cursor *ll2_open_cursor (const char *lastlog2_path,
+					   const char *start, size_t limit,
+					   char **error);
+extern struct ll2_cursor *ll2_ctx_open_cursor (struct ll2_context *context,
+					       const char *start,
+					       size_t limit, char **error);
+/* Store the next entry in entry, the strings are valid until the next
+   call. Returns 1 for an entry, 0 at the end and -1 on failure. */
+extern int ll2_cursor_next (struct ll2_cursor *cursor,
+			    struct ll2_entry *entry, char **error);
+/* Free all resources of the cursor. */
+extern void ll2_cursor_close (struct ll2_cursor *cursor);
+
+/* Read only the used parts of the lastlog file and look up the users
+   of the UIDs found there, instead of looking up every passwd entry
+   in the file. Much faster for large files, but a UID with several
+   names gets imported for one of them only, and records of UIDs
+   without user are skipped. */
+#define LL2_IMPORT_SPARSE 0x01
+/* Same as ll2_import_lastlog, but done in several transactions and
+   continues where it stopped if it was interrupted. progress is
+   called after every transaction with the number of passwd entries
+   (lastlog records with LL2_IMPORT_SPARSE) read and of imported
+   entries so far; returning non-zero stops the import. */
+extern int ll2_ctx_import_lastlog (struct ll2_context *context,
+				   const char *lastlog_file, int flags,
+				   int (*progress)(uint64_t scanned,
+						   uint64_t imported,
+						   void *userdata),
+				   void *userdata, char **error);
+
+/* Same as ll2_compact_journal, but use an already open context. */
+extern int ll2_ctx_compact_journal (struct ll2_context *context,
+				    char **error);
+
+/* Create the cache for ll2_read_cached_entry, or rebuild it.
+   Returns 0 on success, -EBUSY if a writer kept the old cache locked
+   for the busy timeout, -1 on failure. */
+extern int ll2_ctx_rebuild_cache (struct ll2_context *context,
+				  char **error);
+
+/* Copy the WAL file back into the database and rebuild the cache, if
+   it is not up to date. Should be called regularly by maintenance
+   jobs. Returns 0 on success, -1 on failure. */
+extern int ll2_ctx_checkpoint (struct ll2_context *context, char **error);
+
+/* Space used by one table or index, see ll2_ctx_get_space. */
+struct ll2_space_object {
+  char name[64];
+  /* Pages of the table or index, including overflow pages. */
+  int64_t pages;
+  /* Bytes in these pages, which are not used by any content. */
+  int64_t unused;
+};
+
+/* Size and fragmentation of a database. */
+struct ll2_space {
+  int64_t page_size;
+  int64_t page_count;
+  /* Pages not used by any table or index. */
+  int64_t freelist_count;
+  /* 0 none, 1 full, 2 incremental, see PRAGMA auto_vacuum. */
+  int auto_vacuum;
+  /* Tables and indexes, largest first. Empty if SQLite was built
+     without the dbstat virtual table. */
+  size_t count;
+  struct ll2_space_object *objects;
+};
+
+/* Get the size of the database and the space used by every table
+   and index. *space needs to be freed.
+   Returns 0 on success, -1 on failure. */
+extern int ll2_ctx_get_space (struct ll2_context *context,
+			      struct ll2_space **space, char **error);
+
+/* Tasks for ll2_ctx_maintain. */
+#define LL2_MAINTAIN_OPTIMIZE    0x01 /* update the statistics of the
+					 query planner */
+#define LL2_MAINTAIN_INCREMENTAL 0x02 /* give free pages back to the
+					 file system in short slices */
+#define LL2_MAINTAIN_VACUUM      0x04 /* rebuild the whole database,
+					 writers wait until it is done */
+
+/* Remove the strings, which no entry uses anymore, run the
+   maintenance tasks, followed by ll2_ctx_checkpoint. The
+   incremental vacuum needs a database with incremental auto_vacuum,
+   which new databases have and LL2_MAINTAIN_VACUUM switches to.
+   Returns 0 on success, -EBUSY if the database stayed locked, -1
+   on failure. */
+extern int ll2_ctx_maintain (struct ll2_context *context, int tasks,
+			     char **error);
+
+/* Number of buckets of the latency histograms. */
+#define LL2_STATS_BUCKETS 40
+
+/* Statistics of one operation or phase of liblastlog2 in this
+   process, see ll2_get_stats. */
+struct ll2_stats {
+  const char *name;    /* e.g. "read_entry", "open" or "step" */
+  uint64_t count;      /* number of calls */
+  uint64_t busy;       /* calls failed because the database was locked */
+  uint64_t errors;     /* calls failed for other reasons */
+  uint64_t total_ns;   /* time spent in all calls */
+  uint64_t max_ns;     /* longest call */
+  /* histogram[i] is the number of calls, which took at least 2^i
+     and less than 2^(i+1) nanoseconds. The last bucket also counts
+     all longer calls. */
+  uint64_t histogram[LL2_STATS_BUCKETS];
+};
+
+/* Get the statistics of all operations and phases since the start
+   of the process or the last ll2_reset_stats. *stats is an array of
+   *count entries, which needs to be freed.
+   Returns 0 on success, -ENOTSUP if liblastlog2 was built without
+   statistics, -1 on failure. */
+extern int ll2_get_stats (struct ll2_stats **stats, size_t *count,
+			  char **error);
+/* Set all statistics back to zero. */
+extern void ll2_reset_stats (void);
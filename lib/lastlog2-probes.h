@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Static tracepoints (USDT) of the provider "lastlog2" for bpftrace,
+   perf and SystemTap. Not part of the public API. Without HAVE_SDT
+   all macros are empty.
+
+   Operations have a probe NAME_start(str) at the beginning and
+   NAME_done(str, duration in ns, return value, SQLite result code
+   or 0) at the end, e.g.:
+
+     bpftrace -e 'usdt:/usr/lib64/liblastlog2.so.1:lastlog2:ctx_write_entry_done
+       { @ns[str(arg0)] = hist(arg1); }'
+
+   Every probe has a semaphore, which the tracer sets while it is
+   attached, so that the time and arguments are only computed if
+   somebody is listening. The semaphores of all probes used in a
+   file need to be defined there with LL2_PROBE_SEMAPHORES. */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef HAVE_SDT
+
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+
+# define LL2_PROBE_SEMAPHORE(name) \
+  unsigned short lastlog2_##name##_semaphore \
+    __attribute__ ((used, visibility ("hidden"), section (".probes")))
+# define LL2_PROBE_ENABLED(name) \
+  __builtin_expect (lastlog2_##name##_semaphore != 0, 0)
+
+# define LL2_PROBE1(name, a) STAP_PROBE1 (lastlog2, name, a)
+# define LL2_PROBE3(name, a, b, c) STAP_PROBE3 (lastlog2, name, a, b, c)
+# define LL2_PROBE4(name, a, b, c, d) \
+  STAP_PROBE4 (lastlog2, name, a, b, c, d)
+
+static inline uint64_t
+ll2_probe_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Semaphores of NAME_start and NAME_done. */
+# define LL2_PROBE_SEMAPHORES(name) \
+  LL2_PROBE_SEMAPHORE (name##_start); \
+  LL2_PROBE_SEMAPHORE (name##_done)
+
+/* Fires NAME_start and takes the time for NAME_done. LL2_PROBE_END
+   needs to be in the same block. */
+# define LL2_PROBE_BEGIN(name, str) \
+  uint64_t name##_probe_start = \
+    LL2_PROBE_ENABLED (name##_done) ? ll2_probe_now () : 0; \
+  LL2_PROBE1 (name##_start, str)
+
+# define LL2_PROBE_END(name, str, ret, rc) \
+  do { \
+    /* The tracer could have been attached in between. */ \
+    if (LL2_PROBE_ENABLED (name##_done) && name##_probe_start) \
+      LL2_PROBE4 (name##_done, str, ll2_probe_now () - name##_probe_start, \
+		  (int64_t)(ret), (int)(rc)); \
+  } while (0)
+
+#else
+
+/* Only a declaration to swallow the semicolon. */
+# define LL2_PROBE_SEMAPHORES(name) \
+  extern int lastlog2_##name##_no_semaphore
+# define LL2_PROBE_ENABLED(name) 0
+# define LL2_PROBE1(name, a) do { } while (0)
+# define LL2_PROBE3(name, a, b, c) do { } while (0)
+# define LL2_PROBE4(name, a, b, c, d) do { } while (0)
+# define LL2_PROBE_BEGIN(name, str) do { } while (0)
+# define LL2_PROBE_END(name, str, ret, rc) do { } while (0)
+
+#endif
@@ -28,22 +28,615 @@
 #include <pwd.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <syslog.h>
 #include <sqlite3.h>
 #include <lastlog.h>
 
 #include "lastlog2.h"
+#include "lastlog2d-protocol.h"
+#include "lastlog2-probes.h"
+
+LL2_PROBE_SEMAPHORES (open);
+LL2_PROBE_SEMAPHORES (read_entry);
+LL2_PROBE_SEMAPHORES (write_entry);
+LL2_PROBE_SEMAPHORES (ctx_read_entry);
+LL2_PROBE_SEMAPHORES (ctx_write_entry);
+LL2_PROBE_SEMAPHORES (ctx_remove_entry);
+LL2_PROBE_SEMAPHORES (step);
+
+struct ll2_context {
+  sqlite3 *db;
+  char *path;
+  int flags;
+  /* Schema version of the database, 0 if not known yet. */
+  int schema_version;
+  /* Milliseconds to wait for a locked database. */
+  int busy_timeout;
+  /* Time of the first retry for the current lock. */
+  struct timespec busy_start;
+  /* Set when busy_handler gave up waiting for a lock. */
+  int busy_expired;
+  /* Set once cache_begin found a cache to update. */
+  int cache_used;
+  /* Nanoseconds the current statement waited for locks, only
+     counted if slow operations get reported. */
+  int64_t lock_wait_ns;
+  int slowlog;
+  /* Prepared on first use and kept until ll2_close_context. */
+  sqlite3_stmt *stmt_select;
+  sqlite3_stmt *stmt_replace;
+  sqlite3_stmt *stmt_delete;
+  sqlite3_stmt *stmt_import;
+  sqlite3_stmt *stmt_read_all;
+  sqlite3_stmt *stmt_page_first;
+  sqlite3_stmt *stmt_page_next;
+  sqlite3_stmt *stmt_range;
+  sqlite3_stmt *stmt_recent;
+  sqlite3_stmt *stmt_oldest;
+  sqlite3_stmt *stmt_uid_range;
+  sqlite3_stmt *stmt_update_time;
+  sqlite3_stmt *stmt_rename;
+  sqlite3_stmt *stmt_intern;
+  /* Content of Lastlog2_Strings indexed by Id, loaded on demand.
+     Ids are never reused, so loaded strings never get stale. */
+  char **strings;
+  size_t *string_lens;
+  size_t strings_size;
+  int64_t strings_last_id;
+};
+
+/* Operations and phases with statistics, see ll2_get_stats. */
+enum stats_id {
+  STAT_OPEN,
+  STAT_CLOSE,
+  STAT_PREPARE,
+  STAT_STEP,
+  STAT_EXEC,
+  STAT_BUSY_WAIT,
+  STAT_CHECKPOINT,
+  STAT_READ_ENTRY,
+  STAT_READ_ENTRIES,
+  STAT_READ_CACHED_ENTRY,
+  STAT_CURSOR_NEXT,
+  STAT_WRITE_ENTRY,
+  STAT_WRITE_ENTRIES,
+  STAT_UPDATE_LOGIN_TIME,
+  STAT_REMOVE_ENTRY,
+  STAT_RENAME_USER,
+  STAT_SPOOL_ENTRY,
+  STAT_SEND_ENTRY,
+  STAT_COMPACT_JOURNAL,
+  STAT_IMPORT_LASTLOG,
+  STAT_MAINTAIN,
+  STAT_PURGE,
+  STAT_COUNT
+};
+
+#ifdef WITH_STATS
+static const char *const stats_names[STAT_COUNT] = {
+  "open",
+  "close",
+  "prepare",
+  "step",
+  "exec",
+  "busy_wait",
+  "checkpoint",
+  "read_entry",
+  "read_entries",
+  "read_cached_entry",
+  "cursor_next",
+  "write_entry",
+  "write_entries",
+  "update_login_time",
+  "remove_entry",
+  "rename_user",
+  "spool_entry",
+  "send_entry",
+  "compact_journal",
+  "import_lastlog",
+  "maintain",
+  "purge"
+};
+
+/* Statistics of this process, shared by all threads. */
+static struct {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t busy;
+  atomic_uint_fast64_t errors;
+  atomic_uint_fast64_t total_ns;
+  atomic_uint_fast64_t max_ns;
+  atomic_uint_fast64_t histogram[LL2_STATS_BUCKETS];
+} stats[STAT_COUNT];
+
+static uint64_t
+stats_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Accounts a call started at start, which returned ret. -EBUSY
+   counts as busy, -ENOENT and -ESTALE (not found, cache not usable)
+   as success and every other negative value as error. */
+static void
+stats_add (enum stats_id id, uint64_t start, int ret)
+{
+  uint64_t ns = stats_now () - start;
+  uint64_t max;
+  int bucket = 63 - __builtin_clzll (ns | 1);
+
+  if (bucket >= LL2_STATS_BUCKETS)
+    bucket = LL2_STATS_BUCKETS - 1;
+
+  atomic_fetch_add_explicit (&stats[id].count, 1, memory_order_relaxed);
+  if (ret == -EBUSY)
+    atomic_fetch_add_explicit (&stats[id].busy, 1, memory_order_relaxed);
+  else if (ret < 0 && ret != -ENOENT && ret != -ESTALE)
+    atomic_fetch_add_explicit (&stats[id].errors, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stats[id].total_ns, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stats[id].histogram[bucket], 1,
+			     memory_order_relaxed);
+
+  max = atomic_load_explicit (&stats[id].max_ns, memory_order_relaxed);
+  while (ns > max &&
+	 !atomic_compare_exchange_weak_explicit (&stats[id].max_ns, &max, ns,
+						 memory_order_relaxed,
+						 memory_order_relaxed))
+    ;
+}
+
+/* Time the code between STATS_BEGIN and STATS_END, which must be in
+   the same block. Without WITH_STATS, they are empty. */
+# define STATS_BEGIN() uint64_t stats_start = stats_now ()
+# define STATS_END(id, ret) stats_add (id, stats_start, ret)
+#else
+# define STATS_BEGIN() do { } while (0)
+# define STATS_END(id, ret) do { } while (0)
+#endif
+
+/* Copies the statistics of all operations and phases, if they are
+   compiled in. */
+int
+ll2_get_stats (struct ll2_stats **result, size_t *count, char **error)
+{
+#ifdef WITH_STATS
+  struct ll2_stats *copy;
+
+  if ((copy = calloc (STAT_COUNT, sizeof (struct ll2_stats))) == NULL)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      return -1;
+    }
+
+  for (int i = 0; i < STAT_COUNT; i++)
+    {
+      copy[i].name = stats_names[i];
+      copy[i].count = atomic_load (&stats[i].count);
+      copy[i].busy = atomic_load (&stats[i].busy);
+      copy[i].errors = atomic_load (&stats[i].errors);
+      copy[i].total_ns = atomic_load (&stats[i].total_ns);
+      copy[i].max_ns = atomic_load (&stats[i].max_ns);
+      for (int b = 0; b < LL2_STATS_BUCKETS; b++)
+	copy[i].histogram[b] = atomic_load (&stats[i].histogram[b]);
+    }
+
+  *result = copy;
+  *count = STAT_COUNT;
+
+  return 0;
+#else
+  (void)result;
+  (void)count;
+
+  if (error)
+    *error = strdup ("liblastlog2 was built without statistics");
+
+  return -ENOTSUP;
+#endif
+}
+
+/* Sets all statistics back to zero. */
+void
+ll2_reset_stats (void)
+{
+#ifdef WITH_STATS
+  for (int i = 0; i < STAT_COUNT; i++)
+    {
+      atomic_store (&stats[i].count, 0);
+      atomic_store (&stats[i].busy, 0);
+      atomic_store (&stats[i].errors, 0);
+      atomic_store (&stats[i].total_ns, 0);
+      atomic_store (&stats[i].max_ns, 0);
+      for (int b = 0; b < LL2_STATS_BUCKETS; b++)
+	atomic_store (&stats[i].histogram[b], 0);
+    }
+#endif
+}
+
+/* sqlite3_step, counted in the statistics and traced with the SQL
+   text of the statement. */
+static int
+step_stmt (sqlite3_stmt *stmt)
+{
+  STATS_BEGIN ();
+  LL2_PROBE_BEGIN (step, LL2_PROBE_ENABLED (step_start) ?
+		   sqlite3_sql (stmt) : NULL);
+  int ret = sqlite3_step (stmt);
+
+  LL2_PROBE_END (step, sqlite3_sql (stmt), ret, ret);
+  STATS_END (STAT_STEP, ret == SQLITE_BUSY ? -EBUSY :
+	     (ret == SQLITE_ROW || ret == SQLITE_DONE) ? 0 : -1);
+
+  return ret;
+}
+
+/* Slow operations are reported to syslog if they take at least
+   slowlog_ms milliseconds: statements with the time they waited for
+   locks, lock waits which gave up, and syncs of the database files
+   to disk. The threshold is process wide, since the syncs are timed
+   by the VFS, which doesn't know the connection. -1 means not set
+   yet, then LASTLOG2_SLOWLOG_MS is used. 0 disables the reports. */
+#define SLOWLOG_ENV "LASTLOG2_SLOWLOG_MS"
+#define SLOWLOG_VFS "lastlog2-slowlog"
+
+static atomic_int slowlog_ms = -1;
+
+static int
+slowlog_threshold (void)
+{
+  int ms = atomic_load_explicit (&slowlog_ms, memory_order_relaxed);
+
+  if (ms < 0)
+    {
+      /* Not from the environment of setuid programs like su, else
+	 every user could fill the system log. */
+      const char *env = secure_getenv (SLOWLOG_ENV);
+      char *ep;
+      long val;
+
+      ms = 0;
+      if (env != NULL && *env != '\0')
+	{
+	  errno = 0;
+	  val = strtol (env, &ep, 10);
+	  if (errno == 0 && *ep == '\0' && val > 0 && val <= INT_MAX)
+	    ms = val;
+	}
+      atomic_store_explicit (&slowlog_ms, ms, memory_order_relaxed);
+    }
+
+  return ms;
+}
+
+/* Report operations on lastlog2 databases, which take at least
+   threshold_ms milliseconds, to syslog. Affects databases opened
+   afterwards. 0 disables the reports. Overrides LASTLOG2_SLOWLOG_MS. */
+void
+ll2_set_slowlog (int threshold_ms)
+{
+  atomic_store_explicit (&slowlog_ms, threshold_ms > 0 ? threshold_ms : 0,
+			 memory_order_relaxed);
+}
+
+/* suffix follows the duration, e.g. what the statement was. */
+static void
+slowlog_report (const char *what, const char *path, int64_t ns,
+		const char *suffix)
+{
+  syslog (LOG_WARNING, "lastlog2: slow %s of %s in %s[%ld]: %lld ms%s",
+	  what, path, program_invocation_short_name, (long)getpid (),
+	  (long long)(ns / 1000000), suffix);
+}
+
+/* SQLITE_TRACE_PROFILE callback, called when a statement finished. */
+static int
+slowlog_trace (unsigned type, void *data, void *p, void *x)
+{
+  struct ll2_context *context = data;
+  sqlite3_stmt *stmt = p;
+  int64_t ns = *(sqlite3_int64 *)x;
+  int64_t lock_ns = context->lock_wait_ns;
+  int threshold = slowlog_threshold ();
+  char *suffix;
+
+  if (type != SQLITE_TRACE_PROFILE)
+    return 0;
+
+  context->lock_wait_ns = 0;
+  if (threshold == 0 || ns < (int64_t)threshold * 1000000)
+    return 0;
+
+  /* Unexpanded, the values could be user names. */
+  if (asprintf (&suffix, " (%lld ms waiting for locks): %s",
+		(long long)(lock_ns / 1000000), sqlite3_sql (stmt)) < 0)
+    suffix = NULL;
+  slowlog_report ("statement", context->path, ns,
+		  suffix ? suffix : "");
+  free (suffix);
+
+  return 0;
+}
+
+/* The slowlog VFS forwards everything to the default VFS and times
+   xSync, i.e. how long the disk needs to make a commit or checkpoint
+   durable. Lock contention shows up in the busy handler instead. */
+struct slowlog_file {
+  sqlite3_file base;
+  /* Valid until xClose, guaranteed by SQLite. */
+  const char *name;
+  /* File of the default VFS, allocated behind this struct. */
+  sqlite3_file *real;
+};
+
+static sqlite3_vfs *slowlog_real_vfs;
+static sqlite3_vfs slowlog_vfs;
+static pthread_once_t slowlog_vfs_once = PTHREAD_ONCE_INIT;
+static int slowlog_vfs_registered;
+
+#define SLOWLOG_REAL(file) (((struct slowlog_file *)(file))->real)
+
+static int
+slowlog_close (sqlite3_file *file)
+{
+  return SLOWLOG_REAL (file)->pMethods->xClose (SLOWLOG_REAL (file));
+}
+
+static int
+slowlog_read (sqlite3_file *file, void *buf, int amt, sqlite3_int64 ofs)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xRead (real, buf, amt, ofs);
+}
+
+static int
+slowlog_write (sqlite3_file *file, const void *buf, int amt,
+	       sqlite3_int64 ofs)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xWrite (real, buf, amt, ofs);
+}
+
+static int
+slowlog_truncate (sqlite3_file *file, sqlite3_int64 size)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xTruncate (real, size);
+}
+
+static int
+slowlog_sync (sqlite3_file *file, int flags)
+{
+  struct slowlog_file *p = (struct slowlog_file *)file;
+  struct timespec start, end;
+  int64_t ns;
+  int threshold;
+  int ret;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  ret = p->real->pMethods->xSync (p->real, flags);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  ns = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+    (end.tv_nsec - start.tv_nsec);
+  threshold = slowlog_threshold ();
+  if (threshold > 0 && ns >= (int64_t)threshold * 1000000)
+    slowlog_report ("sync", p->name ? p->name : "temporary file", ns, "");
+
+  return ret;
+}
+
+static int
+slowlog_file_size (sqlite3_file *file, sqlite3_int64 *size)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xFileSize (real, size);
+}
+
+static int
+slowlog_lock (sqlite3_file *file, int lock)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xLock (real, lock);
+}
+
+static int
+slowlog_unlock (sqlite3_file *file, int lock)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xUnlock (real, lock);
+}
+
+static int
+slowlog_check_reserved_lock (sqlite3_file *file, int *result)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xCheckReservedLock (real, result);
+}
+
+static int
+slowlog_file_control (sqlite3_file *file, int op, void *arg)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xFileControl (real, op, arg);
+}
+
+static int
+slowlog_sector_size (sqlite3_file *file)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xSectorSize (real);
+}
+
+static int
+slowlog_device_characteristics (sqlite3_file *file)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xDeviceCharacteristics (real);
+}
+
+static int
+slowlog_shm_map (sqlite3_file *file, int page, int size, int extend,
+		 void volatile **mem)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xShmMap (real, page, size, extend, mem);
+}
+
+static int
+slowlog_shm_lock (sqlite3_file *file, int ofs, int n, int flags)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xShmLock (real, ofs, n, flags);
+}
+
+static void
+slowlog_shm_barrier (sqlite3_file *file)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  real->pMethods->xShmBarrier (real);
+}
+
+static int
+slowlog_shm_unmap (sqlite3_file *file, int delete_flag)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xShmUnmap (real, delete_flag);
+}
+
+static int
+slowlog_fetch (sqlite3_file *file, sqlite3_int64 ofs, int amt, void **pp)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xFetch (real, ofs, amt, pp);
+}
+
+static int
+slowlog_unfetch (sqlite3_file *file, sqlite3_int64 ofs, void *p)
+{
+  sqlite3_file *real = SLOWLOG_REAL (file);
+
+  return real->pMethods->xUnfetch (real, ofs, p);
+}
+
+/* Indexed by the version of the methods of the real file, SQLite
+   must not call methods the real file does not have. */
+static const sqlite3_io_methods slowlog_io_methods[] = {
+  { 1, slowlog_close, slowlog_read, slowlog_write, slowlog_truncate,
+    slowlog_sync, slowlog_file_size, slowlog_lock, slowlog_unlock,
+    slowlog_check_reserved_lock, slowlog_file_control, slowlog_sector_size,
+    slowlog_device_characteristics, NULL, NULL, NULL, NULL, NULL, NULL },
+  { 2, slowlog_close, slowlog_read, slowlog_write, slowlog_truncate,
+    slowlog_sync, slowlog_file_size, slowlog_lock, slowlog_unlock,
+    slowlog_check_reserved_lock, slowlog_file_control, slowlog_sector_size,
+    slowlog_device_characteristics, slowlog_shm_map, slowlog_shm_lock,
+    slowlog_shm_barrier, slowlog_shm_unmap, NULL, NULL },
+  { 3, slowlog_close, slowlog_read, slowlog_write, slowlog_truncate,
+    slowlog_sync, slowlog_file_size, slowlog_lock, slowlog_unlock,
+    slowlog_check_reserved_lock, slowlog_file_control, slowlog_sector_size,
+    slowlog_device_characteristics, slowlog_shm_map, slowlog_shm_lock,
+    slowlog_shm_barrier, slowlog_shm_unmap, slowlog_fetch, slowlog_unfetch },
+};
+
+static int
+slowlog_open (sqlite3_vfs *vfs __attribute__((unused)), const char *name,
+	      sqlite3_file *file, int flags, int *out_flags)
+{
+  struct slowlog_file *p = (struct slowlog_file *)file;
+  int version;
+  int ret;
+
+  p->name = name;
+  p->real = (sqlite3_file *)&p[1];
+  ret = slowlog_real_vfs->xOpen (slowlog_real_vfs, name, p->real, flags,
+				 out_flags);
+  /* Without methods, SQLite does not call xClose. */
+  if (p->real->pMethods == NULL)
+    {
+      p->base.pMethods = NULL;
+      return ret;
+    }
+
+  version = p->real->pMethods->iVersion;
+  if (version < 1)
+    version = 1;
+  else if (version > 3)
+    version = 3;
+  p->base.pMethods = &slowlog_io_methods[version - 1];
+
+  return ret;
+}
+
+static void
+slowlog_register_vfs (void)
+{
+  slowlog_real_vfs = sqlite3_vfs_find (NULL);
+  if (slowlog_real_vfs == NULL)
+    return;
+
+  /* All other methods work on the VFS, not on files, and are
+     used unchanged. */
+  slowlog_vfs = *slowlog_real_vfs;
+  slowlog_vfs.pNext = NULL;
+  slowlog_vfs.zName = SLOWLOG_VFS;
+  slowlog_vfs.szOsFile = sizeof (struct slowlog_file) +
+    slowlog_real_vfs->szOsFile;
+  slowlog_vfs.xOpen = slowlog_open;
+
+  slowlog_vfs_registered =
+    sqlite3_vfs_register (&slowlog_vfs, 0) == SQLITE_OK;
+}
+
+/* Name of the VFS to open databases with, NULL for the default. */
+static const char *
+slowlog_vfs_name (void)
+{
+  if (slowlog_threshold () == 0)
+    return NULL;
+
+  pthread_once (&slowlog_vfs_once, slowlog_register_vfs);
+
+  return slowlog_vfs_registered ? SLOWLOG_VFS : NULL;
+}
 
 static sqlite3 *
 open_database_ro (const char *path, char **error)
 {
   sqlite3 *db;
 
-  if (sqlite3_open_v2 (path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+  if (sqlite3_open_v2 (path, &db, SQLITE_OPEN_READONLY,
+		       slowlog_vfs_name ()) != SQLITE_OK)
     {
       if (error)
 	if (asprintf (error, "Cannot open database (%s): %s",
@@ -61,490 +654,5199 @@ open_database_rw (const char *path, char **error)
 {
   sqlite3 *db;
 
-  if (sqlite3_open (path, &db) != SQLITE_OK)
+  if (sqlite3_open_v2 (path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+		       slowlog_vfs_name ()) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Cannot create/open database (%s): %s",
+		      path, sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      sqlite3_close (db);
+      return NULL;
+    }
+
+  return db;
+}
+
+/* Version of the database layout, stored as PRAGMA user_version.
+   Databases written before the layout was versioned have version 0. */
+#define SCHEMA_VERSION 6
+
+/* Id of the string in the SQL expression value in Lastlog2_Strings,
+   and the string of the Id in the column col. Strings need to be
+   added with intern_strings before they are looked up. NULL is not
+   stored and maps to NULL. */
+#define STRING_ID(value) "(SELECT Id FROM Lastlog2_Strings WHERE Value = " value ")"
+#define STRING_VALUE(col) "(SELECT Value FROM Lastlog2_Strings WHERE Id = " col ")"
+
+/* Number of rows copied per transaction if a migration needs to
+   rebuild the table. */
+#define MIGRATION_CHUNK_SIZE 1000
+
+/* Size of the WAL in pages, after which a connection opened with
+   LL2_OPEN_NO_CHECKPOINT still runs a checkpoint. This is only a
+   safety net if no maintenance job calls ll2_ctx_checkpoint. */
+#define NO_CHECKPOINT_WAL_LIMIT 10000
+
+/* Size in bytes (4 MiB) the WAL file gets truncated to after a
+   checkpoint.
+   Without a limit, the WAL file kept with SQLITE_FCNTL_PERSIST_WAL
+   is not reset when the last connection closes, every open recovers
+   all old frames again and the file grows forever. */
+#define WAL_SIZE_LIMIT "4194304"
+
+static int
+exec_sql (sqlite3 *db, const char *sql, char **error)
+{
+  char *err_msg = NULL;
+  STATS_BEGIN ();
+
+  if (sqlite3_exec (db, sql, 0, 0, &err_msg) != SQLITE_OK)
+    {
+      STATS_END (STAT_EXEC,
+		 sqlite3_errcode (db) == SQLITE_BUSY ? -EBUSY : -1);
+      if (error)
+	if (asprintf (error, "SQL error: %s", err_msg) < 0)
+	  *error = strdup ("Out of memory");
+      sqlite3_free (err_msg);
+
+      return -1;
+    }
+
+  STATS_END (STAT_EXEC, 0);
+  return 0;
+}
+
+/* Runs a query returning one integer.
+   Returns 1 if a row was found, 0 if not and -1 on failure. */
+static int
+query_int (sqlite3 *db, const char *sql, int *value, char **error)
+{
+  sqlite3_stmt *res;
+  int retval = 0;
+
+  if (sqlite3_prepare_v2 (db, sql, -1, &res, 0) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      return -1;
+    }
+
+  int step = step_stmt (res);
+
+  if (step == SQLITE_ROW)
+    {
+      *value = sqlite3_column_int (res, 0);
+      retval = 1;
+    }
+  else if (step != SQLITE_DONE)
+    {
+      if (error)
+	if (asprintf (error, "Error stepping through database: %s",
+		      sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      retval = -1;
+    }
+
+  sqlite3_finalize (res);
+
+  return retval;
+}
+
+static int
+get_schema_version (sqlite3 *db, int *version, char **error)
+{
+  if (query_int (db, "PRAGMA user_version", version, error) != 1)
+    return -1;
+
+  return 0;
+}
+
+/* Starts a write transaction and checks, that the database was not
+   migrated to the target version in the meantime by somebody else.
+   Returns 1 if the migration still needs to be done, 0 if not and
+   -1 on failure. Except on failure, the transaction is open. */
+static int
+begin_migration (sqlite3 *db, int target, char **error)
+{
+  int version;
+
+  if (exec_sql (db, "BEGIN IMMEDIATE", error) != 0)
+    return -1;
+
+  if (get_schema_version (db, &version, error) != 0)
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      return -1;
+    }
+
+  return version < target;
+}
+
+/* Sets the new schema version and commits the open transaction.
+   Returns 0 on success, -1 on failure. */
+static int
+commit_migration (sqlite3 *db, int target, char **error)
+{
+  char *sql;
+  int retval;
+
+  if (asprintf (&sql, "PRAGMA user_version = %d; COMMIT", target) < 0)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      exec_sql (db, "ROLLBACK", NULL);
+      return -1;
+    }
+
+  retval = exec_sql (db, sql, error);
+  if (retval != 0)
+    exec_sql (db, "ROLLBACK", NULL);
+
+  free (sql);
+  return retval;
+}
+
+/* Definition of Lastlog2_new since version 6, and the indexes of
+   Lastlog2 to create after a rebuild since version 5. */
+#define LASTLOG2_NEW_V6 "CREATE TABLE IF NOT EXISTS Lastlog2_new(Name TEXT PRIMARY KEY, Time INTEGER, TTYId INTEGER, RemoteHostId INTEGER, ServiceId INTEGER, UID INTEGER) STRICT, WITHOUT ROWID"
+#define LASTLOG2_INDEXES "CREATE INDEX Lastlog2_Time ON Lastlog2(Time); CREATE INDEX Lastlog2_UID ON Lastlog2(UID);"
+
+/* Rows of a chunk with the limits lo and hi as first and second
+   parameter. Both limits can use the index on Name, a blob sorts
+   after every text. */
+#define CHUNK_RANGE "Name >= coalesce(?1, '') AND Name <= coalesce(?2, x'') AND (?1 IS NULL OR Name > ?1)"
+
+/* Copies all rows with lo < Name <= hi into Lastlog2_new. A NULL lo or
+   hi means no lower or upper limit. Returns 0 on success, -1 on failure. */
+static int
+copy_chunk (sqlite3 *db, const char *copy, const char *lo, const char *hi,
+	    char **error)
+{
+  sqlite3_stmt *res;
+  int step;
+
+  if (sqlite3_prepare_v2 (db, copy, -1, &res, 0) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      return -1;
+    }
+
+  if (sqlite3_bind_text (res, 1, lo, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text (res, 2, hi, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create copy statement: %s",
+		      sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      sqlite3_finalize (res);
+      return -1;
+    }
+
+  step = step_stmt (res);
+  sqlite3_finalize (res);
+
+  if (step != SQLITE_DONE)
+    {
+      if (error)
+	if (asprintf (error, "Copy statement failed: %s",
+		      sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* New layout of the Lastlog2 table for rebuild_table. */
+struct table_layout {
+  /* Definition of the new table, which needs to be named Lastlog2_new,
+     and of tables it depends on. */
+  const char *create;
+  /* Values for the new table selected from the old one. */
+  const char *columns;
+  /* Optional statements run before a row or a chunk of rows gets
+     copied, to fill the tables the columns refer to. prepare_row can
+     use NEW for the row, prepare_chunk has the limits of the chunk
+     as parameters like copy_chunk. */
+  const char *prepare_row;
+  const char *prepare_chunk;
+  /* Optional statements run after the new table was renamed, to
+     create the indexes. */
+  const char *finish;
+};
+
+/* Rebuilds the Lastlog2 table with a new layout. The rows are copied
+   in chunks of MIGRATION_CHUNK_SIZE, each in its own transaction, so
+   that the write lock is only held for a short time and logins can
+   continue during the migration. Triggers forward all changes done
+   in the meantime to the new table. If the migration gets
+   interrupted, it will be continued the next time.
+   Returns 0 on success, -1 on failure. */
+static int
+rebuild_table (sqlite3 *db, int target, const struct table_layout *layout,
+	       char **error)
+{
+  const char *prepare_row = layout->prepare_row ? layout->prepare_row : "";
+  const char *sql_next = "SELECT Name FROM Lastlog2 WHERE Name >= coalesce(?1, '') AND (?1 IS NULL OR Name > ?1) ORDER BY Name LIMIT 1 OFFSET ?2";
+  sqlite3_stmt *next = NULL;
+  char *setup = NULL;
+  char *copy = NULL;
+  char *lo = NULL;
+  char *hi = NULL;
+  int retval = -1;
+  int ret;
+
+  if (asprintf (&setup,
+		"%s;"
+		"CREATE TRIGGER IF NOT EXISTS Lastlog2_migrate_insert AFTER INSERT ON Lastlog2 BEGIN "
+		"%s REPLACE INTO Lastlog2_new SELECT %s FROM Lastlog2 WHERE Name = NEW.Name; END;"
+		"CREATE TRIGGER IF NOT EXISTS Lastlog2_migrate_update AFTER UPDATE ON Lastlog2 BEGIN "
+		"DELETE FROM Lastlog2_new WHERE Name = OLD.Name; "
+		"%s REPLACE INTO Lastlog2_new SELECT %s FROM Lastlog2 WHERE Name = NEW.Name; END;"
+		"CREATE TRIGGER IF NOT EXISTS Lastlog2_migrate_delete AFTER DELETE ON Lastlog2 BEGIN "
+		"DELETE FROM Lastlog2_new WHERE Name = OLD.Name; END;",
+		layout->create, prepare_row, layout->columns, prepare_row,
+		layout->columns) < 0 ||
+      asprintf (&copy,
+		"INSERT OR IGNORE INTO Lastlog2_new SELECT %s FROM Lastlog2 "
+		"WHERE " CHUNK_RANGE, layout->columns) < 0)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      goto out;
+    }
+
+  if ((ret = begin_migration (db, target, error)) < 0)
+    goto out;
+  if (ret == 0)
+    {
+      retval = exec_sql (db, "COMMIT", error);
+      goto out;
+    }
+  if (exec_sql (db, setup, error) != 0 || exec_sql (db, "COMMIT", error) != 0)
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      goto out;
+    }
+
+  if (sqlite3_prepare_v2 (db, sql_next, -1, &next, 0) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
+      goto out;
+    }
+
+  do
+    {
+      if (exec_sql (db, "BEGIN IMMEDIATE", error) != 0)
+	goto out;
+
+      /* Find the last name of this chunk, NULL if this is the last one. */
+      sqlite3_bind_text (next, 1, lo, -1, SQLITE_STATIC);
+      sqlite3_bind_int (next, 2, MIGRATION_CHUNK_SIZE - 1);
+      int step = step_stmt (next);
+      if (step == SQLITE_ROW)
+	{
+	  hi = strdup ((const char *)sqlite3_column_text (next, 0));
+	  if (hi == NULL)
+	    {
+	      if (error)
+		*error = strdup ("Out of memory");
+	      sqlite3_reset (next);
+	      exec_sql (db, "ROLLBACK", NULL);
+	      goto out;
+	    }
+	}
+      else if (step != SQLITE_DONE)
+	{
+	  if (error)
+	    if (asprintf (error, "Error stepping through database: %s",
+			  sqlite3_errmsg (db)) < 0)
+	      *error = strdup ("Out of memory");
+	  sqlite3_reset (next);
+	  exec_sql (db, "ROLLBACK", NULL);
+	  goto out;
+	}
+      sqlite3_reset (next);
+
+      if ((layout->prepare_chunk &&
+	   copy_chunk (db, layout->prepare_chunk, lo, hi, error) != 0) ||
+	  copy_chunk (db, copy, lo, hi, error) != 0 ||
+	  exec_sql (db, "COMMIT", error) != 0)
+	{
+	  exec_sql (db, "ROLLBACK", NULL);
+	  goto out;
+	}
+
+      free (lo);
+      lo = hi;
+      hi = NULL;
+    }
+  while (lo != NULL);
+
+  if ((ret = begin_migration (db, target, error)) < 0)
+    goto out;
+  if (ret == 0)
+    {
+      retval = exec_sql (db, "COMMIT", error);
+      goto out;
+    }
+  if (exec_sql (db, "DROP TRIGGER Lastlog2_migrate_insert;"
+		"DROP TRIGGER Lastlog2_migrate_update;"
+		"DROP TRIGGER Lastlog2_migrate_delete;"
+		"DROP TABLE Lastlog2;"
+		"ALTER TABLE Lastlog2_new RENAME TO Lastlog2;", error) != 0 ||
+      (layout->finish && exec_sql (db, layout->finish, error) != 0))
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      goto out;
+    }
+
+  retval = commit_migration (db, target, error);
+
+ out:
+  sqlite3_finalize (next);
+  free (setup);
+  free (copy);
+  free (lo);
+  free (hi);
+  return retval;
+}
+
+/* Version 1: the layout of lastlog2 1.0 up to 1.3. Databases written
+   by older versions have no Service column or are no STRICT table
+   and get rebuilt. */
+static int
+migrate_v1 (sqlite3 *db, char **error)
+{
+  const char *sql_table = "CREATE TABLE Lastlog2(Name TEXT PRIMARY KEY, Time INTEGER, TTY TEXT, RemoteHost TEXT, Service TEXT) STRICT";
+  int strict = 0;
+  int has_service = 0;
+  int ret;
+
+  if ((ret = begin_migration (db, 1, error)) <= 0)
+    return ret < 0 ? -1 : exec_sql (db, "COMMIT", error);
+
+  ret = query_int (db, "SELECT strict FROM pragma_table_list WHERE schema = 'main' AND name = 'Lastlog2'",
+		   &strict, error);
+  if (ret < 0 ||
+      (ret == 1 && query_int (db, "SELECT count(*) FROM pragma_table_info('Lastlog2') WHERE name = 'Service'",
+			      &has_service, error) < 0))
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      return -1;
+    }
+
+  if (ret == 0)
+    {
+      /* New database */
+      if (exec_sql (db, sql_table, error) != 0)
+	{
+	  exec_sql (db, "ROLLBACK", NULL);
+	  return -1;
+	}
+      return commit_migration (db, 1, error);
+    }
+
+  if (strict && has_service)
+    return commit_migration (db, 1, error);
+
+  if (exec_sql (db, "COMMIT", error) != 0)
+    return -1;
+
+  struct table_layout layout = {
+    .create = "CREATE TABLE IF NOT EXISTS Lastlog2_new(Name TEXT PRIMARY KEY, Time INTEGER, TTY TEXT, RemoteHost TEXT, Service TEXT) STRICT",
+    .columns = has_service ?
+    "CAST(Name AS TEXT), CAST(Time AS INTEGER), CAST(TTY AS TEXT), CAST(RemoteHost AS TEXT), CAST(Service AS TEXT)" :
+    "CAST(Name AS TEXT), CAST(Time AS INTEGER), CAST(TTY AS TEXT), CAST(RemoteHost AS TEXT), NULL",
+  };
+
+  return rebuild_table (db, 1, &layout, error);
+}
+
+/* Version 2: ImportState remembers, how far an interrupted import
+   of an old lastlog file got. Mode tells, if Position counts passwd
+   entries or is an offset into the lastlog file. */
+static int
+migrate_v2 (sqlite3 *db, char **error)
+{
+  int ret;
+
+  if ((ret = begin_migration (db, 2, error)) <= 0)
+    return ret < 0 ? -1 : exec_sql (db, "COMMIT", error);
+
+  if (exec_sql (db, "CREATE TABLE IF NOT EXISTS ImportState(File TEXT PRIMARY KEY, Mode INTEGER, Position INTEGER) STRICT",
+		error) != 0)
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      return -1;
+    }
+
+  return commit_migration (db, 2, error);
+}
+
+/* Version 3: Index on Time for range and top-k queries. */
+static int
+migrate_v3 (sqlite3 *db, char **error)
+{
+  int ret;
+
+  if ((ret = begin_migration (db, 3, error)) <= 0)
+    return ret < 0 ? -1 : exec_sql (db, "COMMIT", error);
+
+  if (exec_sql (db, "CREATE INDEX IF NOT EXISTS Lastlog2_Time ON Lastlog2(Time)",
+		error) != 0)
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      return -1;
+    }
+
+  return commit_migration (db, 3, error);
+}
+
+/* Version 4: UID of the user, for lookups and ranges of UIDs. NULL
+   for entries written without UID. */
+static int
+migrate_v4 (sqlite3 *db, char **error)
+{
+  int ret;
+
+  if ((ret = begin_migration (db, 4, error)) <= 0)
+    return ret < 0 ? -1 : exec_sql (db, "COMMIT", error);
+
+  if (exec_sql (db, "ALTER TABLE Lastlog2 ADD COLUMN UID INTEGER",
+		error) != 0 ||
+      exec_sql (db, "CREATE INDEX IF NOT EXISTS Lastlog2_UID ON Lastlog2(UID)",
+		error) != 0)
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      return -1;
+    }
+
+  return commit_migration (db, 4, error);
+}
+
+/* Version 5: TTY, RemoteHost and Service are stored once in
+   Lastlog2_Strings and referenced by Id, there are only a few
+   distinct values of them. The new table is already created
+   WITHOUT ROWID, so that migrate_v6 does not rebuild it again. */
+static int
+migrate_v5 (sqlite3 *db, char **error)
+{
+  const struct table_layout layout = {
+    .create = "CREATE TABLE IF NOT EXISTS Lastlog2_Strings(Id INTEGER PRIMARY KEY AUTOINCREMENT, Value TEXT NOT NULL UNIQUE) STRICT;"
+    LASTLOG2_NEW_V6,
+    .columns = "Name, Time, " STRING_ID ("Lastlog2.TTY") ", "
+    STRING_ID ("Lastlog2.RemoteHost") ", " STRING_ID ("Lastlog2.Service") ", UID",
+    .prepare_row = "INSERT OR IGNORE INTO Lastlog2_Strings(Value) "
+    "VALUES (NEW.TTY), (NEW.RemoteHost), (NEW.Service);",
+    .prepare_chunk = "INSERT OR IGNORE INTO Lastlog2_Strings(Value) "
+    "SELECT TTY FROM Lastlog2 WHERE " CHUNK_RANGE " "
+    "UNION SELECT RemoteHost FROM Lastlog2 WHERE " CHUNK_RANGE " "
+    "UNION SELECT Service FROM Lastlog2 WHERE " CHUNK_RANGE,
+    .finish = LASTLOG2_INDEXES,
+  };
+
+  return rebuild_table (db, 5, &layout, error);
+}
+
+/* Version 6: Lastlog2 is a WITHOUT ROWID table clustered by Name,
+   so looking up or writing an entry needs one B-tree instead of the
+   table and the index on Name. */
+static int
+migrate_v6 (sqlite3 *db, char **error)
+{
+  const struct table_layout layout = {
+    .create = LASTLOG2_NEW_V6,
+    .columns = "Name, Time, TTYId, RemoteHostId, ServiceId, UID",
+    .finish = LASTLOG2_INDEXES,
+  };
+  int without_rowid = 0;
+  int ret;
+
+  if ((ret = begin_migration (db, 6, error)) <= 0)
+    return ret < 0 ? -1 : exec_sql (db, "COMMIT", error);
+
+  if (query_int (db, "SELECT wr FROM pragma_table_list WHERE schema = 'main' AND name = 'Lastlog2'",
+		 &without_rowid, error) < 0)
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      return -1;
+    }
+
+  if (without_rowid)
+    return commit_migration (db, 6, error);
+
+  if (exec_sql (db, "COMMIT", error) != 0)
+    return -1;
+
+  return rebuild_table (db, 6, &layout, error);
+}
+
+/* migrations[n] migrates a database from version n to n+1. */
+static int (*const migrations[SCHEMA_VERSION])(sqlite3 *db, char **error) = {
+  migrate_v1,
+  migrate_v2,
+  migrate_v3,
+  migrate_v4,
+  migrate_v5,
+  migrate_v6,
+};
+
+/* Creates the table for a new database or migrates an existing one
+   to the current layout. This is done once when opening the database,
+   so that the normal write path does not need to care. Databases
+   created or migrated here are switched to WAL mode, unless
+   LL2_OPEN_NO_WAL is set. The journal mode of all others is left
+   alone, it was chosen when they were created.
+   Returns 0 on success, -1 on failure. */
+static int
+setup_schema (sqlite3 *db, int flags, char **error)
+{
+  int version;
+  int upgrade;
+
+  if (get_schema_version (db, &version, error) != 0)
+    return -1;
+  upgrade = version < SCHEMA_VERSION;
+
+  if (version > SCHEMA_VERSION)
+    {
+      if (error)
+	if (asprintf (error, "Database schema version %d is newer than supported version %d",
+		      version, SCHEMA_VERSION) < 0)
+	  *error = strdup ("Out of memory");
+      return -1;
+    }
+
+  /* Only possible before the first table gets created, and not in a
+     transaction. Allows ll2_ctx_maintain to give free pages back in
+     slices. */
+  if (version == 0)
+    exec_sql (db, "PRAGMA auto_vacuum = INCREMENTAL", NULL);
+
+  for (; version < SCHEMA_VERSION; version++)
+    if (migrations[version] (db, error) != 0)
+      return -1;
+
+  /* Not fatal, the database works in every journal mode. */
+  if (upgrade && !(flags & LL2_OPEN_NO_WAL))
+    exec_sql (db, "PRAGMA journal_mode=WAL", NULL);
+
+  return 0;
+}
+
+/* Shortest and longest time to sleep between retries for a locked
+   database, in microseconds. */
+#define BUSY_MIN_DELAY 100
+#define BUSY_MAX_DELAY 10000
+
+/* Called by SQLite as long as the database is locked. Retries with
+   exponential backoff until busy_timeout milliseconds after the
+   first retry for this lock are over.
+   Returns 0 to give up, 1 to retry. */
+static int
+busy_handler (void *data, int count)
+{
+  struct ll2_context *context = data;
+  struct timespec now, delay;
+  int64_t remaining;
+  int64_t delay_us;
+  STATS_BEGIN ();
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if (count == 0)
+    context->busy_start = now;
+
+  remaining = (int64_t)context->busy_timeout * 1000 -
+    ((int64_t)(now.tv_sec - context->busy_start.tv_sec) * 1000000 +
+     (now.tv_nsec - context->busy_start.tv_nsec) / 1000);
+  if (remaining <= 0)
+    {
+      /* Given up, the operation fails with -EBUSY. */
+      context->busy_expired = 1;
+      if (context->slowlog)
+	{
+	  int threshold = slowlog_threshold ();
+	  int64_t waited_ns =
+	    (int64_t)(now.tv_sec - context->busy_start.tv_sec) * 1000000000 +
+	    (now.tv_nsec - context->busy_start.tv_nsec);
+
+	  if (threshold > 0 && waited_ns >= (int64_t)threshold * 1000000)
+	    slowlog_report ("lock wait", context->path, waited_ns,
+			    ", gave up");
+	}
+      STATS_END (STAT_BUSY_WAIT, -EBUSY);
+      return 0;
+    }
+
+  delay_us = (int64_t)BUSY_MIN_DELAY << (count < 8 ? count : 8);
+  if (delay_us > BUSY_MAX_DELAY)
+    delay_us = BUSY_MAX_DELAY;
+  /* Add some jitter, else all waiting logins retry at the same time. */
+  delay_us = delay_us / 2 + (now.tv_nsec / 1000) % (delay_us / 2 + 1);
+  if (delay_us > remaining)
+    delay_us = remaining;
+
+  delay.tv_sec = delay_us / 1000000;
+  delay.tv_nsec = (delay_us % 1000000) * 1000;
+  nanosleep (&delay, NULL);
+  if (context->slowlog)
+    context->lock_wait_ns += delay_us * 1000;
+
+  STATS_END (STAT_BUSY_WAIT, 0);
+  return 1;
+}
+
+/* Set how long to wait for a locked database before an operation
+   fails with -EBUSY. 0 means not to wait at all. */
+void
+ll2_ctx_set_busy_timeout (struct ll2_context *context, int timeout_ms)
+{
+  context->busy_timeout = timeout_ms > 0 ? timeout_ms : 0;
+}
+
+/* The cache is a file next to the database with a hash table of all
+   entries, which readers map into memory and search without locks
+   and without opening the database. Writers of this library update
+   it after every change while holding an exclusive lock on it.
+   Readers don't trust it if the database or the WAL file changed
+   since the last update, e.g. by another program, and fall back to
+   the database. ll2_ctx_checkpoint rebuilds a stale cache.
+   The slots only hold offsets of the strings, which are stored once
+   in an area after the slots. New strings are appended to its free
+   space, the cache is rebuilt if it runs out. With a third of the
+   slots free, a cache needs about 48 bytes per user, plus the user
+   names and the distinct TTYs, hosts and services. */
+#define CACHE_SUFFIX ".cache"
+#define CACHE_MAGIC 0x4c4c3243
+#define CACHE_VERSION 2
+#define CACHE_MIN_SLOTS 1024
+/* Minimal free space in the string area after a rebuild. */
+#define CACHE_MIN_SPARE 65536
+/* Number of attempts to read an entry while the cache gets updated. */
+#define CACHE_READ_TRIES 3
+/* Returned instead of a string offset if the string area is full. */
+#define CACHE_FULL UINT32_MAX
+
+/* Slot flags. */
+#define CACHE_USED        0x01
+#define CACHE_DELETED     0x02
+
+/* Identifies the state of the database or WAL file. */
+struct cache_stamp {
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct cache_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nslots;
+  /* Slots which are used or deleted. */
+  uint32_t used;
+  /* Odd while the cache is modified. */
+  _Atomic uint32_t seq;
+  uint32_t valid;
+  struct cache_stamp db;
+  struct cache_stamp wal;
+  /* Size of the string area and the bytes of it in use. Offset 0
+     means NULL, the last byte always stays zero. */
+  uint32_t strings_size;
+  uint32_t strings_used;
+  char reserved[32];
+};
+
+/* Strings are offsets into the string area. */
+struct cache_slot {
+  uint32_t flags;
+  uint32_t hash;
+  int64_t ll_time;
+  uint32_t user;
+  uint32_t tty;
+  uint32_t rhost;
+  uint32_t pam_service;
+};
+
+_Static_assert (sizeof (struct cache_header) == 128,
+		"cache header must have a fixed size");
+_Static_assert (sizeof (struct cache_slot) == 32,
+		"cache slots must have a fixed size");
+
+/* Offsets of the strings already in the string area, only used while
+   rebuilding the cache, so that every string is stored once. */
+struct cache_strtab {
+  uint32_t *offsets;
+  size_t size;
+  size_t count;
+};
+
+struct cache_map {
+  int fd;
+  size_t size;
+  struct cache_header *header;
+  struct cache_slot *slots;
+  char *strings;
+  /* Copies of the header, checked when mapping. */
+  uint32_t nslots;
+  uint32_t strings_size;
+  struct cache_strtab *strtab;
+  /* Set after the first modification of a writer. */
+  int modified;
+};
+
+static uint64_t
+cache_hash (const char *user)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (const unsigned char *p = (const unsigned char *)user; *p; p++)
+    {
+      hash ^= *p;
+      hash *= 1099511628211ULL;
+    }
+
+  return hash;
+}
+
+static int
+get_stamp (const char *path, const char *suffix, struct cache_stamp *stamp)
+{
+  char buf[PATH_MAX];
+  struct stat st;
+
+  memset (stamp, 0, sizeof (*stamp));
+
+  if (snprintf (buf, sizeof (buf), "%s%s", path, suffix) >= (int)sizeof (buf))
+    return -1;
+
+  if (stat (buf, &st) != 0)
+    return errno == ENOENT ? 0 : -1;
+
+  stamp->ino = st.st_ino;
+  stamp->size = st.st_size;
+  stamp->mtime_sec = st.st_mtim.tv_sec;
+  stamp->mtime_nsec = st.st_mtim.tv_nsec;
+
+  return 0;
+}
+
+/* Stamps of database and WAL file. Returns 0 on success, -1 if they
+   could not be determined. */
+static int
+get_stamps (const char *path, struct cache_stamp *db, struct cache_stamp *wal)
+{
+  if (get_stamp (path, "", db) != 0 || get_stamp (path, "-wal", wal) != 0)
+    return -1;
+
+  return 0;
+}
+
+static int
+stamps_equal (const struct cache_stamp *a, const struct cache_stamp *b)
+{
+  return a->ino == b->ino && a->size == b->size &&
+    a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/* Map the cache file open as fd. Returns 0 on success, -1 if it is
+   no valid cache file. */
+static int
+cache_map_fd (struct cache_map *map, int fd, int writable)
+{
+  struct stat st;
+  void *addr;
+
+  memset (map, 0, sizeof (*map));
+  map->fd = fd;
+
+  if (fstat (fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof (struct cache_header))
+    return -1;
+
+  addr = mmap (NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+	       MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    return -1;
+
+  map->size = st.st_size;
+  map->header = addr;
+  map->nslots = map->header->nslots;
+  map->strings_size = map->header->strings_size;
+  map->slots = (struct cache_slot *)(map->header + 1);
+  map->strings = (char *)(map->slots + map->nslots);
+
+  if (map->header->magic != CACHE_MAGIC ||
+      map->header->version != CACHE_VERSION ||
+      map->nslots == 0 || map->strings_size == 0 ||
+      map->header->strings_used > map->strings_size ||
+      map->size != sizeof (struct cache_header) +
+      (size_t)map->nslots * sizeof (struct cache_slot) + map->strings_size ||
+      map->strings[map->strings_size - 1] != '\0')
+    {
+      munmap (addr, map->size);
+      map->header = NULL;
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+cache_unmap (struct cache_map *map)
+{
+  if (map->header)
+    munmap (map->header, map->size);
+  map->header = NULL;
+  if (map->fd >= 0)
+    close (map->fd);
+  map->fd = -1;
+}
+
+/* Returns the string at offset off, NULL for 0 or an offset outside
+   of the string area. As the last byte of the area stays zero, the
+   string ends in the area even if a writer changes the slot the
+   offset was read from. */
+static const char *
+cache_string (const struct cache_map *map, uint32_t off)
+{
+  if (off == 0 || off >= map->strings_size)
+    return NULL;
+
+  return map->strings + off;
+}
+
+/* Returns the slot of user, or NULL if there is none. If free_slot is
+   not NULL, the first slot usable for user is stored there. */
+static struct cache_slot *
+cache_find (const struct cache_map *map, const char *user, uint64_t hash,
+	    struct cache_slot **free_slot)
+{
+  uint32_t idx = hash % map->nslots;
+
+  if (free_slot)
+    *free_slot = NULL;
+
+  for (uint32_t i = 0; i < map->nslots; i++)
+    {
+      struct cache_slot *slot = &map->slots[idx];
+      const char *name;
+
+      if (slot->flags & CACHE_USED)
+	{
+	  if (slot->hash == (uint32_t)hash &&
+	      (name = cache_string (map, slot->user)) != NULL &&
+	      strcmp (name, user) == 0)
+	    return slot;
+	}
+      else
+	{
+	  if (free_slot && *free_slot == NULL)
+	    *free_slot = slot;
+	  if (!(slot->flags & CACHE_DELETED))
+	    return NULL;
+	}
+
+      if (++idx == map->nslots)
+	idx = 0;
+    }
+
+  return NULL;
+}
+
+/* Looks up str in the strings added during a rebuild. Returns the
+   entry, which is 0 if str is not there yet. */
+static uint32_t *
+cache_strtab_find (const struct cache_map *map, const char *str)
+{
+  struct cache_strtab *tab = map->strtab;
+  size_t i = cache_hash (str) & (tab->size - 1);
+
+  while (tab->offsets[i] != 0 &&
+	 strcmp (map->strings + tab->offsets[i], str) != 0)
+    i = (i + 1) & (tab->size - 1);
+
+  return &tab->offsets[i];
+}
+
+/* Keeps at least half of the entries free. Returns -1 if out of
+   memory. */
+static int
+cache_strtab_grow (struct cache_map *map)
+{
+  struct cache_strtab *tab = map->strtab;
+  struct cache_strtab old = *tab;
+
+  if (tab->count < tab->size / 2)
+    return 0;
+
+  tab->size = old.size ? old.size * 2 : 1024;
+  if ((tab->offsets = calloc (tab->size, sizeof (uint32_t))) == NULL)
+    {
+      *tab = old;
+      return -1;
+    }
+
+  for (size_t i = 0; i < old.size; i++)
+    if (old.offsets[i] != 0)
+      *cache_strtab_find (map, map->strings + old.offsets[i]) =
+	old.offsets[i];
+  free (old.offsets);
+
+  return 0;
+}
+
+/* Returns the offset of str in the string area, 0 for NULL or empty
+   strings and CACHE_FULL if there is no space left. The string at
+   offset old, usually the previous value, is used again if it is
+   the same. */
+static uint32_t
+cache_add_string (struct cache_map *map, const char *str, uint32_t old)
+{
+  const char *old_str = cache_string (map, old);
+  uint32_t *entry = NULL;
+  uint32_t off = map->header->strings_used;
+  size_t len;
+
+  if (str == NULL || str[0] == '\0')
+    return 0;
+
+  if (old_str != NULL && strcmp (old_str, str) == 0)
+    return old;
+
+  if (map->strtab != NULL)
+    {
+      if (cache_strtab_grow (map) != 0)
+	return CACHE_FULL;
+      if (*(entry = cache_strtab_find (map, str)) != 0)
+	return *entry;
+    }
+
+  /* Keeps the last byte zero. */
+  len = strlen (str) + 1;
+  if (off == 0 || off >= map->strings_size ||
+      len >= map->strings_size - off)
+    return CACHE_FULL;
+
+  memcpy (map->strings + off, str, len);
+  map->header->strings_used = off + len;
+  if (entry != NULL)
+    {
+      *entry = off;
+      map->strtab->count++;
+    }
+
+  return off;
+}
+
+/* Readers must not trust the cache until cache_end. */
+static void
+cache_modify (struct cache_map *map)
+{
+  if (map->modified)
+    return;
+
+  atomic_store_explicit (&map->header->seq,
+			 atomic_load_explicit (&map->header->seq,
+					       memory_order_relaxed) + 1,
+			 memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  map->modified = 1;
+}
+
+static void
+cache_invalidate (struct cache_map *map)
+{
+  if (map->header == NULL)
+    return;
+
+  cache_modify (map);
+  map->header->valid = 0;
+}
+
+/* Returns the slot of user, or a new one if there is none, filled
+   with the name. Marks the cache invalid and returns NULL if it is
+   full. */
+static struct cache_slot *
+cache_slot_for (struct cache_map *map, const char *user)
+{
+  struct cache_slot *slot, *free_slot;
+  uint64_t hash = cache_hash (user);
+  uint32_t name;
+
+  cache_modify (map);
+
+  if ((slot = cache_find (map, user, hash, &free_slot)) != NULL)
+    return slot;
+
+  if (free_slot == NULL ||
+      (!(free_slot->flags & CACHE_DELETED) &&
+       map->header->used >= map->nslots / 4 * 3) ||
+      (name = cache_add_string (map, user, 0)) == CACHE_FULL)
+    {
+      map->header->valid = 0;
+      return NULL;
+    }
+
+  if (!(free_slot->flags & CACHE_DELETED))
+    map->header->used++;
+  memset (free_slot, 0, sizeof (*free_slot));
+  free_slot->hash = (uint32_t)hash;
+  free_slot->user = name;
+
+  return free_slot;
+}
+
+/* Store the entry of user, marking the cache invalid if it is full. */
+static void
+cache_put (struct cache_map *map, const char *user, int64_t ll_time,
+	   const char *tty, const char *rhost, const char *pam_service)
+{
+  struct cache_slot *slot;
+  uint32_t tty_off, rhost_off, service_off;
+
+  if (map->header == NULL || !map->header->valid)
+    return;
+
+  if ((slot = cache_slot_for (map, user)) == NULL)
+    return;
+
+  if ((tty_off = cache_add_string (map, tty, slot->tty)) == CACHE_FULL ||
+      (rhost_off = cache_add_string (map, rhost, slot->rhost)) == CACHE_FULL ||
+      (service_off = cache_add_string (map, pam_service,
+				       slot->pam_service)) == CACHE_FULL)
+    {
+      map->header->valid = 0;
+      return;
+    }
+
+  slot->ll_time = ll_time;
+  slot->tty = tty_off;
+  slot->rhost = rhost_off;
+  slot->pam_service = service_off;
+  slot->flags = CACHE_USED;
+}
+
+static void
+cache_delete (struct cache_map *map, const char *user)
+{
+  struct cache_slot *slot;
+
+  if (map->header == NULL || !map->header->valid)
+    return;
+
+  if ((slot = cache_find (map, user, cache_hash (user), NULL)) == NULL)
+    return;
+
+  cache_modify (map);
+  memset (slot, 0, sizeof (*slot));
+  slot->flags = CACHE_DELETED;
+}
+
+/* Update the login time of an entry, which must be in the cache. */
+static void
+cache_set_time (struct cache_map *map, const char *user, int64_t ll_time)
+{
+  struct cache_slot *slot;
+
+  if (map->header == NULL || !map->header->valid)
+    return;
+
+  if ((slot = cache_find (map, user, cache_hash (user), NULL)) == NULL)
+    {
+      cache_invalidate (map);
+      return;
+    }
+
+  cache_modify (map);
+  slot->ll_time = ll_time;
+}
+
+/* The strings of the entry stay where they are, only the new name
+   is added. */
+static void
+cache_rename (struct cache_map *map, const char *user, const char *newname)
+{
+  struct cache_slot *slot;
+  struct cache_slot old;
+
+  if (map->header == NULL || !map->header->valid)
+    return;
+
+  if ((slot = cache_find (map, user, cache_hash (user), NULL)) == NULL)
+    {
+      cache_invalidate (map);
+      return;
+    }
+
+  old = *slot;
+  cache_delete (map, user);
+  if ((slot = cache_slot_for (map, newname)) == NULL)
+    return;
+
+  slot->ll_time = old.ll_time;
+  slot->tty = old.tty;
+  slot->rhost = old.rhost;
+  slot->pam_service = old.pam_service;
+  slot->flags = CACHE_USED;
+}
+
+/* Takes the flock lock operation, LOCK_EX or LOCK_SH, waiting at most
+   timeout_ms for it, as nothing in the login path must hang.
+   Returns 0 on success, -1 with errno EWOULDBLOCK on timeout or
+   another errno on failure. */
+static int
+lock_file (int fd, int operation, int timeout_ms)
+{
+  const struct timespec delay = { 0, 1000000 };
+
+  for (int waited = 0; flock (fd, operation | LOCK_NB) != 0; waited++)
+    {
+      if (errno != EWOULDBLOCK || waited >= timeout_ms)
+	return -1;
+      nanosleep (&delay, NULL);
+    }
+
+  return 0;
+}
+
+/* Open and lock the cache of the database, before the database gets
+   modified. Nothing is done if there is no cache. If the database was
+   changed by somebody else since the last update, the cache is marked
+   invalid. If the lock cannot be obtained, the cache is left alone,
+   readers notice that the database changed. */
+static void
+cache_begin (struct ll2_context *context, struct cache_map *map)
+{
+  struct cache_stamp db, wal;
+  struct stat st_fd, st_path;
+  char *path;
+  int fd;
+
+  memset (map, 0, sizeof (*map));
+  map->fd = -1;
+
+  if (asprintf (&path, "%s" CACHE_SUFFIX, context->path) < 0)
+    return;
+
+  /* ll2_ctx_rebuild_cache could replace the file while we wait. */
+  for (;;)
+    {
+      if ((fd = open (path, O_RDWR | O_CLOEXEC | O_NOFOLLOW)) < 0)
+	{
+	  free (path);
+	  return;
+	}
+
+      if (lock_file (fd, LOCK_EX, context->busy_timeout) != 0 ||
+	  fstat (fd, &st_fd) != 0 ||
+	  stat (path, &st_path) != 0)
+	{
+	  close (fd);
+	  free (path);
+	  return;
+	}
+
+      if (st_fd.st_ino == st_path.st_ino && st_fd.st_dev == st_path.st_dev)
+	break;
+
+      close (fd);
+    }
+  free (path);
+
+  if (cache_map_fd (map, fd, 1) != 0)
+    {
+      close (fd);
+      map->fd = -1;
+      return;
+    }
+  context->cache_used = 1;
+
+  if (map->header->valid &&
+      (get_stamps (context->path, &db, &wal) != 0 ||
+       !stamps_equal (&db, &map->header->db) ||
+       !stamps_equal (&wal, &map->header->wal)))
+    cache_invalidate (map);
+}
+
+/* Remember the state of the database after our modifications, so that
+   readers trust the cache again, and unlock it. */
+static void
+cache_end (struct ll2_context *context, struct cache_map *map)
+{
+  if (map->header == NULL)
+    return;
+
+  if (map->header->valid)
+    {
+      struct cache_stamp db, wal;
+
+      if (get_stamps (context->path, &db, &wal) != 0)
+	cache_invalidate (map);
+      else if (!stamps_equal (&db, &map->header->db) ||
+	       !stamps_equal (&wal, &map->header->wal))
+	{
+	  cache_modify (map);
+	  map->header->db = db;
+	  map->header->wal = wal;
+	}
+    }
+
+  if (map->modified)
+    atomic_store_explicit (&map->header->seq,
+			   atomic_load_explicit (&map->header->seq,
+						 memory_order_relaxed) + 1,
+			   memory_order_release);
+
+  cache_unmap (map);
+}
+
+static int
+cache_fill (const struct ll2_entry *entry, void *userdata)
+{
+  struct cache_map *map = userdata;
+
+  cache_put (map, entry->user, entry->ll_time, entry->tty, entry->rhost,
+	     entry->pam_service);
+
+  return map->header->valid ? 0 : 1;
+}
+
+/* Creates the cache with all entries of the database, or replaces an
+   existing one. Returns 0 on success, -EBUSY if a writer kept the
+   old cache locked, -1 on failure. */
+int
+ll2_ctx_rebuild_cache (struct ll2_context *context, char **error)
+{
+  struct cache_stamp db, wal, db_after, wal_after;
+  struct cache_map map = { .fd = -1 };
+  struct cache_strtab strtab = { NULL, 0, 0 };
+  char *path = NULL;
+  char *tmp = NULL;
+  uint32_t nslots = CACHE_MIN_SLOTS;
+  uint32_t strings_size;
+  int version;
+  int count = 0;
+  int bytes = 0;
+  int old_fd;
+  int retval = -1;
+  int fd;
+
+  if (asprintf (&path, "%s" CACHE_SUFFIX, context->path) < 0 ||
+      asprintf (&tmp, "%s.XXXXXX", path) < 0)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      free (path);
+      return -1;
+    }
+
+  /* Keep writers out, which would update the old file. */
+  if ((old_fd = open (path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) >= 0 &&
+      lock_file (old_fd, LOCK_EX, context->busy_timeout) != 0)
+    {
+      retval = errno == EWOULDBLOCK ? -EBUSY : -1;
+      if (error)
+	{
+	  if (retval == -EBUSY)
+	    *error = strdup ("Cache is busy");
+	  else if (asprintf (error, "Cannot lock %s: %s", path,
+			     strerror (errno)) < 0)
+	    *error = strdup ("Out of memory");
+	}
+      goto out;
+    }
+
+  if (query_int (context->db, "SELECT COUNT(*) FROM Lastlog2", &count,
+		 error) < 0 ||
+      get_schema_version (context->db, &version, error) != 0)
+    goto out;
+
+  /* The names and the strings, including the nul bytes. Older
+     databases store the strings in every entry, which is more than
+     needed. */
+  if (query_int (context->db, version >= 5 ?
+		 "SELECT MIN((SELECT IFNULL(SUM(LENGTH(CAST(Name AS BLOB)) + 1), 0) FROM Lastlog2) + "
+		 "(SELECT IFNULL(SUM(LENGTH(CAST(Value AS BLOB)) + 1), 0) FROM Lastlog2_Strings), 1073741824)" :
+		 "SELECT MIN(IFNULL(SUM(LENGTH(CAST(Name AS BLOB)) + IFNULL(LENGTH(CAST(TTY AS BLOB)), 0) + "
+		 "IFNULL(LENGTH(CAST(RemoteHost AS BLOB)), 0) + IFNULL(LENGTH(CAST(Service AS BLOB)), 0) + 4), 0), "
+		 "1073741824) FROM Lastlog2",
+		 &bytes, error) < 0)
+    goto out;
+
+  /* Keep a third of the slots and some of the string area free for
+     later changes. */
+  if ((uint32_t)count + (uint32_t)count / 2 > nslots)
+    nslots = (uint32_t)count + (uint32_t)count / 2;
+  strings_size = 1 + (uint32_t)bytes +
+    ((uint32_t)bytes / 8 > CACHE_MIN_SPARE ? (uint32_t)bytes / 8 :
+     CACHE_MIN_SPARE);
+
+  if ((fd = mkostemp (tmp, O_CLOEXEC)) < 0)
+    {
+      if (error)
+	if (asprintf (error, "Cannot create %s: %s", tmp, strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
+      goto out;
+    }
+
+  {
+    struct cache_header header = {
+      .magic = CACHE_MAGIC,
+      .version = CACHE_VERSION,
+      .nslots = nslots,
+      .valid = 1,
+      .strings_size = strings_size,
+      .strings_used = 1
+    };
+
+    if (fchmod (fd, 0644) != 0 ||
+	ftruncate (fd, sizeof (header) +
+		   (off_t)nslots * sizeof (struct cache_slot) +
+		   strings_size) != 0 ||
+	pwrite (fd, &header, sizeof (header), 0) != sizeof (header) ||
+	cache_map_fd (&map, fd, 1) != 0)
+      {
+	if (error)
+	  if (asprintf (error, "Cannot write %s: %s", tmp,
+			strerror (errno)) < 0)
+	    *error = strdup ("Out of memory");
+	close (fd);
+	unlink (tmp);
+	goto out;
+      }
+  }
+
+  map.strtab = &strtab;
+
+  /* Nobody may change the database while it gets read, else the
+     stamps would not match the content. */
+  if (get_stamps (context->path, &db, &wal) != 0 ||
+      ll2_ctx_read_all (context, cache_fill, &map, error) != 0 ||
+      get_stamps (context->path, &db_after, &wal_after) != 0 ||
+      !stamps_equal (&db, &db_after) || !stamps_equal (&wal, &wal_after))
+    {
+      if (error && *error == NULL)
+	*error = strdup ("Database changed while rebuilding the cache");
+      cache_unmap (&map);
+      unlink (tmp);
+      goto out;
+    }
+
+  map.header->db = db;
+  map.header->wal = wal;
+  atomic_store (&map.header->seq, 0);
+
+  if (!map.header->valid)
+    {
+      if (error)
+	*error = strdup ("Cache too small");
+      cache_unmap (&map);
+      unlink (tmp);
+      goto out;
+    }
+
+  cache_unmap (&map);
+
+  if (rename (tmp, path) != 0)
+    {
+      if (error)
+	if (asprintf (error, "Cannot rename %s to %s: %s", tmp, path,
+		      strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
+      unlink (tmp);
+      goto out;
+    }
+
+  retval = 0;
+
+ out:
+  if (old_fd >= 0)
+    close (old_fd);
+  free (strtab.offsets);
+  free (path);
+  free (tmp);
+
+  return retval;
+}
+
+/* Rebuilds the cache if it exists and is not valid. */
+static int
+cache_refresh (struct ll2_context *context, char **error)
+{
+  struct cache_stamp db, wal;
+  struct cache_map map;
+  char *path;
+  int stale = 0;
+  int ret;
+  int fd;
+
+  if (asprintf (&path, "%s" CACHE_SUFFIX, context->path) < 0)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      return -1;
+    }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  free (path);
+  if (fd < 0)
+    return 0;
+
+  if (cache_map_fd (&map, fd, 0) != 0)
+    stale = 1;
+  else
+    stale = !map.header->valid ||
+      get_stamps (context->path, &db, &wal) != 0 ||
+      !stamps_equal (&db, &map.header->db) ||
+      !stamps_equal (&wal, &map.header->wal);
+  cache_unmap (&map);
+
+  if (!stale)
+    return 0;
+
+  /* A login holds the cache, try again next time. Readers don't use
+     a stale cache meanwhile. */
+  if ((ret = ll2_ctx_rebuild_cache (context, error)) == -EBUSY)
+    {
+      if (error)
+	{
+	  free (*error);
+	  *error = NULL;
+	}
+      return 0;
+    }
+
+  return ret;
+}
+
+/* Open the database and store a new context in ret, which keeps the
+   connection and the prepared statements until ll2_close_context
+   is called. Creating or migrating the database waits at most
+   timeout_ms for a lock. Returns 0 on success, -EBUSY if the database
+   stayed locked and -1 on failure. */
+static int
+open_context (const char *lastlog2_path, int flags, int timeout_ms,
+	      struct ll2_context **ret, char **error)
+{
+  struct ll2_context *context;
+
+  *ret = NULL;
+
+  context = calloc (1, sizeof (struct ll2_context));
+  if (context == NULL || (context->path = strdup (lastlog2_path)) == NULL)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      free (context);
+      return -1;
+    }
+  context->flags = flags;
+
+  if (flags & LL2_OPEN_READONLY)
+    context->db = open_database_ro (lastlog2_path, error);
+  else
+    context->db = open_database_rw (lastlog2_path, error);
+
+  if (context->db == NULL)
+    {
+      free (context->path);
+      free (context);
+      return -1;
+    }
+
+  context->busy_timeout = timeout_ms > 0 ? timeout_ms : 0;
+  sqlite3_busy_handler (context->db, busy_handler, context);
+
+  if (slowlog_threshold () > 0)
+    {
+      context->slowlog = 1;
+      sqlite3_trace_v2 (context->db, SQLITE_TRACE_PROFILE, slowlog_trace,
+			context);
+    }
+
+  if (!(flags & LL2_OPEN_READONLY))
+    {
+      int one = 1;
+
+      /* Keep the -wal and -shm files after closing the database,
+	 else users without write access to the directory cannot
+	 open a database in WAL mode. */
+      sqlite3_file_control (context->db, "main", SQLITE_FCNTL_PERSIST_WAL,
+			    &one);
+      /* With a limit, the last connection truncates the WAL file to
+	 zero bytes when it closes. */
+      exec_sql (context->db, "PRAGMA journal_size_limit = " WAL_SIZE_LIMIT,
+		NULL);
+
+      /* Not even the last connection writes the WAL back on close,
+	 that is left to ll2_ctx_checkpoint. */
+      if (flags & LL2_OPEN_NO_CHECKPOINT)
+	{
+	  sqlite3_wal_autocheckpoint (context->db, NO_CHECKPOINT_WAL_LIMIT);
+	  sqlite3_db_config (context->db, SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE,
+			     1, NULL);
+	}
+
+      if (setup_schema (context->db, flags, error) != 0)
+	{
+	  int busy = context->busy_expired ||
+	    sqlite3_errcode (context->db) == SQLITE_BUSY;
+
+	  sqlite3_close (context->db);
+	  free (context->path);
+	  free (context);
+	  return busy ? -EBUSY : -1;
+	}
+      context->schema_version = SCHEMA_VERSION;
+    }
+
+  *ret = context;
+  return 0;
+}
+
+int
+ll2_open_context_timeout (const char *lastlog2_path, int flags,
+			  int timeout_ms, struct ll2_context **context,
+			  char **error)
+{
+  STATS_BEGIN ();
+  LL2_PROBE_BEGIN (open, lastlog2_path);
+  int retval = open_context (lastlog2_path, flags, timeout_ms, context,
+			     error);
+
+  LL2_PROBE_END (open, lastlog2_path, retval, 0);
+  STATS_END (STAT_OPEN, retval);
+  return retval;
+}
+
+struct ll2_context *
+ll2_open_context (const char *lastlog2_path, int flags, char **error)
+{
+  struct ll2_context *context;
+
+  ll2_open_context_timeout (lastlog2_path, flags, LL2_DEFAULT_BUSY_TIMEOUT,
+			    &context, error);
+  return context;
+}
+
+/* Finalize all cached statements and close the database. */
+static void
+close_context (struct ll2_context *context)
+{
+  if (context == NULL)
+    return;
+
+  sqlite3_finalize (context->stmt_select);
+  sqlite3_finalize (context->stmt_replace);
+  sqlite3_finalize (context->stmt_delete);
+  sqlite3_finalize (context->stmt_import);
+  sqlite3_finalize (context->stmt_read_all);
+  sqlite3_finalize (context->stmt_page_first);
+  sqlite3_finalize (context->stmt_page_next);
+  sqlite3_finalize (context->stmt_range);
+  sqlite3_finalize (context->stmt_recent);
+  sqlite3_finalize (context->stmt_oldest);
+  sqlite3_finalize (context->stmt_uid_range);
+  sqlite3_finalize (context->stmt_update_time);
+  sqlite3_finalize (context->stmt_rename);
+  sqlite3_finalize (context->stmt_intern);
+  for (size_t i = 0; i < context->strings_size; i++)
+    free (context->strings[i]);
+  free (context->strings);
+  free (context->string_lens);
+
+  /* The last connection writes the WAL file back on close, unless
+     opened with LL2_OPEN_NO_CHECKPOINT. That changes the files, so
+     the stamps in a cache this context kept up to date are renewed.
+     Logins without a cache don't pay for looking for one. */
+  if ((context->flags & (LL2_OPEN_READONLY | LL2_OPEN_NO_CHECKPOINT)) ||
+      !context->cache_used)
+    sqlite3_close (context->db);
+  else
+    {
+      struct cache_map map;
+
+      cache_begin (context, &map);
+      sqlite3_close (context->db);
+      cache_end (context, &map);
+    }
+  free (context->path);
+  free (context);
+}
+
+void
+ll2_close_context (struct ll2_context *context)
+{
+  STATS_BEGIN ();
+
+  close_context (context);
+  STATS_END (STAT_CLOSE, 0);
+}
+
+/* Returns the cached statement, prepares it first if needed.
+   Returns NULL on failure. */
+static sqlite3_stmt *
+get_stmt (struct ll2_context *context, sqlite3_stmt **stmt,
+	  const char *sql, char **error)
+{
+  if (*stmt != NULL)
+    return *stmt;
+
+  STATS_BEGIN ();
+  int ret = sqlite3_prepare_v3 (context->db, sql, -1,
+				SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+  STATS_END (STAT_PREPARE, ret == SQLITE_OK ? 0 : -1);
+
+  if (ret != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      *stmt = NULL;
+      return NULL;
+    }
+
+  return *stmt;
+}
+
+/* Make a cached statement ready for the next call. The bindings
+   are cleared, as they may point to memory of the caller. */
+static void
+put_stmt (sqlite3_stmt *stmt)
+{
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+}
+
+/* Returns the schema version of the database, or -1 on failure.
+   Databases opened read-only are not migrated, so it can be older
+   than SCHEMA_VERSION. */
+static int
+context_schema_version (struct ll2_context *context, char **error)
+{
+  if (context->schema_version == 0 &&
+      get_schema_version (context->db, &context->schema_version,
+			  error) != 0)
+    return -1;
+
+  return context->schema_version;
+}
+
+/* Like get_stmt for statements reading entries with step_entries.
+   The %s in fmt is replaced by the columns, which depend on the
+   schema version, the strings are read with column_string.
+   Returns NULL on failure. */
+static sqlite3_stmt *
+get_entry_stmt (struct ll2_context *context, sqlite3_stmt **stmt,
+		const char *fmt, char **error)
+{
+  sqlite3_stmt *res;
+  char *sql;
+  int version;
+
+  if (*stmt != NULL)
+    return *stmt;
+
+  if ((version = context_schema_version (context, error)) < 0)
+    return NULL;
+
+  if (asprintf (&sql, fmt, version >= 5 ?
+		"Name, Time, TTYId, RemoteHostId, ServiceId, UID" :
+		version == 4 ?
+		"Name, Time, TTY, RemoteHost, Service, UID" :
+		"Name, Time, TTY, RemoteHost, Service, NULL") < 0)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      return NULL;
+    }
+
+  res = get_stmt (context, stmt, sql, error);
+  free (sql);
+
+  return res;
+}
+
+/* Loads the strings added to Lastlog2_Strings since the last call.
+   Returns 0 on success, -1 on failure. */
+static int
+load_strings (struct ll2_context *context, char **error)
+{
+  sqlite3_stmt *res;
+  int step;
+
+  if (sqlite3_prepare_v2 (context->db, "SELECT Id, Value FROM Lastlog2_Strings WHERE Id > ? ORDER BY Id",
+			  -1, &res, NULL) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+      return -1;
+    }
+
+  sqlite3_bind_int64 (res, 1, context->strings_last_id);
+
+  while ((step = step_stmt (res)) == SQLITE_ROW)
+    {
+      int64_t id = sqlite3_column_int64 (res, 0);
+      const char *value = (const char *)sqlite3_column_text (res, 1);
+      size_t len = sqlite3_column_bytes (res, 1);
+
+      if (id <= 0 || value == NULL)
+	continue;
+
+      if ((uint64_t)id >= context->strings_size)
+	{
+	  size_t size = context->strings_size ? context->strings_size : 64;
+	  char **strings;
+	  size_t *lens;
+
+	  while (size <= (uint64_t)id)
+	    size *= 2;
+
+	  if ((strings = realloc (context->strings,
+				  size * sizeof (char *))) == NULL)
+	    goto oom;
+	  context->strings = strings;
+	  if ((lens = realloc (context->string_lens,
+			       size * sizeof (size_t))) == NULL)
+	    goto oom;
+	  context->string_lens = lens;
+	  memset (strings + context->strings_size, 0,
+		  (size - context->strings_size) * sizeof (char *));
+	  context->strings_size = size;
+	}
+
+      if ((context->strings[id] = strndup (value, len)) == NULL)
+	goto oom;
+      context->string_lens[id] = len;
+      context->strings_last_id = id;
+    }
+
+  sqlite3_finalize (res);
+
+  if (step != SQLITE_DONE)
+    {
+      if (error)
+	if (asprintf (error, "Error stepping through database: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+      return -1;
+    }
+
+  return 0;
+
+ oom:
+  sqlite3_finalize (res);
+  if (error)
+    *error = strdup ("Out of memory");
+  return -1;
+}
+
+/* Returns the string in column col of a statement from get_entry_stmt,
+   which is text up to schema version 4 and the Id of the string in
+   Lastlog2_Strings since version 5. str is only valid until the next
+   step of res. Returns 0 on success, -1 on failure. */
+static int
+column_string (struct ll2_context *context, sqlite3_stmt *res, int col,
+	       const char **str, size_t *len, char **error)
+{
+  int64_t id;
+
+  if (context->schema_version < 5)
+    {
+      /* sqlite3_column_bytes needs to be called after
+	 sqlite3_column_text, else the length could be wrong. */
+      *str = (const char *)sqlite3_column_text (res, col);
+      *len = sqlite3_column_bytes (res, col);
+      return 0;
+    }
+
+  if (sqlite3_column_type (res, col) == SQLITE_NULL)
+    {
+      *str = NULL;
+      *len = 0;
+      return 0;
+    }
+
+  id = sqlite3_column_int64 (res, col);
+  if (id > context->strings_last_id &&
+      load_strings (context, error) != 0)
+    return -1;
+
+  if (id <= 0 || (uint64_t)id >= context->strings_size ||
+      context->strings[id] == NULL)
+    {
+      if (error)
+	if (asprintf (error, "Unknown string id %lld", (long long)id) < 0)
+	  *error = strdup ("Out of memory");
+      return -1;
+    }
+
+  *str = context->strings[id];
+  *len = context->string_lens[id];
+  return 0;
+}
+
+/* Adds the strings, which are not NULL, to Lastlog2_Strings, if they
+   are not there yet, so that they can be referenced with STRING_ID.
+   Returns 0 on success, -EBUSY if the database is locked, -1 on
+   failure. */
+static int
+intern_strings (struct ll2_context *context, const char *tty,
+		const char *rhost, const char *pam_service, char **error)
+{
+  sqlite3_stmt *res;
+  const char *sql = "INSERT OR IGNORE INTO Lastlog2_Strings(Value) VALUES (?), (?), (?)";
+  int step;
+
+  if (tty == NULL && rhost == NULL && pam_service == NULL)
+    return 0;
+
+  if ((res = get_stmt (context, &context->stmt_intern, sql, error)) == NULL)
+    return -1;
+
+  if (sqlite3_bind_text (res, 1, tty, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text (res, 2, rhost, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text (res, 3, pam_service, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create intern statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  step = step_stmt (res);
+  put_stmt (res);
+
+  if (step == SQLITE_BUSY)
+    {
+      if (error)
+	*error = strdup ("Database busy");
+      return -EBUSY;
+    }
+  else if (step != SQLITE_DONE)
+    {
+      if (error)
+	if (asprintf (error, "Intern statement failed: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Copies the content of the WAL file back into the database and
+   truncates the WAL file, if no reader is still using it. Nothing
+   waits for other connections, so concurrent logins are never
+   blocked. Returns 0 on success, -1 on failure. */
+static int
+ctx_checkpoint (struct ll2_context *context, char **error)
+{
+  struct cache_map map;
+  int log_frames;
+  int ckpt_frames;
+  int ret;
+
+  /* The checkpoint changes the files, but not the content. */
+  cache_begin (context, &map);
+
+  /* Don't wait for logins, which would wait for us in turn. */
+  sqlite3_busy_handler (context->db, NULL, NULL);
+
+  ret = sqlite3_wal_checkpoint_v2 (context->db, NULL,
+				   SQLITE_CHECKPOINT_PASSIVE,
+				   &log_frames, &ckpt_frames);
+  /* Truncate only if everything got copied. */
+  if (ret == SQLITE_OK && log_frames > 0 && log_frames == ckpt_frames)
+    ret = sqlite3_wal_checkpoint_v2 (context->db, NULL,
+				     SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+
+  sqlite3_busy_handler (context->db, busy_handler, context);
+
+  cache_end (context, &map);
+
+  /* Somebody else is busy with the database, try again next time. */
+  if (ret == SQLITE_BUSY)
+    return cache_refresh (context, error);
+
+  if (ret != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Checkpoint failed: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      return -1;
+    }
+
+  return cache_refresh (context, error);
+}
+
+int
+ll2_ctx_checkpoint (struct ll2_context *context, char **error)
+{
+  STATS_BEGIN ();
+  int retval = ctx_checkpoint (context, error);
+
+  STATS_END (STAT_CHECKPOINT, retval);
+  return retval;
+}
+
+/* Pages given back to the file system per transaction by the
+   incremental vacuum, and the pause between two of them, so that
+   logins get the lock in between. */
+#define MAINTAIN_SLICE_PAGES "256"
+#define MAINTAIN_SLICE_PAUSE_US 10000
+
+/* Size of the database and the space used by every table and index.
+   *space needs to be freed. The list of tables and indexes is empty
+   if SQLite was built without the dbstat virtual table.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_ctx_get_space (struct ll2_context *context, struct ll2_space **space,
+		   char **error)
+{
+  const char *sql = "SELECT name, count(*), sum(unused) FROM dbstat "
+    "GROUP BY name ORDER BY count(*) DESC, name";
+  struct ll2_space *result;
+  sqlite3_stmt *res;
+  int page_size, page_count, freelist_count, auto_vacuum;
+  size_t count = 0;
+  int step;
+
+  if (query_int (context->db, "PRAGMA page_size", &page_size, error) != 1 ||
+      query_int (context->db, "PRAGMA page_count", &page_count, error) != 1 ||
+      query_int (context->db, "PRAGMA freelist_count", &freelist_count,
+		 error) != 1 ||
+      query_int (context->db, "PRAGMA auto_vacuum", &auto_vacuum, error) != 1)
+    return -1;
+
+  /* Without dbstat, only the size of the database is known. */
+  if (sqlite3_prepare_v2 (context->db, sql, -1, &res, 0) != SQLITE_OK)
+    res = NULL;
+  else
+    {
+      while ((step = step_stmt (res)) == SQLITE_ROW)
+	count++;
+      sqlite3_reset (res);
+      if (step != SQLITE_DONE)
+	{
+	  if (error)
+	    if (asprintf (error, "Error stepping through database: %s",
+			  sqlite3_errmsg (context->db)) < 0)
+	      *error = strdup ("Out of memory");
+	  sqlite3_finalize (res);
+	  return -1;
+	}
+    }
+
+  /* One allocation, so that the caller only needs to free it. */
+  result = calloc (1, sizeof (struct ll2_space) +
+		   count * sizeof (struct ll2_space_object));
+  if (result == NULL)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      sqlite3_finalize (res);
+      return -1;
+    }
+  result->page_size = page_size;
+  result->page_count = page_count;
+  result->freelist_count = freelist_count;
+  result->auto_vacuum = auto_vacuum;
+  result->objects = (struct ll2_space_object *)(result + 1);
+
+  /* Tables created in between are left out. */
+  while (res != NULL && result->count < count &&
+	 step_stmt (res) == SQLITE_ROW)
+    {
+      struct ll2_space_object *obj = &result->objects[result->count++];
+
+      snprintf (obj->name, sizeof (obj->name), "%s",
+		(const char *)sqlite3_column_text (res, 0));
+      obj->pages = sqlite3_column_int64 (res, 1);
+      obj->unused = sqlite3_column_int64 (res, 2);
+    }
+  sqlite3_finalize (res);
+
+  *space = result;
+  return 0;
+}
+
+/* Removes the strings, which no entry references anymore, e.g. after
+   purging entries. The referenced Ids are collected once, instead of
+   searching the entries for every string. Deleted Ids are never
+   reused, so the strings loaded by other contexts stay valid. Writers
+   add strings and the entry referencing them in one transaction.
+   Returns 0 on success, -EBUSY if the database stayed locked and
+   -1 on failure. */
+static int
+prune_strings (struct ll2_context *context, char **error)
+{
+  if (exec_sql (context->db, "DELETE FROM Lastlog2_Strings WHERE Id NOT IN "
+		"(SELECT TTYId FROM Lastlog2 WHERE TTYId IS NOT NULL "
+		"UNION SELECT RemoteHostId FROM Lastlog2 WHERE RemoteHostId IS NOT NULL "
+		"UNION SELECT ServiceId FROM Lastlog2 WHERE ServiceId IS NOT NULL)",
+		error) != 0)
+    return sqlite3_errcode (context->db) == SQLITE_BUSY ? -EBUSY : -1;
+
+  return 0;
+}
+
+/* Gives the free pages back to the file system in slices of
+   MAINTAIN_SLICE_PAGES. Does nothing without auto_vacuum.
+   Returns 0 on success, -EBUSY if the database stayed locked and
+   -1 on failure. */
+static int
+incremental_vacuum (struct ll2_context *context, char **error)
+{
+  struct timespec pause = { 0, MAINTAIN_SLICE_PAUSE_US * 1000 };
+  int last = INT_MAX;
+  int free_pages;
+
+  for (;;)
+    {
+      if (query_int (context->db, "PRAGMA freelist_count", &free_pages,
+		     error) != 1)
+	return -1;
+
+      /* Nothing freed by the last slice, auto_vacuum is off. */
+      if (free_pages == 0 || free_pages >= last)
+	return 0;
+      last = free_pages;
+
+      if (exec_sql (context->db, "PRAGMA incremental_vacuum("
+		    MAINTAIN_SLICE_PAGES ")", error) != 0)
+	return sqlite3_errcode (context->db) == SQLITE_BUSY ? -EBUSY : -1;
+
+      nanosleep (&pause, NULL);
+    }
+}
+
+static int
+ctx_maintain (struct ll2_context *context, int tasks, char **error)
+{
+  int ret;
+
+  /* First, so that the vacuum gives the pages back, too. */
+  if ((ret = prune_strings (context, error)) != 0)
+    return ret;
+
+  if (tasks & LL2_MAINTAIN_VACUUM)
+    {
+      /* Rebuilds the database in one transaction, readers continue,
+	 but writers wait for it. Other connections keep their open
+	 files, which rules out building a copy and renaming it.
+	 Switches to incremental auto_vacuum, so that the next
+	 maintenance can work in slices. */
+      if (exec_sql (context->db, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM",
+		    error) != 0)
+	return sqlite3_errcode (context->db) == SQLITE_BUSY ? -EBUSY : -1;
+    }
+  else if (tasks & LL2_MAINTAIN_INCREMENTAL)
+    {
+      if ((ret = incremental_vacuum (context, error)) != 0)
+	return ret;
+    }
+
+  /* Analyzes only tables, which changed enough since the last time,
+     with a limit on the rows looked at, so that it stays short. */
+  if ((tasks & LL2_MAINTAIN_OPTIMIZE) &&
+      exec_sql (context->db, "PRAGMA analysis_limit = 1000;"
+		"PRAGMA optimize = 0x10002", error) != 0)
+    return sqlite3_errcode (context->db) == SQLITE_BUSY ? -EBUSY : -1;
+
+  /* Both vacuums wrote all moved pages into the WAL. Rebuilds the
+     cache, too, the files changed. */
+  return ctx_checkpoint (context, error);
+}
+
+int
+ll2_ctx_maintain (struct ll2_context *context, int tasks, char **error)
+{
+  STATS_BEGIN ();
+  int retval = ctx_maintain (context, tasks, error);
+
+  STATS_END (STAT_MAINTAIN, retval);
+  return retval;
+}
+
+/* Check if database file exists.
+   Returns 0 on success, -1 on failure. */
+int ll2_check_database (const char *lastlog2_path)
+{
+    struct stat st;
+    return stat(lastlog2_path, &st);
+}
+
+/* The spool is a file next to the database, to which pam_lastlog2
+   appends fixed-size records without touching the database. Appending
+   writers take a shared lock without waiting, ll2_ctx_compact_journal
+   takes an exclusive one while it folds the records into the
+   database and truncates the file. Readers take a shared lock, so
+   they never see a record neither in the spool nor in the database. */
+#define SPOOL_SUFFIX ".spool"
+#define SPOOL_MAGIC 0x4c4c3253
+#define SPOOL_READ_RECORDS 64
+
+/* Set in flags for strings which are not NULL. */
+#define SPOOL_HAS_TTY     0x01
+#define SPOOL_HAS_RHOST   0x02
+#define SPOOL_HAS_SERVICE 0x04
+#define SPOOL_HAS_UID     0x08
+
+struct spool_record {
+  uint32_t magic;
+  uint32_t flags;
+  int64_t ll_time;
+  char user[128];
+  char tty[64];
+  char rhost[256];
+  char pam_service[44];
+  uint32_t uid;
+};
+
+_Static_assert (sizeof (struct spool_record) == 512,
+		"spool records must have a fixed size");
+
+/* Opens the spool of the database with the given flags.
+   Returns the file descriptor, or a negative errno value. */
+static int
+open_spool (const char *lastlog2_path, int flags, char **error)
+{
+  char *path;
+  int retval;
+  int fd;
+
+  if (asprintf (&path, "%s" SPOOL_SUFFIX, lastlog2_path) < 0)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      return -ENOMEM;
+    }
+
+  fd = open (path, flags | O_CLOEXEC | O_NOFOLLOW, 0644);
+  if (fd < 0)
+    {
+      retval = -errno;
+      if (error && retval != -ENOENT)
+	if (asprintf (error, "Cannot open %s: %s", path, strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
+      free (path);
+      return retval;
+    }
+
+  free (path);
+  return fd;
+}
+
+/* Copies src into dst and marks it in flags if it is not NULL.
+   Returns -1 if it is too long. */
+static int
+spool_field (char *dst, size_t size, const char *src,
+	     uint32_t *flags, uint32_t flag)
+{
+  size_t len;
+
+  if (src == NULL)
+    return 0;
+
+  if ((len = strlen (src)) >= size)
+    return -1;
+
+  memcpy (dst, src, len);
+  *flags |= flag;
+  return 0;
+}
+
+/* Strings are terminated and padded with zeros, as spool_entry
+   writes them. Rules out most misaligned reads of a damaged spool. */
+static int
+spool_string_valid (const char *str, size_t size)
+{
+  const char *end = memchr (str, '\0', size);
+
+  if (end == NULL)
+    return 0;
+
+  for (; end < str + size; end++)
+    if (*end != '\0')
+      return 0;
+
+  return 1;
+}
+
+static int
+spool_record_valid (const struct spool_record *rec)
+{
+  return rec->magic == SPOOL_MAGIC && rec->user[0] != '\0' &&
+    (rec->flags & ~(uint32_t)(SPOOL_HAS_TTY | SPOOL_HAS_RHOST |
+			      SPOOL_HAS_SERVICE | SPOOL_HAS_UID)) == 0 &&
+    spool_string_valid (rec->user, sizeof (rec->user)) &&
+    spool_string_valid (rec->tty, sizeof (rec->tty)) &&
+    spool_string_valid (rec->rhost, sizeof (rec->rhost)) &&
+    spool_string_valid (rec->pam_service, sizeof (rec->pam_service));
+}
+
+/* Returns the offset of the first possible start of a record in buf
+   after the first byte, or len - 3 if there is none, so that a magic
+   cut off at the end is found by the next read. */
+static size_t
+spool_find_magic (const char *buf, size_t len)
+{
+  uint32_t magic = SPOOL_MAGIC;
+  size_t i;
+
+  for (i = 1; i + sizeof (magic) <= len; i++)
+    if (memcmp (buf + i, &magic, sizeof (magic)) == 0)
+      return i;
+
+  return i;
+}
+
+/* Calls callback for every valid record in the spool, a return value
+   other than 0 stops reading. Damaged records, e.g. a part of a
+   record written before the disk got full, are skipped. All records
+   after such a part are shifted, so reading continues at the next
+   magic. Returns the return value of the callback, or -1 if reading
+   failed. */
+static int
+scan_spool (int fd, int (*callback)(const struct spool_record *rec,
+				    void *userdata),
+	    void *userdata, char **error)
+{
+  struct spool_record recs[SPOOL_READ_RECORDS];
+  off_t offset = 0;
+  ssize_t n;
+
+  while ((n = pread (fd, recs, sizeof (recs), offset)) > 0)
+    {
+      size_t count = n / sizeof (struct spool_record);
+      size_t i;
+
+      /* A record which is still being written. */
+      if (count == 0)
+	break;
+
+      for (i = 0; i < count; i++)
+	{
+	  int ret;
+
+	  if (!spool_record_valid (&recs[i]))
+	    break;
+
+	  if ((ret = callback (&recs[i], userdata)) != 0)
+	    return ret;
+	}
+
+      offset += i * sizeof (struct spool_record);
+      if (i < count)
+	offset += spool_find_magic ((const char *)&recs[i],
+				    n - i * sizeof (struct spool_record));
+    }
+
+  if (n < 0)
+    {
+      if (error)
+	if (asprintf (error, "Cannot read spool: %s", strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Append an entry to the spool of the database, from where
+   ll2_ctx_compact_journal moves it into the database.
+   Returns 0 on success, -EINVAL if the entry does not fit into a
+   spool record, -EBUSY if the spool is being compacted, other
+   negative errno values on failure. */
+static int
+spool_entry (const char *lastlog2_path, const struct ll2_entry *entry,
+	     char **error)
+{
+  struct spool_record rec;
+  ssize_t n;
+  int retval = 0;
+  int fd;
+
+  memset (&rec, 0, sizeof (rec));
+  rec.magic = SPOOL_MAGIC;
+  rec.ll_time = entry->ll_time;
+  if (entry->has_uid)
+    {
+      rec.uid = entry->uid;
+      rec.flags |= SPOOL_HAS_UID;
+    }
+
+  if (entry->user == NULL || entry->user[0] == '\0' ||
+      spool_field (rec.user, sizeof (rec.user), entry->user,
+		   &rec.flags, 0) != 0 ||
+      spool_field (rec.tty, sizeof (rec.tty), entry->tty,
+		   &rec.flags, SPOOL_HAS_TTY) != 0 ||
+      spool_field (rec.rhost, sizeof (rec.rhost), entry->rhost,
+		   &rec.flags, SPOOL_HAS_RHOST) != 0 ||
+      spool_field (rec.pam_service, sizeof (rec.pam_service),
+		   entry->pam_service, &rec.flags, SPOOL_HAS_SERVICE) != 0)
+    {
+      if (error)
+	*error = strdup ("Entry too large for spool");
+      return -EINVAL;
+    }
+
+  if ((fd = open_spool (lastlog2_path, O_WRONLY | O_APPEND | O_CREAT,
+			error)) < 0)
+    return fd;
+
+  if (flock (fd, LOCK_SH | LOCK_NB) != 0)
+    {
+      retval = (errno == EWOULDBLOCK) ? -EBUSY : -errno;
+      if (error)
+	{
+	  if (retval == -EBUSY)
+	    *error = strdup ("Spool is being compacted");
+	  else if (asprintf (error, "Cannot lock spool: %s",
+			     strerror (errno)) < 0)
+	    *error = strdup ("Out of memory");
+	}
+      close (fd);
+      return retval;
+    }
+
+  /* O_APPEND writes of a record are not interleaved with others. */
+  n = write (fd, &rec, sizeof (rec));
+  if (n != sizeof (rec))
+    {
+      retval = (n < 0) ? -errno : -ENOSPC;
+      if (error)
+	if (asprintf (error, "Cannot write spool: %s",
+		      strerror (-retval)) < 0)
+	  *error = strdup ("Out of memory");
+    }
+
+  close (fd);
+
+  return retval;
+}
+
+int
+ll2_spool_entry (const char *lastlog2_path, const struct ll2_entry *entry,
+		 char **error)
+{
+  STATS_BEGIN ();
+  int retval = spool_entry (lastlog2_path, entry, error);
+
+  STATS_END (STAT_SPOOL_ENTRY, retval);
+  return retval;
+}
+
+struct spool_lookup {
+  const char *user;
+  struct spool_record rec;
+  int found;
+};
+
+/* Remember the newest record of the user. */
+static int
+spool_lookup (const struct spool_record *rec, void *userdata)
+{
+  struct spool_lookup *lookup = userdata;
+
+  if (strcmp (rec->user, lookup->user) == 0 &&
+      (!lookup->found || rec->ll_time >= lookup->rec.ll_time))
+    {
+      lookup->rec = *rec;
+      lookup->found = 1;
+    }
+
+  return 0;
+}
+
+static int
+spool_strdup (char **dst, const char *src, uint32_t flags, uint32_t flag)
+{
+  free (*dst);
+  *dst = NULL;
+
+  if (!(flags & flag) || src[0] == '\0')
+    return 0;
+
+  return (*dst = strdup (src)) == NULL ? -1 : 0;
+}
+
+static int
+cache_strdup (char **dst, const struct cache_map *map, uint32_t off)
+{
+  const char *src;
+
+  if (dst == NULL || (src = cache_string (map, off)) == NULL)
+    return 0;
+
+  return (*dst = strdup (src)) == NULL ? -1 : 0;
+}
+
+/* Look up the entry of user in the cache.
+   Returns 0 on success, -ENOENT if user has no entry, -ESTALE if the
+   database needs to be read instead, -1 on failure. */
+static int
+read_cached_entry (const char *lastlog2_path, const char *user,
+		   int64_t *ll_time, char **tty, char **rhost,
+		   char **pam_service, char **error)
+{
+  struct cache_stamp db, wal;
+  struct cache_slot slot = { 0 };
+  struct cache_map map;
+  struct stat st;
+  char buf[PATH_MAX];
+  int found = 0;
+  int retval = -ESTALE;
+  int fd;
+
+  /* Spooled entries are only merged by ll2_read_entry. */
+  if (snprintf (buf, sizeof (buf), "%s" SPOOL_SUFFIX,
+		lastlog2_path) >= (int)sizeof (buf) ||
+      (stat (buf, &st) == 0 && st.st_size > 0))
+    return -ESTALE;
+
+  if (snprintf (buf, sizeof (buf), "%s" CACHE_SUFFIX,
+		lastlog2_path) >= (int)sizeof (buf) ||
+      (fd = open (buf, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) < 0)
+    return -ESTALE;
+
+  if (cache_map_fd (&map, fd, 0) != 0)
+    {
+      close (fd);
+      return -ESTALE;
+    }
+
+  for (int tries = 0; tries < CACHE_READ_TRIES; tries++)
+    {
+      uint32_t seq = atomic_load_explicit (&map.header->seq,
+					   memory_order_acquire);
+      struct cache_stamp db_cached, wal_cached;
+      const struct cache_slot *s;
+      int valid;
+
+      if (seq & 1)
+	continue;
+
+      valid = map.header->valid;
+      db_cached = map.header->db;
+      wal_cached = map.header->wal;
+      s = valid ? cache_find (&map, user, cache_hash (user), NULL) : NULL;
+      if (s)
+	slot = *s;
+
+      atomic_thread_fence (memory_order_acquire);
+      if (atomic_load_explicit (&map.header->seq,
+				memory_order_relaxed) != seq)
+	continue;
+
+      if (!valid || get_stamps (lastlog2_path, &db, &wal) != 0 ||
+	  !stamps_equal (&db, &db_cached) || !stamps_equal (&wal, &wal_cached))
+	break;
+
+      if (s == NULL)
+	retval = -ENOENT;
+      else
+	found = 1;
+      break;
+    }
+
+  /* Strings are never changed once the slot refers to them. */
+  if (found)
+    {
+      if (ll_time)
+	*ll_time = slot.ll_time;
+      if (cache_strdup (tty, &map, slot.tty) != 0 ||
+	  cache_strdup (rhost, &map, slot.rhost) != 0 ||
+	  cache_strdup (pam_service, &map, slot.pam_service) != 0)
+	{
+	  if (error)
+	    *error = strdup ("Out of memory");
+	  retval = -1;
+	}
+      else
+	retval = 0;
+    }
+
+  cache_unmap (&map);
+
+  return retval;
+}
+
+int
+ll2_read_cached_entry (const char *lastlog2_path, const char *user,
+		       int64_t *ll_time, char **tty, char **rhost,
+		       char **pam_service, char **error)
+{
+  STATS_BEGIN ();
+  int retval = read_cached_entry (lastlog2_path, user, ll_time, tty, rhost,
+				  pam_service, error);
+
+  STATS_END (STAT_READ_CACHED_ENTRY, retval);
+  return retval;
+}
+
+struct spool_compact {
+  struct ll2_context *context;
+  struct cache_map map;
+  sqlite3_stmt *res;
+  int count;
+  char **error;
+};
+
+/* Write one record, if it is newer than the entry in the database. */
+static int
+spool_compact (const struct spool_record *rec, void *userdata)
+{
+  struct spool_compact *compact = userdata;
+  sqlite3_stmt *res = compact->res;
+
+  if (intern_strings (compact->context,
+		      (rec->flags & SPOOL_HAS_TTY) ? rec->tty : NULL,
+		      (rec->flags & SPOOL_HAS_RHOST) ? rec->rhost : NULL,
+		      (rec->flags & SPOOL_HAS_SERVICE) ? rec->pam_service : NULL,
+		      compact->error) != 0)
+    return -1;
+
+  if (sqlite3_bind_text (res, 1, rec->user, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_int64 (res, 2, rec->ll_time) != SQLITE_OK ||
+      sqlite3_bind_text (res, 3, (rec->flags & SPOOL_HAS_TTY) ?
+			 rec->tty : NULL, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text (res, 4, (rec->flags & SPOOL_HAS_RHOST) ?
+			 rec->rhost : NULL, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text (res, 5, (rec->flags & SPOOL_HAS_SERVICE) ?
+			 rec->pam_service : NULL, -1,
+			 SQLITE_STATIC) != SQLITE_OK ||
+      ((rec->flags & SPOOL_HAS_UID) ? sqlite3_bind_int64 (res, 6, rec->uid) :
+       sqlite3_bind_null (res, 6)) != SQLITE_OK ||
+      step_stmt (res) != SQLITE_DONE)
+    {
+      if (compact->error)
+	if (asprintf (compact->error, "Failed to write spooled entry for %s: %s",
+		      rec->user, sqlite3_errmsg (compact->context->db)) < 0)
+	  *compact->error = strdup ("Out of memory");
+      sqlite3_reset (res);
+      return -1;
+    }
+
+  sqlite3_reset (res);
+  compact->count++;
+
+  if (sqlite3_changes (compact->context->db) > 0)
+    cache_put (&compact->map, rec->user, rec->ll_time,
+	       (rec->flags & SPOOL_HAS_TTY) ? rec->tty : NULL,
+	       (rec->flags & SPOOL_HAS_RHOST) ? rec->rhost : NULL,
+	       (rec->flags & SPOOL_HAS_SERVICE) ? rec->pam_service : NULL);
+
+  return 0;
+}
+
+/* Move all records of the spool into the database with one
+   transaction and truncate the spool. Records older than the entry
+   in the database are skipped, so nothing breaks if a record is
+   written twice. Returns the number of records, or -1 on failure. */
+static int
+ctx_compact_journal (struct ll2_context *context, char **error)
+{
+  struct spool_compact compact = { .context = context, .error = error };
+  const char *sql = "INSERT INTO Lastlog2 (Name, Time, TTYId, RemoteHostId, ServiceId, UID) "
+    "VALUES (?1, ?2, " STRING_ID ("?3") ", " STRING_ID ("?4") ", "
+    STRING_ID ("?5") ", ?6) ON CONFLICT (Name) DO UPDATE SET "
+    "Time = excluded.Time, TTYId = excluded.TTYId, "
+    "RemoteHostId = excluded.RemoteHostId, ServiceId = excluded.ServiceId, "
+    "UID = coalesce(excluded.UID, UID) WHERE excluded.Time >= Time";
+  struct stat st;
+  int retval = -1;
+  int fd;
+
+  if ((fd = open_spool (context->path, O_RDWR, error)) < 0)
+    return fd == -ENOENT ? 0 : -1;
+
+  /* Nothing to move, so neither lock nor transaction are needed.
+     A record appended meanwhile is moved next time. */
+  if (fstat (fd, &st) == 0 && st.st_size == 0)
+    {
+      close (fd);
+      return 0;
+    }
+
+  /* New records go directly into the database meanwhile. Readers
+     and writers hold their lock only shortly, so don't wait longer
+     than for a locked database. */
+  if (lock_file (fd, LOCK_EX, context->busy_timeout) != 0)
+    {
+      retval = errno == EWOULDBLOCK ? -EBUSY : -1;
+      if (error)
+	{
+	  if (retval == -EBUSY)
+	    *error = strdup ("Spool is busy");
+	  else if (asprintf (error, "Cannot lock spool: %s",
+			     strerror (errno)) < 0)
+	    *error = strdup ("Out of memory");
+	}
+      close (fd);
+      return retval;
+    }
+
+  if (sqlite3_prepare_v2 (context->db, sql, -1, &compact.res, NULL) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+      close (fd);
+      return -1;
+    }
+
+  cache_begin (context, &compact.map);
+
+  if (exec_sql (context->db, "BEGIN IMMEDIATE", error) != 0)
+    goto done;
+
+  if (scan_spool (fd, spool_compact, &compact, error) != 0)
+    {
+      exec_sql (context->db, "ROLLBACK", NULL);
+      cache_invalidate (&compact.map);
+      goto done;
+    }
+
+  if (exec_sql (context->db, "COMMIT", error) != 0)
+    {
+      exec_sql (context->db, "ROLLBACK", NULL);
+      cache_invalidate (&compact.map);
+      goto done;
+    }
+
+  /* If this fails, the records are written again next time. */
+  if (ftruncate (fd, 0) != 0)
+    {
+      if (error)
+	if (asprintf (error, "Cannot truncate spool: %s",
+		      strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
+      goto done;
+    }
+
+  retval = compact.count;
+
+ done:
+  cache_end (context, &compact.map);
+  sqlite3_finalize (compact.res);
+  close (fd);
+
+  return retval;
+}
+
+int
+ll2_ctx_compact_journal (struct ll2_context *context, char **error)
+{
+  STATS_BEGIN ();
+  int retval = ctx_compact_journal (context, error);
+
+  STATS_END (STAT_COMPACT_JOURNAL, retval);
+  return retval;
+}
+
+/* Stops scan_spool at the first record of one of the users. */
+struct spool_match {
+  const char *user;
+  const char *other;
+};
+
+static int
+spool_match (const struct spool_record *rec, void *userdata)
+{
+  const struct spool_match *match = userdata;
+
+  return strcmp (rec->user, match->user) == 0 ||
+    (match->other != NULL && strcmp (rec->user, match->other) == 0);
+}
+
+/* Moves the spool into the database, if it has records of user or
+   other, which may be NULL, so that a change of their entries is not
+   undone by a spooled record later. Changing a single entry, e.g. by
+   usermod, does not pay for moving the records of everybody else.
+   Returns 0 on success, -EBUSY if the spool stayed locked, -1 on
+   failure. */
+static int
+compact_journal_of (struct ll2_context *context, const char *user,
+		    const char *other, char **error)
+{
+  struct spool_match match = { .user = user, .other = other };
+  struct stat st;
+  int found = 0;
+  int retval;
+  int fd;
+
+  if ((fd = open_spool (context->path, O_RDONLY, error)) < 0)
+    return fd == -ENOENT ? 0 : -1;
+
+  if (fstat (fd, &st) != 0 || st.st_size > 0)
+    {
+      /* Wait for a running compaction, as readers do. */
+      if (lock_file (fd, LOCK_SH, context->busy_timeout) != 0)
+	{
+	  retval = errno == EWOULDBLOCK ? -EBUSY : -1;
+	  if (error)
+	    {
+	      if (retval == -EBUSY)
+		*error = strdup ("Spool is busy");
+	      else if (asprintf (error, "Cannot lock spool: %s",
+				 strerror (errno)) < 0)
+		*error = strdup ("Out of memory");
+	    }
+	  close (fd);
+	  return retval;
+	}
+
+      found = scan_spool (fd, spool_match, &match, error);
+    }
+  close (fd);
+
+  if (found <= 0)
+    return found;
+
+  retval = ll2_ctx_compact_journal (context, error);
+  return retval < 0 ? retval : 0;
+}
+
+/* Move all records of the spool into the database.
+   Returns the number of records, -EBUSY if the spool stayed locked,
+   or -1 on failure. */
+int
+ll2_compact_journal (const char *lastlog2_path, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+
+  if ((context = ll2_open_context (lastlog2_path, 0, error)) == NULL)
+    return -1;
+
+  retval = ll2_ctx_compact_journal (context, error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+/* Reads one entry from database and returns that.
+   Returns 0 on success, -1 on failure. */
+static int
+read_entry (struct ll2_context *context, const char *user,
+	    int64_t *ll_time, char **tty, char **rhost,
+	    char **pam_service, char **error)
+{
+  int retval = 0;
+  sqlite3_stmt *res;
+  /* Look up the strings with SQL, loading all of them for a single
+     entry would be more expensive. */
+  const char *sql = "SELECT Name, Time, " STRING_VALUE ("TTYId") ", "
+    STRING_VALUE ("RemoteHostId") ", " STRING_VALUE ("ServiceId")
+    " FROM Lastlog2 WHERE Name = ?";
+  const char *sql_v4 = "SELECT Name, Time, TTY, RemoteHost, Service FROM Lastlog2 WHERE Name = ?";
+  int version;
+
+  if ((version = context_schema_version (context, error)) < 0)
+    return -1;
+
+  if ((res = get_stmt (context, &context->stmt_select,
+		       version >= 5 ? sql : sql_v4, error)) == NULL)
+    return -1;
+
+  if (sqlite3_bind_text (res, 1, user, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create search query: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  int step = step_stmt (res);
+
+  if (step == SQLITE_ROW)
+    {
+      const unsigned char *luser = sqlite3_column_text (res, 0);
+      const unsigned char *uc;
+
+      if (strcmp ((const char *)luser, user) != 0)
+	{
+	  if (error)
+	    if (asprintf (error, "Returned data is for %s, not %s", luser, user) < 0)
+	      *error = strdup("Out of memory");
+
+	  put_stmt (res);
+	  return -1;
+	}
+
+      if (ll_time)
+	*ll_time = sqlite3_column_int64 (res, 1);
+
+      if (tty)
+	{
+	  uc = sqlite3_column_text (res, 2);
+	  if (uc != NULL && strlen ((const char *)uc) > 0)
+	    *tty = strdup ((const char *)uc);
+	}
+      if (rhost)
+	{
+	  uc = sqlite3_column_text (res, 3);
+	  if (uc != NULL && strlen ((const char *)uc) > 0)
+	    *rhost = strdup ((const char *)uc);
+	}
+      if (pam_service)
+	{
+	  uc = sqlite3_column_text (res, 4);
+	  if (uc != NULL && strlen ((const char *)uc) > 0)
+	    *pam_service = strdup ((const char *)uc);
+	}
+    }
+  else if (step == SQLITE_DONE)
+    {
+      retval = -ENOENT;
+    }
+  else if (step == SQLITE_BUSY)
+    {
+      if (error)
+	  *error = strdup ("Database busy");
+
+      retval = -EBUSY;
+    }
+  else if (step == SQLITE_ERROR)
+    {
+      if (error)
+	if (asprintf (error, "Error stepping through database: %s", sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      retval = -1;
+    }
+
+  put_stmt (res);
+
+  return retval;
+}
+
+/* reads 1 entry from database and returns that. A newer record of
+   the user in the spool is returned instead. Returns 0 on success,
+   -EBUSY if the spool stayed locked by a compaction, -1 on failure. */
+static int
+ctx_read_entry (struct ll2_context *context, const char *user,
+		int64_t *ll_time, char **tty, char **rhost, char **pam_service,
+		char **error)
+{
+  struct spool_lookup lookup = { .user = user };
+  int64_t db_time = 0;
+  char *db_tty = NULL;
+  char *db_rhost = NULL;
+  char *db_service = NULL;
+  int retval;
+  int fd;
+
+  if ((fd = open_spool (context->path, O_RDONLY, NULL)) < 0)
+    return read_entry (context, user, ll_time, tty, rhost, pam_service, error);
+
+  /* Wait until a running compaction is done, but not longer than
+     for a locked database. */
+  if (lock_file (fd, LOCK_SH, context->busy_timeout) != 0)
+    {
+      int busy = errno == EWOULDBLOCK;
+
+      close (fd);
+      if (!busy)
+	return read_entry (context, user, ll_time, tty, rhost, pam_service,
+			   error);
+
+      if (error)
+	*error = strdup ("Database busy");
+      return -EBUSY;
+    }
+
+  retval = read_entry (context, user, &db_time, &db_tty, &db_rhost,
+		       &db_service, error);
+  if ((retval == 0 || retval == -ENOENT) &&
+      scan_spool (fd, spool_lookup, &lookup, error) != 0)
+    retval = -1;
+
+  close (fd);
+
+  if (lookup.found && (retval == -ENOENT ||
+		       (retval == 0 && lookup.rec.ll_time >= db_time)))
+    {
+      const struct spool_record *rec = &lookup.rec;
+
+      db_time = rec->ll_time;
+      if (spool_strdup (&db_tty, rec->tty, rec->flags, SPOOL_HAS_TTY) != 0 ||
+	  spool_strdup (&db_rhost, rec->rhost, rec->flags, SPOOL_HAS_RHOST) != 0 ||
+	  spool_strdup (&db_service, rec->pam_service, rec->flags,
+			SPOOL_HAS_SERVICE) != 0)
+	{
+	  if (error)
+	    *error = strdup ("Out of memory");
+	  retval = -1;
+	}
+      else
+	retval = 0;
+    }
+
+  if (retval != 0)
+    {
+      free (db_tty);
+      free (db_rhost);
+      free (db_service);
+      return retval;
+    }
+
+  if (ll_time)
+    *ll_time = db_time;
+  if (tty)
+    *tty = db_tty;
+  else
+    free (db_tty);
+  if (rhost)
+    *rhost = db_rhost;
+  else
+    free (db_rhost);
+  if (pam_service)
+    *pam_service = db_service;
+  else
+    free (db_service);
+
+  return 0;
+}
+
+int
+ll2_ctx_read_entry (struct ll2_context *context, const char *user,
+		    int64_t *ll_time, char **tty, char **rhost,
+		    char **pam_service, char **error)
+{
+  STATS_BEGIN ();
+  LL2_PROBE_BEGIN (ctx_read_entry, user);
+  int retval = ctx_read_entry (context, user, ll_time, tty, rhost, pam_service,
+			       error);
+
+  LL2_PROBE_END (ctx_read_entry, user, retval,
+		 sqlite3_extended_errcode (context->db));
+  STATS_END (STAT_READ_ENTRY, retval);
+  return retval;
+}
+
+/* reads 1 entry from database and returns that. Returns 0 on success,
+   -ENOENT if user has no entry, -EBUSY if the database or the spool
+   is locked, -1 on failure. */
+int
+ll2_read_entry (const char *lastlog2_path, const char *user,
+		int64_t *ll_time, char **tty, char **rhost,
+		char **pam_service, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+  LL2_PROBE_BEGIN (read_entry, user);
+
+  if ((context = ll2_open_context (lastlog2_path, LL2_OPEN_READONLY,
+				   error)) == NULL)
+    {
+      LL2_PROBE_END (read_entry, user, -1, 0);
+      return -1;
+    }
+
+  retval = ll2_ctx_read_entry (context, user, ll_time, tty, rhost,
+			       pam_service, error);
+
+  ll2_close_context (context);
+
+  LL2_PROBE_END (read_entry, user, retval, 0);
+  return retval;
+}
+
+/* Write a new entry. Returns 0 on success, -EBUSY if the database
+   is locked, -1 on failure. */
+static int
+write_entry (struct ll2_context *context, const char *user,
+	     int64_t ll_time, const char *tty, const char *rhost,
+	     const char *pam_service, int64_t uid, char **error)
+{
+  sqlite3_stmt *res;
+  /* Keep the UID, if the new entry has none. */
+  char *sql_replace = "INSERT INTO Lastlog2(Name, Time, TTYId, RemoteHostId, ServiceId, UID) "
+    "VALUES(?1, ?2, " STRING_ID ("?3") ", " STRING_ID ("?4") ", "
+    STRING_ID ("?5") ", ?6) "
+    "ON CONFLICT(Name) DO UPDATE SET Time = excluded.Time, TTYId = excluded.TTYId, "
+    "RemoteHostId = excluded.RemoteHostId, ServiceId = excluded.ServiceId, "
+    "UID = coalesce(excluded.UID, UID)";
+  int retval;
+
+  if ((retval = intern_strings (context, tty, rhost, pam_service,
+				error)) != 0)
+    return retval;
+
+  if ((res = get_stmt (context, &context->stmt_replace, sql_replace,
+		       error)) == NULL)
+    return -1;
+
+  if (sqlite3_bind_text (res, 1, user, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+        if (asprintf (error, "Failed to create replace statement for user: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+          *error = strdup("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  if (sqlite3_bind_int64 (res, 2, ll_time) != SQLITE_OK)
+    {
+      if (error)
+        if (asprintf (error, "Failed to create replace statement for ll_time: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+          *error = strdup("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  if (sqlite3_bind_text (res, 3, tty, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+        if (asprintf (error, "Failed to create replace statement for tty: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+          *error = strdup("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  if (sqlite3_bind_text (res, 4, rhost, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+        if (asprintf (error, "Failed to create replace statement for rhost: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+          *error = strdup("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  if (sqlite3_bind_text (res, 5, pam_service, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+        if (asprintf (error, "Failed to create replace statement for PAM service: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+          *error = strdup("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  if ((uid < 0 ? sqlite3_bind_null (res, 6) :
+       sqlite3_bind_int64 (res, 6, uid)) != SQLITE_OK)
+    {
+      if (error)
+        if (asprintf (error, "Failed to create replace statement for UID: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+          *error = strdup("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  int step = step_stmt (res);
+
+  if (step != SQLITE_DONE)
+    {
+      if (step == SQLITE_BUSY)
+	{
+	  if (error)
+	    *error = strdup ("Database busy");
+
+	  put_stmt (res);
+	  return -EBUSY;
+	}
+      else if (step == SQLITE_ERROR)
+	{
+	  if (error)
+	    if (asprintf (error, "Replace statement failed: %s",
+			  sqlite3_errmsg (context->db)) < 0)
+	      *error = strdup("Out of memory");
+	}
+      else
+	{
+	  if (error)
+	    if (asprintf (error, "Replace statement did not return SQLITE_DONE: %d",
+			  step) < 0)
+	      *error = strdup("Out of memory");
+	}
+
+      put_stmt (res);
+      return -1;
+    }
+
+  put_stmt (res);
+
+  return 0;
+}
+
+/* Write a new entry. Returns 0 on success, -EBUSY if the database
+   is locked, -1 on failure. */
+int
+ll2_ctx_write_entry (struct ll2_context *context, const char *user,
+		     int64_t ll_time, const char *tty, const char *rhost,
+		     const char *pam_service, char **error)
+{
+  return ll2_ctx_write_entry_uid (context, user, ll_time, tty, rhost,
+				  pam_service, -1, error);
+}
+
+/* Write a new entry with the UID of the user, or keep the UID of an
+   existing entry if uid is negative. Returns 0 on success, -EBUSY if
+   the database is locked, -1 on failure. */
+static int
+ctx_write_entry_uid (struct ll2_context *context, const char *user,
+		     int64_t ll_time, const char *tty, const char *rhost,
+		     const char *pam_service, int64_t uid, char **error)
+{
+  struct cache_map map;
+  int retval;
+
+  cache_begin (context, &map);
+
+  /* The strings and the entry are written together. */
+  if (exec_sql (context->db, "BEGIN IMMEDIATE", error) != 0)
+    {
+      cache_end (context, &map);
+      return sqlite3_errcode (context->db) == SQLITE_BUSY ? -EBUSY : -1;
+    }
+
+  retval = write_entry (context, user, ll_time, tty, rhost, pam_service, uid,
+			error);
+  if (retval == 0 && exec_sql (context->db, "COMMIT", error) != 0)
+    retval = -1;
+  if (retval != 0)
+    exec_sql (context->db, "ROLLBACK", NULL);
+  else
+    cache_put (&map, user, ll_time, tty, rhost, pam_service);
+  cache_end (context, &map);
+
+  return retval;
+}
+
+int
+ll2_ctx_write_entry_uid (struct ll2_context *context, const char *user,
+			 int64_t ll_time, const char *tty, const char *rhost,
+			 const char *pam_service, int64_t uid, char **error)
+{
+  STATS_BEGIN ();
+  LL2_PROBE_BEGIN (ctx_write_entry, user);
+  int retval = ctx_write_entry_uid (context, user, ll_time, tty, rhost,
+				    pam_service, uid, error);
+
+  LL2_PROBE_END (ctx_write_entry, user, retval,
+		 sqlite3_extended_errcode (context->db));
+  STATS_END (STAT_WRITE_ENTRY, retval);
+  return retval;
+}
+
+/* Write a new entry. Returns 0 on success, -EBUSY if the database
+   is locked, -1 on failure. */
+int
+ll2_write_entry (const char *lastlog2_path, const char *user,
+		 int64_t ll_time, const char *tty, const char *rhost,
+		 const char *pam_service, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+  LL2_PROBE_BEGIN (write_entry, user);
+
+  if ((context = ll2_open_context (lastlog2_path, 0, error)) == NULL)
+    {
+      LL2_PROBE_END (write_entry, user, -1, 0);
+      return -1;
+    }
+
+  retval = ll2_ctx_write_entry (context, user, ll_time, tty, rhost,
+				pam_service, error);
+
+  ll2_close_context (context);
+
+  LL2_PROBE_END (write_entry, user, retval, 0);
+  return retval;
+}
+
+/* Write many entries in transactions of chunk_size entries, or all
+   in one transaction if chunk_size is 0. A failing entry does not
+   abort the transaction. If status is not NULL, status[i] is set to 0
+   or -1 for every entry, error contains the message of the first
+   failure. Returns the number of entries, which could not be written,
+   or -1 if a transaction failed. */
+static int
+ctx_write_entries (struct ll2_context *context,
+		   const struct ll2_entry *entries, size_t count,
+		   size_t chunk_size, int *status, char **error)
+{
+  struct cache_map map;
+  int failed = 0;
+  size_t start, end, i;
+
+  if (chunk_size == 0)
+    chunk_size = count;
+
+  cache_begin (context, &map);
+
+  for (start = 0; start < count; start = end)
+    {
+      end = (count - start > chunk_size) ? start + chunk_size : count;
+
+      /* Keep the message of an entry failed in an earlier chunk. */
+      if (exec_sql (context->db, "BEGIN IMMEDIATE",
+		    (error && *error == NULL) ? error : NULL) != 0)
+	goto abort;
+
+      for (i = start; i < end; i++)
+	{
+	  const struct ll2_entry *e = &entries[i];
+	  int ret;
+
+	  ret = write_entry (context, e->user, e->ll_time, e->tty, e->rhost,
+			     e->pam_service, e->has_uid ? (int64_t)e->uid : -1,
+			     (error && *error == NULL) ? error : NULL);
+	  if (status)
+	    status[i] = ret;
+	  if (ret == 0)
+	    cache_put (&map, e->user, e->ll_time, e->tty, e->rhost,
+		       e->pam_service);
+	  else
+	    {
+	      failed++;
+	      /* Only the statement was rolled back, unless the error
+		 was severe enough to abort the whole transaction. */
+	      if (sqlite3_get_autocommit (context->db))
+		goto abort;
+	    }
+	}
+
+      if (exec_sql (context->db, "COMMIT", (error && *error == NULL) ? error : NULL) != 0)
+	{
+	  exec_sql (context->db, "ROLLBACK", NULL);
+	  goto abort;
+	}
+    }
+
+  cache_end (context, &map);
+
+  return failed;
+
+ abort:
+  /* Nothing of this chunk and the following ones got written. */
+  if (status)
+    for (i = start; i < count; i++)
+      status[i] = -1;
+  /* The cache contains entries which got rolled back. */
+  if (map.modified)
+    cache_invalidate (&map);
+  cache_end (context, &map);
+  return -1;
+}
+
+int
+ll2_ctx_write_entries (struct ll2_context *context,
+		       const struct ll2_entry *entries, size_t count,
+		       size_t chunk_size, int *status, char **error)
+{
+  STATS_BEGIN ();
+  int retval = ctx_write_entries (context, entries, count, chunk_size, status,
+				  error);
+
+  STATS_END (STAT_WRITE_ENTRIES, retval);
+  return retval;
+}
+
+/* Write many entries, see ll2_ctx_write_entries. */
+int
+ll2_write_entries (const char *lastlog2_path, const struct ll2_entry *entries,
+		   size_t count, size_t chunk_size, int *status, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+
+  if ((context = ll2_open_context (lastlog2_path, 0, error)) == NULL)
+    return -1;
+
+  retval = ll2_ctx_write_entries (context, entries, count, chunk_size,
+				  status, error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+/* Runs an UPDATE statement for the entry of user, which gets bound
+   as second parameter, the first one is bound by the caller. The
+   statement changes only a single row, so no transaction is needed.
+   Returns 0 on success, -ENOENT if user has no entry, -1 on failure. */
+static int
+update_entry (struct ll2_context *context, sqlite3_stmt *res,
+	      const char *user, char **error)
+{
+  int step;
+
+  if (sqlite3_bind_text (res, 2, user, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create update statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  step = step_stmt (res);
+  if (step == SQLITE_BUSY)
+    {
+      if (error)
+	*error = strdup ("Database busy");
+
+      put_stmt (res);
+      return -EBUSY;
+    }
+  else if (step != SQLITE_DONE)
+    {
+      if (error)
+	if (asprintf (error, "Update statement failed: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  put_stmt (res);
+
+  if (sqlite3_changes (context->db) == 0)
+    {
+      if (error)
+	if (asprintf (error, "No entry for user '%s' found", user) < 0)
+	  *error = strdup ("Out of memory");
+
+      return -ENOENT;
+    }
+
+  return 0;
+}
+
+/* Update the login time of an existing entry. Returns 0 on success,
+   -ENOENT if user has no entry, -EBUSY if the database or the spool
+   is locked, -1 on failure. */
+static int
+ctx_update_login_time (struct ll2_context *context, const char *user,
+		       int64_t ll_time, char **error)
+{
+  struct cache_map map;
+  sqlite3_stmt *res;
+  char *sql = "UPDATE Lastlog2 SET Time = ? WHERE Name = ?";
+  int retval;
+
+  /* Else a newer spooled record would win over ll_time. */
+  if ((retval = compact_journal_of (context, user, NULL, error)) != 0)
+    return retval;
+
+  if ((res = get_stmt (context, &context->stmt_update_time, sql,
+		       error)) == NULL)
+    return -1;
+
+  if (sqlite3_bind_int64 (res, 1, ll_time) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create update statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  cache_begin (context, &map);
+  retval = update_entry (context, res, user, error);
+  if (retval == 0)
+    cache_set_time (&map, user, ll_time);
+  cache_end (context, &map);
+
+  return retval;
+}
+
+int
+ll2_ctx_update_login_time (struct ll2_context *context, const char *user,
+			   int64_t ll_time, char **error)
+{
+  STATS_BEGIN ();
+  int retval = ctx_update_login_time (context, user, ll_time, error);
+
+  STATS_END (STAT_UPDATE_LOGIN_TIME, retval);
+  return retval;
+}
+
+/* Update the login time of an existing entry. Returns 0 on success,
+   -ENOENT if user has no entry, -EBUSY if the database or the spool
+   is locked, -1 on failure. */
+int
+ll2_update_login_time (const char *lastlog2_path, const char *user,
+		       int64_t ll_time, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+
+  if ((context = ll2_open_context (lastlog2_path, 0, error)) == NULL)
+    return -1;
+
+  retval = ll2_ctx_update_login_time (context, user, ll_time, error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+/* Steps through the result of res and calls the callback function for
+   each entry. The strings of the entry are only valid during the
+   callback, a return value other than 0 stops reading. res gets reset
+   afterwards. The statistics count the time of the callbacks, too.
+   Returns 0 on success, -1 on failure. */
+static int
+step_entries (struct ll2_context *context, sqlite3_stmt *res,
+	      int (*cb_func)(const struct ll2_entry *entry, void *userdata),
+	      void *userdata, char **error)
+{
+  int step;
+  STATS_BEGIN ();
+
+  while ((step = step_stmt (res)) == SQLITE_ROW)
+    {
+      struct ll2_entry entry;
+
+      /* sqlite3_column_bytes needs to be called after
+	 sqlite3_column_text, else the length could be wrong. */
+      entry.user = (const char *)sqlite3_column_text (res, 0);
+      entry.user_len = sqlite3_column_bytes (res, 0);
+      entry.ll_time = sqlite3_column_int64 (res, 1);
+      if (column_string (context, res, 2, &entry.tty, &entry.tty_len,
+			 error) != 0 ||
+	  column_string (context, res, 3, &entry.rhost, &entry.rhost_len,
+			 error) != 0 ||
+	  column_string (context, res, 4, &entry.pam_service,
+			 &entry.pam_service_len, error) != 0)
+	{
+	  put_stmt (res);
+	  STATS_END (STAT_READ_ENTRIES, -1);
+	  return -1;
+	}
+      entry.has_uid = sqlite3_column_type (res, 5) != SQLITE_NULL;
+      entry.uid = sqlite3_column_int64 (res, 5);
+
+      if (cb_func (&entry, userdata) != 0)
+	{
+	  step = SQLITE_DONE;
+	  break;
+	}
+    }
+
+  if (step != SQLITE_DONE)
+    {
+      if (error)
+	if (asprintf (error, "SQL error: %s", sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      STATS_END (STAT_READ_ENTRIES, -1);
+      return -1;
+    }
+
+  put_stmt (res);
+
+  STATS_END (STAT_READ_ENTRIES, 0);
+  return 0;
+}
+
+/* Reads all entries from database and calls the callback function for each
+   entry, see step_entries.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_ctx_read_all (struct ll2_context *context,
+		  int (*cb_func)(const struct ll2_entry *entry,
+				 void *userdata),
+		  void *userdata, char **error)
+{
+  sqlite3_stmt *res;
+  char *sql = "SELECT %s FROM Lastlog2 ORDER BY Name ASC";
+
+  if ((res = get_entry_stmt (context, &context->stmt_read_all, sql,
+			     error)) == NULL)
+    return -1;
+
+  return step_entries (context, res, cb_func, userdata, error);
+}
+
+/* Reads all entries with from <= Time < to, ordered by name, and calls
+   the callback function for each entry, see step_entries. The range
+   is looked up in the Time index.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_ctx_read_range (struct ll2_context *context, int64_t from, int64_t to,
+		    int (*cb_func)(const struct ll2_entry *entry,
+				   void *userdata),
+		    void *userdata, char **error)
+{
+  sqlite3_stmt *res;
+  char *sql = "SELECT %s FROM Lastlog2 WHERE Time >= ? AND Time < ? ORDER BY Name ASC";
+
+  if ((res = get_entry_stmt (context, &context->stmt_range, sql,
+			     error)) == NULL)
+    return -1;
+
+  if (sqlite3_bind_int64 (res, 1, from) != SQLITE_OK ||
+      sqlite3_bind_int64 (res, 2, to) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create select statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  return step_entries (context, res, cb_func, userdata, error);
+}
+
+/* Reads all entries with from <= UID <= to, ordered by UID and name,
+   and calls the callback function for each entry, see step_entries.
+   Entries without UID are never returned.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_ctx_read_uid_range (struct ll2_context *context, uid_t from, uid_t to,
+			int (*cb_func)(const struct ll2_entry *entry,
+				       void *userdata),
+			void *userdata, char **error)
+{
+  sqlite3_stmt *res;
+  char *sql = "SELECT %s FROM Lastlog2 WHERE UID BETWEEN ? AND ? ORDER BY UID, Name";
+  int version;
+
+  if ((version = context_schema_version (context, error)) < 0)
+    return -1;
+  /* Not migrated yet, so no entry has an UID. */
+  if (version < 4)
+    return 0;
+
+  if ((res = get_entry_stmt (context, &context->stmt_uid_range, sql,
+			     error)) == NULL)
+    return -1;
+
+  if (sqlite3_bind_int64 (res, 1, from) != SQLITE_OK ||
+      sqlite3_bind_int64 (res, 2, to) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create select statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  return step_entries (context, res, cb_func, userdata, error);
+}
+
+/* Reads the count entries with the most recent, or with LL2_READ_OLDEST
+   the oldest, login and calls the callback function for each entry,
+   ordered by Time, see step_entries.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_ctx_read_recent (struct ll2_context *context, size_t count, int flags,
+		     int (*cb_func)(const struct ll2_entry *entry,
+				    void *userdata),
+		     void *userdata, char **error)
+{
+  sqlite3_stmt *res;
+
+  if (flags & LL2_READ_OLDEST)
+    res = get_entry_stmt (context, &context->stmt_oldest,
+			  "SELECT %s FROM Lastlog2 ORDER BY Time ASC LIMIT ?",
+			  error);
+  else
+    res = get_entry_stmt (context, &context->stmt_recent,
+			  "SELECT %s FROM Lastlog2 ORDER BY Time DESC LIMIT ?",
+			  error);
+  if (res == NULL)
+    return -1;
+
+  if (sqlite3_bind_int64 (res, 1, count > INT64_MAX ? INT64_MAX :
+			  (int64_t)count) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create select statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  return step_entries (context, res, cb_func, userdata, error);
+}
+
+/* Reads all entries with from <= Time < to, see ll2_ctx_read_range.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_read_range (const char *lastlog2_path, int64_t from, int64_t to,
+		int (*cb_func)(const struct ll2_entry *entry,
+			       void *userdata),
+		void *userdata, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+
+  if ((context = ll2_open_context (lastlog2_path, LL2_OPEN_READONLY,
+				   error)) == NULL)
+    return -1;
+
+  retval = ll2_ctx_read_range (context, from, to, cb_func, userdata, error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+/* Reads the count most recent or oldest entries, see
+   ll2_ctx_read_recent.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_read_recent (const char *lastlog2_path, size_t count, int flags,
+		 int (*cb_func)(const struct ll2_entry *entry,
+				void *userdata),
+		 void *userdata, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+
+  if ((context = ll2_open_context (lastlog2_path, LL2_OPEN_READONLY,
+				   error)) == NULL)
+    return -1;
+
+  retval = ll2_ctx_read_recent (context, count, flags, cb_func, userdata,
+				error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+/* Reads all entries with from <= UID <= to, see ll2_ctx_read_uid_range.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_read_uid_range (const char *lastlog2_path, uid_t from, uid_t to,
+		    int (*cb_func)(const struct ll2_entry *entry,
+				   void *userdata),
+		    void *userdata, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+
+  if ((context = ll2_open_context (lastlog2_path, LL2_OPEN_READONLY,
+				   error)) == NULL)
+    return -1;
+
+  retval = ll2_ctx_read_uid_range (context, from, to, cb_func, userdata,
+				   error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+/* Reads all entries of the UID, see ll2_ctx_read_uid_range.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_read_uid (const char *lastlog2_path, uid_t uid,
+	      int (*cb_func)(const struct ll2_entry *entry, void *userdata),
+	      void *userdata, char **error)
+{
+  return ll2_read_uid_range (lastlog2_path, uid, uid, cb_func, userdata,
+			     error);
+}
+
+/* Reads all entries from database and calls the callback function for each
+   entry, see ll2_ctx_read_all.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_read_all_entries (const char *lastlog2_path,
+		      int (*cb_func)(const struct ll2_entry *entry,
+				     void *userdata),
+		      void *userdata, char **error)
+{
+  struct ll2_context *context;
+  int retval;
+
+  if ((context = ll2_open_context (lastlog2_path, LL2_OPEN_READONLY,
+				   error)) == NULL)
+    return -1;
+
+  retval = ll2_ctx_read_all (context, cb_func, userdata, error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+struct legacy_callback {
+  int (*cb_func)(const char *user, int64_t ll_time,
+		 const char *tty, const char *rhost,
+		 const char *pam_service);
+};
+
+static int
+legacy_callback (const struct ll2_entry *entry, void *userdata)
+{
+  const struct legacy_callback *legacy = userdata;
+
+  /* The return value was always ignored. */
+  legacy->cb_func (entry->user, entry->ll_time, entry->tty, entry->rhost,
+		   entry->pam_service);
+
+  return 0;
+}
+
+/* Reads all entries from database and calls the callback function for each entry.
+   Returns 0 on success, -1 on failure. */
+int
+ll2_read_all  (const char *lastlog2_path,
+	       int (*cb_func)(const char *user, int64_t ll_time,
+			      const char *tty, const char *rhost,
+			      const char *pam_service),
+	       char **error)
+{
+  struct legacy_callback legacy = { cb_func };
+
+  return ll2_read_all_entries (lastlog2_path, legacy_callback, &legacy,
+			       error);
+}
+
+/* Number of entries a cursor reads at once. */
+#define CURSOR_PAGE_SIZE 256
+
+struct cursor_row {
+  char *user;
+  int64_t ll_time;
+  char *tty;
+  char *rhost;
+  char *pam_service;
+  size_t user_len;
+  size_t tty_len;
+  size_t rhost_len;
+  size_t pam_service_len;
+  uid_t uid;
+  int has_uid;
+};
+
+struct ll2_cursor {
+  struct ll2_context *context;
+  int own_context;
+  /* Name of the last entry read from the database, the next page
+     starts after it. */
+  char *last;
+  /* Entries left until the limit is reached, SIZE_MAX if unlimited. */
+  size_t remaining;
+  int eof;
+  struct cursor_row page[CURSOR_PAGE_SIZE];
+  size_t count;
+  size_t pos;
+};
+
+static void
+free_page (struct ll2_cursor *cursor)
+{
+  for (size_t i = 0; i < cursor->count; i++)
+    {
+      free (cursor->page[i].user);
+      free (cursor->page[i].tty);
+      free (cursor->page[i].rhost);
+      free (cursor->page[i].pam_service);
+    }
+  memset (cursor->page, 0, cursor->count * sizeof (cursor->page[0]));
+  cursor->count = 0;
+  cursor->pos = 0;
+}
+
+static char *
+column_strdup (sqlite3_stmt *res, int col, size_t *len, int *failed)
+{
+  const char *str = (const char *)sqlite3_column_text (res, col);
+  char *copy;
+
+  *len = sqlite3_column_bytes (res, col);
+  if (str == NULL)
+    return NULL;
+
+  if ((copy = strndup (str, *len)) == NULL)
+    *failed = 1;
+
+  return copy;
+}
+
+/* Like column_strdup for the strings read with column_string. */
+static char *
+column_string_dup (struct ll2_context *context, sqlite3_stmt *res, int col,
+		   size_t *len, int *failed, char **error)
+{
+  const char *str;
+  char *copy;
+
+  *len = 0;
+  if (*failed)
+    return NULL;
+
+  if (column_string (context, res, col, &str, len, error) != 0)
+    {
+      *failed = 1;
+      return NULL;
+    }
+  if (str == NULL)
+    return NULL;
+
+  if ((copy = strndup (str, *len)) == NULL)
+    *failed = 1;
+
+  return copy;
+}
+
+/* Reads the next page of entries after cursor->last. The statement
+   is reset afterwards, so that no read transaction stays open
+   between pages and blocks checkpoints.
+   Returns 0 on success, -1 on failure. */
+static int
+fetch_page (struct ll2_cursor *cursor, char **error)
+{
+  struct ll2_context *context = cursor->context;
+  sqlite3_stmt *res;
+  size_t limit = CURSOR_PAGE_SIZE;
+  int failed = 0;
+  int step = SQLITE_DONE;
+
+  free_page (cursor);
+
+  if (cursor->remaining < limit)
+    limit = cursor->remaining;
+  if (limit == 0)
+    {
+      cursor->eof = 1;
+      return 0;
+    }
+
+  if (cursor->last == NULL)
+    res = get_entry_stmt (context, &context->stmt_page_first,
+			  "SELECT %s FROM Lastlog2 ORDER BY Name LIMIT ?",
+			  error);
+  else
+    res = get_entry_stmt (context, &context->stmt_page_next,
+			  "SELECT %s FROM Lastlog2 WHERE Name > ? ORDER BY Name LIMIT ?",
+			  error);
+  if (res == NULL)
+    return -1;
+
+  if ((cursor->last != NULL &&
+       sqlite3_bind_text (res, 1, cursor->last, -1, SQLITE_STATIC) != SQLITE_OK) ||
+      sqlite3_bind_int64 (res, cursor->last ? 2 : 1, limit) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create select statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  while (!failed && (step = step_stmt (res)) == SQLITE_ROW)
+    {
+      struct cursor_row *row = &cursor->page[cursor->count++];
+
+      row->user = column_strdup (res, 0, &row->user_len, &failed);
+      row->ll_time = sqlite3_column_int64 (res, 1);
+      row->tty = column_string_dup (context, res, 2, &row->tty_len, &failed,
+				    error);
+      row->rhost = column_string_dup (context, res, 3, &row->rhost_len,
+				      &failed, error);
+      row->pam_service = column_string_dup (context, res, 4,
+					    &row->pam_service_len, &failed,
+					    error);
+      row->has_uid = sqlite3_column_type (res, 5) != SQLITE_NULL;
+      row->uid = sqlite3_column_int64 (res, 5);
+    }
+  put_stmt (res);
+
+  if (failed)
+    {
+      if (error && *error == NULL)
+	*error = strdup ("Out of memory");
+      free_page (cursor);
+      return -1;
+    }
+
+  if (step != SQLITE_DONE)
+    {
+      if (error)
+	if (asprintf (error, "SQL error: %s", sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+      free_page (cursor);
+      return -1;
+    }
+
+  if (cursor->count < limit)
+    cursor->eof = 1;
+
+  if (cursor->remaining != SIZE_MAX)
+    cursor->remaining -= cursor->count;
+
+  if (cursor->count > 0)
+    {
+      char *last = strdup (cursor->page[cursor->count - 1].user);
+
+      if (last == NULL)
+	{
+	  if (error)
+	    *error = strdup ("Out of memory");
+	  free_page (cursor);
+	  return -1;
+	}
+      free (cursor->last);
+      cursor->last = last;
+    }
+
+  return 0;
+}
+
+/* Create a cursor returning the entries after the user start, or
+   from the beginning if start is NULL, ordered by user name. At most
+   limit entries are returned, or all if limit is 0.
+   Returns NULL on failure. */
+struct ll2_cursor *
+ll2_ctx_open_cursor (struct ll2_context *context, const char *start,
+		     size_t limit, char **error)
+{
+  struct ll2_cursor *cursor;
+
+  if ((cursor = calloc (1, sizeof (*cursor))) == NULL ||
+      (start != NULL && (cursor->last = strdup (start)) == NULL))
+    {
+      free (cursor);
+      if (error)
+	*error = strdup ("Out of memory");
+      return NULL;
+    }
+
+  cursor->context = context;
+  cursor->remaining = limit ? limit : SIZE_MAX;
+
+  return cursor;
+}
+
+/* Same as ll2_ctx_open_cursor, but opens the database read-only
+   for the lifetime of the cursor.
+   Returns NULL on failure. */
+struct ll2_cursor *
+ll2_open_cursor (const char *lastlog2_path, const char *start,
+		 size_t limit, char **error)
+{
+  struct ll2_context *context;
+  struct ll2_cursor *cursor;
+
+  if ((context = ll2_open_context (lastlog2_path, LL2_OPEN_READONLY,
+				   error)) == NULL)
+    return NULL;
+
+  if ((cursor = ll2_ctx_open_cursor (context, start, limit, error)) == NULL)
+    {
+      ll2_close_context (context);
+      return NULL;
+    }
+  cursor->own_context = 1;
+
+  return cursor;
+}
+
+/* Stores the next entry in entry. The strings stay valid until the
+   next call or until the cursor gets closed.
+   Returns 1 if there was an entry, 0 at the end and -1 on failure. */
+static int
+cursor_next (struct ll2_cursor *cursor, struct ll2_entry *entry, char **error)
+{
+  const struct cursor_row *row;
+
+  if (cursor->pos == cursor->count)
+    {
+      if (cursor->eof)
+	return 0;
+      if (fetch_page (cursor, error) != 0)
+	return -1;
+      if (cursor->count == 0)
+	return 0;
+    }
+
+  row = &cursor->page[cursor->pos++];
+  entry->user = row->user;
+  entry->ll_time = row->ll_time;
+  entry->tty = row->tty;
+  entry->rhost = row->rhost;
+  entry->pam_service = row->pam_service;
+  entry->user_len = row->user_len;
+  entry->tty_len = row->tty_len;
+  entry->rhost_len = row->rhost_len;
+  entry->pam_service_len = row->pam_service_len;
+  entry->uid = row->uid;
+  entry->has_uid = row->has_uid;
+
+  return 1;
+}
+
+int
+ll2_cursor_next (struct ll2_cursor *cursor, struct ll2_entry *entry,
+		 char **error)
+{
+  STATS_BEGIN ();
+  int retval = cursor_next (cursor, entry, error);
+
+  STATS_END (STAT_CURSOR_NEXT, retval);
+  return retval;
+}
+
+/* Free all resources of the cursor. */
+void
+ll2_cursor_close (struct ll2_cursor *cursor)
+{
+  if (cursor == NULL)
+    return;
+
+  free_page (cursor);
+  free (cursor->last);
+  if (cursor->own_context)
+    ll2_close_context (cursor->context);
+  free (cursor);
+}
+
+/* Remove an user entry. Returns 0 on success, -1 on failure. */
+static int
+remove_entry (struct ll2_context *context, const char *user, char **error)
+{
+  sqlite3_stmt *res;
+  char *sql = "DELETE FROM Lastlog2 WHERE Name = ?";
+
+  if ((res = get_stmt (context, &context->stmt_delete, sql, error)) == NULL)
+    return -1;
+
+  if (sqlite3_bind_text (res, 1, user, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+        if (asprintf (error, "Failed to create delete statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+          *error = strdup("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  int step = step_stmt (res);
+
+  if (step != SQLITE_DONE)
+    {
+      if (step == SQLITE_BUSY)
+	{
+	  if (error)
+	    *error = strdup ("Database busy");
+
+	  put_stmt (res);
+	  return -EBUSY;
+	}
+      else if (step == SQLITE_ERROR)
+	{
+	  if (error)
+	    if (asprintf (error, "Delete statement failed: %s",
+			  sqlite3_errmsg (context->db)) < 0)
+	      *error = strdup("Out of memory");
+	}
+      else
+	{
+	  if (error)
+	    if (asprintf (error, "Delete statement did not return SQLITE_DONE: %d",
+			  step) < 0)
+	      *error = strdup("Out of memory");
+	}
+      put_stmt (res);
+      return -1;
+    }
+
+  put_stmt (res);
+
+  return 0;
+}
+
+/* Remove an user entry. Returns 0 on success, -EBUSY if the database
+   or the spool is locked, -1 on failure. */
+static int
+ctx_remove_entry (struct ll2_context *context, const char *user, char **error)
+{
+  struct cache_map map;
+  int retval;
+
+  /* Else a spooled record would bring the entry back. */
+  if ((retval = compact_journal_of (context, user, NULL, error)) != 0)
+    return retval;
+
+  cache_begin (context, &map);
+  retval = remove_entry (context, user, error);
+  if (retval == 0)
+    cache_delete (&map, user);
+  cache_end (context, &map);
+
+  return retval;
+}
+
+int
+ll2_ctx_remove_entry (struct ll2_context *context, const char *user,
+		      char **error)
+{
+  STATS_BEGIN ();
+  LL2_PROBE_BEGIN (ctx_remove_entry, user);
+  int retval = ctx_remove_entry (context, user, error);
+
+  LL2_PROBE_END (ctx_remove_entry, user, retval,
+		 sqlite3_extended_errcode (context->db));
+  STATS_END (STAT_REMOVE_ENTRY, retval);
+  return retval;
+}
+
+/* Remove an user entry. Returns 0 on success, -EBUSY if the database
+   or the spool is locked, -1 on failure. */
+int
+ll2_remove_entry (const char *lastlog2_path, const char *user,
+		 char **error)
+{
+  struct ll2_context *context;
+  int retval;
+
+  if ((context = ll2_open_context (lastlog2_path, 0, error)) == NULL)
+    return -1;
+
+  retval = ll2_ctx_remove_entry (context, user, error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+/* Number of entries removed per transaction by the purge functions,
+   so that logins get the lock in between. */
+#define PURGE_CHUNK_SIZE 1000
+
+/* Counts with LL2_PURGE_DRY_RUN, else removes the entries with
+   Time < before in chunks of PURGE_CHUNK_SIZE, which the index on
+   Time finds without reading the other entries. */
+static int
+ctx_purge_before (struct ll2_context *context, int64_t before, int flags,
+		  size_t *count, char **error)
+{
+  const char *sql = (flags & LL2_PURGE_DRY_RUN) ?
+    "SELECT count(*) FROM Lastlog2 WHERE Time < ?1" :
+    "DELETE FROM Lastlog2 WHERE Name IN "
+    "(SELECT Name FROM Lastlog2 WHERE Time < ?1 LIMIT ?2)";
+  sqlite3_stmt *res;
+  int retval = 0;
+  int step;
+
+  *count = 0;
+
+  /* Else a spooled record would bring an entry back. */
+  if (!(flags & LL2_PURGE_DRY_RUN) &&
+      (retval = ll2_ctx_compact_journal (context, error)) < 0)
+    return retval;
+  retval = 0;
+
+  if (sqlite3_prepare_v2 (context->db, sql, -1, &res, 0) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      return -1;
+    }
+
+  sqlite3_bind_int64 (res, 1, before);
+  sqlite3_bind_int (res, 2, PURGE_CHUNK_SIZE);
+
+  for (;;)
+    {
+      step = step_stmt (res);
+
+      if (step == SQLITE_ROW)
+	{
+	  *count = sqlite3_column_int64 (res, 0);
+	  break;
+	}
+      if (step != SQLITE_DONE)
+	break;
+
+      *count += sqlite3_changes (context->db);
+      if (sqlite3_changes (context->db) < PURGE_CHUNK_SIZE)
+	break;
+      sqlite3_reset (res);
+    }
+
+  if (step != SQLITE_ROW && step != SQLITE_DONE)
     {
       if (error)
-	if (asprintf (error, "Cannot create/open database (%s): %s",
-		      path, sqlite3_errmsg (db)) < 0)
+	if (asprintf (error, "Purge statement failed: %s",
+		      sqlite3_errmsg (context->db)) < 0)
 	  *error = strdup ("Out of memory");
 
-      sqlite3_close (db);
-      return NULL;
+      retval = step == SQLITE_BUSY ? -EBUSY : -1;
     }
+  sqlite3_finalize (res);
 
-  return db;
+  if (retval == 0 && *count > 0 && !(flags & LL2_PURGE_DRY_RUN))
+    retval = prune_strings (context, error);
+
+  /* The cache got stale with the first removed entry. */
+  if (*count > 0 && !(flags & LL2_PURGE_DRY_RUN) &&
+      cache_refresh (context, retval == 0 ? error : NULL) != 0 &&
+      retval == 0)
+    retval = -1;
+
+  return retval;
 }
 
-/* Check if database file exists.
-   Returns 0 on success, -1 on failure. */
-int ll2_check_database (const char *lastlog2_path)
+int
+ll2_ctx_purge_before (struct ll2_context *context, int64_t before,
+		      int flags, size_t *count, char **error)
 {
-    struct stat st;
-    return stat(lastlog2_path, &st);
+  STATS_BEGIN ();
+  int retval = ctx_purge_before (context, before, flags, count, error);
+
+  STATS_END (STAT_PURGE, retval);
+  return retval;
 }
 
-/* Reads one entry from database and returns that.
-   Returns 0 on success, -1 on failure. */
+/* Looks up name with the name services, one user at a time, as
+   services like SSSD or LDAP don't list all their users.
+   Returns 1 if name is a user of the system, 0 if not, -1 if the
+   lookup failed. */
 static int
-read_entry (sqlite3 *db, const char *user,
-	    int64_t *ll_time, char **tty, char **rhost,
-	    char **pam_service, char **error)
+user_exists (const char *name, char **buf, size_t *buflen, char **error)
 {
-  int retval = 0;
-  sqlite3_stmt *res;
-  char *sql = "SELECT * FROM Lastlog2 WHERE Name = ?";
+  struct passwd pwd, *pw = NULL;
+  int ret;
 
-  if (sqlite3_prepare_v2 (db, sql, -1, &res, 0) != SQLITE_OK)
+  while ((ret = getpwnam_r (name, &pwd, *buf, *buflen, &pw)) == ERANGE)
     {
-      if (error)
-	if (asprintf (error, "Failed to execute statement: %s",
-		      sqlite3_errmsg (db)) < 0)
-	  *error = strdup ("Out of memory");
+      char *tmp = realloc (*buf, *buflen * 2);
 
-      return -1;
+      if (tmp == NULL)
+	{
+	  ret = ENOMEM;
+	  break;
+	}
+      *buf = tmp;
+      *buflen *= 2;
     }
 
-  if (sqlite3_bind_text (res, 1, user, -1, SQLITE_STATIC) != SQLITE_OK)
-    {
-      if (error)
-	if (asprintf (error, "Failed to create search query: %s",
-		      sqlite3_errmsg (db)) < 0)
-	  *error = strdup("Out of memory");
+  if (ret == 0)
+    return pw != NULL;
 
-      sqlite3_finalize(res);
-      return -1;
+  /* Also if the name service is not available: removing the entry of
+     a user, who still exists, would be worse than keeping it. */
+  if (error)
+    {
+      if (ret == ENOMEM)
+	*error = strdup ("Out of memory");
+      else if (asprintf (error, "Cannot look up user '%s': %s", name,
+			 strerror (ret)) < 0)
+	*error = strdup ("Out of memory");
     }
 
-  int step = sqlite3_step (res);
+  return -1;
+}
 
-  if (step == SQLITE_ROW)
-    {
-      const unsigned char *luser = sqlite3_column_text (res, 0);
-      const unsigned char *uc;
+/* Reads the next PURGE_CHUNK_SIZE names after *last, which is
+   replaced by the last name read, or NULL after the last chunk, and
+   stores the ones of users, which don't exist anymore, in orphans.
+   The users are looked up after the statement got reset, so that no
+   read transaction is open during slow lookups.
+   Returns the number of orphans, or -1 on failure. */
+static int
+find_orphans (struct ll2_context *context, sqlite3_stmt *res, char **buf,
+	      size_t *buflen, char **last, char **orphans, char **error)
+{
+  int found = 0;
+  int rows = 0;
+  int kept = 0;
+  int ret = 0;
+  int step;
 
-      if (strcmp ((const char *)luser, user) != 0)
-	{
-	  if (error)
-	    if (asprintf (error, "Returned data is for %s, not %s", luser, user) < 0)
-	      *error = strdup("Out of memory");
+  sqlite3_bind_text (res, 1, *last, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int (res, 2, PURGE_CHUNK_SIZE);
+  free (*last);
+  *last = NULL;
 
-	  sqlite3_finalize (res);
-	  return -1;
-	}
+  while ((step = step_stmt (res)) == SQLITE_ROW)
+    {
+      const char *name = (const char *)sqlite3_column_text (res, 0);
 
-      if (ll_time)
-	*ll_time = sqlite3_column_int64 (res, 1);
+      rows++;
+      if (name == NULL)
+	continue;
 
-      if (tty)
+      if ((orphans[found++] = strdup (name)) == NULL)
 	{
-	  uc = sqlite3_column_text (res, 2);
-	  if (uc != NULL && strlen ((const char *)uc) > 0)
-	    *tty = strdup ((const char *)uc);
+	  found--;
+	  step = SQLITE_NOMEM;
+	  break;
 	}
-      if (rhost)
+
+      if (rows == PURGE_CHUNK_SIZE)
 	{
-	  uc = sqlite3_column_text (res, 3);
-	  if (uc != NULL && strlen ((const char *)uc) > 0)
-	    *rhost = strdup ((const char *)uc);
+	  free (*last);
+	  if ((*last = strdup (name)) == NULL)
+	    {
+	      step = SQLITE_NOMEM;
+	      break;
+	    }
 	}
-      if (pam_service)
+    }
+  sqlite3_reset (res);
+
+  if (step != SQLITE_DONE)
+    {
+      if (error)
 	{
-	  uc = sqlite3_column_text (res, 4);
-	  if (uc != NULL && strlen ((const char *)uc) > 0)
-	    *pam_service = strdup ((const char *)uc);
+	  if (step == SQLITE_NOMEM)
+	    *error = strdup ("Out of memory");
+	  else if (asprintf (error, "Error stepping through database: %s",
+			     sqlite3_errmsg (context->db)) < 0)
+	    *error = strdup ("Out of memory");
 	}
+      while (found > 0)
+	free (orphans[--found]);
+
+      return step == SQLITE_BUSY ? -EBUSY : -1;
     }
-  else if (step == SQLITE_DONE)
+
+  /* Keeps the orphans, after a failed lookup none. */
+  for (int i = 0; i < found; i++)
     {
-      retval = -ENOENT;
+      if (ret >= 0)
+	ret = user_exists (orphans[i], buf, buflen, error);
+      if (ret == 0)
+	orphans[kept++] = orphans[i];
+      else
+	free (orphans[i]);
     }
-  else if (step == SQLITE_BUSY)
+
+  if (ret < 0)
     {
-      if (error)
-	  *error = strdup ("Database busy");
+      while (kept > 0)
+	free (orphans[--kept]);
+      return -1;
+    }
 
-      retval = -1;
+  return kept;
+}
+
+/* Removes the entries of all users, which getpwnam does not find
+   anymore, in transactions of at most PURGE_CHUNK_SIZE entries. */
+static int
+ctx_purge_orphans (struct ll2_context *context, int flags, size_t *count,
+		   char **error)
+{
+  const char *sql = "SELECT Name FROM Lastlog2 WHERE Name >= coalesce(?1, '') AND (?1 IS NULL OR Name > ?1) ORDER BY Name LIMIT ?2";
+  long bufsize = sysconf (_SC_GETPW_R_SIZE_MAX);
+  size_t buflen = bufsize > 0 ? (size_t)bufsize : 16384;
+  char *orphans[PURGE_CHUNK_SIZE];
+  sqlite3_stmt *res = NULL;
+  char *last = NULL;
+  char *buf;
+  int retval = 0;
+  int found;
+
+  *count = 0;
+
+  if (!(flags & LL2_PURGE_DRY_RUN) &&
+      (retval = ll2_ctx_compact_journal (context, error)) < 0)
+    return retval;
+  retval = 0;
+
+  if ((buf = malloc (buflen)) == NULL)
+    {
+      if (error)
+	*error = strdup ("Out of memory");
+      return -1;
     }
-  else if (step == SQLITE_ERROR)
+
+  if (sqlite3_prepare_v2 (context->db, sql, -1, &res, 0) != SQLITE_OK)
     {
       if (error)
-	if (asprintf (error, "Error stepping through database: %s", sqlite3_errmsg (db)) < 0)
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
 	  *error = strdup ("Out of memory");
 
-      retval = -1;
+      free (buf);
+      return -1;
+    }
+
+  do
+    {
+      if ((found = find_orphans (context, res, &buf, &buflen, &last,
+				 orphans, error)) < 0)
+	{
+	  retval = found;
+	  break;
+	}
+
+      if (flags & LL2_PURGE_DRY_RUN)
+	*count += found;
+      else if (found > 0)
+	{
+	  if (exec_sql (context->db, "BEGIN IMMEDIATE", error) != 0)
+	    retval = sqlite3_errcode (context->db) == SQLITE_BUSY ?
+	      -EBUSY : -1;
+
+	  for (int i = 0; i < found && retval == 0; i++)
+	    retval = remove_entry (context, orphans[i], error);
+
+	  if (retval == 0 && exec_sql (context->db, "COMMIT", error) != 0)
+	    retval = sqlite3_errcode (context->db) == SQLITE_BUSY ?
+	      -EBUSY : -1;
+	  if (retval != 0)
+	    exec_sql (context->db, "ROLLBACK", NULL);
+	  else
+	    *count += found;
+	}
+
+      for (int i = 0; i < found; i++)
+	free (orphans[i]);
     }
+  while (retval == 0 && last != NULL);
 
   sqlite3_finalize (res);
+  free (last);
+  free (buf);
+
+  if (retval == 0 && *count > 0 && !(flags & LL2_PURGE_DRY_RUN))
+    retval = prune_strings (context, error);
+
+  if (*count > 0 && !(flags & LL2_PURGE_DRY_RUN) &&
+      cache_refresh (context, retval == 0 ? error : NULL) != 0 &&
+      retval == 0)
+    retval = -1;
 
   return retval;
 }
 
-/* reads 1 entry from database and returns that. Returns 0 on success, -1 on failure. */
 int
-ll2_read_entry (const char *lastlog2_path, const char *user,
-		int64_t *ll_time, char **tty, char **rhost,
-		char **pam_service, char **error)
+ll2_ctx_purge_orphans (struct ll2_context *context, int flags,
+		       size_t *count, char **error)
 {
-  sqlite3 *db;
+  STATS_BEGIN ();
+  int retval = ctx_purge_orphans (context, flags, count, error);
+
+  STATS_END (STAT_PURGE, retval);
+  return retval;
+}
+
+/* Renames an user entry. An existing entry for newname gets replaced.
+   Returns 0 on success, -ENOENT if user has no entry, -EBUSY if the
+   database or the spool is locked, -1 on failure. */
+static int
+ctx_rename_user (struct ll2_context *context, const char *user,
+		 const char *newname, char **error)
+{
+  struct cache_map map;
+  sqlite3_stmt *res;
+  char *sql = "UPDATE OR REPLACE Lastlog2 SET Name = ? WHERE Name = ?";
+  int retval;
+
+  /* Spooled records of user are renamed, too. */
+  if ((retval = compact_journal_of (context, user, newname, error)) != 0)
+    return retval;
+
+  if ((res = get_stmt (context, &context->stmt_rename, sql, error)) == NULL)
+    return -1;
+
+  if (sqlite3_bind_text (res, 1, newname, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+      if (error)
+	if (asprintf (error, "Failed to create rename statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
+
+      put_stmt (res);
+      return -1;
+    }
+
+  cache_begin (context, &map);
+  retval = update_entry (context, res, user, error);
+  if (retval == 0)
+    cache_rename (&map, user, newname);
+  cache_end (context, &map);
+
+  return retval;
+}
+
+int
+ll2_ctx_rename_user (struct ll2_context *context, const char *user,
+		     const char *newname, char **error)
+{
+  STATS_BEGIN ();
+  int retval = ctx_rename_user (context, user, newname, error);
+
+  STATS_END (STAT_RENAME_USER, retval);
+  return retval;
+}
+
+/* Renames an user entry. Returns 0 on success, -ENOENT if user has
+   no entry, -EBUSY if the database or the spool is locked, -1 on
+   failure. */
+int
+ll2_rename_user (const char *lastlog2_path, const char *user,
+		 const char *newname, char **error)
+{
+  struct ll2_context *context;
   int retval;
 
-  if ((db = open_database_ro (lastlog2_path, error)) == NULL)
+  if ((context = ll2_open_context (lastlog2_path, 0, error)) == NULL)
     return -1;
 
-  retval = read_entry (db, user, ll_time, tty, rhost, pam_service, error);
+  retval = ll2_ctx_rename_user (context, user, newname, error);
 
-  sqlite3_close (db);
+  ll2_close_context (context);
 
   return retval;
 }
 
-/* Write a new entry. Returns 0 on success, -1 on failure. */
+/* Number of passwd entries or used lastlog records handled per
+   transaction during import. */
+#define IMPORT_CHUNK_SIZE 1000
+/* Number of lastlog records read at once. */
+#define IMPORT_READ_RECORDS 256
+/* Maximum number of threads looking up UIDs during import. */
+#define IMPORT_RESOLVE_THREADS 8
+
+/* Values of ImportState.Mode. */
+#define IMPORT_MODE_PASSWD 0
+#define IMPORT_MODE_SPARSE 1
+
+/* Write an imported entry, but don't overwrite newer data, so that an
+   import can be repeated or resumed at any time.
+   Returns 0 on success, -1 on failure. */
 static int
-write_entry (sqlite3 *db, const char *user,
-	     int64_t ll_time, const char *tty, const char *rhost,
-	     const char *pam_service, char **error)
+import_entry (struct ll2_context *context, const char *user,
+	      int64_t ll_time, const char *tty, const char *rhost,
+	      uid_t uid, char **error)
 {
-  char *err_msg = NULL;
   sqlite3_stmt *res;
-  char *sql_table = "CREATE TABLE IF NOT EXISTS Lastlog2(Name TEXT PRIMARY KEY, Time INTEGER, TTY TEXT, RemoteHost TEXT, Service TEXT) STRICT;";
-  char *sql_replace = "REPLACE INTO Lastlog2 VALUES(?,?,?,?,?);";
+  char *sql = "INSERT INTO Lastlog2(Name, Time, TTYId, RemoteHostId, ServiceId, UID) "
+    "VALUES(?1, ?2, " STRING_ID ("?3") ", " STRING_ID ("?4") ", NULL, ?5) "
+    "ON CONFLICT(Name) DO UPDATE SET Time = excluded.Time, TTYId = excluded.TTYId, "
+    "RemoteHostId = excluded.RemoteHostId, ServiceId = NULL, UID = excluded.UID "
+    "WHERE excluded.Time > Lastlog2.Time";
+
+  if (intern_strings (context, tty, rhost, NULL, error) != 0)
+    return -1;
+
+  if ((res = get_stmt (context, &context->stmt_import, sql, error)) == NULL)
+    return -1;
 
-  if (sqlite3_exec (db, sql_table, 0, 0, &err_msg) != SQLITE_OK)
+  if (sqlite3_bind_text (res, 1, user, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_int64 (res, 2, ll_time) != SQLITE_OK ||
+      sqlite3_bind_text (res, 3, tty, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text (res, 4, rhost, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_int64 (res, 5, uid) != SQLITE_OK)
     {
       if (error)
-	if (asprintf (error, "SQL error: %s", err_msg) < 0)
+	if (asprintf (error, "Failed to create import statement: %s",
+		      sqlite3_errmsg (context->db)) < 0)
 	  *error = strdup ("Out of memory");
-      sqlite3_free (err_msg);
 
+      put_stmt (res);
       return -1;
     }
 
-  if (sqlite3_prepare_v2 (db, sql_replace, -1, &res, 0) != SQLITE_OK)
+  if (step_stmt (res) != SQLITE_DONE)
     {
       if (error)
-        if (asprintf (error, "Failed to execute statement: %s",
-                      sqlite3_errmsg (db)) < 0)
-          *error = strdup ("Out of memory");
+	if (asprintf (error, "Import statement failed: %s",
+		      sqlite3_errmsg (context->db)) < 0)
+	  *error = strdup ("Out of memory");
 
+      put_stmt (res);
       return -1;
     }
 
-  if (sqlite3_bind_text (res, 1, user, -1, SQLITE_STATIC) != SQLITE_OK)
+  put_stmt (res);
+
+  return 0;
+}
+
+/* Runs a statement with the name of the imported file as first,
+   the import mode as second and the position as third parameter,
+   as far as the statement has them.
+   Returns 0 on success, -1 on failure. */
+static int
+exec_import_state (sqlite3 *db, const char *sql, const char *file,
+		   int mode, int64_t position, int64_t *result, char **error)
+{
+  sqlite3_stmt *res;
+  int step;
+
+  if (sqlite3_prepare_v2 (db, sql, -1, &res, 0) != SQLITE_OK)
     {
       if (error)
-        if (asprintf (error, "Failed to create replace statement for user: %s",
-                      sqlite3_errmsg (db)) < 0)
-          *error = strdup("Out of memory");
+	if (asprintf (error, "Failed to execute statement: %s",
+		      sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
 
-      sqlite3_finalize(res);
       return -1;
     }
 
-  if (sqlite3_bind_int64 (res, 2, ll_time) != SQLITE_OK)
+  sqlite3_bind_text (res, 1, file, -1, SQLITE_STATIC);
+  if (sqlite3_bind_parameter_count (res) > 1)
+    sqlite3_bind_int (res, 2, mode);
+  if (sqlite3_bind_parameter_count (res) > 2)
+    sqlite3_bind_int64 (res, 3, position);
+
+  step = step_stmt (res);
+  if (step == SQLITE_ROW && result)
+    *result = sqlite3_column_int64 (res, 0);
+  sqlite3_finalize (res);
+
+  if (step != SQLITE_ROW && step != SQLITE_DONE)
     {
       if (error)
-        if (asprintf (error, "Failed to create replace statement for ll_time: %s",
-                      sqlite3_errmsg (db)) < 0)
-          *error = strdup("Out of memory");
+	if (asprintf (error, "Failed to update import state: %s",
+		      sqlite3_errmsg (db)) < 0)
+	  *error = strdup ("Out of memory");
 
-      sqlite3_finalize(res);
       return -1;
     }
 
-  if (sqlite3_bind_text (res, 3, tty, -1, SQLITE_STATIC) != SQLITE_OK)
+  return 0;
+}
+
+struct import_state {
+  struct ll2_context *context;
+  const char *file;
+  int fd;
+  off_t size;
+  int mode;
+  int (*progress)(uint64_t scanned, uint64_t imported, void *userdata);
+  void *userdata;
+  uint64_t scanned;
+  uint64_t imported;
+};
+
+/* Stores position as import state and commits the open transaction.
+   Returns 0 on success, -1 on failure or if progress asked to stop
+   the import. In both cases the transaction is closed afterwards. */
+static int
+import_commit (struct import_state *state, int64_t position, char **error)
+{
+  sqlite3 *db = state->context->db;
+
+  if (exec_import_state (db, "REPLACE INTO ImportState VALUES(?, ?, ?)",
+			 state->file, state->mode, position, NULL, error) != 0 ||
+      exec_sql (db, "COMMIT", error) != 0)
+    {
+      exec_sql (db, "ROLLBACK", NULL);
+      return -1;
+    }
+
+  if (state->progress &&
+      state->progress (state->scanned, state->imported, state->userdata) != 0)
     {
       if (error)
-        if (asprintf (error, "Failed to create replace statement for tty: %s",
-                      sqlite3_errmsg (db)) < 0)
-          *error = strdup("Out of memory");
+	*error = strdup ("Import interrupted");
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+copy_lastlog (const struct lastlog *ll, char tty[UT_LINESIZE+1],
+	      char rhost[UT_HOSTSIZE+1])
+{
+  strncpy (tty, ll->ll_line, UT_LINESIZE);
+  tty[UT_LINESIZE] = '\0';
+  strncpy (rhost, ll->ll_host, UT_HOSTSIZE);
+  rhost[UT_HOSTSIZE] = '\0';
+}
+
+/* Looks up every passwd entry in the lastlog file. position is the
+   number of passwd entries already done.
+   Returns 0 on success, -1 on failure. */
+static int
+import_passwd (struct import_state *state, int64_t position, char **error)
+{
+  sqlite3 *db = state->context->db;
+  const struct passwd *pw;
+  int retval = -1;
+
+  if (exec_sql (db, "BEGIN IMMEDIATE", error) != 0)
+    return -1;
+
+  setpwent ();
+  while ((pw = getpwent ()) != NULL )
+    {
+      off_t offset;
+      struct lastlog ll;
+
+      /* Already done by an earlier, interrupted run. */
+      if ((int64_t)++state->scanned <= position)
+	continue;
+
+      offset = (off_t) pw->pw_uid * sizeof (ll);
+
+      if ((offset + (off_t)sizeof (ll)) <= state->size)
+	{
+	  if (pread (state->fd, &ll, sizeof (ll), offset) != sizeof (ll))
+	    {
+	      if (error)
+		if (asprintf (error, "Failed to get the entry for UID '%lu'",
+			      (unsigned long int)pw->pw_uid) < 0)
+		  *error = strdup ("Out of memory");
+
+	      goto rollback;
+	    }
+
+	  if (ll.ll_time != 0)
+	    {
+	      char tty[UT_LINESIZE+1];
+	      char rhost[UT_HOSTSIZE+1];
+
+	      copy_lastlog (&ll, tty, rhost);
+
+	      if (import_entry (state->context, pw->pw_name, ll.ll_time, tty,
+				rhost, pw->pw_uid, error) != 0)
+		goto rollback;
+
+	      state->imported++;
+	    }
+	}
+
+      if (state->scanned % IMPORT_CHUNK_SIZE == 0)
+	{
+	  if (import_commit (state, state->scanned, error) != 0 ||
+	      exec_sql (db, "BEGIN IMMEDIATE", error) != 0)
+	    goto out;
+	}
+    }
+
+  if (exec_sql (db, "COMMIT", error) != 0)
+    goto rollback;
+
+  retval = 0;
+  goto out;
+
+ rollback:
+  exec_sql (db, "ROLLBACK", NULL);
+ out:
+  endpwent ();
 
-      sqlite3_finalize(res);
-      return -1;
-    }
+  return retval;
+}
 
-  if (sqlite3_bind_text (res, 4, rhost, -1, SQLITE_STATIC) != SQLITE_OK)
-    {
-      if (error)
-        if (asprintf (error, "Failed to create replace statement for rhost: %s",
-                      sqlite3_errmsg (db)) < 0)
-          *error = strdup("Out of memory");
+struct import_record {
+  uid_t uid;
+  int64_t ll_time;
+  char tty[UT_LINESIZE+1];
+  char rhost[UT_HOSTSIZE+1];
+  char *user; /* NULL if the UID has no passwd entry */
+};
 
-      sqlite3_finalize(res);
-      return -1;
-    }
+struct resolve_job {
+  struct import_record *records;
+  size_t count;
+  atomic_size_t next;
+  atomic_int failed;
+};
 
-  if (sqlite3_bind_text (res, 5, pam_service, -1, SQLITE_STATIC) != SQLITE_OK)
-    {
-      if (error)
-        if (asprintf (error, "Failed to create replace statement for PAM service: %s",
-                      sqlite3_errmsg (db)) < 0)
-          *error = strdup("Out of memory");
+static void *
+resolve_worker (void *arg)
+{
+  struct resolve_job *job = arg;
+  long bufsize = sysconf (_SC_GETPW_R_SIZE_MAX);
+  size_t buflen = bufsize > 0 ? (size_t)bufsize : 16384;
+  char *buf;
+  size_t i;
 
-      sqlite3_finalize(res);
-      return -1;
+  if ((buf = malloc (buflen)) == NULL)
+    {
+      atomic_store (&job->failed, 1);
+      return NULL;
     }
 
-  int step = sqlite3_step (res);
-
-  if (step != SQLITE_DONE)
+  while ((i = atomic_fetch_add (&job->next, 1)) < job->count)
     {
-      if (step == SQLITE_ERROR)
-	{
-	  if (error)
-	    if (asprintf (error, "Delete statement failed: %s",
-			  sqlite3_errmsg (db)) < 0)
-	      *error = strdup("Out of memory");
-	}
-      else
+      struct import_record *rec = &job->records[i];
+      struct passwd pwbuf;
+      struct passwd *pw = NULL;
+      int ret;
+
+      while ((ret = getpwuid_r (rec->uid, &pwbuf, buf, buflen,
+				&pw)) == ERANGE)
 	{
-	  if (error)
-	    if (asprintf (error, "Delete statement did not return SQLITE_DONE: %d",
-			  step) < 0)
-	      *error = strdup("Out of memory");
+	  char *tmp = realloc (buf, buflen * 2);
+
+	  if (tmp == NULL)
+	    break;
+	  buf = tmp;
+	  buflen *= 2;
 	}
 
-      sqlite3_finalize(res);
-      return -1;
+      if (ret == ERANGE ||
+	  (ret == 0 && pw != NULL &&
+	   (rec->user = strdup (pw->pw_name)) == NULL))
+	atomic_store (&job->failed, 1);
     }
 
-  sqlite3_finalize(res);
+  free (buf);
 
-  return 0;
+  return NULL;
 }
 
-/* Write a new entry. Returns 0 on success, -1 on failure. */
-int
-ll2_write_entry (const char *lastlog2_path, const char *user,
-		 int64_t ll_time, const char *tty, const char *rhost,
-		 const char *pam_service, char **error)
+/* Looks up the user names of all records. With network based name
+   services every lookup is a round trip, so they are done by several
+   threads in parallel.
+   Returns 0 on success, -1 if out of memory. */
+static int
+resolve_uids (struct import_record *records, size_t count)
 {
-  sqlite3 *db;
-  int retval;
+  pthread_t threads[IMPORT_RESOLVE_THREADS - 1];
+  struct resolve_job job;
+  size_t nthreads = 0;
+  size_t i;
 
-  if ((db = open_database_rw (lastlog2_path, error)) == NULL)
-    return -1;
+  job.records = records;
+  job.count = count;
+  atomic_init (&job.next, 0);
+  atomic_init (&job.failed, 0);
 
-  retval = write_entry (db, user, ll_time, tty, rhost, pam_service, error);
+  /* The calling thread works, too, so it doesn't matter if no
+     thread can be created. */
+  while (nthreads < IMPORT_RESOLVE_THREADS - 1 && nthreads + 1 < count &&
+	 pthread_create (&threads[nthreads], NULL, resolve_worker, &job) == 0)
+    nthreads++;
 
-  sqlite3_close (db);
+  resolve_worker (&job);
 
-  return retval;
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads[i], NULL);
+
+  return atomic_load (&job.failed) ? -1 : 0;
 }
 
-/* Write a new entry with updated login time.
+/* Writes the records in one transaction, together with the offset
+   where the import has to continue.
    Returns 0 on success, -1 on failure. */
-int
-ll2_update_login_time (const char *lastlog2_path, const char *user,
-		       int64_t ll_time, char **error)
+static int
+import_records (struct import_state *state, struct import_record *records,
+		size_t count, off_t position, char **error)
 {
-  sqlite3 *db;
-  int retval;
-  char *tty;
-  char *rhost;
-  char *pam_service;
-
-  if ((db = open_database_rw (lastlog2_path, error)) == NULL)
-    return -1;
+  sqlite3 *db = state->context->db;
+  int retval = -1;
+  size_t i;
 
-  if (read_entry (db, user, 0, &tty, &rhost, &pam_service, error) != 0)
+  if (resolve_uids (records, count) != 0)
     {
-      sqlite3_close (db);
-      return -1;
+      if (error)
+	*error = strdup ("Out of memory");
+      goto out;
     }
 
-  retval = write_entry (db, user, ll_time, tty, rhost, pam_service, error);
+  if (exec_sql (db, "BEGIN IMMEDIATE", error) != 0)
+    goto out;
+
+  for (i = 0; i < count; i++)
+    {
+      if (records[i].user == NULL)
+	continue;
 
-  sqlite3_close (db);
+      if (import_entry (state->context, records[i].user, records[i].ll_time,
+			records[i].tty, records[i].rhost, records[i].uid,
+			error) != 0)
+	{
+	  exec_sql (db, "ROLLBACK", NULL);
+	  goto out;
+	}
 
-  if (tty)
-    free (tty);
-  if (rhost)
-    free (rhost);
-  if (pam_service)
-    free (pam_service);
+      state->imported++;
+    }
 
-  return retval;
-}
+  retval = import_commit (state, position, error);
 
+ out:
+  for (i = 0; i < count; i++)
+    {
+      free (records[i].user);
+      records[i].user = NULL;
+    }
 
-typedef int (*callback_f)(const char *user, int64_t ll_time,
-			  const char *tty, const char *rhost,
-			  const char *pam_service);
+  return retval;
+}
 
+/* Reads only the parts of the lastlog file which contain data. The
+   file is indexed by UID and therefore mostly a hole, most records
+   in the data parts are empty, too. position is the file offset
+   where the import continues.
+   Returns 0 on success, -1 on failure. */
 static int
-callback (void *cb_func, int argc, char **argv, char **azColName)
+import_sparse (struct import_state *state, int64_t position, char **error)
 {
-  char *endptr;
-  callback_f print_entry = cb_func;
+  const off_t recsize = sizeof (struct lastlog);
+  /* Trailing partial records are ignored. */
+  const off_t end = state->size - state->size % recsize;
+  struct import_record *records;
+  struct lastlog *buf;
+  size_t count = 0;
+  off_t offset;
+  int retval = -1;
 
-  if (argc != 5)
+  records = calloc (IMPORT_CHUNK_SIZE, sizeof (*records));
+  buf = malloc (IMPORT_READ_RECORDS * sizeof (*buf));
+  if (records == NULL || buf == NULL)
     {
-      fprintf (stderr, "Mangled entry:");
-      for (int i = 0; i < argc; i++)
-	fprintf (stderr, " %s=%s", azColName[i], argv[i] ? argv[i] : "NULL");
-      fprintf (stderr, "\n");
-      return 0;
+      if (error)
+	*error = strdup ("Out of memory");
+      goto out;
     }
 
-  errno = 0;
-  int64_t ll_time = strtoll(argv[1], &endptr, 10);
-  if ((errno == ERANGE && (ll_time == INT64_MAX || ll_time == INT64_MIN))
-      || (endptr == argv[1]) || (*endptr != '\0'))
-    fprintf (stderr, "Invalid numeric time entry for '%s': '%s'\n", argv[0], argv[1]);
+  offset = position - position % recsize;
+  while (offset < end)
+    {
+      off_t data, hole;
 
-  print_entry (argv[0], ll_time, argv[2], argv[3], argv[4]);
+      data = lseek (state->fd, offset, SEEK_DATA);
+      if (data < 0 && errno == ENXIO)
+	break; /* Only a hole left. */
+      else if (data < 0)
+	{
+	  /* No support for holes, read everything. */
+	  data = offset;
+	  hole = end;
+	}
+      else if ((hole = lseek (state->fd, data, SEEK_HOLE)) < 0)
+	hole = end;
 
-  return 0;
-}
+      /* Extents are block aligned, records are not. */
+      offset = data - data % recsize;
+      hole = hole % recsize ? hole + recsize - hole % recsize : hole;
+      if (hole > end)
+	hole = end;
 
-/* Reads all entries from database and calls the callback function for each entry.
-   Returns 0 on success, -1 on failure. */
-int
-ll2_read_all  (const char *lastlog2_path,
-	       int (*cb_func)(const char *user, int64_t ll_time,
-			      const char *tty, const char *rhost,
-			      const char *pam_service),
-	       char **error)
-{
-  sqlite3 *db;
-  char *err_msg = 0;
+      while (offset < hole)
+	{
+	  size_t len = IMPORT_READ_RECORDS * sizeof (*buf);
+	  size_t nrecs, i;
+	  ssize_t n;
 
-  if ((db = open_database_ro (lastlog2_path, error)) == NULL)
-    return -1;
+	  if ((off_t)len > hole - offset)
+	    len = hole - offset;
 
-  char *sql = "SELECT * FROM Lastlog2 ORDER BY Name ASC";
+	  n = pread (state->fd, buf, len, offset);
+	  if (n < 0 && errno == EINTR)
+	    continue;
+	  if (n < 0)
+	    {
+	      if (error)
+		if (asprintf (error, "Failed to read '%s': %s",
+			      state->file, strerror (errno)) < 0)
+		  *error = strdup ("Out of memory");
+	      goto out;
+	    }
+	  /* File got truncated. */
+	  if ((nrecs = n / recsize) == 0)
+	    goto done;
 
-  if (sqlite3_exec (db, sql, callback, cb_func, &err_msg) != SQLITE_OK)
-    {
-      if (error)
-	if (asprintf (error, "SQL error: %s", err_msg) < 0)
-	  *error = strdup ("Out of memory");
+	  for (i = 0; i < nrecs; i++)
+	    {
+	      uid_t uid = offset / recsize;
 
-      sqlite3_free (err_msg);
-      sqlite3_close (db);
-      return -1;
+	      state->scanned++;
+	      offset += recsize;
+
+	      if (buf[i].ll_time == 0)
+		continue;
+
+	      records[count].uid = uid;
+	      records[count].ll_time = buf[i].ll_time;
+	      copy_lastlog (&buf[i], records[count].tty, records[count].rhost);
+
+	      if (++count == IMPORT_CHUNK_SIZE)
+		{
+		  if (import_records (state, records, count, offset,
+				      error) != 0)
+		    goto out;
+		  count = 0;
+		}
+	    }
+	}
     }
 
-  sqlite3_close (db);
+ done:
+  if (count > 0 &&
+      import_records (state, records, count, offset, error) != 0)
+    goto out;
 
-  return 0;
+  retval = 0;
+
+ out:
+  free (records);
+  free (buf);
+
+  return retval;
 }
 
-/* Remove an user entry. Returns 0 on success, -1 on failure. */
+/* Import old lastlog file. The data is written in transactions of
+   IMPORT_CHUNK_SIZE entries, which also record how far the import
+   got, so that an interrupted import continues at this point the
+   next time. By default every passwd entry is looked up in the file,
+   with LL2_IMPORT_SPARSE only the used parts of the file are read
+   and the UIDs found there are looked up instead.
+   progress, if not NULL, gets called after every transaction, a
+   return value other than 0 stops the import.
+   Returns 0 on success, -1 on failure. */
 static int
-remove_entry (sqlite3 *db, const char *user, char **error)
+ctx_import_lastlog (struct ll2_context *context, const char *lastlog_file,
+		    int flags,
+		    int (*progress)(uint64_t scanned, uint64_t imported,
+				    void *userdata),
+		    void *userdata, char **error)
 {
-  sqlite3_stmt *res;
-  char *sql = "DELETE FROM Lastlog2 WHERE Name = ?";
+  struct import_state state;
+  struct stat statll;
+  char *file;
+  int64_t position = 0;
+  int retval = -1;
+  int fd;
 
-  if (sqlite3_prepare_v2 (db, sql, -1, &res, 0) != SQLITE_OK)
+  fd = open (lastlog_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
     {
       if (error)
-        if (asprintf (error, "Failed to execute statement: %s",
-                      sqlite3_errmsg (db)) < 0)
-          *error = strdup ("Out of memory");
+	if (asprintf (error, "Failed to open '%s': %s",
+		      lastlog_file, strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
 
       return -1;
     }
 
-  if (sqlite3_bind_text (res, 1, user, -1, SQLITE_STATIC) != SQLITE_OK)
+  if (fstat (fd, &statll) != 0)
     {
       if (error)
-        if (asprintf (error, "Failed to create delete statement: %s",
-                      sqlite3_errmsg (db)) < 0)
-          *error = strdup("Out of memory");
-
-      sqlite3_finalize(res);
+	if (asprintf (error, "Cannot get size of '%s': %s",
+		      lastlog_file, strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
+      close (fd);
       return -1;
     }
 
-  int step = sqlite3_step (res);
-
-  if (step != SQLITE_DONE)
+  /* The import state is stored for the canonical file name. */
+  if ((file = realpath (lastlog_file, NULL)) == NULL &&
+      (file = strdup (lastlog_file)) == NULL)
     {
-      if (step == SQLITE_ERROR)
-	{
-	  if (error)
-	    if (asprintf (error, "Delete statement failed: %s",
-			  sqlite3_errmsg (db)) < 0)
-	      *error = strdup("Out of memory");
-	}
-      else
-	{
-	  if (error)
-	    if (asprintf (error, "Delete statement did not return SQLITE_DONE: %d",
-			  step) < 0)
-	      *error = strdup("Out of memory");
-	}
-      sqlite3_finalize(res);
+      if (error)
+	*error = strdup ("Out of memory");
+      close (fd);
       return -1;
     }
 
-  sqlite3_finalize(res);
+  memset (&state, 0, sizeof (state));
+  state.context = context;
+  state.file = file;
+  state.fd = fd;
+  state.size = statll.st_size;
+  state.mode = (flags & LL2_IMPORT_SPARSE) ?
+    IMPORT_MODE_SPARSE : IMPORT_MODE_PASSWD;
+  state.progress = progress;
+  state.userdata = userdata;
 
-  return 0;
-}
+  /* A position stored by the other mode is meaningless. */
+  if (exec_import_state (context->db, "SELECT Position FROM ImportState WHERE File = ? AND Mode = ?",
+			 file, state.mode, 0, &position, error) != 0)
+    goto out;
 
-/* Remove an user entry. Returns 0 on success, -1 on failure. */
-int
-ll2_remove_entry (const char *lastlog2_path, const char *user,
-		 char **error)
-{
-  sqlite3 *db;
-  int retval;
+  if (state.mode == IMPORT_MODE_PASSWD)
+    retval = import_passwd (&state, position, error);
+  else
+    retval = import_sparse (&state, position, error);
 
-  if ((db = open_database_rw (lastlog2_path, error)) == NULL)
-    return -1;
+  if (retval != 0)
+    goto out;
+
+  if (exec_import_state (context->db, "DELETE FROM ImportState WHERE File = ?",
+			 file, 0, 0, NULL, error) != 0)
+    {
+      retval = -1;
+      goto out;
+    }
 
-  retval = remove_entry (db, user, error);
+  if (progress)
+    progress (state.scanned, state.imported, userdata);
 
-  sqlite3_close (db);
+ out:
+  close (fd);
+  free (file);
 
   return retval;
 }
 
-/* Renames an user entry. Returns 0 on success, -1 on failure. */
 int
-ll2_rename_user (const char *lastlog2_path, const char *user,
-		 const char *newname, char **error)
+ll2_ctx_import_lastlog (struct ll2_context *context, const char *lastlog_file,
+			int flags,
+			int (*progress)(uint64_t scanned, uint64_t imported,
+					void *userdata),
+			void *userdata, char **error)
 {
-  sqlite3 *db;
-  int64_t ll_time;
-  char *tty;
-  char *rhost;
-  char *pam_service;
-  int retval;
-
-  if ((db = open_database_rw (lastlog2_path, error)) == NULL)
-    return -1;
-
-  if (read_entry (db, user, &ll_time, &tty, &rhost, &pam_service, error) != 0)
-    {
-      sqlite3_close (db);
-      return -1;
-    }
-
-  if (write_entry (db, newname, ll_time, tty, rhost, pam_service, error) != 0)
-    {
-      sqlite3_close (db);
-      if (tty)
-	free (tty);
-      if (rhost)
-	free (rhost);
-      return -1;
-    }
-
-  retval = remove_entry (db, user, error);
-
-  sqlite3_close (db);
-
-  if (tty)
-    free (tty);
-  if (rhost)
-    free (rhost);
-  if (pam_service)
-    free (pam_service);
+  STATS_BEGIN ();
+  int retval = ctx_import_lastlog (context, lastlog_file, flags, progress,
+				   userdata, error);
 
+  STATS_END (STAT_IMPORT_LASTLOG, retval);
   return retval;
 }
 
@@ -554,85 +5856,86 @@ int
 ll2_import_lastlog (const char *lastlog2_path, const char *lastlog_file,
 		    char **error)
 {
-  const struct passwd *pw;
-  struct stat statll;
-  sqlite3 *db;
-  FILE *ll_fp;
+  struct ll2_context *context;
+  int retval;
 
-  if ((db = open_database_rw (lastlog2_path, error)) == NULL)
+  if ((context = ll2_open_context (lastlog2_path, 0, error)) == NULL)
     return -1;
 
-  ll_fp = fopen (lastlog_file, "r");
-  if (ll_fp == NULL)
+  retval = ll2_ctx_import_lastlog (context, lastlog_file, 0, NULL, NULL,
+				   error);
+
+  ll2_close_context (context);
+
+  return retval;
+}
+
+/* Send an entry to lastlog2d, which writes it together with other
+   entries. Does not block if the daemon cannot keep up.
+   Returns 0 on success, -ENOENT or -ECONNREFUSED if the daemon is not
+   running, other negative errno values on failure. */
+static int
+send_entry (const char *socket_path, const struct ll2_entry *entry,
+	    char **error)
+{
+  struct sockaddr_un addr;
+  char buf[LL2D_MAX_MESSAGE];
+  ssize_t len;
+  int retval = 0;
+  int fd;
+
+  if (socket_path == NULL)
+    socket_path = _PATH_LASTLOG2D_SOCKET;
+
+  if ((len = ll2d_encode (buf, sizeof (buf), entry)) < 0)
     {
       if (error)
-	if (asprintf (error, "Failed to open '%s': %s",
-		      lastlog_file, strerror (errno)) < 0)
-	  *error = strdup ("Out of memory");
-
-      return -1;
+	*error = strdup ("Entry too large for lastlog2d");
+      return -EINVAL;
     }
 
-
-  if (fstat (fileno (ll_fp), &statll) != 0)
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
     {
       if (error)
-	if (asprintf (error, "Cannot get size of '%s': %s",
-		      lastlog_file, strerror (errno)) < 0)
+	if (asprintf (error, "Socket path too long: %s", socket_path) < 0)
 	  *error = strdup ("Out of memory");
-      return -1;
+      return -EINVAL;
     }
+  strcpy (addr.sun_path, socket_path);
 
-  setpwent ();
-  while ((pw = getpwent ()) != NULL )
+  if ((fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
     {
-      off_t offset;
-      struct lastlog ll;
-
-      offset = (off_t) pw->pw_uid * sizeof (ll);
-
-      if ((offset + (off_t)sizeof (ll)) <= statll.st_size)
-	{
-	  if (fseeko (ll_fp, offset, SEEK_SET) == -1)
-	    continue; /* Ignore seek error */
-
-	  if (fread (&ll, sizeof (ll), 1, ll_fp) != 1)
-	    {
-	      if (error)
-		if (asprintf (error, "Failed to get the entry for UID '%lu'",
-			      (unsigned long int)pw->pw_uid) < 0)
-		  *error = strdup ("Out of memory");
-
-	      endpwent ();
-	      sqlite3_close (db);
-	      return -1;
-	    }
+      retval = -errno;
+      if (error)
+	if (asprintf (error, "Cannot create socket: %s", strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
+      return retval;
+    }
 
-	  if (ll.ll_time != 0)
-	    {
-	      int64_t ll_time;
-	      char tty[UT_LINESIZE+1];
-	      char rhost[UT_HOSTSIZE+1];
+  if (sendto (fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL,
+	      (const struct sockaddr *)&addr, sizeof (addr)) != len)
+    {
+      retval = -errno;
+      if (error)
+	if (asprintf (error, "Cannot send entry to %s: %s", socket_path,
+		      strerror (errno)) < 0)
+	  *error = strdup ("Out of memory");
+    }
 
-	      ll_time = ll.ll_time;
-	      strncpy (tty, ll.ll_line, UT_LINESIZE);
-	      tty[UT_LINESIZE] = '\0';
-	      strncpy (rhost, ll.ll_host, UT_HOSTSIZE);
-	      rhost[UT_HOSTSIZE] = '\0';
+  close (fd);
 
-	      if (write_entry (db, pw->pw_name, ll_time, tty,
-			       rhost, NULL, error) != 0)
-		{
-		  endpwent ();
-		  sqlite3_close (db);
-		  return -1;
-		}
-	    }
-	}
-    }
+  return retval;
+}
 
-  endpwent ();
-  sqlite3_close (db);
+int
+ll2_send_entry (const char *socket_path, const struct ll2_entry *entry,
+		char **error)
+{
+  STATS_BEGIN ();
+  int retval = send_entry (socket_path, entry, error);
 
-  return 0;
+  STATS_END (STAT_SEND_ENTRY, retval);
+  return retval;
 }
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Wire format of the login records sent to lastlog2d. Not part of
+   the public API, sender and receiver always come from the same
+   build and run on the same host, so native byte order is used. */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "lastlog2.h"
+
+#define LL2D_MAGIC       0x4c4c3201
+/* Larger datagrams get rejected by the daemon. */
+#define LL2D_MAX_MESSAGE 1024
+/* Length of a field which is NULL. */
+#define LL2D_NULL_FIELD  UINT16_MAX
+/* UID of an entry without UID. */
+#define LL2D_NO_UID      UINT32_MAX
+
+/* The header is followed by the strings of all fields, which are
+   not NULL, in the order of len, each with a trailing NUL byte. */
+struct ll2d_header {
+  uint32_t magic;
+  uint32_t uid;
+  int64_t ll_time;
+  uint16_t len[4]; /* user, tty, rhost, pam_service */
+};
+
+/* Stores entry in buf. Returns the length of the message or -1 if
+   it does not fit or the user is missing. */
+static inline ssize_t
+ll2d_encode (char *buf, size_t size, const struct ll2_entry *entry)
+{
+  const char *fields[4] = { entry->user, entry->tty, entry->rhost,
+			    entry->pam_service };
+  struct ll2d_header header;
+  size_t pos = sizeof (header);
+
+  if (entry->user == NULL || size < pos)
+    return -1;
+
+  memset (&header, 0, sizeof (header));
+  header.magic = LL2D_MAGIC;
+  header.uid = entry->has_uid ? entry->uid : LL2D_NO_UID;
+  header.ll_time = entry->ll_time;
+
+  for (int i = 0; i < 4; i++)
+    {
+      size_t len;
+
+      if (fields[i] == NULL)
+	{
+	  header.len[i] = LL2D_NULL_FIELD;
+	  continue;
+	}
+
+      len = strlen (fields[i]);
+      if (len >= LL2D_NULL_FIELD || len + 1 > size - pos)
+	return -1;
+
+      memcpy (buf + pos, fields[i], len + 1);
+      header.len[i] = len;
+      pos += len + 1;
+    }
+
+  memcpy (buf, &header, sizeof (header));
+
+  return pos;
+}
+
+/* Parses the message in buf of length len. The strings of entry
+   point into buf.
+   Returns 0 on success, -1 if the message is invalid. */
+static inline int
+ll2d_decode (const char *buf, size_t len, struct ll2_entry *entry)
+{
+  const char **fields[4] = { &entry->user, &entry->tty, &entry->rhost,
+			     &entry->pam_service };
+  size_t *lens[4] = { &entry->user_len, &entry->tty_len, &entry->rhost_len,
+		      &entry->pam_service_len };
+  struct ll2d_header header;
+  size_t pos = sizeof (header);
+
+  if (len < pos)
+    return -1;
+
+  memcpy (&header, buf, sizeof (header));
+  if (header.magic != LL2D_MAGIC || header.len[0] == LL2D_NULL_FIELD)
+    return -1;
+
+  entry->ll_time = header.ll_time;
+  entry->uid = header.uid;
+  entry->has_uid = header.uid != LL2D_NO_UID;
+
+  for (int i = 0; i < 4; i++)
+    {
+      if (header.len[i] == LL2D_NULL_FIELD)
+	{
+	  *fields[i] = NULL;
+	  *lens[i] = 0;
+	  continue;
+	}
+
+      if ((size_t)header.len[i] + 1 > len - pos ||
+	  buf[pos + header.len[i]] != '\0' ||
+	  memchr (buf + pos, '\0', header.len[i]) != NULL)
+	return -1;
+
+      *fields[i] = buf + pos;
+      *lens[i] = header.len[i];
+      pos += header.len[i] + 1;
+    }
+
+  return pos == len ? 0 : -1;
+}
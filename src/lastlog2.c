@@ -33,23 +33,46 @@
 #include <string.h>
 #include <getopt.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include "lastlog2.h"
 
 static char *lastlog2_path = _PATH_LASTLOG2;
 
-static int bflg = 0;
-static time_t b_days = 0;
-static int tflg = 0;
-static time_t t_days = 0;
-static int sflg = 0;
+/* Options without short form */
+enum {
+  OPT_CHECKPOINT = 256,
+  OPT_RECENT,
+  OPT_COMPACT_JOURNAL,
+  OPT_REBUILD_CACHE,
+  OPT_UID_RANGE,
+  OPT_STATS,
+  OPT_MAINTAIN,
+  OPT_PURGE_BEFORE,
+  OPT_PURGE_ORPHANS,
+  OPT_DRY_RUN,
+  OPT_SPARSE,
+};
+
+struct print_options {
+  int bflg;
+  time_t b_days;
+  int tflg;
+  time_t t_days;
+  int sflg;
+  time_t now;
+  int header_printed;
+};
 
 static int
-print_entry (const char *user, int64_t ll_time,
-	     const char *tty, const char *rhost,
-	     const char *pam_service)
+print_entry (const struct ll2_entry *entry, void *userdata)
 {
-  static int once = 0;
+  struct print_options *opts = userdata;
+  int64_t ll_time = entry->ll_time;
+  const char *tty = entry->tty;
+  const char *rhost = entry->rhost;
+  const char *pam_service = entry->pam_service;
+  int sflg = opts->sflg;
   char *datep;
   struct tm *tm;
   char datetime[80];
@@ -59,11 +82,11 @@ print_entry (const char *user, int64_t ll_time,
   const int maxIPv6Addrlen = 42;
 
   /* Print only if older than b days */
-  if (bflg && ((time (NULL) - ll_time) < b_days))
+  if (opts->bflg && ((opts->now - ll_time) < opts->b_days))
     return 0;
 
   /* Print only if newer than t days */
-  if (tflg && ((time (NULL) - ll_time) > t_days))
+  if (opts->tflg && ((opts->now - ll_time) > opts->t_days))
     return 0;
 
   /* this is necessary if you compile this on architectures with
@@ -81,20 +104,41 @@ print_entry (const char *user, int64_t ll_time,
   if (ll_time == 0)
     datep = "**Never logged in**";
 
-  if (!once)
+  if (!opts->header_printed)
     {
       printf ("Username         Port     From%*s Latest%*s%s\n",
 	      maxIPv6Addrlen-4, " ",
 	      sflg?(int)strlen (datep)-5:0, " ", sflg?"Service":"");
-      once = 1;
+      opts->header_printed = 1;
     }
-  printf ("%-16s %-8.8s %*s %s%*s%s\n", user, tty ? tty : "",
+  printf ("%-16s %-8.8s %*s %s%*s%s\n", entry->user, tty ? tty : "",
 	  -maxIPv6Addrlen, rhost ? rhost : "", datep,
 	  sflg?31-(int)strlen(datep):0, " ", sflg?(pam_service?pam_service:""):"");
 
   return 0;
 }
 
+struct import_progress {
+  uint64_t scanned;
+  uint64_t imported;
+  int show;
+};
+
+static int
+import_progress (uint64_t scanned, uint64_t imported, void *userdata)
+{
+  struct import_progress *p = userdata;
+
+  p->scanned = scanned;
+  p->imported = imported;
+
+  if (p->show)
+    fprintf (stderr, "\rRead %llu records, imported %llu entries",
+	     (unsigned long long)scanned, (unsigned long long)imported);
+
+  return 0;
+}
+
 static void
 usage (int retval)
 {
@@ -103,20 +147,195 @@ usage (int retval)
   fprintf (output, "Usage: lastlog2 [options]\n\n"
 	   "Options:\n");
   fputs ("  -b, --before DAYS     Print only records older than DAYS\n", output);
+  fputs ("      --checkpoint      Write the WAL file back into the database\n", output);
+  fputs ("      --compact-journal Move spooled logins into the database\n", output);
   fputs ("  -C, --clear           Clear record of a user (requires -u)\n", output);
   fputs ("  -d, --database FILE   Use FILE as lastlog2 database\n", output);
+  fputs ("      --dry-run         Only count the records --purge-* would remove\n", output);
   fputs ("  -h, --help            Display this help message and exit\n", output);
   fputs ("  -i, --import FILE     Import data from old lastlog file\n", output);
+  fputs ("      --maintain[=MODE] Report the fragmentation of the database and\n"
+	 "                        maintain it, MODE is incremental (default),\n"
+	 "                        full or report\n", output);
+  fputs ("      --purge-before DAYS\n"
+	 "                        Remove records older than DAYS\n", output);
+  fputs ("      --purge-orphans   Remove records of users, which don't exist anymore\n", output);
+  fputs ("      --recent N        Print the N most recent logins\n", output);
+  fputs ("      --rebuild-cache   Create the cache for fast lookups of single users\n", output);
   fputs ("  -r, --rename NEWNAME  Rename existing user to NEWNAME (requires -u)\n", output);
   fputs ("  -s, --service         Display PAM service\n", output);
   fputs ("  -S, --set             Set lastlog record to current time (requires -u)\n", output);
+  fputs ("      --sparse          Import only the used parts of the lastlog file\n"
+	 "                        (requires -i)\n", output);
+  fputs ("      --stats           Print statistics of the database operations\n", output);
   fputs ("  -t, --time DAYS       Print only lastlog records more recent than DAYS\n", output);
   fputs ("  -u, --user LOGIN      Print lastlog record of the specified LOGIN\n", output);
+  fputs ("      --uid-range RANGE Print only records of users with UID in RANGE,\n"
+	 "                        written as UID, MIN-MAX, MIN- or -MAX\n", output);
   fputs ("  -v, --version         Print version number and exit\n", output);
   fputs ("\n", output);
   exit (retval);
 }
 
+/* Parses UID, MIN-MAX, MIN- or -MAX. Returns 0 on success, -1 if
+   the range is invalid. */
+static int
+parse_uid_range (const char *arg, uid_t *from, uid_t *to)
+{
+  const char *dash = strchr (arg, '-');
+  unsigned long val;
+  char *endptr;
+
+  *from = 0;
+  *to = (uid_t)-1 - 1;
+
+  if (dash != arg)
+    {
+      errno = 0;
+      val = strtoul (arg, &endptr, 10);
+      if (errno != 0 || endptr == arg || endptr != (dash ? dash : arg + strlen (arg)) ||
+	  val >= (uid_t)-1)
+	return -1;
+      *from = val;
+      if (dash == NULL)
+	{
+	  *to = val;
+	  return 0;
+	}
+    }
+
+  if (dash[1] != '\0')
+    {
+      errno = 0;
+      val = strtoul (dash + 1, &endptr, 10);
+      if (errno != 0 || endptr == dash + 1 || *endptr != '\0' ||
+	  val >= (uid_t)-1)
+	return -1;
+      *to = val;
+    }
+  else if (dash == arg)
+    return -1;
+
+  return *from <= *to ? 0 : -1;
+}
+
+/* Formats a duration of ns nanoseconds with the largest unit, which
+   keeps it at least 1. */
+static void
+format_ns (char *buf, size_t size, uint64_t ns)
+{
+  if (ns < 1000)
+    snprintf (buf, size, "%lluns", (unsigned long long)ns);
+  else if (ns < 1000000)
+    snprintf (buf, size, "%lluus", (unsigned long long)(ns / 1000));
+  else if (ns < 1000000000)
+    snprintf (buf, size, "%llums", (unsigned long long)(ns / 1000000));
+  else
+    snprintf (buf, size, "%llus", (unsigned long long)(ns / 1000000000));
+}
+
+/* Prints the statistics of liblastlog2 for --stats to stderr, so
+   that they don't mix with the normal output. */
+static void
+print_stats (void)
+{
+  struct ll2_stats *stats;
+  size_t count;
+  char *error = NULL;
+
+  /* Runs before stdout gets flushed on exit. */
+  fflush (stdout);
+
+  if (ll2_get_stats (&stats, &count, &error) != 0)
+    {
+      fprintf (stderr, "%s\n", error ? error : "Cannot get statistics");
+      free (error);
+      return;
+    }
+
+  fprintf (stderr, "\n%-18s %8s %6s %6s %11s %10s %10s\n", "Operation",
+	   "Calls", "Busy", "Errors", "Total ms", "Avg us", "Max us");
+  for (size_t i = 0; i < count; i++)
+    {
+      const struct ll2_stats *st = &stats[i];
+
+      if (st->count == 0)
+	continue;
+
+      fprintf (stderr, "%-18s %8llu %6llu %6llu %11.3f %10.1f %10.1f\n",
+	       st->name, (unsigned long long)st->count,
+	       (unsigned long long)st->busy, (unsigned long long)st->errors,
+	       st->total_ns / 1e6, st->total_ns / 1e3 / st->count,
+	       st->max_ns / 1e3);
+    }
+
+  /* Latency histograms, every bucket as upper limit and calls. */
+  fputc ('\n', stderr);
+  for (size_t i = 0; i < count; i++)
+    {
+      const struct ll2_stats *st = &stats[i];
+      const char *sep = "";
+
+      if (st->count == 0)
+	continue;
+
+      fprintf (stderr, "%-18s", st->name);
+      for (int b = 0; b < LL2_STATS_BUCKETS; b++)
+	{
+	  char limit[32];
+
+	  if (st->histogram[b] == 0)
+	    continue;
+
+	  if (b == LL2_STATS_BUCKETS - 1)
+	    {
+	      format_ns (limit, sizeof (limit), (uint64_t)1 << b);
+	      fprintf (stderr, "%s >=%s: %llu", sep, limit,
+		       (unsigned long long)st->histogram[b]);
+	    }
+	  else
+	    {
+	      format_ns (limit, sizeof (limit), (uint64_t)1 << (b + 1));
+	      fprintf (stderr, "%s <%s: %llu", sep, limit,
+		       (unsigned long long)st->histogram[b]);
+	    }
+	  sep = ",";
+	}
+      fputc ('\n', stderr);
+    }
+
+  free (stats);
+}
+
+/* Prints the size of the database and, if objects is set, the pages
+   and the fill of all tables and indexes. */
+static void
+print_space (const struct ll2_space *space, int objects)
+{
+  static const char *const auto_vacuum[] = { "none", "full", "incremental" };
+
+  printf ("%lld pages of %lld bytes, %lld free (%.1f%%), auto_vacuum %s\n",
+	  (long long)space->page_count, (long long)space->page_size,
+	  (long long)space->freelist_count,
+	  space->page_count > 0 ?
+	  100.0 * space->freelist_count / space->page_count : 0.0,
+	  space->auto_vacuum >= 0 && space->auto_vacuum <= 2 ?
+	  auto_vacuum[space->auto_vacuum] : "unknown");
+
+  if (!objects || space->count == 0)
+    return;
+
+  printf ("%-40s %10s %6s\n", "Table/Index", "Pages", "Fill");
+  for (size_t i = 0; i < space->count; i++)
+    {
+      const struct ll2_space_object *obj = &space->objects[i];
+      int64_t size = obj->pages * space->page_size;
+
+      printf ("%-40s %10lld %5.1f%%\n", obj->name, (long long)obj->pages,
+	      size > 0 ? 100.0 * (size - obj->unused) / size : 0.0);
+    }
+}
+
 /* Check if an user exists on the system.
    If yes, return 0, else return -1. */
 static int
@@ -132,27 +351,56 @@ main (int argc, char **argv)
 {
   struct option const longopts[] = {
     {"before",   required_argument, NULL, 'b'},
+    {"checkpoint", no_argument,     NULL, OPT_CHECKPOINT},
     {"clear",    no_argument,       NULL, 'C'},
+    {"compact-journal", no_argument, NULL, OPT_COMPACT_JOURNAL},
     {"database", required_argument, NULL, 'd'},
+    {"dry-run",  no_argument,       NULL, OPT_DRY_RUN},
     {"help",     no_argument,       NULL, 'h'},
     {"import",   required_argument, NULL, 'i'},
+    {"maintain", optional_argument, NULL, OPT_MAINTAIN},
+    {"purge-before", required_argument, NULL, OPT_PURGE_BEFORE},
+    {"purge-orphans", no_argument,  NULL, OPT_PURGE_ORPHANS},
+    {"recent",   required_argument, NULL, OPT_RECENT},
+    {"rebuild-cache", no_argument,  NULL, OPT_REBUILD_CACHE},
     {"rename",   required_argument, NULL, 'r'},
     {"service",  no_argument,       NULL, 's'},
     {"set",      no_argument,       NULL, 'S'},
+    {"sparse",   no_argument,       NULL, OPT_SPARSE},
+    {"stats",    no_argument,       NULL, OPT_STATS},
     {"time",     required_argument, NULL, 't'},
     {"user",     required_argument, NULL, 'u'},
+    {"uid-range", required_argument, NULL, OPT_UID_RANGE},
     {"version",  no_argument,       NULL, 'v'},
     {NULL, 0, NULL, '\0'}
   };
+  struct print_options opts = { 0 };
   char *error = NULL;
+  int checkpointflg = 0;
   int Cflg = 0;
+  int compactflg = 0;
   int iflg = 0;
+  int maintainflg = 0;
+  int purgebeforeflg = 0;
+  time_t purge_days = 0;
+  int purgeorphansflg = 0;
+  int dryrunflg = 0;
+  int maintain_tasks = 0;
+  int rebuildflg = 0;
+  int recentflg = 0;
+  size_t recent_count = 0;
   int rflg = 0;
   int Sflg = 0;
+  int sparseflg = 0;
+  int statsflg = 0;
   int uflg = 0;
+  int uidflg = 0;
+  uid_t uid_from = 0;
+  uid_t uid_to = 0;
   const char *user = NULL;
   const char *newname = NULL;
   const char *lastlog_file = NULL;
+  int ret;
   int c;
 
   while ((c = getopt_long (argc, argv, "b:Cd:hi:r:sSt:u:v", longopts, NULL)) != -1)
@@ -172,16 +420,25 @@ main (int argc, char **argv)
 		fprintf (stderr, "Invalid numeric argument: '%s'\n", optarg);
 		exit (EXIT_FAILURE);
 	      }
-	    b_days = (time_t) days * (24L*3600L) /* seconds/DAY */;
-	    bflg = 1;
+	    opts.b_days = (time_t) days * (24L*3600L) /* seconds/DAY */;
+	    opts.bflg = 1;
 	  }
 	  break;
+	case OPT_CHECKPOINT:
+	  checkpointflg = 1;
+	  break;
 	case 'C':
 	  Cflg = 1;
 	  break;
+	case OPT_COMPACT_JOURNAL:
+	  compactflg = 1;
+	  break;
 	case 'd':
 	  lastlog2_path = optarg;
 	  break;
+	case OPT_DRY_RUN:
+	  dryrunflg = 1;
+	  break;
 	case 'h':
 	  usage (EXIT_SUCCESS);
 	  break;
@@ -189,17 +446,85 @@ main (int argc, char **argv)
 	  lastlog_file = optarg;
 	  iflg = 1;
 	  break;
+	case OPT_MAINTAIN:
+	  maintainflg = 1;
+	  if (optarg == NULL || strcmp (optarg, "incremental") == 0)
+	    maintain_tasks = LL2_MAINTAIN_OPTIMIZE | LL2_MAINTAIN_INCREMENTAL;
+	  else if (strcmp (optarg, "full") == 0)
+	    maintain_tasks = LL2_MAINTAIN_OPTIMIZE | LL2_MAINTAIN_VACUUM;
+	  else if (strcmp (optarg, "report") == 0)
+	    maintain_tasks = 0;
+	  else
+	    {
+	      fprintf (stderr, "Invalid maintenance mode: '%s'\n", optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_PURGE_BEFORE:
+	  {
+	    unsigned long days;
+	    char *endptr;
+
+	    errno = 0;
+	    days = strtoul(optarg, &endptr, 10);
+	    if ((errno == ERANGE && days == ULONG_MAX)
+		|| (endptr == optarg) || (*endptr != '\0'))
+	      {
+		fprintf (stderr, "Invalid numeric argument: '%s'\n", optarg);
+		exit (EXIT_FAILURE);
+	      }
+	    purge_days = (time_t) days * (24L*3600L) /* seconds/DAY */;
+	    purgebeforeflg = 1;
+	  }
+	  break;
+	case OPT_PURGE_ORPHANS:
+	  purgeorphansflg = 1;
+	  break;
+	case OPT_RECENT:
+	  {
+	    unsigned long count;
+	    char *endptr;
+
+	    errno = 0;
+	    count = strtoul(optarg, &endptr, 10);
+	    if ((errno == ERANGE && count == ULONG_MAX)
+		|| (endptr == optarg) || (*endptr != '\0'))
+	      {
+		fprintf (stderr, "Invalid numeric argument: '%s'\n", optarg);
+		exit (EXIT_FAILURE);
+	      }
+	    recent_count = count;
+	    recentflg = 1;
+	  }
+	  break;
+	case OPT_UID_RANGE:
+	  if (parse_uid_range (optarg, &uid_from, &uid_to) != 0)
+	    {
+	      fprintf (stderr, "Invalid UID range: '%s'\n", optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  uidflg = 1;
+	  break;
+	case OPT_REBUILD_CACHE:
+	  rebuildflg = 1;
+	  break;
 	case 'r':
 	  rflg = 1;
 	  newname = optarg;
 	  break;
 	case 's':
-	  sflg = 1;
+	  opts.sflg = 1;
 	  break;
 	case 'S':
 	  /* Set lastlog record of a user to the current time. */
 	  Sflg = 1;
 	  break;
+	case OPT_SPARSE:
+	  sparseflg = 1;
+	  break;
+	case OPT_STATS:
+	  statsflg = 1;
+	  break;
 	case 't':
 	  {
 	    unsigned long days;
@@ -213,8 +538,8 @@ main (int argc, char **argv)
 		fprintf (stderr, "Invalid numeric argument: '%s'\n", optarg);
 		exit (EXIT_FAILURE);
 	      }
-	    t_days = (time_t) days * (24L*3600L) /* seconds/DAY */;
-	    tflg = 1;
+	    opts.t_days = (time_t) days * (24L*3600L) /* seconds/DAY */;
+	    opts.tflg = 1;
 	  }
 	  break;
 	case 'u':
@@ -237,16 +562,260 @@ main (int argc, char **argv)
       usage (EXIT_FAILURE);
     }
 
-  if ((Cflg + Sflg + iflg) > 1)
+  if (statsflg)
+    {
+      struct ll2_stats *stats;
+      size_t count;
+
+      if (ll2_get_stats (&stats, &count, &error) != 0)
+	{
+	  fprintf (stderr, "%s\n", error ? error : "Cannot get statistics");
+	  free (error);
+	  exit (EXIT_FAILURE);
+	}
+      free (stats);
+      /* Printed on every exit, also after failures. */
+      atexit (print_stats);
+    }
+
+  if ((Cflg + Sflg + iflg + checkpointflg + compactflg + maintainflg +
+       (purgebeforeflg || purgeorphansflg) + rebuildflg) > 1)
+    {
+      fprintf (stderr, "Option -C, -i, -S, --checkpoint, --compact-journal, --maintain, --purge-* and --rebuild-cache cannot be used together\n");
+      usage (EXIT_FAILURE);
+    }
+
+  if (sparseflg && !iflg)
     {
-      fprintf (stderr, "Option -C, -i and -S cannot be used together\n");
+      fprintf (stderr, "Option --sparse requires -i\n");
       usage (EXIT_FAILURE);
     }
 
+  if (dryrunflg && !purgebeforeflg && !purgeorphansflg)
+    {
+      fprintf (stderr, "Option --dry-run requires --purge-before or --purge-orphans\n");
+      usage (EXIT_FAILURE);
+    }
+
+  if (recentflg && (opts.bflg || opts.tflg || uflg || iflg || checkpointflg ||
+		    compactflg || maintainflg || purgebeforeflg ||
+		    purgeorphansflg || rebuildflg))
+    {
+      fprintf (stderr, "Option --recent cannot be used together with -b, -i, -t, -u, --checkpoint, --compact-journal, --maintain, --purge-* and --rebuild-cache\n");
+      usage (EXIT_FAILURE);
+    }
+
+  if (uidflg && (recentflg || uflg || iflg || checkpointflg || compactflg ||
+		 maintainflg || purgebeforeflg || purgeorphansflg ||
+		 rebuildflg))
+    {
+      fprintf (stderr, "Option --uid-range cannot be used together with -i, -u, --checkpoint, --compact-journal, --maintain, --purge-*, --rebuild-cache and --recent\n");
+      usage (EXIT_FAILURE);
+    }
+
+  if (checkpointflg)
+    {
+      struct ll2_context *context;
+
+      if (ll2_check_database (lastlog2_path) != 0)
+	{
+	  fprintf (stderr, "Database '%s' does not exist\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
+      if ((context = ll2_open_context (lastlog2_path, 0, &error)) == NULL ||
+	  ll2_ctx_checkpoint (context, &error) != 0)
+	{
+	  if (error)
+	    {
+	      fprintf (stderr, "%s\n", error);
+	      free (error);
+	    }
+	  else
+	    fprintf (stderr, "Couldn't checkpoint database '%s'\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
+      ll2_close_context (context);
+      exit (EXIT_SUCCESS);
+    }
+
+  if (maintainflg)
+    {
+      struct ll2_context *context;
+      struct ll2_space *space;
+
+      if (ll2_check_database (lastlog2_path) != 0)
+	{
+	  fprintf (stderr, "Database '%s' does not exist\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
+      if ((context = ll2_open_context (lastlog2_path, 0, &error)) == NULL ||
+	  ll2_ctx_get_space (context, &space, &error) != 0)
+	{
+	  if (error)
+	    {
+	      fprintf (stderr, "%s\n", error);
+	      free (error);
+	    }
+	  else
+	    fprintf (stderr, "Couldn't get size of '%s'\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+      print_space (space, 1);
+      free (space);
+
+      if (maintain_tasks != 0)
+	{
+	  if ((ret = ll2_ctx_maintain (context, maintain_tasks, &error)) != 0)
+	    {
+	      if (error)
+		{
+		  fprintf (stderr, "%s\n", error);
+		  free (error);
+		}
+	      else if (ret == -EBUSY)
+		fprintf (stderr, "Database '%s' is locked, try again later\n",
+			 lastlog2_path);
+	      else
+		fprintf (stderr, "Couldn't maintain '%s'\n", lastlog2_path);
+	      exit (EXIT_FAILURE);
+	    }
+
+	  if (ll2_ctx_get_space (context, &space, &error) != 0)
+	    {
+	      fprintf (stderr, "%s\n", error ? error : "Couldn't get size of database");
+	      free (error);
+	      exit (EXIT_FAILURE);
+	    }
+	  printf ("After maintenance: ");
+	  print_space (space, 0);
+	  free (space);
+	}
+
+      ll2_close_context (context);
+      exit (EXIT_SUCCESS);
+    }
+
+  if (purgebeforeflg || purgeorphansflg)
+    {
+      int flags = dryrunflg ? LL2_PURGE_DRY_RUN : 0;
+      struct ll2_context *context;
+      size_t count = 0;
+
+      if (ll2_check_database (lastlog2_path) != 0)
+	{
+	  fprintf (stderr, "Database '%s' does not exist\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
+      if ((context = ll2_open_context (lastlog2_path, 0, &error)) == NULL)
+	{
+	  if (error)
+	    {
+	      fprintf (stderr, "%s\n", error);
+	      free (error);
+	    }
+	  else
+	    fprintf (stderr, "Couldn't open database '%s'\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
+      if (purgebeforeflg)
+	{
+	  ret = ll2_ctx_purge_before (context, time (NULL) - purge_days,
+				      flags, &count, &error);
+	  printf ("%s %zu records older than %lld days\n",
+		  dryrunflg ? "Would remove" : "Removed", count,
+		  (long long)(purge_days / (24L*3600L)));
+	  if (ret != 0)
+	    {
+	      fprintf (stderr, "%s\n", error ? error : "Couldn't remove old records");
+	      free (error);
+	      exit (EXIT_FAILURE);
+	    }
+	}
+
+      if (purgeorphansflg)
+	{
+	  ret = ll2_ctx_purge_orphans (context, flags, &count, &error);
+	  printf ("%s %zu records of users, which don't exist anymore\n",
+		  dryrunflg ? "Would remove" : "Removed", count);
+	  if (ret != 0)
+	    {
+	      fprintf (stderr, "%s\n", error ? error : "Couldn't remove records of old users");
+	      free (error);
+	      exit (EXIT_FAILURE);
+	    }
+	}
+
+      ll2_close_context (context);
+      exit (EXIT_SUCCESS);
+    }
+
+  if (rebuildflg)
+    {
+      struct ll2_context *context;
+
+      if (ll2_check_database (lastlog2_path) != 0)
+	{
+	  fprintf (stderr, "Database '%s' does not exist\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
+      if ((context = ll2_open_context (lastlog2_path, 0, &error)) == NULL ||
+	  ll2_ctx_rebuild_cache (context, &error) != 0)
+	{
+	  if (error)
+	    {
+	      fprintf (stderr, "%s\n", error);
+	      free (error);
+	    }
+	  else
+	    fprintf (stderr, "Couldn't rebuild cache of '%s'\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
+      ll2_close_context (context);
+      exit (EXIT_SUCCESS);
+    }
+
+  if (compactflg)
+    {
+      if ((ret = ll2_compact_journal (lastlog2_path, &error)) < 0)
+	{
+	  if (error)
+	    {
+	      fprintf (stderr, "%s\n", error);
+	      free (error);
+	    }
+	  else
+	    fprintf (stderr, "Couldn't compact spool of '%s'\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
+      if (ret > 0)
+	printf ("Moved %d spooled logins into the database\n", ret);
+      exit (EXIT_SUCCESS);
+    }
+
   if (iflg)
     {
-      if (ll2_import_lastlog (lastlog2_path, lastlog_file, &error) != 0)
+      struct import_progress progress = { .show = isatty (STDERR_FILENO) };
+      struct ll2_context *context;
+      struct timespec start, end;
+      double secs;
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+
+      if ((context = ll2_open_context (lastlog2_path, 0, &error)) == NULL ||
+	  ll2_ctx_import_lastlog (context, lastlog_file,
+				  sparseflg ? LL2_IMPORT_SPARSE : 0,
+				  import_progress, &progress, &error) != 0)
 	{
+	  if (progress.show && progress.scanned > 0)
+	    fputc ('\n', stderr);
 	  if (error)
 	    {
 	      fprintf (stderr, "%s\n", error);
@@ -256,11 +825,24 @@ main (int argc, char **argv)
 	    fprintf (stderr, "Couldn't import entries from '%s'\n", lastlog_file);
 	  exit (EXIT_FAILURE);
 	}
+      ll2_close_context (context);
+
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+      if (progress.show)
+	fputc ('\n', stderr);
+      printf ("Imported %llu entries (%llu records read) in %.2f seconds, %.0f records/s\n",
+	      (unsigned long long)progress.imported,
+	      (unsigned long long)progress.scanned, secs,
+	      secs > 0 ? progress.scanned / secs : 0.0);
       exit (EXIT_SUCCESS);
     }
 
   if (Cflg || Sflg || rflg)
     {
+      struct ll2_context *context;
+
       if (!uflg || strlen (user) == 0)
 	{
 	  fprintf (stderr, "Options -C, -r and -S require option -u to specify the user\n");
@@ -273,9 +855,21 @@ main (int argc, char **argv)
 	  exit (EXIT_FAILURE);
 	}
 
+      if ((context = ll2_open_context (lastlog2_path, 0, &error)) == NULL)
+	{
+	  if (error)
+	    {
+	      fprintf (stderr, "%s\n", error);
+	      free (error);
+	    }
+	  else
+	    fprintf (stderr, "Couldn't open database '%s'\n", lastlog2_path);
+	  exit (EXIT_FAILURE);
+	}
+
       if (Cflg)
 	{
-	  if (ll2_remove_entry (lastlog2_path, user, &error) != 0)
+	  if (ll2_ctx_remove_entry (context, user, &error) != 0)
 	    {
 	      if (error)
 		{
@@ -299,7 +893,7 @@ main (int argc, char **argv)
 	      exit (EXIT_FAILURE);
 	    }
 
-	  if (ll2_update_login_time (lastlog2_path, user, ll_time, &error) != 0)
+	  if (ll2_ctx_update_login_time (context, user, ll_time, &error) != 0)
 	    {
 	      if (error)
 		{
@@ -315,7 +909,7 @@ main (int argc, char **argv)
 
       if (rflg)
 	{
-	  if (ll2_rename_user (lastlog2_path, user, newname, &error) != 0)
+	  if (ll2_ctx_rename_user (context, user, newname, &error) != 0)
 	    {
 	      if (error)
 		{
@@ -328,11 +922,15 @@ main (int argc, char **argv)
 	    }
 	}
 
+      ll2_close_context (context);
       exit (EXIT_SUCCESS);
     }
 
+  opts.now = time (NULL);
+
   if (user)
     {
+      struct ll2_entry entry = { .user = user };
       int64_t ll_time = 0;
       char *tty = NULL;
       char *rhost = NULL;
@@ -345,15 +943,40 @@ main (int argc, char **argv)
 	}
 
       /* We ignore errors, if the user is not in the database he did never login */
-      ll2_read_entry (lastlog2_path, user, &ll_time, &tty, &rhost,
-		      &service, NULL);
+      if (ll2_read_cached_entry (lastlog2_path, user, &ll_time, &tty, &rhost,
+				 &service, NULL) == -ESTALE)
+	ll2_read_entry (lastlog2_path, user, &ll_time, &tty, &rhost,
+			&service, NULL);
 
-      print_entry(user, ll_time, tty, rhost, service);
+      entry.ll_time = ll_time;
+      entry.tty = tty;
+      entry.rhost = rhost;
+      entry.pam_service = service;
+      print_entry (&entry, &opts);
 
       exit (EXIT_SUCCESS);
     }
 
-  if (ll2_read_all (lastlog2_path, print_entry, &error) != 0)
+  if (recentflg)
+    ret = ll2_read_recent (lastlog2_path, recent_count, 0, print_entry,
+			   &opts, &error);
+  else if (uidflg)
+    /* print_entry filters by -b and -t. */
+    ret = ll2_read_uid_range (lastlog2_path, uid_from, uid_to, print_entry,
+			      &opts, &error);
+  else if (opts.bflg || opts.tflg)
+    {
+      /* Let the database select the entries print_entry would print. */
+      int64_t from = opts.tflg ? opts.now - opts.t_days : INT64_MIN;
+      int64_t to = opts.bflg ? opts.now - opts.b_days + 1 : INT64_MAX;
+
+      ret = ll2_read_range (lastlog2_path, from, to, print_entry, &opts,
+			    &error);
+    }
+  else
+    ret = ll2_read_all_entries (lastlog2_path, print_entry, &opts, &error);
+
+  if (ret != 0)
     {
       if (error)
 	{
@@ -0,0 +1,391 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* lastlog2d receives login records from pam_lastlog2 and
+   ll2_send_entry and writes them in group commits: all records
+   arriving within the commit interval are written in one
+   transaction, repeated logins of the same user only once. */
+
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "lastlog2.h"
+#include "lastlog2d-protocol.h"
+
+/* First file descriptor passed by systemd socket activation. */
+#define LISTEN_FDS_START 3
+/* Maximum number of records written in one transaction. */
+#define MAX_BATCH 1024
+#define DEFAULT_COMMIT_INTERVAL 10 /* ms */
+#define DEFAULT_IDLE_TIMEOUT 60    /* s */
+
+struct pending {
+  char buf[LL2D_MAX_MESSAGE];
+  struct ll2_entry entry;
+};
+
+static volatile sig_atomic_t terminate = 0;
+
+static void
+handle_signal (int sig __attribute__((__unused__)))
+{
+  terminate = 1;
+}
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns the socket passed by systemd, or binds a new one to
+   socket_path. activated tells which one it was.
+   Returns -1 on failure. */
+static int
+get_socket (const char *socket_path, int *activated)
+{
+  const char *env;
+  struct sockaddr_un addr;
+  int fd;
+
+  if ((env = getenv ("LISTEN_PID")) != NULL &&
+      strtol (env, NULL, 10) == getpid () &&
+      (env = getenv ("LISTEN_FDS")) != NULL &&
+      strtol (env, NULL, 10) >= 1)
+    {
+      unsetenv ("LISTEN_PID");
+      unsetenv ("LISTEN_FDS");
+      unsetenv ("LISTEN_FDNAMES");
+      *activated = 1;
+      return LISTEN_FDS_START;
+    }
+  *activated = 0;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
+    {
+      fprintf (stderr, "Socket path too long: %s\n", socket_path);
+      return -1;
+    }
+  strcpy (addr.sun_path, socket_path);
+
+  if ((fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+      fprintf (stderr, "Cannot create socket: %s\n", strerror (errno));
+      return -1;
+    }
+
+  /* Only root may send records. */
+  unlink (socket_path);
+  if (bind (fd, (const struct sockaddr *)&addr, sizeof (addr)) != 0 ||
+      chmod (socket_path, 0600) != 0)
+    {
+      fprintf (stderr, "Cannot bind socket %s: %s\n", socket_path,
+	       strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+static int
+cmp_entry (const void *p1, const void *p2)
+{
+  const struct ll2_entry *e1 = p1;
+  const struct ll2_entry *e2 = p2;
+  int ret;
+
+  if ((ret = strcmp (e1->user, e2->user)) != 0)
+    return ret;
+
+  return (e1->ll_time > e2->ll_time) - (e1->ll_time < e2->ll_time);
+}
+
+/* Writes the newest record of every user in one transaction.
+   Returns 0 on success, -1 if the records need to be written
+   again. */
+static int
+flush (struct ll2_context *context, struct pending *pending, size_t count)
+{
+  struct ll2_entry entries[MAX_BATCH];
+  char *error = NULL;
+  size_t n = 0;
+  int ret;
+
+  for (size_t i = 0; i < count; i++)
+    entries[i] = pending[i].entry;
+
+  /* Sorted by user and time, the last one of a user is the newest. */
+  qsort (entries, count, sizeof (entries[0]), cmp_entry);
+  for (size_t i = 0; i < count; i++)
+    {
+      if (i + 1 < count && strcmp (entries[i].user, entries[i + 1].user) == 0)
+	continue;
+      entries[n++] = entries[i];
+    }
+
+  ret = ll2_ctx_write_entries (context, entries, n, 0, NULL, &error);
+  if (ret < 0)
+    {
+      fprintf (stderr, "Writing %zu entries failed: %s\n", n,
+	       error ? error : "unknown error");
+      free (error);
+      return -1;
+    }
+  else if (ret > 0)
+    fprintf (stderr, "Could not write %d of %zu entries\n", ret, n);
+
+  return 0;
+}
+
+/* Reads all waiting records, as long as there is space for them.
+   first is set to the arrival time of the first record of a batch.
+   Returns the new number of pending records. */
+static size_t
+receive (int fd, struct pending *pending, size_t count, int64_t *first)
+{
+  while (count < MAX_BATCH)
+    {
+      struct pending *p = &pending[count];
+      ssize_t n = recv (fd, p->buf, sizeof (p->buf),
+			MSG_DONTWAIT | MSG_TRUNC);
+
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    fprintf (stderr, "recv failed: %s\n", strerror (errno));
+	  break;
+	}
+
+      if ((size_t)n > sizeof (p->buf) ||
+	  ll2d_decode (p->buf, n, &p->entry) != 0)
+	{
+	  fprintf (stderr, "Ignoring invalid record\n");
+	  continue;
+	}
+
+      if (count++ == 0)
+	*first = now_ms ();
+    }
+
+  return count;
+}
+
+static void
+usage (int retval)
+{
+  FILE *output = (retval != EXIT_SUCCESS) ? stderr : stdout;
+
+  fprintf (output, "Usage: lastlog2d [options]\n\n"
+	   "Options:\n");
+  fputs ("  -c, --commit-interval MS  Collect records for MS milliseconds before writing\n", output);
+  fputs ("  -d, --database FILE       Use FILE as lastlog2 database\n", output);
+  fputs ("  -h, --help                Display this help message and exit\n", output);
+  fputs ("  -i, --idle-timeout SECS   Exit after SECS seconds without records if started\n"
+	 "                            by systemd, 0 never\n", output);
+  fputs ("  -s, --socket FILE         Listen on FILE if not started by systemd\n", output);
+  fputs ("  -v, --version             Print version number and exit\n", output);
+  fputs ("\n", output);
+  exit (retval);
+}
+
+static long
+parse_number (const char *arg)
+{
+  char *endptr;
+  long val;
+
+  errno = 0;
+  val = strtol (arg, &endptr, 10);
+  if (errno != 0 || endptr == arg || *endptr != '\0' || val < 0 ||
+      val > INT_MAX / 1000)
+    {
+      fprintf (stderr, "Invalid numeric argument: '%s'\n", arg);
+      exit (EXIT_FAILURE);
+    }
+
+  return val;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct option const longopts[] = {
+    {"commit-interval", required_argument, NULL, 'c'},
+    {"database",        required_argument, NULL, 'd'},
+    {"help",            no_argument,       NULL, 'h'},
+    {"idle-timeout",    required_argument, NULL, 'i'},
+    {"socket",          required_argument, NULL, 's'},
+    {"version",         no_argument,       NULL, 'v'},
+    {NULL, 0, NULL, '\0'}
+  };
+  const char *lastlog2_path = _PATH_LASTLOG2;
+  const char *socket_path = _PATH_LASTLOG2D_SOCKET;
+  long commit_interval = DEFAULT_COMMIT_INTERVAL;
+  long idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  struct ll2_context *context;
+  struct pending *pending;
+  struct sigaction sa;
+  struct pollfd pfd;
+  int64_t first = 0;
+  size_t count = 0;
+  char *error = NULL;
+  int activated;
+  int c;
+
+  while ((c = getopt_long (argc, argv, "c:d:hi:s:v", longopts, NULL)) != -1)
+    {
+      switch (c)
+	{
+	case 'c':
+	  commit_interval = parse_number (optarg);
+	  break;
+	case 'd':
+	  lastlog2_path = optarg;
+	  break;
+	case 'h':
+	  usage (EXIT_SUCCESS);
+	  break;
+	case 'i':
+	  idle_timeout = parse_number (optarg);
+	  break;
+	case 's':
+	  socket_path = optarg;
+	  break;
+	case 'v':
+	  printf ("lastlog2d %s\n", PROJECT_VERSION);
+	  exit (EXIT_SUCCESS);
+	  break;
+	default:
+	  usage (EXIT_FAILURE);
+	  break;
+	}
+    }
+
+  if (argc > optind)
+    {
+      fprintf (stderr, "Unexpected argument: %s\n", argv[optind]);
+      usage (EXIT_FAILURE);
+    }
+
+  if ((pending = calloc (MAX_BATCH, sizeof (*pending))) == NULL)
+    {
+      fprintf (stderr, "Out of memory\n");
+      exit (EXIT_FAILURE);
+    }
+
+  /* Checkpoints are done by lastlog2-checkpoint.timer. */
+  if ((context = ll2_open_context (lastlog2_path, LL2_OPEN_NO_CHECKPOINT,
+				   &error)) == NULL)
+    {
+      fprintf (stderr, "%s\n", error ? error : "Couldn't open database");
+      exit (EXIT_FAILURE);
+    }
+
+  if ((pfd.fd = get_socket (socket_path, &activated)) < 0)
+    exit (EXIT_FAILURE);
+  /* Records arriving after exiting would get lost, if nobody starts
+     us again. */
+  if (!activated)
+    idle_timeout = 0;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = handle_signal;
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGINT, &sa, NULL);
+
+  while (!terminate)
+    {
+      int timeout;
+      int ret;
+
+      if (count > 0)
+	{
+	  int64_t left = first + commit_interval - now_ms ();
+	  timeout = left > 0 ? left : 0;
+	}
+      else
+	timeout = idle_timeout > 0 ? idle_timeout * 1000 : -1;
+
+      /* With a full batch, records wait in the socket buffer. If that
+	 is full, too, senders write directly to the database. */
+      pfd.events = count < MAX_BATCH ? POLLIN : 0;
+      ret = poll (&pfd, 1, timeout);
+      if (ret < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fprintf (stderr, "poll failed: %s\n", strerror (errno));
+	  break;
+	}
+
+      /* Nothing to do, systemd starts us again if needed. */
+      if (ret == 0 && count == 0)
+	break;
+
+      count = receive (pfd.fd, pending, count, &first);
+
+      if (count > 0 &&
+	  (count == MAX_BATCH || now_ms () >= first + commit_interval))
+	{
+	  if (flush (context, pending, count) == 0)
+	    count = 0;
+	  else
+	    first = now_ms (); /* Try again after the next interval. */
+	}
+    }
+
+  /* Don't lose records sent before we got terminated. */
+  count = receive (pfd.fd, pending, count, &first);
+  if (count > 0)
+    flush (context, pending, count);
+
+  if (!activated)
+    unlink (socket_path);
+  ll2_close_context (context);
+  free (pending);
+
+  return EXIT_SUCCESS;
+}
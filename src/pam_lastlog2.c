@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <syslog.h>
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
@@ -37,11 +38,25 @@
 #include <security/_pam_macros.h>
 
 #include "lastlog2.h"
+#include "lastlog2-probes.h"
 
 #define LASTLOG2_DEBUG        01  /* send info to syslog(3) */
 #define LASTLOG2_QUIET        02  /* keep quiet about things */
+#define LASTLOG2_NODAEMON     04  /* don't send data to lastlog2d */
+#define LASTLOG2_SPOOL       010  /* append data to the spool file */
+#define LASTLOG2_CACHE       020  /* look up last login in the cache */
+
+/* Milliseconds to wait for a locked database, logins should not
+   hang because of lastlog2. */
+#define DEFAULT_BUSY_TIMEOUT 50
 
 static const char *lastlog2_path = _PATH_LASTLOG2;
+static int busy_timeout = DEFAULT_BUSY_TIMEOUT;
+
+/* The durations passed to the probes include everything the module
+   does for this step, the return value is the one of liblastlog2. */
+LL2_PROBE_SEMAPHORES (pam_show_lastlogin);
+LL2_PROBE_SEMAPHORES (pam_write_login_data);
 
 /* From pam_inline.h
  *
@@ -112,8 +127,40 @@ _pam_parse_args (pam_handle_t *pamh,
 	ctrl |= LASTLOG2_DEBUG;
       else if (strcmp (*argv, "silent") == 0)
 	ctrl |= LASTLOG2_QUIET;
+      else if (strcmp (*argv, "nodaemon") == 0)
+	ctrl |= LASTLOG2_NODAEMON;
+      else if (strcmp (*argv, "spool") == 0)
+	ctrl |= LASTLOG2_SPOOL;
+      else if (strcmp (*argv, "cache") == 0)
+	ctrl |= LASTLOG2_CACHE;
       else if ((str = skip_prefix (*argv, "database=")) != NULL)
 	lastlog2_path = str;
+      else if ((str = skip_prefix (*argv, "busy_timeout=")) != NULL)
+	{
+	  char *endptr;
+	  long val;
+
+	  errno = 0;
+	  val = strtol (str, &endptr, 10);
+	  if (errno != 0 || endptr == str || *endptr != '\0' ||
+	      val < 0 || val > INT_MAX)
+	    pam_syslog (pamh, LOG_ERR, "Invalid busy_timeout: %s", str);
+	  else
+	    busy_timeout = val;
+	}
+      else if ((str = skip_prefix (*argv, "slowlog=")) != NULL)
+	{
+	  char *endptr;
+	  long val;
+
+	  errno = 0;
+	  val = strtol (str, &endptr, 10);
+	  if (errno != 0 || endptr == str || *endptr != '\0' ||
+	      val < 0 || val > INT_MAX)
+	    pam_syslog (pamh, LOG_ERR, "Invalid slowlog: %s", str);
+	  else
+	    ll2_set_slowlog (val);
+	}
       else if ((str = skip_prefix (*argv, "silent_if=")) != NULL)
 	{
 	  const void *void_str = NULL;
@@ -138,8 +185,11 @@ _pam_parse_args (pam_handle_t *pamh,
   return ctrl;
 }
 
+/* Collects the data for the login of user. tty_buf needs to stay
+   valid as long as entry is used. */
 static int
-write_login_data (pam_handle_t *pamh, int ctrl, const char *user)
+get_login_data (pam_handle_t *pamh, int ctrl, const char *user,
+		struct ll2_entry *entry, char tty_buf[8])
 {
   const void *void_str;
   const char *tty;
@@ -147,9 +197,7 @@ write_login_data (pam_handle_t *pamh, int ctrl, const char *user)
   const char *pam_service;
   const char *xdg_vtnr;
   int xdg_vtnr_nr;
-  char tty_buf[8];
   time_t ll_time;
-  char *error = NULL;
   int retval;
 
   void_str = NULL;
@@ -171,7 +219,7 @@ write_login_data (pam_handle_t *pamh, int ctrl, const char *user)
   if ((tty[0] == '\0' || strchr(tty, ':') != NULL) && (xdg_vtnr = pam_getenv (pamh, "XDG_VTNR")) != NULL)
     {
       xdg_vtnr_nr = atoi (xdg_vtnr);
-      if (xdg_vtnr_nr > 0 && snprintf (tty_buf, sizeof(tty_buf), "tty%d", xdg_vtnr_nr) < (int) sizeof(tty_buf))
+      if (xdg_vtnr_nr > 0 && snprintf (tty_buf, 8, "tty%d", xdg_vtnr_nr) < 8)
         {
           tty = tty_buf;
           if (ctrl & LASTLOG2_DEBUG)
@@ -211,8 +259,37 @@ write_login_data (pam_handle_t *pamh, int ctrl, const char *user)
   if (time (&ll_time) < 0)
     return PAM_SYSTEM_ERR;
 
-  if (ll2_write_entry (lastlog2_path, user, ll_time, tty, rhost,
-		       pam_service, &error) != 0)
+  memset (entry, 0, sizeof (*entry));
+  entry->user = user;
+  entry->ll_time = ll_time;
+  entry->tty = tty;
+  entry->rhost = rhost;
+  entry->pam_service = pam_service;
+
+  return PAM_SUCCESS;
+}
+
+static int
+write_login_data (pam_handle_t *pamh, struct ll2_context *context,
+		  const struct ll2_entry *entry)
+{
+  char *error = NULL;
+  int retval;
+  LL2_PROBE_BEGIN (pam_write_login_data, entry->user);
+
+  retval = ll2_ctx_write_entry_uid (context, entry->user, entry->ll_time,
+				    entry->tty, entry->rhost,
+				    entry->pam_service, entry->uid, &error);
+  LL2_PROBE_END (pam_write_login_data, entry->user, retval, 0);
+  if (retval == -EBUSY)
+    {
+      pam_syslog (pamh, LOG_NOTICE,
+		  "Database %s busy, skipped updating last login of %s",
+		  lastlog2_path, entry->user);
+      free (error);
+      return PAM_SUCCESS;
+    }
+  else if (retval != 0)
     {
       if (error)
 	{
@@ -227,8 +304,45 @@ write_login_data (pam_handle_t *pamh, int ctrl, const char *user)
   return PAM_SUCCESS;
 }
 
+/* Hands the entry to lastlog2d. Returns 0 if the daemon took it,
+   else it needs to be written directly. */
+static int
+send_login_data (pam_handle_t *pamh, int ctrl, const struct ll2_entry *entry)
+{
+  char *error = NULL;
+  int ret;
+
+  ret = ll2_send_entry (NULL, entry, &error);
+  if (ret != 0 && (ctrl & LASTLOG2_DEBUG))
+    pam_syslog (pamh, LOG_DEBUG, "Writing directly: %s",
+		error ? error : "lastlog2d not available");
+  free (error);
+
+  return ret;
+}
+
+/* Appends the entry to the spool file. Returns 0 on success, else it
+   needs to be written directly. */
 static int
-show_lastlogin (pam_handle_t *pamh, int ctrl, const char *user)
+spool_login_data (pam_handle_t *pamh, int ctrl, const struct ll2_entry *entry)
+{
+  char *error = NULL;
+  int ret;
+
+  ret = ll2_spool_entry (lastlog2_path, entry, &error);
+  if (ret != 0 && (ctrl & LASTLOG2_DEBUG))
+    pam_syslog (pamh, LOG_DEBUG, "Writing directly: %s",
+		error ? error : "spool not available");
+  free (error);
+
+  return ret;
+}
+
+/* Shows the last login of user. If context is NULL, the database
+   is only opened if the cache cannot be used. */
+static int
+show_lastlogin (pam_handle_t *pamh, int ctrl,
+		struct ll2_context *context, const char *user)
 {
   time_t ll_time = 0;
   char *tty = NULL;
@@ -242,12 +356,38 @@ show_lastlogin (pam_handle_t *pamh, int ctrl, const char *user)
   if (ctrl & LASTLOG2_QUIET)
     return retval;
 
-  if (ll2_check_database (lastlog2_path) != 0)
-    return retval;
+  int ret = -ESTALE;
+  LL2_PROBE_BEGIN (pam_show_lastlogin, user);
+
+  if (ctrl & LASTLOG2_CACHE)
+    ret = ll2_read_cached_entry (lastlog2_path, user, &ll_time, &tty, &rhost,
+				 &service, &error);
+  if (ret == -ESTALE)
+    {
+      if (context != NULL)
+	ret = ll2_ctx_read_entry (context, user, &ll_time, &tty, &rhost,
+				  &service, &error);
+      else if ((ret = ll2_open_context_timeout (lastlog2_path,
+						LL2_OPEN_READONLY,
+						busy_timeout, &context,
+						&error)) == 0)
+	{
+	  ret = ll2_ctx_read_entry (context, user, &ll_time, &tty, &rhost,
+				    &service, &error);
+	  ll2_close_context (context);
+	}
+    }
 
-  int ret = ll2_read_entry (lastlog2_path, user, &ll_time, &tty, &rhost,
-			    &service, &error);
-  if (ret < 0)
+  if (ret == -EBUSY)
+    {
+      if (ctrl & LASTLOG2_DEBUG)
+	pam_syslog (pamh, LOG_DEBUG, "Database %s busy, not showing last login",
+		    lastlog2_path);
+      free (error);
+      LL2_PROBE_END (pam_show_lastlogin, user, ret, 0);
+      return retval;
+    }
+  else if (ret < 0)
     {
       if (error)
 	{
@@ -260,6 +400,7 @@ show_lastlogin (pam_handle_t *pamh, int ctrl, const char *user)
 	  pam_syslog (pamh, LOG_ERR, "Unknown error reading database %s", lastlog2_path);
 	  retval = PAM_SYSTEM_ERR;
 	}
+      LL2_PROBE_END (pam_show_lastlogin, user, ret, 0);
       return retval;
     }
 
@@ -287,6 +428,7 @@ show_lastlogin (pam_handle_t *pamh, int ctrl, const char *user)
   _pam_drop(rhost);
   _pam_drop(tty);
 
+  LL2_PROBE_END (pam_show_lastlogin, user, ret, 0);
   return retval;
 }
 
@@ -324,6 +466,14 @@ pam_sm_open_session (pam_handle_t *pamh, int flags,
   const struct passwd *pwd;
   const void *void_str;
   const char *user;
+  struct ll2_context *context;
+  struct ll2_entry entry;
+  char tty_buf[8];
+  char *error = NULL;
+  int shown = 0;
+  int ret;
+  int use_daemon = 0;
+  int db_exists;
   int ctrl;
 
   ctrl = _pam_parse_args (pamh, flags, argc, argv);
@@ -351,9 +501,71 @@ pam_sm_open_session (pam_handle_t *pamh, int flags,
   if (ctrl & LASTLOG2_DEBUG)
     pam_syslog (pamh, LOG_DEBUG, "user=%s", user);
 
-  show_lastlogin (pamh, ctrl, user);
+  if (get_login_data (pamh, ctrl, user, &entry, tty_buf) != PAM_SUCCESS)
+    return PAM_SYSTEM_ERR;
+  entry.uid = pwd->pw_uid;
+  entry.has_uid = 1;
+
+  /* Check before opening the database, as this will create it. */
+  db_exists = (ll2_check_database (lastlog2_path) == 0);
+
+  /* lastlog2d writes only the default database. */
+  if (!(ctrl & LASTLOG2_NODAEMON) &&
+      strcmp (lastlog2_path, _PATH_LASTLOG2) == 0)
+    use_daemon = 1;
 
-  return write_login_data (pamh, ctrl, user);
+  if ((ctrl & LASTLOG2_SPOOL) || use_daemon)
+    {
+      if (db_exists)
+	{
+	  show_lastlogin (pamh, ctrl, NULL, user);
+	  shown = 1;
+	}
+
+      if (ctrl & LASTLOG2_SPOOL)
+	{
+	  if (spool_login_data (pamh, ctrl, &entry) == 0)
+	    return PAM_SUCCESS;
+	}
+      else if (send_login_data (pamh, ctrl, &entry) == 0)
+	return PAM_SUCCESS;
+    }
+
+  /* Checkpoints are done by lastlog2-checkpoint.timer, not during login.
+     Creating or migrating the database must not wait longer for a lock
+     than writing the entry. */
+  ret = ll2_open_context_timeout (lastlog2_path, LL2_OPEN_NO_CHECKPOINT,
+				  busy_timeout, &context, &error);
+  if (ret == -EBUSY)
+    {
+      pam_syslog (pamh, LOG_NOTICE,
+		  "Database %s busy, skipped updating last login of %s",
+		  lastlog2_path, user);
+      free (error);
+      if (db_exists && !shown)
+	show_lastlogin (pamh, ctrl, NULL, user);
+      return PAM_SUCCESS;
+    }
+  else if (ret != 0)
+    {
+      if (error)
+	{
+	  pam_syslog (pamh, LOG_ERR, "%s", error);
+	  free (error);
+	}
+      else
+	pam_syslog (pamh, LOG_ERR, "Unknown error opening database %s", lastlog2_path);
+      return PAM_SYSTEM_ERR;
+    }
+
+  if (db_exists && !shown)
+    show_lastlogin (pamh, ctrl, context, user);
+
+  retval = write_login_data (pamh, context, &entry);
+
+  ll2_close_context (context);
+
+  return retval;
 }
 
 int
@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Lock the database with a second connection and make sure writes
+   fail with -EBUSY after the busy timeout, succeed if the lock gets
+   released in time and that a checkpoint does not wait at all.
+   Creating a new database, which is locked, must fail with -EBUSY
+   after the timeout passed to ll2_open_context_timeout.
+*/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *
+release_lock (void *arg)
+{
+  sqlite3 *db = arg;
+  struct timespec delay = { 0, 50 * 1000000 };
+
+  nanosleep (&delay, NULL);
+  sqlite3_exec (db, "COMMIT", NULL, NULL, NULL);
+
+  return NULL;
+}
+
+/* Write an entry and return the result, the duration in ms is stored
+   in elapsed. */
+static int
+timed_write (struct ll2_context *context, int64_t *elapsed)
+{
+  int64_t start = now_ms ();
+  char *error = NULL;
+  int ret;
+
+  ret = ll2_ctx_write_entry (context, "tstuser", 1000, "pts/0", NULL, NULL,
+			     &error);
+  *elapsed = now_ms () - start;
+  if (ret != 0 && ret != -EBUSY)
+    fprintf (stderr, "ll2_ctx_write_entry: %s\n", error ? error : "failed");
+  free (error);
+
+  return ret;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-busy-timeout.db";
+  const char *new_path = "tst-busy-timeout-new.db";
+  struct ll2_context *context;
+  pthread_t thread;
+  char *error = NULL;
+  int64_t elapsed;
+  sqlite3 *db;
+  int ret;
+
+  remove (db_path);
+  remove (new_path);
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      fprintf (stderr, "ll2_open_context: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (sqlite3_open (db_path, &db) != SQLITE_OK ||
+      sqlite3_exec (db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf (stderr, "Couldn't lock database\n");
+      return 1;
+    }
+
+  ll2_ctx_set_busy_timeout (context, 0);
+  if ((ret = timed_write (context, &elapsed)) != -EBUSY || elapsed > 20)
+    {
+      fprintf (stderr, "Without timeout: ret=%d after %lld ms\n", ret,
+	       (long long)elapsed);
+      return 1;
+    }
+
+  ll2_ctx_set_busy_timeout (context, 100);
+  if ((ret = timed_write (context, &elapsed)) != -EBUSY ||
+      elapsed < 100 || elapsed > 1000)
+    {
+      fprintf (stderr, "With timeout: ret=%d after %lld ms\n", ret,
+	       (long long)elapsed);
+      return 1;
+    }
+
+  /* Checkpoints must not wait for the lock. */
+  ll2_ctx_set_busy_timeout (context, 10000);
+  elapsed = now_ms ();
+  if (ll2_ctx_checkpoint (context, &error) != 0 ||
+      now_ms () - elapsed > 1000)
+    {
+      fprintf (stderr, "ll2_ctx_checkpoint: %s\n", error ? error : "too slow");
+      return 1;
+    }
+
+  /* Lock gets released while waiting. */
+  if (pthread_create (&thread, NULL, release_lock, db) != 0)
+    {
+      fprintf (stderr, "pthread_create failed\n");
+      return 1;
+    }
+  if ((ret = timed_write (context, &elapsed)) != 0)
+    {
+      fprintf (stderr, "Released lock: ret=%d after %lld ms\n", ret,
+	       (long long)elapsed);
+      return 1;
+    }
+  pthread_join (thread, NULL);
+
+  sqlite3_close (db);
+  ll2_close_context (context);
+
+  if (sqlite3_open (new_path, &db) != SQLITE_OK ||
+      sqlite3_exec (db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf (stderr, "Couldn't lock new database\n");
+      return 1;
+    }
+  elapsed = now_ms ();
+  ret = ll2_open_context_timeout (new_path, 0, 50, &context, &error);
+  elapsed = now_ms () - elapsed;
+  if (ret != -EBUSY || context != NULL || elapsed < 50 || elapsed > 1000)
+    {
+      fprintf (stderr, "Open locked database: ret=%d after %lld ms\n", ret,
+	       (long long)elapsed);
+      return 1;
+    }
+  free (error);
+  sqlite3_close (db);
+
+  return 0;
+}
@@ -0,0 +1,252 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+/* Test case:
+   Build the cache, make sure lookups in it follow the changes done
+   with the library, that it is not trusted after the database was
+   changed behind its back, and that a checkpoint rebuilds it.
+   New strings filling the string area make the cache invalid.
+   Rebuilding must not wait forever for a writer holding the cache.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+static int
+check_cached (const char *db_path, const char *user, int expected,
+	      int64_t ll_time, const char *tty)
+{
+  int64_t res_time = 0;
+  char *res_tty = NULL;
+  int ret;
+
+  ret = ll2_read_cached_entry (db_path, user, &res_time, &res_tty, NULL,
+			       NULL, NULL);
+  if (ret != expected)
+    {
+      fprintf (stderr, "Cached lookup of '%s' returned %d, expected %d\n",
+	       user, ret, expected);
+      free (res_tty);
+      return 1;
+    }
+
+  if (ret == 0 && (res_time != ll_time ||
+		   (tty == NULL ? res_tty != NULL :
+		    res_tty == NULL || strcmp (res_tty, tty) != 0)))
+    {
+      fprintf (stderr, "Wrong cached entry for '%s': %lld %s\n", user,
+	       (long long)res_time, res_tty ? res_tty : "NULL");
+      free (res_tty);
+      return 1;
+    }
+  free (res_tty);
+
+  return 0;
+}
+
+static int
+rebuild (const char *db_path, int checkpoint)
+{
+  struct ll2_context *context;
+  char *error = NULL;
+  int ret;
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      fprintf (stderr, "ll2_open_context: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (checkpoint)
+    ret = ll2_ctx_checkpoint (context, &error);
+  else
+    ret = ll2_ctx_rebuild_cache (context, &error);
+  ll2_close_context (context);
+
+  if (ret != 0)
+    {
+      fprintf (stderr, "%s: %s\n", checkpoint ? "ll2_ctx_checkpoint" :
+	       "ll2_ctx_rebuild_cache", error ? error : "failed");
+      return 1;
+    }
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-cache.db";
+  struct ll2_entry entry = { .user = "spooled", .ll_time = 9000 };
+  struct ll2_entry many[2000];
+  char hosts[2000][64];
+  struct ll2_context *context;
+  char long_name[100];
+  char *error = NULL;
+  sqlite3 *db;
+  int fd, ret;
+
+  remove (db_path);
+  remove ("tst-cache.db.cache");
+  remove ("tst-cache.db.spool");
+
+  memset (long_name, 'x', sizeof (long_name) - 1);
+  long_name[sizeof (long_name) - 1] = '\0';
+
+  if (ll2_write_entry (db_path, "tstuser", 1000, "pts/1", NULL, NULL,
+		       &error) != 0 ||
+      ll2_write_entry (db_path, "other", 2000, "pts/2", NULL, NULL,
+		       &error) != 0 ||
+      ll2_write_entry (db_path, long_name, 3000, "pts/3", NULL, NULL,
+		       &error) != 0)
+    {
+      fprintf (stderr, "ll2_write_entry: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (check_cached (db_path, "tstuser", -ESTALE, 0, NULL))
+    return 1;
+
+  if (rebuild (db_path, 0))
+    return 1;
+
+  if (check_cached (db_path, "tstuser", 0, 1000, "pts/1") ||
+      check_cached (db_path, "other", 0, 2000, "pts/2") ||
+      check_cached (db_path, "nobody", -ENOENT, 0, NULL) ||
+      check_cached (db_path, long_name, 0, 3000, "pts/3"))
+    return 1;
+
+  /* Changes done with the library keep the cache valid. */
+  if (ll2_write_entry (db_path, "tstuser", 4000, "pts/4", NULL, NULL,
+		       &error) != 0 ||
+      ll2_update_login_time (db_path, "other", 5000, &error) != 0 ||
+      ll2_rename_user (db_path, "other", "renamed", &error) != 0)
+    {
+      fprintf (stderr, "Changing entries failed: %s\n",
+	       error ? error : "unknown error");
+      return 1;
+    }
+
+  if (check_cached (db_path, "tstuser", 0, 4000, "pts/4") ||
+      check_cached (db_path, "other", -ENOENT, 0, NULL) ||
+      check_cached (db_path, "renamed", 0, 5000, "pts/2"))
+    return 1;
+
+  if (ll2_remove_entry (db_path, "renamed", &error) != 0)
+    {
+      fprintf (stderr, "ll2_remove_entry: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_cached (db_path, "renamed", -ENOENT, 0, NULL))
+    return 1;
+
+  /* Spooled entries are not in the cache. */
+  if (ll2_spool_entry (db_path, &entry, &error) != 0)
+    {
+      fprintf (stderr, "ll2_spool_entry: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_cached (db_path, "tstuser", -ESTALE, 0, NULL))
+    return 1;
+  if (ll2_compact_journal (db_path, &error) != 1)
+    {
+      fprintf (stderr, "ll2_compact_journal: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_cached (db_path, "spooled", 0, 9000, NULL) ||
+      check_cached (db_path, "tstuser", 0, 4000, "pts/4"))
+    return 1;
+
+  /* A change by somebody else must not be missed. */
+  if (sqlite3_open (db_path, &db) != SQLITE_OK ||
+      sqlite3_exec (db, "UPDATE Lastlog2 SET Time = 6000 WHERE Name = 'tstuser'",
+		    NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf (stderr, "Updating database failed: %s\n", sqlite3_errmsg (db));
+      return 1;
+    }
+  sqlite3_close (db);
+
+  if (check_cached (db_path, "tstuser", -ESTALE, 0, NULL))
+    return 1;
+
+  if (rebuild (db_path, 1))
+    return 1;
+
+  if (check_cached (db_path, "tstuser", 0, 6000, "pts/4"))
+    return 1;
+
+  for (size_t i = 0; i < sizeof (many) / sizeof (many[0]); i++)
+    {
+      snprintf (hosts[i], sizeof (hosts[i]),
+		"host-%04zu.with.a.rather.long.domain.name.example.com", i);
+      many[i] = (struct ll2_entry) { .user = hosts[i], .ll_time = 7000,
+				     .rhost = hosts[i] };
+    }
+  if (ll2_write_entries (db_path, many, sizeof (many) / sizeof (many[0]), 0,
+			 NULL, &error) != 0)
+    {
+      fprintf (stderr, "ll2_write_entries: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_cached (db_path, "tstuser", -ESTALE, 0, NULL))
+    return 1;
+
+  if (rebuild (db_path, 0))
+    return 1;
+
+  if (check_cached (db_path, "tstuser", 0, 6000, "pts/4") ||
+      check_cached (db_path, hosts[1999], 0, 7000, NULL))
+    return 1;
+
+  if ((fd = open ("tst-cache.db.cache", O_RDWR)) < 0 ||
+      flock (fd, LOCK_EX) != 0 ||
+      (context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      fprintf (stderr, "Locking cache: %s\n", error ? error : "failed");
+      return 1;
+    }
+  ll2_ctx_set_busy_timeout (context, 20);
+  if ((ret = ll2_ctx_rebuild_cache (context, &error)) != -EBUSY)
+    {
+      fprintf (stderr, "Rebuild of locked cache returned %d, expected -EBUSY\n",
+	       ret);
+      return 1;
+    }
+  free (error);
+  close (fd);
+  ll2_close_context (context);
+
+  return 0;
+}
@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Open one context, write, read, rename and remove several entries
+   with it, so that the cached statements get reused.
+*/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lastlog2.h"
+
+static int
+check_entry (struct ll2_context *context, const char *user,
+	     int64_t expect_time, const char *expect_tty)
+{
+  int64_t ll_time = 0;
+  char *tty = NULL;
+  char *error = NULL;
+
+  if (ll2_ctx_read_entry (context, user, &ll_time, &tty, NULL, NULL,
+			  &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "Couldn't read entry for '%s'\n", user);
+      return 1;
+    }
+
+  if (ll_time != expect_time || tty == NULL || strcmp (tty, expect_tty) != 0)
+    {
+      fprintf (stderr, "Wrong data for '%s': got %lld/%s, expect %lld/%s\n",
+	       user, (long long int)ll_time, tty,
+	       (long long int)expect_time, expect_tty);
+      free (tty);
+      return 1;
+    }
+
+  free (tty);
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-context.db";
+  struct ll2_context *context;
+  char user[32];
+  char *error = NULL;
+  int i;
+
+  remove (db_path);
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "ll2_open_context failed\n");
+      return 1;
+    }
+
+  for (i = 0; i < 100; i++)
+    {
+      snprintf (user, sizeof (user), "user%d", i);
+      if (ll2_ctx_write_entry (context, user, 1000 + i, "pts/0",
+			       "localhost", "sshd", &error) != 0)
+	{
+	  if (error)
+	    {
+	      fprintf (stderr, "%s\n", error);
+	      free (error);
+	    }
+	  else
+	    fprintf (stderr, "ll2_ctx_write_entry failed\n");
+	  return 1;
+	}
+    }
+
+  for (i = 0; i < 100; i++)
+    {
+      snprintf (user, sizeof (user), "user%d", i);
+      if (check_entry (context, user, 1000 + i, "pts/0") != 0)
+	return 1;
+    }
+
+  if (ll2_ctx_update_login_time (context, "user1", 5000, &error) != 0 ||
+      ll2_ctx_rename_user (context, "user2", "renamed", &error) != 0 ||
+      ll2_ctx_remove_entry (context, "user3", &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "Modifying entries failed\n");
+      return 1;
+    }
+
+  if (check_entry (context, "user1", 5000, "pts/0") != 0 ||
+      check_entry (context, "renamed", 1002, "pts/0") != 0)
+    return 1;
+
+  if (ll2_ctx_read_entry (context, "user2", NULL, NULL, NULL, NULL,
+			  NULL) != -ENOENT ||
+      ll2_ctx_read_entry (context, "user3", NULL, NULL, NULL, NULL,
+			  NULL) != -ENOENT)
+    {
+      fprintf (stderr, "Renamed or removed entry still exists\n");
+      return 1;
+    }
+
+  ll2_close_context (context);
+
+  /* The path based functions need to see the same data. */
+  if (ll2_read_entry (db_path, "user1", NULL, NULL, NULL, NULL, NULL) != 0)
+    {
+      fprintf (stderr, "Data written with context not found\n");
+      return 1;
+    }
+
+  return 0;
+}
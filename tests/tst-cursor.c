@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Write more entries than fit in one page of a cursor, read them all
+   with a cursor, page through them with start key and limit and make
+   sure a write between pages is not blocked by the cursor.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lastlog2.h"
+
+#define NUM_ENTRIES 1000
+#define PAGE_SIZE   300
+
+static void
+print_error (const char *func, char *error)
+{
+  if (error)
+    {
+      fprintf (stderr, "%s: %s\n", func, error);
+      free (error);
+    }
+  else
+    fprintf (stderr, "%s failed\n", func);
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-cursor.db";
+  struct ll2_entry entries[NUM_ENTRIES];
+  char names[NUM_ENTRIES][16];
+  struct ll2_context *context;
+  struct ll2_cursor *cursor;
+  struct ll2_entry entry;
+  char last[16] = "";
+  char *error = NULL;
+  int i, ret;
+
+  remove (db_path);
+
+  memset (entries, 0, sizeof (entries));
+  for (i = 0; i < NUM_ENTRIES; i++)
+    {
+      /* Zero padded, so that sorting by name is sorting by number. */
+      snprintf (names[i], sizeof (names[i]), "user%04d", i);
+      entries[i].user = names[i];
+      entries[i].ll_time = 1000 + i;
+      entries[i].tty = "pts/0";
+    }
+
+  if (ll2_write_entries (db_path, entries, NUM_ENTRIES, 0, NULL,
+			 &error) != 0)
+    {
+      print_error ("ll2_write_entries", error);
+      return 1;
+    }
+
+  /* Read everything. */
+  if ((cursor = ll2_open_cursor (db_path, NULL, 0, &error)) == NULL)
+    {
+      print_error ("ll2_open_cursor", error);
+      return 1;
+    }
+  for (i = 0; (ret = ll2_cursor_next (cursor, &entry, &error)) == 1; i++)
+    {
+      if (i >= NUM_ENTRIES || strcmp (entry.user, names[i]) != 0 ||
+	  entry.ll_time != 1000 + i || strcmp (entry.tty, "pts/0") != 0 ||
+	  entry.tty_len != 5 || entry.rhost != NULL)
+	{
+	  fprintf (stderr, "Wrong entry %d: '%s'\n", i, entry.user);
+	  return 1;
+	}
+    }
+  if (ret != 0 || i != NUM_ENTRIES)
+    {
+      print_error ("ll2_cursor_next", error);
+      return 1;
+    }
+  ll2_cursor_close (cursor);
+
+  /* Page through the entries, writing between the pages. */
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      print_error ("ll2_open_context", error);
+      return 1;
+    }
+  for (i = 0; i < NUM_ENTRIES; )
+    {
+      int n = 0;
+
+      if ((cursor = ll2_ctx_open_cursor (context, i ? last : NULL,
+					 PAGE_SIZE, &error)) == NULL)
+	{
+	  print_error ("ll2_ctx_open_cursor", error);
+	  return 1;
+	}
+      while ((ret = ll2_cursor_next (cursor, &entry, &error)) == 1)
+	{
+	  const char *expected = i + n < NUM_ENTRIES ? names[i + n] : "zzz";
+
+	  if (strcmp (entry.user, expected) != 0)
+	    {
+	      fprintf (stderr, "Got '%s', expected '%s'\n", entry.user,
+		       expected);
+	      return 1;
+	    }
+	  strcpy (last, entry.user);
+	  n++;
+
+	  /* Newer than all entries, so it ends up in the last page. */
+	  if (n == 1 &&
+	      ll2_ctx_write_entry (context, "zzz", 1, NULL, NULL, NULL,
+				   &error) != 0)
+	    {
+	      print_error ("ll2_ctx_write_entry", error);
+	      return 1;
+	    }
+	}
+      ll2_cursor_close (cursor);
+
+      if (ret != 0 || n != (NUM_ENTRIES - i < PAGE_SIZE ?
+			    NUM_ENTRIES - i + 1 : PAGE_SIZE))
+	{
+	  fprintf (stderr, "Page at %d has %d entries\n", i, n);
+	  return 1;
+	}
+      i += n;
+    }
+
+  if (strcmp (last, "zzz") != 0)
+    {
+      fprintf (stderr, "Entry written during paging is missing\n");
+      return 1;
+    }
+  ll2_close_context (context);
+
+  return 0;
+}
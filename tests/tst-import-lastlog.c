@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Create an old lastlog file with entries for all users in passwd
+   and a far away UID without user, import it by reading the file
+   and by looking up passwd entries and check that newer entries in
+   the database are not overwritten and that an import recorded as
+   partially done gets resumed at the stored position.
+*/
+
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lastlog.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+struct progress_data {
+  uint64_t scanned;
+  uint64_t imported;
+};
+
+static int
+progress (uint64_t scanned, uint64_t imported, void *userdata)
+{
+  struct progress_data *data = userdata;
+
+  data->scanned = scanned;
+  data->imported = imported;
+
+  return 0;
+}
+
+/* UID without passwd entry, leaves a large hole in the file. */
+#define UNKNOWN_UID 3000000
+
+/* Write a lastlog entry with time 1000 + UID for every passwd entry
+   and for UNKNOWN_UID and return the number of passwd entries. */
+static int
+create_lastlog (const char *ll_path)
+{
+  const struct passwd *pw;
+  struct lastlog ll;
+  FILE *fp;
+  int count = 0;
+
+  if ((fp = fopen (ll_path, "w")) == NULL)
+    return -1;
+
+  setpwent ();
+  while ((pw = getpwent ()) != NULL)
+    {
+      memset (&ll, 0, sizeof (ll));
+      ll.ll_time = 1000 + pw->pw_uid;
+      strncpy (ll.ll_line, "tty1", sizeof (ll.ll_line));
+      strncpy (ll.ll_host, "oldhost", sizeof (ll.ll_host));
+
+      if (fseeko (fp, (off_t)pw->pw_uid * sizeof (ll), SEEK_SET) != 0 ||
+	  fwrite (&ll, sizeof (ll), 1, fp) != 1)
+	{
+	  fclose (fp);
+	  return -1;
+	}
+      count++;
+    }
+  endpwent ();
+
+  ll.ll_time = 1000;
+  if (fseeko (fp, (off_t)UNKNOWN_UID * sizeof (ll), SEEK_SET) != 0 ||
+      fwrite (&ll, sizeof (ll), 1, fp) != 1)
+    count = -1;
+  fclose (fp);
+
+  return count;
+}
+
+static int
+import (const char *db_path, const char *ll_path, int flags,
+	struct progress_data *data)
+{
+  struct ll2_context *context;
+  char *error = NULL;
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL ||
+      ll2_ctx_import_lastlog (context, ll_path, flags, progress, data,
+			      &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "Import failed\n");
+      return 1;
+    }
+  ll2_close_context (context);
+
+  return 0;
+}
+
+/* Imports ll_path twice with flags, the second time with an import
+   state at position, which is where the import ends. */
+static int
+test_import (const char *db_path, const char *ll_path, int flags,
+	     int count, int64_t position)
+{
+  struct progress_data data = { 0, 0 };
+  const struct passwd *pw = getpwuid (0);
+  char *tty = NULL;
+  char *error = NULL;
+  char *file;
+  char *sql;
+  int64_t ll_time;
+  sqlite3 *db;
+
+  remove (db_path);
+
+  /* Newer than the imported data, needs to survive. */
+  if (ll2_write_entry (db_path, pw->pw_name, 5000, "pts/9", NULL, "sshd",
+		       &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "ll2_write_entry failed\n");
+      return 1;
+    }
+
+  if (import (db_path, ll_path, flags, &data) != 0)
+    return 1;
+
+  if (data.imported != (uint64_t)count ||
+      (!(flags & LL2_IMPORT_SPARSE) && data.scanned != (uint64_t)count))
+    {
+      fprintf (stderr, "Progress reported %llu/%llu, expected %d\n",
+	       (unsigned long long)data.scanned,
+	       (unsigned long long)data.imported, count);
+      return 1;
+    }
+
+  if (ll2_read_entry (db_path, pw->pw_name, &ll_time, &tty, NULL, NULL,
+		      NULL) != 0 || ll_time != 5000 || strcmp (tty, "pts/9") != 0)
+    {
+      fprintf (stderr, "Newer entry got overwritten by import\n");
+      return 1;
+    }
+  free (tty);
+
+  /* Pretend an earlier import got interrupted after all entries. */
+  file = realpath (ll_path, NULL);
+
+  remove (db_path);
+  if (ll2_write_entry (db_path, pw->pw_name, 5000, "pts/9", NULL, "sshd",
+		       NULL) != 0 ||
+      sqlite3_open (db_path, &db) != SQLITE_OK ||
+      asprintf (&sql, "INSERT INTO ImportState VALUES('%s', %d, %lld)",
+		file, (flags & LL2_IMPORT_SPARSE) ? 1 : 0,
+		(long long)position) < 0 ||
+      sqlite3_exec (db, sql, 0, 0, NULL) != SQLITE_OK)
+    {
+      fprintf (stderr, "Couldn't create import state\n");
+      return 1;
+    }
+  sqlite3_close (db);
+  free (sql);
+  free (file);
+
+  if (import (db_path, ll_path, flags, &data) != 0)
+    return 1;
+
+  if (data.imported != 0)
+    {
+      fprintf (stderr, "Resumed import did not skip finished part\n");
+      return 1;
+    }
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-import-lastlog.db";
+  const char *ll_path = "tst-import-lastlog.lastlog";
+  int count;
+
+  if ((count = create_lastlog (ll_path)) <= 0 ||
+      getpwuid (0) == NULL || getpwuid (UNKNOWN_UID) != NULL)
+    {
+      fprintf (stderr, "Couldn't create lastlog file\n");
+      return 1;
+    }
+
+  if (test_import (db_path, ll_path, LL2_IMPORT_SPARSE, count,
+		   (int64_t)(UNKNOWN_UID + 1) * sizeof (struct lastlog)) != 0 ||
+      test_import (db_path, ll_path, 0, count, count) != 0)
+    return 1;
+
+  remove (ll_path);
+
+  return 0;
+}
@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Start lastlog2d on its own socket and database, send several
+   logins of the same users and make sure only the newest one of
+   every user is written. Sending to a missing socket must fail with
+   -ENOENT, so that callers can fall back to direct writes.
+*/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "lastlog2.h"
+
+static const char *db_path = "tst-lastlog2d.db";
+static const char *socket_path = "tst-lastlog2d.sock";
+
+static void
+sleep_ms (long ms)
+{
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+  nanosleep (&ts, NULL);
+}
+
+static int
+send_entry (const char *user, int64_t ll_time, const char *tty)
+{
+  struct ll2_entry entry = { .user = user, .ll_time = ll_time, .tty = tty };
+  char *error = NULL;
+  int ret;
+
+  if ((ret = ll2_send_entry (socket_path, &entry, &error)) != 0)
+    {
+      fprintf (stderr, "ll2_send_entry: %s\n", error ? error : "failed");
+      free (error);
+    }
+
+  return ret;
+}
+
+/* Waits until the entry of user has ll_time. */
+static int
+wait_for_entry (const char *user, int64_t ll_time)
+{
+  for (int i = 0; i < 200; i++)
+    {
+      int64_t res_time = 0;
+
+      if (ll2_read_entry (db_path, user, &res_time, NULL, NULL, NULL,
+			  NULL) == 0 && res_time == ll_time)
+	return 0;
+      sleep_ms (10);
+    }
+
+  fprintf (stderr, "Entry of '%s' was not written with time %lld\n",
+	   user, (long long)ll_time);
+  return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct ll2_entry entry = { .user = "tstuser" };
+  struct stat st;
+  char *tty = NULL;
+  char *error = NULL;
+  char big[2048];
+  pid_t pid;
+  int status;
+  int i;
+
+  if (argc != 2)
+    {
+      fprintf (stderr, "Usage: tst-lastlog2d <lastlog2d>\n");
+      return 1;
+    }
+
+  remove (db_path);
+  remove (socket_path);
+
+  if (ll2_send_entry (socket_path, &entry, &error) != -ENOENT)
+    {
+      fprintf (stderr, "Sending without daemon did not fail\n");
+      return 1;
+    }
+  free (error);
+  error = NULL;
+
+  if ((pid = fork ()) < 0)
+    return 1;
+  if (pid == 0)
+    {
+      execl (argv[1], "lastlog2d", "-d", db_path, "-s", socket_path,
+	     "-c", "50", NULL);
+      _exit (127);
+    }
+
+  for (i = 0; i < 200 && stat (socket_path, &st) != 0; i++)
+    sleep_ms (10);
+  if (i == 200 || (st.st_mode & 0777) != 0600)
+    {
+      fprintf (stderr, "lastlog2d did not create socket\n");
+      kill (pid, SIGTERM);
+      return 1;
+    }
+
+  if (send_entry ("alice", 100, "pts/1") != 0 ||
+      send_entry ("alice", 300, "pts/3") != 0 ||
+      send_entry ("bob", 50, NULL) != 0 ||
+      send_entry ("alice", 200, "pts/2") != 0)
+    {
+      kill (pid, SIGTERM);
+      return 1;
+    }
+
+  memset (big, 'x', sizeof (big) - 1);
+  big[sizeof (big) - 1] = '\0';
+  entry.user = big;
+  if (ll2_send_entry (socket_path, &entry, &error) != -EINVAL)
+    {
+      fprintf (stderr, "Too large entry was not rejected\n");
+      kill (pid, SIGTERM);
+      return 1;
+    }
+  free (error);
+
+  if (wait_for_entry ("alice", 300) != 0 || wait_for_entry ("bob", 50) != 0)
+    {
+      kill (pid, SIGTERM);
+      return 1;
+    }
+
+  if (ll2_read_entry (db_path, "alice", NULL, &tty, NULL, NULL, NULL) != 0 ||
+      tty == NULL || strcmp (tty, "pts/3") != 0)
+    {
+      fprintf (stderr, "Wrong tty for newest login: %s\n", tty ? tty : "NULL");
+      kill (pid, SIGTERM);
+      return 1;
+    }
+  free (tty);
+
+  /* Records still pending get written at exit. */
+  if (send_entry ("carol", 400, NULL) != 0 ||
+      kill (pid, SIGTERM) != 0 ||
+      waitpid (pid, &status, 0) != pid ||
+      !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      fprintf (stderr, "lastlog2d did not exit cleanly\n");
+      return 1;
+    }
+
+  if (wait_for_entry ("carol", 400) != 0)
+    return 1;
+
+  if (stat (socket_path, &st) == 0)
+    {
+      fprintf (stderr, "lastlog2d did not remove its socket\n");
+      return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Delete most entries of a new database, which has incremental
+   auto_vacuum, and make sure ll2_ctx_maintain gives the free pages
+   back and keeps the remaining entries. Then turn auto_vacuum off
+   and make sure LL2_MAINTAIN_VACUUM turns it on again. Strings only
+   used by the deleted entries need to be removed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+#define NUM_ENTRIES 5000
+#define KEEP_ENTRIES 100
+
+static int
+get_space (struct ll2_context *context, struct ll2_space **space)
+{
+  char *error = NULL;
+
+  if (ll2_ctx_get_space (context, space, &error) != 0)
+    {
+      fprintf (stderr, "ll2_ctx_get_space: %s\n", error ? error : "failed");
+      free (error);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Returns how often value is in Lastlog2_Strings, -1 on failure. */
+static int
+count_strings (sqlite3 *db, const char *value)
+{
+  sqlite3_stmt *res;
+  int count = -1;
+
+  if (sqlite3_prepare_v2 (db, "SELECT count(*) FROM Lastlog2_Strings WHERE Value = ?",
+			  -1, &res, 0) != SQLITE_OK)
+    return -1;
+  if (sqlite3_bind_text (res, 1, value, -1, SQLITE_STATIC) == SQLITE_OK &&
+      sqlite3_step (res) == SQLITE_ROW)
+    count = sqlite3_column_int (res, 0);
+  sqlite3_finalize (res);
+
+  return count;
+}
+
+static int
+maintain (struct ll2_context *context, int tasks)
+{
+  char *error = NULL;
+  int ret;
+
+  if ((ret = ll2_ctx_maintain (context, tasks, &error)) != 0)
+    {
+      fprintf (stderr, "ll2_ctx_maintain: %d %s\n", ret,
+	       error ? error : "failed");
+      free (error);
+      return -1;
+    }
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-maintain.db";
+  static struct ll2_entry entries[NUM_ENTRIES];
+  static char names[NUM_ENTRIES][16];
+  struct ll2_context *context;
+  struct ll2_space *space;
+  char *error = NULL;
+  int64_t pages;
+  int found = 0;
+  sqlite3 *db;
+  int i;
+
+  remove (db_path);
+
+  for (i = 0; i < NUM_ENTRIES; i++)
+    {
+      snprintf (names[i], sizeof (names[i]), "user%05d", i);
+      entries[i].user = names[i];
+      entries[i].ll_time = 1000 + i;
+      entries[i].tty = "pts/0";
+      entries[i].rhost = i < KEEP_ENTRIES ? "localhost" : "remote";
+      entries[i].pam_service = "sshd";
+    }
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL ||
+      ll2_ctx_write_entries (context, entries, NUM_ENTRIES, 0, NULL,
+			     &error) != 0)
+    {
+      fprintf (stderr, "Writing entries: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (sqlite3_open (db_path, &db) != SQLITE_OK ||
+      sqlite3_exec (db, "DELETE FROM Lastlog2 WHERE Name >= 'user00100'",
+		    NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf (stderr, "Deleting entries: %s\n", sqlite3_errmsg (db));
+      return 1;
+    }
+
+  if (get_space (context, &space) != 0)
+    return 1;
+  if (space->auto_vacuum != 2 || space->freelist_count == 0)
+    {
+      fprintf (stderr, "New database: auto_vacuum=%d, %lld free pages\n",
+	       space->auto_vacuum, (long long)space->freelist_count);
+      return 1;
+    }
+  /* dbstat is optional. */
+  for (size_t j = 0; j < space->count; j++)
+    if (strcmp (space->objects[j].name, "Lastlog2") == 0 &&
+	space->objects[j].pages > 0)
+      found = 1;
+  if (space->count > 0 && !found)
+    {
+      fprintf (stderr, "Lastlog2 missing in space report\n");
+      return 1;
+    }
+  pages = space->page_count;
+  free (space);
+
+  if (maintain (context, LL2_MAINTAIN_OPTIMIZE |
+		LL2_MAINTAIN_INCREMENTAL) != 0 ||
+      get_space (context, &space) != 0)
+    return 1;
+  if (space->freelist_count != 0 || space->page_count >= pages)
+    {
+      fprintf (stderr, "After incremental vacuum: %lld of %lld pages, %lld free\n",
+	       (long long)space->page_count, (long long)pages,
+	       (long long)space->freelist_count);
+      return 1;
+    }
+  free (space);
+
+  if (count_strings (db, "remote") != 0 ||
+      count_strings (db, "localhost") != 1)
+    {
+      fprintf (stderr, "Unused strings not removed\n");
+      return 1;
+    }
+
+  if (sqlite3_exec (db, "PRAGMA auto_vacuum = NONE; VACUUM",
+		    NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf (stderr, "Turning off auto_vacuum: %s\n", sqlite3_errmsg (db));
+      return 1;
+    }
+  sqlite3_close (db);
+
+  if (maintain (context, LL2_MAINTAIN_VACUUM) != 0 ||
+      get_space (context, &space) != 0)
+    return 1;
+  if (space->auto_vacuum != 2)
+    {
+      fprintf (stderr, "After vacuum: auto_vacuum=%d\n", space->auto_vacuum);
+      return 1;
+    }
+  free (space);
+
+  for (i = 0; i < NUM_ENTRIES; i++)
+    {
+      int ret = ll2_ctx_read_entry (context, names[i], NULL, NULL, NULL,
+				    NULL, NULL);
+
+      if ((i < KEEP_ENTRIES) != (ret == 0))
+	{
+	  fprintf (stderr, "Entry %s: %d\n", names[i], ret);
+	  return 1;
+	}
+    }
+  ll2_close_context (context);
+
+  return 0;
+}
@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Purge the entries with an old login, which needs more than one
+   chunk, and the entries of users not in passwd. A dry run needs to
+   count the same entries without removing them. Strings only used
+   by the purged entries need to be removed, too.
+*/
+
+#include <pwd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+#define NUM_ENTRIES 2500
+#define OLD_ENTRIES 1200
+
+static char names[NUM_ENTRIES][32];
+
+static int
+purge (struct ll2_context *context, int orphans, int64_t before, int flags,
+       size_t expect)
+{
+  size_t count = 0;
+  char *error = NULL;
+  int ret;
+
+  if (orphans)
+    ret = ll2_ctx_purge_orphans (context, flags, &count, &error);
+  else
+    ret = ll2_ctx_purge_before (context, before, flags, &count, &error);
+
+  if (ret != 0 || count != expect)
+    {
+      fprintf (stderr, "Purge %s%s: ret=%d, count=%zu, expected %zu: %s\n",
+	       orphans ? "orphans" : "before",
+	       (flags & LL2_PURGE_DRY_RUN) ? " (dry run)" : "", ret, count,
+	       expect, error ? error : "");
+      free (error);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Checks, that the entries from first to last exist or not. */
+static int
+check_entries (struct ll2_context *context, int first, int last, int exist)
+{
+  for (int i = first; i <= last; i++)
+    if ((ll2_ctx_read_entry (context, names[i], NULL, NULL, NULL, NULL,
+			     NULL) == 0) != exist)
+      {
+	fprintf (stderr, "Entry %s %s\n", names[i],
+		 exist ? "missing" : "not removed");
+	return -1;
+      }
+
+  return 0;
+}
+
+/* Checks, that value is in Lastlog2_Strings or not. */
+static int
+check_string (const char *db_path, const char *value, int exist)
+{
+  sqlite3 *db;
+  sqlite3_stmt *res;
+  int found = -1;
+
+  if (sqlite3_open_v2 (db_path, &db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK &&
+      sqlite3_prepare_v2 (db, "SELECT count(*) FROM Lastlog2_Strings WHERE Value = ?",
+			  -1, &res, 0) == SQLITE_OK)
+    {
+      if (sqlite3_bind_text (res, 1, value, -1, SQLITE_STATIC) == SQLITE_OK &&
+	  sqlite3_step (res) == SQLITE_ROW)
+	found = sqlite3_column_int (res, 0);
+      sqlite3_finalize (res);
+    }
+  sqlite3_close (db);
+
+  if (found != exist)
+    {
+      fprintf (stderr, "String %s: found %d times, expected %d\n", value,
+	       found, exist);
+      return -1;
+    }
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-purge.db";
+  static struct ll2_entry entries[NUM_ENTRIES];
+  struct ll2_context *context;
+  int64_t now = time (NULL);
+  int64_t cutoff = now - 86400;
+  char *error = NULL;
+  struct passwd *pw;
+  int i;
+
+  /* Needs one user, which exists. */
+  if ((pw = getpwuid (0)) == NULL)
+    return 77;
+
+  remove (db_path);
+
+  for (i = 0; i < NUM_ENTRIES; i++)
+    {
+      if (i == 0)
+	snprintf (names[i], sizeof (names[i]), "%s", pw->pw_name);
+      else
+	snprintf (names[i], sizeof (names[i]), "tst-purge-%05d", i);
+      entries[i].user = names[i];
+      entries[i].ll_time = i < OLD_ENTRIES ? 1000 + i : now;
+      entries[i].tty = i < OLD_ENTRIES ? "tty1" : "pts/0";
+      entries[i].pam_service = i > 0 ? "sshd" : NULL;
+    }
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL ||
+      ll2_ctx_write_entries (context, entries, NUM_ENTRIES, 0, NULL,
+			     &error) != 0)
+    {
+      fprintf (stderr, "Writing entries: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (purge (context, 0, cutoff, LL2_PURGE_DRY_RUN, OLD_ENTRIES) != 0 ||
+      check_entries (context, 0, NUM_ENTRIES - 1, 1) != 0 ||
+      purge (context, 0, cutoff, 0, OLD_ENTRIES) != 0 ||
+      check_entries (context, 0, OLD_ENTRIES - 1, 0) != 0 ||
+      check_entries (context, OLD_ENTRIES, NUM_ENTRIES - 1, 1) != 0 ||
+      check_string (db_path, "tty1", 0) != 0 ||
+      check_string (db_path, "pts/0", 1) != 0)
+    return 1;
+
+  /* The existing user logs in again. */
+  if (ll2_ctx_write_entry (context, names[0], now, "pts/0", NULL, NULL,
+			   &error) != 0)
+    {
+      fprintf (stderr, "Writing entry: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (purge (context, 1, 0, LL2_PURGE_DRY_RUN,
+	     NUM_ENTRIES - OLD_ENTRIES) != 0 ||
+      check_entries (context, OLD_ENTRIES, NUM_ENTRIES - 1, 1) != 0 ||
+      purge (context, 1, 0, 0, NUM_ENTRIES - OLD_ENTRIES) != 0 ||
+      check_entries (context, 0, 0, 1) != 0 ||
+      check_entries (context, 1, NUM_ENTRIES - 1, 0) != 0 ||
+      check_string (db_path, "sshd", 0) != 0)
+    return 1;
+
+  ll2_close_context (context);
+
+  return 0;
+}
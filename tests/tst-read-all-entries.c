@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Write some entries, some of them with NULL strings, read them with
+   ll2_read_all_entries and check values, lengths, order and that the
+   callback can stop reading.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lastlog2.h"
+
+static const struct ll2_entry expected[] = {
+  { "alice", INT64_C(1) << 40, "pts/1", "192.168.1.1", "sshd",
+    5, 5, 11, 4, 0, 0 },
+  { "bob", 1000, NULL, NULL, NULL, 3, 0, 0, 0, 0, 0 },
+  { "carol", 2000, "tty1", "", "login", 5, 4, 0, 5, 0, 0 },
+};
+#define NUM_ENTRIES (sizeof (expected) / sizeof (expected[0]))
+
+struct read_data {
+  size_t count;
+  size_t stop_after;
+  int failed;
+};
+
+static int
+cmp_str (const char *a, const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a != b;
+  return strcmp (a, b);
+}
+
+static int
+check_entry (const struct ll2_entry *entry, void *userdata)
+{
+  struct read_data *data = userdata;
+  const struct ll2_entry *exp;
+
+  if (data->count >= NUM_ENTRIES)
+    {
+      fprintf (stderr, "Too many entries\n");
+      data->failed = 1;
+      return 1;
+    }
+  exp = &expected[data->count++];
+
+  if (cmp_str (entry->user, exp->user) != 0 ||
+      entry->ll_time != exp->ll_time ||
+      cmp_str (entry->tty, exp->tty) != 0 ||
+      cmp_str (entry->rhost, exp->rhost) != 0 ||
+      cmp_str (entry->pam_service, exp->pam_service) != 0)
+    {
+      fprintf (stderr, "Wrong entry for '%s'\n", exp->user);
+      data->failed = 1;
+    }
+
+  if (entry->user_len != exp->user_len ||
+      entry->tty_len != exp->tty_len ||
+      entry->rhost_len != exp->rhost_len ||
+      entry->pam_service_len != exp->pam_service_len)
+    {
+      fprintf (stderr, "Wrong length for '%s'\n", exp->user);
+      data->failed = 1;
+    }
+
+  return data->count == data->stop_after;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-read-all-entries.db";
+  struct read_data data = { 0, 0, 0 };
+  char *error = NULL;
+
+  remove (db_path);
+
+  /* Write in reverse order to see that reading sorts. */
+  for (size_t i = NUM_ENTRIES; i > 0; i--)
+    {
+      const struct ll2_entry *e = &expected[i - 1];
+
+      if (ll2_write_entry (db_path, e->user, e->ll_time, e->tty, e->rhost,
+			   e->pam_service, &error) != 0)
+	{
+	  if (error)
+	    {
+	      fprintf (stderr, "%s\n", error);
+	      free (error);
+	    }
+	  else
+	    fprintf (stderr, "ll2_write_entry failed\n");
+	  return 1;
+	}
+    }
+
+  if (ll2_read_all_entries (db_path, check_entry, &data, &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "ll2_read_all_entries failed\n");
+      return 1;
+    }
+
+  if (data.failed || data.count != NUM_ENTRIES)
+    {
+      fprintf (stderr, "Read %zu entries, expected %zu\n",
+	       data.count, NUM_ENTRIES);
+      return 1;
+    }
+
+  data.count = 0;
+  data.stop_after = 2;
+  if (ll2_read_all_entries (db_path, check_entry, &data, &error) != 0 ||
+      data.failed || data.count != 2)
+    {
+      fprintf (stderr, "Stopping after two entries failed\n");
+      return 1;
+    }
+
+  return 0;
+}
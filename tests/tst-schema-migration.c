@@ -0,0 +1,280 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Create a database with the layout of lastlog2 < 1.0 (no Service
+   column, no STRICT table) and more rows than fit into one migration
+   chunk, open it for writing and make sure it got migrated to the
+   current layout without losing data, and that every distinct TTY,
+   RemoteHost and Service is stored only once and the table is
+   clustered by Name. A database of version 5 with a rowid table
+   gets rebuilt as well.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+#define NUM_USERS 2500
+
+static int
+create_old_database (const char *db_path)
+{
+  sqlite3 *db;
+  char *err_msg = NULL;
+  char sql[256];
+
+  remove (db_path);
+
+  if (sqlite3_open (db_path, &db) != SQLITE_OK)
+    {
+      fprintf (stderr, "Cannot create database: %s\n", sqlite3_errmsg (db));
+      return 1;
+    }
+
+  if (sqlite3_exec (db, "CREATE TABLE Lastlog2(Name TEXT PRIMARY KEY, Time INTEGER, TTY TEXT, RemoteHost TEXT); BEGIN",
+		    0, 0, &err_msg) != SQLITE_OK)
+    {
+      fprintf (stderr, "SQL error: %s\n", err_msg);
+      sqlite3_free (err_msg);
+      return 1;
+    }
+
+  for (int i = 0; i < NUM_USERS; i++)
+    {
+      snprintf (sql, sizeof (sql),
+		"INSERT INTO Lastlog2 VALUES('user%04d', %d, 'pts/%d', 'host%d')",
+		i, 1000 + i, i % 10, i % 7);
+      if (sqlite3_exec (db, sql, 0, 0, &err_msg) != SQLITE_OK)
+	{
+	  fprintf (stderr, "SQL error: %s\n", err_msg);
+	  sqlite3_free (err_msg);
+	  return 1;
+	}
+    }
+
+  if (sqlite3_exec (db, "COMMIT", 0, 0, &err_msg) != SQLITE_OK)
+    {
+      fprintf (stderr, "SQL error: %s\n", err_msg);
+      sqlite3_free (err_msg);
+      return 1;
+    }
+
+  sqlite3_close (db);
+  return 0;
+}
+
+static int
+get_int (const char *db_path, const char *sql)
+{
+  sqlite3 *db;
+  sqlite3_stmt *res;
+  int value = -1;
+
+  if (sqlite3_open (db_path, &db) != SQLITE_OK)
+    return -1;
+  if (sqlite3_prepare_v2 (db, sql, -1, &res, 0) == SQLITE_OK)
+    {
+      if (sqlite3_step (res) == SQLITE_ROW)
+	value = sqlite3_column_int (res, 0);
+      sqlite3_finalize (res);
+    }
+  sqlite3_close (db);
+
+  return value;
+}
+
+/* Version 5 databases of a development snapshot have a rowid table. */
+static int
+check_v5_migration (const char *db_path)
+{
+  struct ll2_context *context;
+  sqlite3 *db;
+  int64_t ll_time = 0;
+  char *tty = NULL;
+  char *error = NULL;
+
+  remove (db_path);
+
+  if (sqlite3_open (db_path, &db) != SQLITE_OK ||
+      sqlite3_exec (db, "CREATE TABLE Lastlog2_Strings(Id INTEGER PRIMARY KEY AUTOINCREMENT, Value TEXT NOT NULL UNIQUE) STRICT;"
+		    "CREATE TABLE ImportState(File TEXT PRIMARY KEY, Mode INTEGER, Position INTEGER) STRICT;"
+		    "CREATE TABLE Lastlog2(Name TEXT PRIMARY KEY, Time INTEGER, TTYId INTEGER, RemoteHostId INTEGER, ServiceId INTEGER, UID INTEGER) STRICT;"
+		    "CREATE INDEX Lastlog2_Time ON Lastlog2(Time);"
+		    "CREATE INDEX Lastlog2_UID ON Lastlog2(UID);"
+		    "INSERT INTO Lastlog2_Strings(Value) VALUES ('pts/7');"
+		    "INSERT INTO Lastlog2 VALUES ('v5user', 7000, 1, NULL, NULL, 1005);"
+		    "PRAGMA user_version = 5;", 0, 0, NULL) != SQLITE_OK)
+    {
+      fprintf (stderr, "Cannot create version 5 database: %s\n",
+	       sqlite3_errmsg (db));
+      sqlite3_close (db);
+      return 1;
+    }
+  sqlite3_close (db);
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      fprintf (stderr, "ll2_open_context: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (ll2_ctx_read_entry (context, "v5user", &ll_time, &tty, NULL, NULL,
+			  &error) != 0)
+    {
+      fprintf (stderr, "ll2_ctx_read_entry: %s\n", error ? error : "failed");
+      return 1;
+    }
+  ll2_close_context (context);
+
+  if (ll_time != 7000 || tty == NULL || strcmp (tty, "pts/7") != 0)
+    {
+      fprintf (stderr, "Migrated version 5 entry is wrong: %lld, %s\n",
+	       (long long int)ll_time, tty);
+      return 1;
+    }
+  free (tty);
+
+  if (get_int (db_path, "SELECT wr FROM pragma_table_list WHERE name = 'Lastlog2'") != 1 ||
+      get_int (db_path, "SELECT UID FROM Lastlog2 WHERE Name = 'v5user'") != 1005 ||
+      get_int (db_path, "SELECT count(*) FROM sqlite_master WHERE type = 'index' AND name IN ('Lastlog2_Time', 'Lastlog2_UID')") != 2)
+    {
+      fprintf (stderr, "Version 5 database was not rebuilt correctly\n");
+      return 1;
+    }
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-schema-migration.db";
+  struct ll2_context *context;
+  int64_t ll_time = 0;
+  char *tty = NULL;
+  char *rhost = NULL;
+  char *service = NULL;
+  char *error = NULL;
+
+  if (create_old_database (db_path) != 0)
+    return 1;
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "ll2_open_context failed\n");
+      return 1;
+    }
+
+  if (ll2_ctx_write_entry (context, "newuser", 5000, "tty1", NULL,
+			   "login", &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "ll2_ctx_write_entry failed\n");
+      return 1;
+    }
+
+  if (ll2_ctx_read_entry (context, "user1234", &ll_time, &tty, &rhost,
+			  &service, &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "Migrated entry not found\n");
+      return 1;
+    }
+
+  ll2_close_context (context);
+
+  if (ll_time != 2234 || tty == NULL || strcmp (tty, "pts/4") != 0 ||
+      rhost == NULL || strcmp (rhost, "host2") != 0 || service != NULL)
+    {
+      fprintf (stderr, "Migrated entry is wrong: %lld, %s, %s, %s\n",
+	       (long long int)ll_time, tty, rhost, service);
+      return 1;
+    }
+  free (tty);
+  free (rhost);
+
+  if (get_int (db_path, "PRAGMA user_version") < 1)
+    {
+      fprintf (stderr, "Schema version was not updated\n");
+      return 1;
+    }
+
+  if (get_int (db_path, "SELECT count(*) FROM Lastlog2") != NUM_USERS + 1)
+    {
+      fprintf (stderr, "Wrong number of entries after migration\n");
+      return 1;
+    }
+
+  /* 10 TTYs, 7 hosts, "tty1" and "login". */
+  if (get_int (db_path, "SELECT count(*) FROM Lastlog2_Strings") != 19)
+    {
+      fprintf (stderr, "Wrong number of strings after migration\n");
+      return 1;
+    }
+
+  if (get_int (db_path, "SELECT wr FROM pragma_table_list WHERE name = 'Lastlog2'") != 1)
+    {
+      fprintf (stderr, "Lastlog2 is not a WITHOUT ROWID table\n");
+      return 1;
+    }
+
+  if (get_int (db_path, "SELECT count(*) FROM sqlite_master WHERE type = 'index' AND name IN ('Lastlog2_Time', 'Lastlog2_UID')") != 2)
+    {
+      fprintf (stderr, "Indexes missing after migration\n");
+      return 1;
+    }
+
+  if (get_int (db_path, "SELECT count(*) FROM sqlite_master WHERE name LIKE '%migrate%' OR name = 'Lastlog2_new'") != 0)
+    {
+      fprintf (stderr, "Temporary migration objects left over\n");
+      return 1;
+    }
+
+  if (check_v5_migration (db_path) != 0)
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Enable the slow operation log with LASTLOG2_SLOWLOG_MS, make sure
+   entries can be written and read through the slowlog VFS, and that
+   a write waiting for a lock gets reported as slow statement and a
+   write giving up as lock wait, but nothing after ll2_set_slowlog (0).
+*/
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+static char messages[8192];
+
+static void
+record (const char *fmt, va_list ap)
+{
+  size_t len = strlen (messages);
+
+  vsnprintf (messages + len, sizeof (messages) - len, fmt, ap);
+  len = strlen (messages);
+  if (len < sizeof (messages) - 1)
+    strcpy (messages + len, "\n");
+}
+
+/* Catch the reports of liblastlog2, which is built with or without
+   _FORTIFY_SOURCE. */
+void syslog (int priority, const char *fmt, ...);
+
+void
+syslog (int priority __attribute__((unused)), const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start (ap, fmt);
+  record (fmt, ap);
+  va_end (ap);
+}
+
+void __syslog_chk (int priority, int flag, const char *fmt, ...);
+
+void
+__syslog_chk (int priority __attribute__((unused)),
+	      int flag __attribute__((unused)), const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start (ap, fmt);
+  record (fmt, ap);
+  va_end (ap);
+}
+
+static void *
+release_lock (void *arg)
+{
+  sqlite3 *db = arg;
+  struct timespec delay = { 0, 50 * 1000000 };
+
+  nanosleep (&delay, NULL);
+  sqlite3_exec (db, "COMMIT", NULL, NULL, NULL);
+
+  return NULL;
+}
+
+/* Lock the database with a second connection and write an entry,
+   which has to wait timeout_ms for the lock, released after 50 ms
+   by another thread. */
+static int
+contended_write (const char *db_path, int timeout_ms)
+{
+  struct ll2_context *context;
+  pthread_t thread;
+  char *error = NULL;
+  sqlite3 *db;
+  int ret;
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      fprintf (stderr, "ll2_open_context: %s\n", error ? error : "failed");
+      free (error);
+      return -1;
+    }
+  ll2_ctx_set_busy_timeout (context, timeout_ms);
+
+  if (sqlite3_open (db_path, &db) != SQLITE_OK ||
+      sqlite3_exec (db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK ||
+      pthread_create (&thread, NULL, release_lock, db) != 0)
+    {
+      fprintf (stderr, "Couldn't lock database\n");
+      return -1;
+    }
+
+  ret = ll2_ctx_write_entry (context, "tstuser", 1000, "pts/0", NULL, NULL,
+			     &error);
+  if (ret != 0 && ret != -EBUSY)
+    fprintf (stderr, "ll2_ctx_write_entry: %s\n", error ? error : "failed");
+  free (error);
+
+  pthread_join (thread, NULL);
+  sqlite3_close (db);
+  ll2_close_context (context);
+
+  return ret;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-slowlog.db";
+  struct ll2_context *context;
+  char *error = NULL;
+  char *tty = NULL;
+  int64_t ll_time = 0;
+  int ret;
+
+  remove (db_path);
+  setenv ("LASTLOG2_SLOWLOG_MS", "1", 1);
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL ||
+      ll2_ctx_write_entry (context, "user1", 1000, "pts/0", NULL, NULL,
+			   &error) != 0 ||
+      ll2_ctx_checkpoint (context, &error) != 0 ||
+      ll2_ctx_read_entry (context, "user1", &ll_time, &tty, NULL, NULL,
+			  &error) != 0)
+    {
+      fprintf (stderr, "Slowlog VFS: %s\n", error ? error : "failed");
+      return 1;
+    }
+  ll2_close_context (context);
+
+  if (ll_time != 1000 || tty == NULL || strcmp (tty, "pts/0") != 0)
+    {
+      fprintf (stderr, "Read back time=%lld, tty=%s\n", (long long)ll_time,
+	       tty ? tty : "(null)");
+      return 1;
+    }
+  free (tty);
+
+  messages[0] = '\0';
+  if ((ret = contended_write (db_path, 10000)) != 0)
+    {
+      fprintf (stderr, "Waiting write returned %d\n", ret);
+      return 1;
+    }
+  if (strstr (messages, "slow statement of tst-slowlog.db") == NULL ||
+      strstr (messages, "waiting for locks") == NULL)
+    {
+      fprintf (stderr, "Waiting write not reported:\n%s", messages);
+      return 1;
+    }
+
+  messages[0] = '\0';
+  if ((ret = contended_write (db_path, 10)) != -EBUSY)
+    {
+      fprintf (stderr, "Write giving up returned %d\n", ret);
+      return 1;
+    }
+  if (strstr (messages, "slow lock wait of tst-slowlog.db") == NULL)
+    {
+      fprintf (stderr, "Lock wait not reported:\n%s", messages);
+      return 1;
+    }
+
+  ll2_set_slowlog (0);
+  messages[0] = '\0';
+  if (contended_write (db_path, 10000) != 0)
+    return 1;
+  if (messages[0] != '\0')
+    {
+      fprintf (stderr, "Reported although disabled:\n%s", messages);
+      return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+/* Test case:
+   Append entries to the spool, make sure ll2_read_entry returns the
+   newest of spool and database, that compaction moves them into the
+   database without replacing newer entries and empties the spool,
+   and that removed entries don't come back from the spool. A record
+   cut short by a full disk must not hide the records after it.
+   Compaction must not wait forever for a reader, and changing the
+   entry of one user must not move the records of others.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "lastlog2.h"
+
+static int
+check_entry (const char *db_path, const char *user, int64_t ll_time,
+	     const char *tty)
+{
+  int64_t res_time;
+  char *res_tty = NULL;
+  int ret = 0;
+
+  if (ll2_read_entry (db_path, user, &res_time, &res_tty, NULL, NULL,
+		      NULL) != 0)
+    {
+      fprintf (stderr, "Entry for '%s' missing\n", user);
+      return 1;
+    }
+
+  if (res_time != ll_time || res_tty == NULL || strcmp (res_tty, tty) != 0)
+    {
+      fprintf (stderr, "Wrong entry for '%s': %lld %s\n", user,
+	       (long long)res_time, res_tty ? res_tty : "NULL");
+      ret = 1;
+    }
+  free (res_tty);
+
+  return ret;
+}
+
+static int
+spool (const char *db_path, const char *user, int64_t ll_time,
+       const char *tty)
+{
+  struct ll2_entry entry = { .user = user, .ll_time = ll_time, .tty = tty,
+			     .pam_service = "sshd" };
+  char *error = NULL;
+  int ret;
+
+  if ((ret = ll2_spool_entry (db_path, &entry, &error)) != 0)
+    {
+      fprintf (stderr, "ll2_spool_entry: %s\n", error ? error : "failed");
+      free (error);
+      return 1;
+    }
+
+  return 0;
+}
+
+static int
+compact (const char *db_path, int expected)
+{
+  char *error = NULL;
+  int ret;
+
+  if ((ret = ll2_compact_journal (db_path, &error)) != expected)
+    {
+      fprintf (stderr, "ll2_compact_journal returned %d, expected %d: %s\n",
+	       ret, expected, error ? error : "no error");
+      free (error);
+      return 1;
+    }
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-spool.db";
+  const char *spool_path = "tst-spool.db.spool";
+  char long_name[200];
+  struct ll2_entry entry = { .user = long_name };
+  struct ll2_context *context;
+  struct stat st;
+  char *error = NULL;
+  char buf[100];
+  int fd, ret;
+
+  remove (db_path);
+  remove (spool_path);
+
+  if (ll2_write_entry (db_path, "tstuser", 1000, "pts/1", NULL, NULL,
+		       &error) != 0 ||
+      ll2_write_entry (db_path, "other", 5000, "pts/5", NULL, NULL,
+		       &error) != 0)
+    {
+      fprintf (stderr, "ll2_write_entry: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (spool (db_path, "tstuser", 2000, "pts/2") ||
+      spool (db_path, "other", 4000, "pts/4") ||
+      spool (db_path, "fresh", 3000, "pts/3") ||
+      spool (db_path, "fresh", 2500, "tty1"))
+    return 1;
+
+  /* Before compaction, the newest of spool and database is read. */
+  if (check_entry (db_path, "tstuser", 2000, "pts/2") ||
+      check_entry (db_path, "other", 5000, "pts/5") ||
+      check_entry (db_path, "fresh", 3000, "pts/3"))
+    return 1;
+
+  if (compact (db_path, 4))
+    return 1;
+
+  if (stat (spool_path, &st) != 0 || st.st_size != 0)
+    {
+      fprintf (stderr, "Spool not truncated after compaction\n");
+      return 1;
+    }
+
+  if (check_entry (db_path, "tstuser", 2000, "pts/2") ||
+      check_entry (db_path, "other", 5000, "pts/5") ||
+      check_entry (db_path, "fresh", 3000, "pts/3"))
+    return 1;
+
+  if (compact (db_path, 0))
+    return 1;
+
+  /* Removing an user must remove the spooled entries, too. */
+  if (spool (db_path, "fresh", 6000, "pts/6"))
+    return 1;
+  if (ll2_remove_entry (db_path, "fresh", &error) != 0)
+    {
+      fprintf (stderr, "ll2_remove_entry: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (ll2_read_entry (db_path, "fresh", NULL, NULL, NULL, NULL,
+		      NULL) != -ENOENT)
+    {
+      fprintf (stderr, "Removed entry came back from spool\n");
+      return 1;
+    }
+
+  memset (long_name, 'x', sizeof (long_name) - 1);
+  long_name[sizeof (long_name) - 1] = '\0';
+  ret = ll2_spool_entry (db_path, &entry, &error);
+  if (ret != -EINVAL)
+    {
+      fprintf (stderr, "Too long entry returned %d, expected -EINVAL\n", ret);
+      return 1;
+    }
+  free (error);
+  error = NULL;
+
+  /* Readers must not wait forever for a running compaction. */
+  if (spool (db_path, "locked", 7000, "pts/7"))
+    return 1;
+  if ((fd = open (spool_path, O_RDWR)) < 0 || flock (fd, LOCK_EX) != 0 ||
+      (context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      fprintf (stderr, "Locking spool: %s\n", error ? error : "failed");
+      return 1;
+    }
+  ll2_ctx_set_busy_timeout (context, 20);
+  ret = ll2_ctx_read_entry (context, "locked", NULL, NULL, NULL, NULL,
+			   &error);
+  if (ret != -EBUSY)
+    {
+      fprintf (stderr, "Read with locked spool returned %d, expected -EBUSY\n",
+	       ret);
+      return 1;
+    }
+  free (error);
+  close (fd);
+  ll2_close_context (context);
+
+  /* Keep only the start of a record, as a short write would. */
+  if (compact (db_path, 1) || spool (db_path, "partial", 8000, "pts/8"))
+    return 1;
+  if ((fd = open (spool_path, O_RDWR)) < 0 ||
+      pread (fd, buf, sizeof (buf), 0) != sizeof (buf) ||
+      ftruncate (fd, 0) != 0 ||
+      write (fd, buf, sizeof (buf)) != sizeof (buf))
+    {
+      fprintf (stderr, "Cutting spool record failed\n");
+      return 1;
+    }
+  close (fd);
+
+  if (spool (db_path, "after", 9000, "pts/9") ||
+      check_entry (db_path, "after", 9000, "pts/9"))
+    return 1;
+  if (ll2_read_entry (db_path, "partial", NULL, NULL, NULL, NULL,
+		      NULL) != -ENOENT)
+    {
+      fprintf (stderr, "Partial spool record was read\n");
+      return 1;
+    }
+  if (compact (db_path, 1) ||
+      check_entry (db_path, "after", 9000, "pts/9"))
+    return 1;
+
+  if (spool (db_path, "other", 9500, "pts/5") ||
+      ll2_update_login_time (db_path, "tstuser", 9600, &error) != 0 ||
+      stat (spool_path, &st) != 0 || st.st_size == 0)
+    {
+      fprintf (stderr, "Updating another user moved the spool: %s\n",
+	       error ? error : "spool empty");
+      return 1;
+    }
+
+  if ((fd = open (spool_path, O_RDONLY)) < 0 || flock (fd, LOCK_SH) != 0 ||
+      (context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      fprintf (stderr, "Locking spool: %s\n", error ? error : "failed");
+      return 1;
+    }
+  ll2_ctx_set_busy_timeout (context, 20);
+  if ((ret = ll2_ctx_compact_journal (context, &error)) != -EBUSY)
+    {
+      fprintf (stderr, "Compaction with reader returned %d, expected -EBUSY\n",
+	       ret);
+      return 1;
+    }
+  free (error);
+  error = NULL;
+  close (fd);
+  ll2_close_context (context);
+
+  /* The spooled record is newer than the database. */
+  if (ll2_remove_entry (db_path, "other", &error) != 0 ||
+      stat (spool_path, &st) != 0 || st.st_size != 0 ||
+      ll2_read_entry (db_path, "other", NULL, NULL, NULL, NULL,
+		      NULL) != -ENOENT)
+    {
+      fprintf (stderr, "Removing a spooled user failed: %s\n",
+	       error ? error : "spool not moved");
+      return 1;
+    }
+
+  return 0;
+}
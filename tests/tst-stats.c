@@ -0,0 +1,178 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   If liblastlog2 was built with statistics, writing and reading an
+   entry need to be counted, the histograms need to match the number
+   of calls, and ll2_reset_stats needs to clear everything. Else
+   ll2_get_stats needs to fail with -ENOTSUP and the test is skipped.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lastlog2.h"
+
+static const struct ll2_stats *
+find_stats (const struct ll2_stats *stats, size_t count, const char *name)
+{
+  for (size_t i = 0; i < count; i++)
+    if (strcmp (stats[i].name, name) == 0)
+      return &stats[i];
+
+  fprintf (stderr, "No statistics for %s\n", name);
+  return NULL;
+}
+
+static int
+check_count (const struct ll2_stats *stats, size_t count, const char *name,
+	     uint64_t min, uint64_t max)
+{
+  const struct ll2_stats *st = find_stats (stats, count, name);
+  uint64_t sum = 0;
+
+  if (st == NULL)
+    return 1;
+
+  if (st->count < min || st->count > max)
+    {
+      fprintf (stderr, "%s: %llu calls, expected %llu to %llu\n", name,
+	       (unsigned long long)st->count, (unsigned long long)min,
+	       (unsigned long long)max);
+      return 1;
+    }
+
+  for (int b = 0; b < LL2_STATS_BUCKETS; b++)
+    sum += st->histogram[b];
+  if (sum != st->count)
+    {
+      fprintf (stderr, "%s: histogram has %llu calls, expected %llu\n", name,
+	       (unsigned long long)sum, (unsigned long long)st->count);
+      return 1;
+    }
+
+  if (st->count > 0 && (st->total_ns == 0 || st->max_ns == 0 ||
+			st->max_ns > st->total_ns))
+    {
+      fprintf (stderr, "%s: wrong times\n", name);
+      return 1;
+    }
+
+  return 0;
+}
+
+int
+main (void)
+{
+  const char *db_path = "tst-stats.db";
+  struct ll2_stats *stats;
+  size_t count;
+  char *error = NULL;
+  int ret;
+
+  ret = ll2_get_stats (&stats, &count, &error);
+  if (ret == -ENOTSUP)
+    {
+      free (error);
+      /* Skipped, built without statistics. */
+      return 77;
+    }
+  else if (ret != 0)
+    {
+      fprintf (stderr, "ll2_get_stats failed: %s\n", error);
+      free (error);
+      return 1;
+    }
+  free (stats);
+
+  remove (db_path);
+  if (ll2_write_entry (db_path, "user1", 1000, "pts/0", NULL, NULL,
+		       &error) != 0)
+    {
+      fprintf (stderr, "ll2_write_entry failed: %s\n", error);
+      free (error);
+      return 1;
+    }
+
+  ll2_reset_stats ();
+
+  if (ll2_write_entry (db_path, "user2", 2000, "pts/1", "localhost", "sshd",
+		       &error) != 0 ||
+      ll2_read_entry (db_path, "user2", NULL, NULL, NULL, NULL,
+		      &error) != 0)
+    {
+      fprintf (stderr, "Accessing the database failed: %s\n", error);
+      free (error);
+      return 1;
+    }
+  /* Not found is no error. */
+  if (ll2_read_entry (db_path, "nobody", NULL, NULL, NULL, NULL,
+		      &error) != -ENOENT)
+    {
+      fprintf (stderr, "Unexpected entry for nobody\n");
+      free (error);
+      return 1;
+    }
+
+  if (ll2_get_stats (&stats, &count, &error) != 0)
+    {
+      fprintf (stderr, "ll2_get_stats failed: %s\n", error);
+      free (error);
+      return 1;
+    }
+
+  if (check_count (stats, count, "open", 3, 3) != 0 ||
+      check_count (stats, count, "close", 3, 3) != 0 ||
+      check_count (stats, count, "write_entry", 1, 1) != 0 ||
+      check_count (stats, count, "read_entry", 2, 2) != 0 ||
+      check_count (stats, count, "step", 3, UINT64_MAX) != 0 ||
+      check_count (stats, count, "rename_user", 0, 0) != 0)
+    return 1;
+
+  if (find_stats (stats, count, "read_entry")->errors != 0)
+    {
+      fprintf (stderr, "Missing entry counted as error\n");
+      return 1;
+    }
+  free (stats);
+
+  ll2_reset_stats ();
+  if (ll2_get_stats (&stats, &count, &error) != 0)
+    {
+      fprintf (stderr, "ll2_get_stats failed: %s\n", error);
+      free (error);
+      return 1;
+    }
+  for (size_t i = 0; i < count; i++)
+    if (check_count (stats, count, stats[i].name, 0, 0) != 0)
+      return 1;
+  free (stats);
+
+  return 0;
+}
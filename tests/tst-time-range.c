@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Write entries with different login times, make sure the Time index
+   exists and is used and check ll2_read_range and ll2_read_recent
+   results and their order.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+/* Name and time, the names are not in time order. */
+static const struct {
+  const char *user;
+  int64_t ll_time;
+} data[] = {
+  { "anna", 500 },
+  { "bert", 100 },
+  { "cora", 0 },
+  { "dave", 300 },
+  { "emil", 200 },
+  { "fred", INT64_C(1) << 40 },
+};
+#define NUM_ENTRIES (sizeof (data) / sizeof (data[0]))
+
+struct result {
+  size_t count;
+  char names[NUM_ENTRIES * 5 + 1];
+};
+
+static int
+collect (const struct ll2_entry *entry, void *userdata)
+{
+  struct result *result = userdata;
+
+  result->count++;
+  strcat (result->names, entry->user);
+  strcat (result->names, " ");
+
+  return 0;
+}
+
+static int
+check (const char *what, int ret, char *error, const struct result *result,
+       const char *expected)
+{
+  if (ret != 0)
+    {
+      fprintf (stderr, "%s: %s\n", what, error ? error : "failed");
+      free (error);
+      return 1;
+    }
+
+  if (strcmp (result->names, expected) != 0)
+    {
+      fprintf (stderr, "%s: got '%s', expected '%s'\n", what,
+	       result->names, expected);
+      return 1;
+    }
+
+  return 0;
+}
+
+static int
+uses_time_index (const char *db_path, const char *sql)
+{
+  sqlite3 *db;
+  sqlite3_stmt *res;
+  int found = 0;
+  char *plan;
+
+  if (asprintf (&plan, "EXPLAIN QUERY PLAN %s", sql) < 0)
+    return 0;
+
+  if (sqlite3_open_v2 (db_path, &db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK &&
+      sqlite3_prepare_v2 (db, plan, -1, &res, NULL) == SQLITE_OK)
+    {
+      while (sqlite3_step (res) == SQLITE_ROW)
+	if (strstr ((const char *)sqlite3_column_text (res, 3),
+		    "Lastlog2_Time") != NULL)
+	  found = 1;
+      sqlite3_finalize (res);
+    }
+  sqlite3_close (db);
+  free (plan);
+
+  return found;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-time-range.db";
+  struct result result;
+  char *error = NULL;
+  int ret;
+
+  remove (db_path);
+
+  for (size_t i = 0; i < NUM_ENTRIES; i++)
+    if (ll2_write_entry (db_path, data[i].user, data[i].ll_time, NULL, NULL,
+			 NULL, &error) != 0)
+      {
+	fprintf (stderr, "ll2_write_entry: %s\n", error ? error : "failed");
+	free (error);
+	return 1;
+      }
+
+  if (!uses_time_index (db_path, "SELECT Name FROM Lastlog2 WHERE Time >= 1 AND Time < 2 ORDER BY Name") ||
+      !uses_time_index (db_path, "SELECT Name FROM Lastlog2 ORDER BY Time DESC LIMIT 1"))
+    {
+      fprintf (stderr, "Time index is not used\n");
+      return 1;
+    }
+
+  memset (&result, 0, sizeof (result));
+  ret = ll2_read_range (db_path, 100, 500, collect, &result, &error);
+  if (check ("ll2_read_range", ret, error, &result, "bert dave emil "))
+    return 1;
+
+  memset (&result, 0, sizeof (result));
+  ret = ll2_read_range (db_path, INT64_MIN, 1, collect, &result, &error);
+  if (check ("ll2_read_range from INT64_MIN", ret, error, &result, "cora "))
+    return 1;
+
+  memset (&result, 0, sizeof (result));
+  ret = ll2_read_range (db_path, 200, INT64_MAX, collect, &result, &error);
+  if (check ("ll2_read_range to INT64_MAX", ret, error, &result,
+	     "anna dave emil fred "))
+    return 1;
+
+  memset (&result, 0, sizeof (result));
+  ret = ll2_read_range (db_path, 300, 300, collect, &result, &error);
+  if (check ("ll2_read_range empty", ret, error, &result, ""))
+    return 1;
+
+  memset (&result, 0, sizeof (result));
+  ret = ll2_read_recent (db_path, 3, 0, collect, &result, &error);
+  if (check ("ll2_read_recent", ret, error, &result, "fred anna dave "))
+    return 1;
+
+  memset (&result, 0, sizeof (result));
+  ret = ll2_read_recent (db_path, 2, LL2_READ_OLDEST, collect, &result,
+			 &error);
+  if (check ("ll2_read_recent oldest", ret, error, &result, "cora bert "))
+    return 1;
+
+  memset (&result, 0, sizeof (result));
+  ret = ll2_read_recent (db_path, 100, 0, collect, &result, &error);
+  if (check ("ll2_read_recent all", ret, error, &result,
+	     "fred anna dave emil bert cora "))
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,228 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+/* Test case:
+   Write entries with and without UID, make sure the UID survives
+   writes without UID and renames, and that lookups by UID return
+   the right entries in the right order.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+#define MAX_SEEN 8
+
+struct seen {
+  size_t count;
+  char *user[MAX_SEEN];
+  uid_t uid[MAX_SEEN];
+};
+
+static int
+collect (const struct ll2_entry *entry, void *userdata)
+{
+  struct seen *seen = userdata;
+
+  if (seen->count >= MAX_SEEN || !entry->has_uid)
+    return -1;
+
+  seen->user[seen->count] = strdup (entry->user);
+  seen->uid[seen->count] = entry->uid;
+  seen->count++;
+
+  return 0;
+}
+
+static void
+free_seen (struct seen *seen)
+{
+  for (size_t i = 0; i < seen->count; i++)
+    free (seen->user[i]);
+  seen->count = 0;
+}
+
+/* expected is a list of count user/uid pairs. */
+static int
+check_seen (const char *what, struct seen *seen, size_t count,
+	    const char *const *users, const uid_t *uids)
+{
+  int ret = 0;
+
+  if (seen->count != count)
+    {
+      fprintf (stderr, "%s: got %zu entries, expected %zu\n", what,
+	       seen->count, count);
+      ret = 1;
+    }
+  else
+    for (size_t i = 0; i < count; i++)
+      if (seen->user[i] == NULL || strcmp (seen->user[i], users[i]) != 0 ||
+	  seen->uid[i] != uids[i])
+	{
+	  fprintf (stderr, "%s: entry %zu is %s/%u, expected %s/%u\n", what,
+		   i, seen->user[i] ? seen->user[i] : "NULL",
+		   (unsigned)seen->uid[i], users[i], (unsigned)uids[i]);
+	  ret = 1;
+	}
+
+  free_seen (seen);
+  return ret;
+}
+
+static int
+check_schema (const char *db_path)
+{
+  sqlite3 *db;
+  sqlite3_stmt *stmt = NULL;
+  int version = -1;
+  int has_index = 0;
+
+  if (sqlite3_open (db_path, &db) != SQLITE_OK)
+    {
+      fprintf (stderr, "sqlite3_open: %s\n", sqlite3_errmsg (db));
+      sqlite3_close (db);
+      return 1;
+    }
+
+  if (sqlite3_prepare_v2 (db, "PRAGMA user_version", -1, &stmt,
+			  NULL) == SQLITE_OK &&
+      sqlite3_step (stmt) == SQLITE_ROW)
+    version = sqlite3_column_int (stmt, 0);
+  sqlite3_finalize (stmt);
+
+  if (sqlite3_prepare_v2 (db, "SELECT 1 FROM sqlite_master WHERE "
+			  "type = 'index' AND name = 'Lastlog2_UID'", -1,
+			  &stmt, NULL) == SQLITE_OK &&
+      sqlite3_step (stmt) == SQLITE_ROW)
+    has_index = 1;
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+
+  if (version < 4 || !has_index)
+    {
+      fprintf (stderr, "Schema version %d, UID index %s\n", version,
+	       has_index ? "exists" : "missing");
+      return 1;
+    }
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-uid.db";
+  struct ll2_entry entries[] = {
+    { .user = "alice", .ll_time = 100, .uid = 1001, .has_uid = 1 },
+    { .user = "bob", .ll_time = 200, .uid = 1000, .has_uid = 1 },
+    { .user = "nouid", .ll_time = 300 },
+  };
+  struct ll2_context *context;
+  struct seen seen = { 0 };
+  char *error = NULL;
+
+  remove (db_path);
+
+  if (ll2_write_entries (db_path, entries, 3, 0, NULL, &error) != 0)
+    {
+      fprintf (stderr, "ll2_write_entries: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL)
+    {
+      fprintf (stderr, "ll2_open_context: %s\n", error ? error : "failed");
+      return 1;
+    }
+  /* A write without UID keeps the stored one. */
+  if (ll2_ctx_write_entry_uid (context, "carol", 400, "pts/1", NULL, NULL,
+			       2000, &error) != 0 ||
+      ll2_ctx_write_entry (context, "alice", 500, "pts/2", NULL, NULL,
+			   &error) != 0)
+    {
+      fprintf (stderr, "Writing entries failed: %s\n",
+	       error ? error : "unknown error");
+      ll2_close_context (context);
+      return 1;
+    }
+  ll2_close_context (context);
+
+  if (check_schema (db_path))
+    return 1;
+
+  if (ll2_read_uid_range (db_path, 0, 5000, collect, &seen, &error) != 0)
+    {
+      fprintf (stderr, "ll2_read_uid_range: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_seen ("all UIDs", &seen, 3,
+		  (const char *const[]){ "bob", "alice", "carol" },
+		  (const uid_t[]){ 1000, 1001, 2000 }))
+    return 1;
+
+  if (ll2_read_uid_range (db_path, 1001, 1999, collect, &seen, &error) != 0)
+    {
+      fprintf (stderr, "ll2_read_uid_range: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_seen ("1001-1999", &seen, 1,
+		  (const char *const[]){ "alice" },
+		  (const uid_t[]){ 1001 }))
+    return 1;
+
+  /* Renaming keeps the UID. */
+  if (ll2_rename_user (db_path, "alice", "alicia", &error) != 0)
+    {
+      fprintf (stderr, "ll2_rename_user: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (ll2_read_uid (db_path, 1001, collect, &seen, &error) != 0)
+    {
+      fprintf (stderr, "ll2_read_uid: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_seen ("UID 1001", &seen, 1,
+		  (const char *const[]){ "alicia" },
+		  (const uid_t[]){ 1001 }))
+    return 1;
+
+  if (ll2_read_uid (db_path, 3000, collect, &seen, &error) != 0)
+    {
+      fprintf (stderr, "ll2_read_uid: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_seen ("UID 3000", &seen, 0, NULL, NULL))
+    return 1;
+
+  remove (db_path);
+
+  return 0;
+}
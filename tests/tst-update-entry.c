@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Update the login time and rename entries, make sure the other
+   fields are kept, that renaming replaces an existing entry of the
+   new name and that missing users are reported with -ENOENT.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lastlog2.h"
+
+static int
+check_entry (const char *db_path, const char *user, int64_t ll_time,
+	     const char *tty)
+{
+  int64_t res_time;
+  char *res_tty = NULL;
+  int ret = 0;
+
+  if (ll2_read_entry (db_path, user, &res_time, &res_tty, NULL, NULL,
+		      NULL) != 0)
+    {
+      fprintf (stderr, "Entry for '%s' missing\n", user);
+      return 1;
+    }
+
+  if (res_time != ll_time || res_tty == NULL || strcmp (res_tty, tty) != 0)
+    {
+      fprintf (stderr, "Wrong entry for '%s': %lld %s\n", user,
+	       (long long)res_time, res_tty ? res_tty : "NULL");
+      ret = 1;
+    }
+  free (res_tty);
+
+  return ret;
+}
+
+static int
+expect_enoent (const char *what, int ret, char *error)
+{
+  if (ret != -ENOENT || error == NULL)
+    {
+      fprintf (stderr, "%s returned %d (%s), expected -ENOENT\n", what, ret,
+	       error ? error : "no error");
+      free (error);
+      return 1;
+    }
+  free (error);
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-update-entry.db";
+  char *error = NULL;
+  int ret;
+
+  remove (db_path);
+
+  if (ll2_write_entry (db_path, "tstuser", 1000, "pts/1", "host", "sshd",
+		       &error) != 0 ||
+      ll2_write_entry (db_path, "other", 2000, "pts/2", NULL, NULL,
+		       &error) != 0)
+    {
+      fprintf (stderr, "ll2_write_entry: %s\n", error ? error : "failed");
+      return 1;
+    }
+
+  if (ll2_update_login_time (db_path, "tstuser", 3000, &error) != 0)
+    {
+      fprintf (stderr, "ll2_update_login_time: %s\n",
+	       error ? error : "failed");
+      return 1;
+    }
+  if (check_entry (db_path, "tstuser", 3000, "pts/1"))
+    return 1;
+
+  ret = ll2_update_login_time (db_path, "nobody-here", 3000, &error);
+  if (expect_enoent ("ll2_update_login_time", ret, error))
+    return 1;
+  error = NULL;
+
+  /* Rename onto an existing entry, which gets replaced. */
+  if (ll2_rename_user (db_path, "tstuser", "other", &error) != 0)
+    {
+      fprintf (stderr, "ll2_rename_user: %s\n", error ? error : "failed");
+      return 1;
+    }
+  if (check_entry (db_path, "other", 3000, "pts/1"))
+    return 1;
+  if (ll2_read_entry (db_path, "tstuser", NULL, NULL, NULL, NULL,
+		      NULL) != -ENOENT)
+    {
+      fprintf (stderr, "Old name still exists after rename\n");
+      return 1;
+    }
+
+  ret = ll2_rename_user (db_path, "tstuser", "new", &error);
+  if (expect_enoent ("ll2_rename_user", ret, error))
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,165 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   New databases need to be in WAL mode unless LL2_OPEN_NO_WAL is
+   given, and ll2_ctx_checkpoint needs to empty the WAL file.
+   Opening an existing database must not change its journal mode.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+#include "lastlog2.h"
+
+static int
+check_journal_mode (const char *db_path, const char *expect)
+{
+  sqlite3 *db;
+  sqlite3_stmt *res;
+  int retval = 1;
+
+  if (sqlite3_open_v2 (db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+    {
+      fprintf (stderr, "Cannot open database: %s\n", sqlite3_errmsg (db));
+      return 1;
+    }
+
+  if (sqlite3_prepare_v2 (db, "PRAGMA journal_mode", -1, &res, 0) == SQLITE_OK)
+    {
+      if (sqlite3_step (res) == SQLITE_ROW)
+	{
+	  const char *mode = (const char *)sqlite3_column_text (res, 0);
+
+	  if (strcmp (mode, expect) == 0)
+	    retval = 0;
+	  else
+	    fprintf (stderr, "Journal mode of %s is %s, expected %s\n",
+		     db_path, mode, expect);
+	}
+      sqlite3_finalize (res);
+    }
+  sqlite3_close (db);
+
+  return retval;
+}
+
+static int
+write_entries (const char *db_path, int flags)
+{
+  struct ll2_context *context;
+  char *error = NULL;
+
+  remove (db_path);
+
+  if ((context = ll2_open_context (db_path, flags, &error)) == NULL ||
+      ll2_ctx_write_entry (context, "user1", 1000, "pts/0", NULL, NULL,
+			   &error) != 0 ||
+      ll2_ctx_write_entry (context, "user2", 2000, "pts/1", NULL, NULL,
+			   &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "Writing entries failed\n");
+      return 1;
+    }
+
+  ll2_close_context (context);
+
+  return 0;
+}
+
+int
+main(void)
+{
+  const char *db_path = "tst-wal.db";
+  const char *db_path_nowal = "tst-wal-nowal.db";
+  struct ll2_context *context;
+  char *error = NULL;
+  struct stat st;
+
+  if (write_entries (db_path, LL2_OPEN_NO_CHECKPOINT) != 0 ||
+      check_journal_mode (db_path, "wal") != 0)
+    return 1;
+
+  if (stat ("tst-wal.db-wal", &st) != 0 || st.st_size == 0)
+    {
+      fprintf (stderr, "WAL file missing or empty\n");
+      return 1;
+    }
+
+  if ((context = ll2_open_context (db_path, 0, &error)) == NULL ||
+      ll2_ctx_checkpoint (context, &error) != 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s\n", error);
+	  free (error);
+	}
+      else
+	fprintf (stderr, "Checkpoint failed\n");
+      return 1;
+    }
+  ll2_close_context (context);
+
+  if (stat ("tst-wal.db-wal", &st) != 0 || st.st_size != 0)
+    {
+      fprintf (stderr, "WAL file was not truncated\n");
+      return 1;
+    }
+
+  if (ll2_read_entry (db_path, "user2", NULL, NULL, NULL, NULL, NULL) != 0)
+    {
+      fprintf (stderr, "Entry lost after checkpoint\n");
+      return 1;
+    }
+
+  if (write_entries (db_path_nowal, LL2_OPEN_NO_WAL) != 0 ||
+      check_journal_mode (db_path_nowal, "delete") != 0)
+    return 1;
+
+  if ((context = ll2_open_context (db_path_nowal, 0, &error)) == NULL ||
+      ll2_ctx_write_entry (context, "user3", 3000, "pts/2", NULL, NULL,
+			   &error) != 0)
+    {
+      fprintf (stderr, "%s\n", error ? error : "Writing entry failed");
+      free (error);
+      return 1;
+    }
+  ll2_close_context (context);
+  if (check_journal_mode (db_path_nowal, "delete") != 0)
+    return 1;
+
+  return 0;
+}
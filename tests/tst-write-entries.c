@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+
+  Copyright (c) 2023, Thorsten Kukuk <kukuk@suse.com>
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Test case:
+   Write many entries in chunks with ll2_write_entries, including one
+   invalid entry, and make sure only the invalid one is missing.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lastlog2.h"
+
+#define NUM_ENTRIES 2500
+#define BAD_ENTRY   1234
+
+int
+main(void)
+{
+  const char *db_path = "tst-write-entries.db";
+  struct ll2_entry *entries;
+  char (*names)[16];
+  int *status;
+  char *error = NULL;
+  int i, ret;
+
+  remove (db_path);
+
+  entries = calloc (NUM_ENTRIES, sizeof (struct ll2_entry));
+  names = calloc (NUM_ENTRIES, sizeof (*names));
+  status = calloc (NUM_ENTRIES, sizeof (int));
+  if (entries == NULL || names == NULL || status == NULL)
+    {
+      fprintf (stderr, "Out of memory!\n");
+      return 1;
+    }
+
+  for (i = 0; i < NUM_ENTRIES; i++)
+    {
+      snprintf (names[i], sizeof (names[i]), "user%d", i);
+      entries[i].user = names[i];
+      entries[i].ll_time = 1000 + i;
+      entries[i].tty = "pts/0";
+      entries[i].rhost = "localhost";
+      entries[i].pam_service = "sshd";
+    }
+  /* A user name is mandatory. */
+  entries[BAD_ENTRY].user = NULL;
+
+  ret = ll2_write_entries (db_path, entries, NUM_ENTRIES, 1000, status,
+			   &error);
+  if (ret != 1)
+    {
+      fprintf (stderr, "ll2_write_entries returned %d, expected 1\n", ret);
+      return 1;
+    }
+  if (error == NULL)
+    {
+      fprintf (stderr, "No error message for failed entry\n");
+      return 1;
+    }
+  free (error);
+
+  for (i = 0; i < NUM_ENTRIES; i++)
+    {
+      int64_t ll_time = 0;
+
+      if (status[i] != (i == BAD_ENTRY ? -1 : 0))
+	{
+	  fprintf (stderr, "Wrong status %d for entry %d\n", status[i], i);
+	  return 1;
+	}
+
+      if (i == BAD_ENTRY)
+	continue;
+
+      if (ll2_read_entry (db_path, names[i], &ll_time, NULL, NULL, NULL,
+			  NULL) != 0 || ll_time != 1000 + i)
+	{
+	  fprintf (stderr, "Entry for %s not written\n", names[i]);
+	  return 1;
+	}
+    }
+
+  free (entries);
+  free (names);
+  free (status);
+
+  return 0;
+}